@@ -3,8 +3,6 @@
 -- SPDX-FileCopyrightText: Copyright 2014-present Greg Hurrell and contributors.
 -- SPDX-License-Identifier: BSD-2-Clause
 
-local ffi = require('ffi')
-
 local pwd = os.getenv('PWD')
 local lua_directory = pwd .. '/' .. debug.getinfo(1).source:match('@?(.*/)') .. '../../lua'
 
@@ -49,9 +47,10 @@ benchmark({
   end,
 
   run = function(config, setup)
+    local lib = require('wincent.commandt.private.lib')
     local scanner = setup.scanner(pwd) -- For now, only Watchman wants pwd.
     for i = 1, scanner.count do
-      ffi.string(scanner.candidates[i - 1].contents)
+      lib.scanner_get(scanner, i - 1)
     end
   end,
 
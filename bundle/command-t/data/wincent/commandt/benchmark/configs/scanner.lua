@@ -1,5 +1,51 @@
 local times = 100
 
+-- Returns a variant that lists `count` files served by a stand-in for Watchman
+-- (see "stub.h"), so that it measures our side of the exchange (encoding the
+-- query, moving the response through the socket, and decoding it) the same way
+-- every time, without needing a Watchman daemon.
+local watchman_stub = function(label, count, variant_times)
+  local stub = nil
+  return {
+    name = 'watchman (stub ' .. label .. ')',
+    source = function()
+      local scanner = require('wincent.commandt.private.scanners.watchman').scanner
+      return {
+        scanner = function()
+          return scanner('/stub')
+        end,
+      }
+    end,
+    times = variant_times,
+    skip_in_ci = false,
+    stub = function()
+      assert(_G.vim == nil)
+      _G.vim = {
+        fn = {
+          fnamemodify = function(name, _modifier)
+            return name
+          end,
+        },
+      }
+      local socket_path = os.tmpname()
+      stub = require('wincent.commandt.private.lib').watchman_stub(socket_path, count)
+      require('wincent.commandt.private.scanners.watchman').set_sockname(socket_path)
+    end,
+    unstub = function()
+      _G.vim = nil
+      require('wincent.commandt.private.lib').watchman_stub_free(stub)
+      stub = nil
+    end,
+  }
+end
+
+local large = watchman_stub('10M', 10000000, 1)
+
+-- Opt-in, because it takes a few GB of memory, and a while.
+large.skip = function()
+  return os.getenv('LARGE') == nil
+end
+
 return {
   variants = {
     {
@@ -292,5 +338,8 @@ return {
         _G.vim = nil
       end,
     },
+    watchman_stub('10k', 10000, times),
+    watchman_stub('1M', 1000000, 1),
+    large,
   },
 }
@@ -54,7 +54,17 @@ local options_spec = {
             },
             optional = true,
           },
+          delimiter = { kind = { one_of = { 'crlf', 'lf', 'nul' } }, optional = true },
           fallback = { kind = 'boolean', optional = true },
+          manifest = {
+            kind = {
+              one_of = {
+                { kind = 'function' },
+                { kind = 'string' },
+              },
+            },
+            optional = true,
+          },
           max_files = {
             kind = {
               one_of = {
@@ -65,18 +75,37 @@ local options_spec = {
             optional = true,
           },
           open = { kind = 'function', optional = true },
+          scanner = { kind = 'function', optional = true },
+          sources = { kind = 'function', optional = true },
         },
       },
       meta = function(t)
         local errors = {}
         if is_table(t) then
           for key, value in pairs(t) do
-            if value.candidates and value.command then
+            local set = (value.candidates and 1 or 0)
+              + (value.command and 1 or 0)
+              + (value.manifest and 1 or 0)
+              + (value.sources and 1 or 0)
+            if set > 1 then
+              -- Same precedence as in `commandt.finder()`.
               value.command = nil
-              table.insert(errors, string.format('%s: `candidates` and `command` should not both be set', key))
-            elseif value.candidates == nil and value.command == nil then
+              if value.candidates then
+                value.manifest = nil
+                value.sources = nil
+              elseif value.manifest then
+                value.sources = nil
+              end
+              table.insert(
+                errors,
+                string.format('%s: only one of `candidates`, `command`, `manifest` or `sources` should be set', key)
+              )
+            elseif set == 0 then
               value.candidates = {}
-              table.insert(errors, string.format('%s: either `candidates` or `command` should be set', key))
+              table.insert(
+                errors,
+                string.format('%s: either `candidates`, `command`, `manifest` or `sources` should be set', key)
+              )
             end
 
             if value.candidates and value.max_files then
@@ -131,7 +160,14 @@ local options_spec = {
         file = {
           kind = 'table',
           keys = {
+            compact = { kind = 'boolean' },
+            emit_aliases = { kind = 'boolean' },
+            index = { kind = 'boolean' },
+            max_depth = { kind = 'number' },
             max_files = { kind = 'number' },
+            respect_gitignore = { kind = 'boolean' },
+            scan_dot_directories = { kind = 'boolean' },
+            watch = { kind = 'boolean' },
           },
           optional = true,
         },
@@ -139,6 +175,10 @@ local options_spec = {
           kind = 'table',
           keys = {
             max_files = { kind = 'number' },
+            parallel = {
+              kind = 'boolean',
+              optional = true,
+            },
             submodules = {
               kind = 'boolean',
               optional = true,
@@ -164,6 +204,24 @@ local options_spec = {
           },
           optional = true,
         },
+        watchman = {
+          kind = 'table',
+          keys = {
+            exclude = {
+              kind = 'list',
+              of = { kind = 'string' },
+            },
+            recency = { kind = 'boolean' },
+            since = { kind = 'boolean' },
+            subscribe = { kind = 'boolean' },
+            suffixes = {
+              kind = 'list',
+              of = { kind = 'string' },
+            },
+            wildignore = { kind = 'boolean' },
+          },
+          optional = true,
+        },
       },
     },
     selection_highlight = { kind = 'string' },
@@ -257,6 +315,11 @@ local default_options = {
       max_files = function(options)
         return options.scanners.git.max_files
       end,
+      scanner = function(directory, options, max_files)
+        if options.scanners.git.submodules and options.scanners.git.parallel then
+          return require('wincent.commandt.private.scanners.git').scanner(directory, max_files, options.threads)
+        end
+      end,
     },
     help = {
       candidates = function()
@@ -414,7 +477,14 @@ local default_options = {
   open = open,
   scanners = {
     file = {
+      compact = false,
+      emit_aliases = false,
+      index = false,
+      max_depth = 0,
       max_files = 0,
+      respect_gitignore = false,
+      scan_dot_directories = false,
+      watch = false,
     },
     find = {
       max_files = 0,
@@ -427,6 +497,14 @@ local default_options = {
     rg = {
       max_files = 0,
     },
+    watchman = {
+      exclude = {},
+      recency = false,
+      since = false,
+      subscribe = false,
+      suffixes = {},
+      wildignore = false,
+    },
   },
   selection_highlight = 'PMenuSel',
   smart_case = nil, -- If nil, will infer from Neovim's `'smartcase'`.
@@ -475,6 +553,10 @@ commandt.finder = function(name, directory)
   end
   if config.candidates then
     finder = require('wincent.commandt.private.finders.list')(directory, config.candidates, options)
+  elseif config.manifest then
+    finder = require('wincent.commandt.private.finders.manifest')(directory, config.manifest, options)
+  elseif config.sources then
+    finder = require('wincent.commandt.private.finders.union')(directory, config.sources, options)
   else
     finder = require('wincent.commandt.private.finders.command')(directory, config.command, options, name)
   end
@@ -0,0 +1,697 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "client.h"
+
+#include <assert.h> /* for assert() */
+#include <errno.h> /* for EAGAIN, EINPROGRESS, EINTR, errno */
+#include <fcntl.h> /* for F_GETFL, F_SETFL, O_NONBLOCK, fcntl() */
+#include <poll.h> /* for POLLIN, POLLOUT, poll() */
+#include <stdbool.h> /* for bool, false, true */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcpy(), memmove(), memset(), strcmp() etc */
+#include <sys/socket.h> /* for connect(), recv(), send(), socket() etc */
+#include <sys/un.h> /* for sockaddr_un */
+#include <unistd.h> /* for close() */
+
+#include "debug.h"
+#include "xmalloc.h" /* for xcalloc(), xmalloc(), xrealloc() */
+#include "xmap.h" /* for xmunmap() */
+#include "xstrdup.h" /* for xstrdup() */
+
+// Don't let a closed connection kill the whole process with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// How many times in a row to try reconnecting before giving up on the
+// commands in flight.
+#define CLIENT_RECONNECT_ATTEMPTS 3
+
+// Enough room for the largest PDU header (a 2-byte marker, followed by an
+// int64 length and its 1-byte type marker).
+#define CLIENT_HEADER_SIZE 11
+
+// How much of a PDU to receive at a time.
+#define CLIENT_CHUNK_SIZE (1024 * 1024)
+
+typedef enum {
+    CLIENT_ROOT_IDLE,
+    CLIENT_ROOT_WATCHING,
+    CLIENT_ROOT_QUERYING,
+    CLIENT_ROOT_DONE,
+} client_root_state_t;
+
+/**
+ * A directory that has been asked for with `client_query()`.
+ */
+typedef struct {
+    char *directory;
+    watchman_filter_t *filter;
+    unsigned fields;
+
+    /**
+     * From the last successful "watch-project" response, if any, so that
+     * later queries don't have to wait for another one.
+     */
+    char *watch;
+    char *relative_path;
+
+    /**
+     * Set if the query in flight reuses `watch`, in which case an error may
+     * just mean that the watch has gone away in the meantime (eg. because of
+     * `watchman watch-del`), and is worth retrying after a "watch-project".
+     */
+    bool cached;
+
+    client_root_state_t state;
+    watchman_query_t *result;
+} client_root_t;
+
+typedef enum {
+    CLIENT_REQUEST_QUERY,
+    CLIENT_REQUEST_WATCH_PROJECT,
+} client_request_kind_t;
+
+/**
+ * A command that has been sent (or is waiting to be), but not yet answered.
+ */
+typedef struct {
+    unsigned root;
+    client_request_kind_t kind;
+} client_request_t;
+
+struct client_t {
+    char *socket_path;
+
+    /**
+     * -1 if not connected.
+     */
+    int fd;
+
+    /**
+     * Set while a non-blocking `connect()` is still in progress.
+     */
+    bool connecting;
+
+    /**
+     * Number of times we have reconnected since a query was last answered.
+     */
+    unsigned attempts;
+
+    client_root_t *roots;
+    unsigned roots_count;
+    unsigned roots_capacity;
+
+    /**
+     * Commands awaiting responses, oldest (ie. next to be answered) first,
+     * starting at `requests_head`.
+     */
+    client_request_t *requests;
+    unsigned requests_head;
+    unsigned requests_count;
+    unsigned requests_capacity;
+
+    /**
+     * Encoded commands; the first `out_sent` bytes have already been sent.
+     */
+    char *out;
+    size_t out_length;
+    size_t out_sent;
+    size_t out_capacity;
+
+    /**
+     * The PDU being received, of which `in_length` bytes have arrived;
+     * `in_expected` is its full length, or 0 until its header is in.
+     */
+    char *in;
+    size_t in_length;
+    size_t in_expected;
+    size_t in_capacity;
+
+    /**
+     * Storage handed back by `client_recycle()`, for the next "query"
+     * response (`spare_payload`) and its `files` (`spare_files`).
+     */
+    char *spare_payload;
+    size_t spare_payload_size;
+    str_t *spare_files;
+    size_t spare_files_size;
+};
+
+// Forward declarations.
+static bool client_connect(client_t *client);
+static void client_fail(client_t *client, unsigned index, const char *error);
+static bool client_flush(client_t *client);
+static void client_handle(client_t *client, char *pdu, size_t length);
+static void client_lost(client_t *client);
+static void client_push(
+    client_t *client,
+    unsigned index,
+    client_request_kind_t kind,
+    char *pdu,
+    size_t length
+);
+static unsigned client_ready(const client_t *client);
+static bool client_receive(client_t *client);
+static void client_reserve(client_t *client);
+static void client_start(client_t *client, unsigned index);
+
+client_t *client_new(const char *socket_path) {
+    client_t *client = xcalloc(1, sizeof(client_t));
+    client->socket_path = xstrdup(socket_path);
+    client->fd = -1;
+    if (!client_connect(client)) {
+        DEBUG_LOG("client_new(): failed to connect to Watchman\n");
+        client_free(client);
+        return NULL;
+    }
+    return client;
+}
+
+unsigned client_query(
+    client_t *client,
+    const char *directory,
+    const watchman_filter_t *filter,
+    unsigned fields
+) {
+    unsigned index = 0;
+    while (index < client->roots_count &&
+           strcmp(client->roots[index].directory, directory) != 0) {
+        index++;
+    }
+    if (index == client->roots_count) {
+        if (client->roots_count == client->roots_capacity) {
+            client->roots_capacity =
+                client->roots_capacity ? client->roots_capacity * 2 : 4;
+            client->roots = xrealloc(
+                client->roots, client->roots_capacity * sizeof(client_root_t)
+            );
+        }
+        memset(&client->roots[index], 0, sizeof(client_root_t));
+        client->roots[index].directory = xstrdup(directory);
+        client->roots_count++;
+    }
+
+    client_root_t *root = &client->roots[index];
+    if (root->state == CLIENT_ROOT_WATCHING ||
+        root->state == CLIENT_ROOT_QUERYING) {
+        return index;
+    } else if (root->result) {
+        commandt_watchman_query_free(root->result);
+        root->result = NULL;
+    }
+    commandt_watchman_filter_free(root->filter);
+    root->filter = commandt_watchman_filter_copy(filter);
+    root->fields = fields;
+
+    if (client->fd == -1) {
+        client->attempts = 0;
+        if (!client_connect(client)) {
+            client_fail(client, index, "client_query(): failed to connect");
+            return index;
+        }
+    }
+    client_start(client, index);
+    if (!client_flush(client)) {
+        client_lost(client);
+    }
+    return index;
+}
+
+unsigned client_process(client_t *client, int timeout) {
+    short events = client_events(client);
+    if (!events) {
+        return client_ready(client);
+    }
+    struct pollfd pollfd = {.fd = client->fd, .events = events};
+    int count = poll(&pollfd, 1, timeout);
+    if (count == -1 && errno != EINTR) {
+        DEBUG_LOG("client_process(): poll() failed\n");
+        return client_ready(client);
+    } else if (count <= 0) {
+        return client_ready(client);
+    }
+
+    if (client->connecting) {
+        int err = 0;
+        socklen_t err_length = sizeof(err);
+        if (getsockopt(
+                client->fd, SOL_SOCKET, SO_ERROR, &err, &err_length
+            ) == -1 ||
+            err != 0) {
+            client_lost(client);
+            return client_ready(client);
+        }
+        client->connecting = false;
+    }
+
+    // Receiving may queue up more commands (ie. a "query" once a
+    // "watch-project" has been answered), so flush again afterwards.
+    if (!client_flush(client) || !client_receive(client) ||
+        !client_flush(client)) {
+        client_lost(client);
+    }
+    return client_ready(client);
+}
+
+watchman_query_t *client_result(client_t *client, unsigned id) {
+    if (id >= client->roots_count ||
+        client->roots[id].state != CLIENT_ROOT_DONE) {
+        return NULL;
+    }
+    watchman_query_t *result = client->roots[id].result;
+    client->roots[id].result = NULL;
+    client->roots[id].state = CLIENT_ROOT_IDLE;
+    return result;
+}
+
+void client_recycle(client_t *client, scanner_t *scanner) {
+    if (!scanner->payload) {
+        // Not (or no longer) made from a Watchman result.
+        return;
+    }
+    assert(!scanner->handles && !scanner->paths);
+    free(client->spare_payload);
+    client->spare_payload = scanner->payload;
+    client->spare_payload_size = scanner->payload_size;
+    if (client->spare_files) {
+        xmunmap(client->spare_files, client->spare_files_size);
+    }
+    client->spare_files = scanner->candidates;
+    client->spare_files_size = scanner->candidates_size;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t str = scanner->candidates[i];
+        if (str.contents && str.capacity >= 0) {
+            free((void *)str.contents);
+        }
+    }
+    free(scanner->sources);
+    free(scanner->source_weights);
+
+    // Leave an empty scanner behind, and make sure that any matcher built on
+    // it lets go of the old candidates.
+    scanner->bitmasks = NULL;
+    scanner->bitmasks_count = 0;
+    scanner->payload = NULL;
+    scanner->payload_size = 0;
+    scanner->candidates = NULL;
+    scanner->candidates_size = 0;
+    scanner->sources = NULL;
+    scanner->source_weights = NULL;
+    scanner->count = 0;
+    scanner->tombstones = 0;
+    scanner->clock++;
+    scanner->generation++;
+}
+
+int client_fd(const client_t *client) {
+    return client->fd;
+}
+
+short client_events(const client_t *client) {
+    if (client->fd == -1) {
+        return 0;
+    } else if (client->connecting) {
+        return POLLOUT;
+    }
+    short events = 0;
+    if (client->requests_count) {
+        events |= POLLIN;
+    }
+    if (client->out_sent < client->out_length) {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
+void client_free(client_t *client) {
+    if (client->fd != -1) {
+        close(client->fd);
+    }
+    for (unsigned i = 0; i < client->roots_count; i++) {
+        client_root_t *root = &client->roots[i];
+        free(root->directory);
+        commandt_watchman_filter_free(root->filter);
+        free(root->watch);
+        free(root->relative_path);
+        if (root->result) {
+            commandt_watchman_query_free(root->result);
+        }
+    }
+    free(client->roots);
+    free(client->requests);
+    free(client->out);
+    free(client->in);
+    free(client->spare_payload);
+    if (client->spare_files) {
+        xmunmap(client->spare_files, client->spare_files_size);
+    }
+    free(client->socket_path);
+    free(client);
+}
+
+/**
+ * Starts connecting to the server, without waiting for the connection to be
+ * accepted. Returns false on failure.
+ */
+static bool client_connect(client_t *client) {
+    int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(fd);
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, client->socket_path, sizeof(addr.sun_path) - 1);
+    client->connecting = false;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) ==
+        -1) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return false;
+        }
+        client->connecting = true;
+    }
+    client->fd = fd;
+    return true;
+}
+
+/**
+ * Gives up on the root at `index`, recording `error` as its result.
+ */
+static void client_fail(client_t *client, unsigned index, const char *error) {
+    client_root_t *root = &client->roots[index];
+    root->result = xcalloc(1, sizeof(watchman_query_t));
+    root->result->error = xstrdup(error);
+    root->state = CLIENT_ROOT_DONE;
+}
+
+/**
+ * Sends as much of the pending output as the socket will take. Returns false
+ * if the connection has been lost.
+ */
+static bool client_flush(client_t *client) {
+    if (client->connecting) {
+        return true;
+    }
+    while (client->out_sent < client->out_length) {
+        ssize_t count = send(
+            client->fd,
+            client->out + client->out_sent,
+            client->out_length - client->out_sent,
+            SEND_FLAGS
+        );
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return false;
+        }
+        client->out_sent += count;
+    }
+    client->out_sent = 0;
+    client->out_length = 0;
+    return true;
+}
+
+/**
+ * Handles the complete response of `length` bytes at `pdu` (taking ownership
+ * of it) to the oldest command in flight.
+ */
+static void client_handle(client_t *client, char *pdu, size_t length) {
+    if (!client->requests_count) {
+        DEBUG_LOG("client_handle(): unexpected PDU\n");
+        free(pdu);
+        return;
+    }
+    client_request_t request = client->requests[client->requests_head];
+    client->requests_head++;
+    client->requests_count--;
+    if (!client->requests_count) {
+        client->requests_head = 0;
+    }
+
+    client_root_t *root = &client->roots[request.root];
+    if (request.kind == CLIENT_REQUEST_WATCH_PROJECT) {
+        watchman_watch_project_t *project =
+            commandt_watchman_decode_watch_project(pdu, length);
+        if (project->error) {
+            client_fail(client, request.root, project->error);
+        } else {
+            root->watch = xstrdup(project->watch);
+            root->relative_path = project->relative_path
+                                      ? xstrdup(project->relative_path)
+                                      : NULL;
+            client_start(client, request.root);
+            client->roots[request.root].cached = false;
+        }
+        commandt_watchman_watch_project_free(project);
+    } else {
+        watchman_query_t *result = commandt_watchman_decode_query(
+            pdu, length, client->spare_files, client->spare_files_size
+        );
+        client->spare_files = NULL;
+        client->spare_files_size = 0;
+        if (result->error && root->cached) {
+            DEBUG_LOG("client_handle(): %s (retrying)\n", result->error);
+            commandt_watchman_query_free(result);
+            free(root->watch);
+            free(root->relative_path);
+            root->watch = NULL;
+            root->relative_path = NULL;
+            client_start(client, request.root);
+        } else {
+            root->result = result;
+            root->state = CLIENT_ROOT_DONE;
+            client->attempts = 0;
+        }
+    }
+}
+
+/**
+ * Closes a connection that has failed, and either reconnects and reissues
+ * the commands that were in flight, or (if we have already tried that too
+ * many times) gives up on them.
+ */
+static void client_lost(client_t *client) {
+    DEBUG_LOG("client_lost(): connection lost\n");
+    close(client->fd);
+    client->fd = -1;
+    client->connecting = false;
+    client->requests_head = 0;
+    client->requests_count = 0;
+    client->out_length = 0;
+    client->out_sent = 0;
+    free(client->in);
+    client->in = NULL;
+    client->in_length = 0;
+    client->in_expected = 0;
+    client->in_capacity = 0;
+
+    // If the server restarted, it may not be watching anything any more.
+    for (unsigned i = 0; i < client->roots_count; i++) {
+        free(client->roots[i].watch);
+        free(client->roots[i].relative_path);
+        client->roots[i].watch = NULL;
+        client->roots[i].relative_path = NULL;
+    }
+
+    bool reconnected = client->attempts++ < CLIENT_RECONNECT_ATTEMPTS &&
+                       client_connect(client);
+    for (unsigned i = 0; i < client->roots_count; i++) {
+        client_root_state_t state = client->roots[i].state;
+        if (state == CLIENT_ROOT_WATCHING || state == CLIENT_ROOT_QUERYING) {
+            if (reconnected) {
+                client_start(client, i);
+            } else {
+                client_fail(client, i, "client_lost(): lost connection");
+            }
+        }
+    }
+}
+
+/**
+ * Queues the command of `length` bytes at `pdu` (taking ownership of it) on
+ * behalf of the root at `index`.
+ */
+static void client_push(
+    client_t *client,
+    unsigned index,
+    client_request_kind_t kind,
+    char *pdu,
+    size_t length
+) {
+    if (client->out_length + length > client->out_capacity) {
+        while (client->out_length + length > client->out_capacity) {
+            client->out_capacity =
+                client->out_capacity ? client->out_capacity * 2 : 4096;
+        }
+        client->out = xrealloc(client->out, client->out_capacity);
+    }
+    memcpy(client->out + client->out_length, pdu, length);
+    client->out_length += length;
+    free(pdu);
+
+    if (client->requests_head + client->requests_count ==
+        client->requests_capacity) {
+        if (client->requests_head) {
+            memmove(
+                client->requests,
+                client->requests + client->requests_head,
+                client->requests_count * sizeof(client_request_t)
+            );
+            client->requests_head = 0;
+        } else {
+            client->requests_capacity =
+                client->requests_capacity ? client->requests_capacity * 2 : 4;
+            client->requests = xrealloc(
+                client->requests,
+                client->requests_capacity * sizeof(client_request_t)
+            );
+        }
+    }
+    client_request_t *request =
+        &client->requests[client->requests_head + client->requests_count++];
+    request->root = index;
+    request->kind = kind;
+}
+
+/**
+ * Returns the number of results waiting to be collected.
+ */
+static unsigned client_ready(const client_t *client) {
+    unsigned count = 0;
+    for (unsigned i = 0; i < client->roots_count; i++) {
+        if (client->roots[i].state == CLIENT_ROOT_DONE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Receives whatever has arrived, handling each PDU as soon as it is
+ * complete. Returns false if the connection has been lost (or the server
+ * sent something that isn't a PDU).
+ */
+static bool client_receive(client_t *client) {
+    while (true) {
+        if (!client->in_expected) {
+            int64_t expected =
+                commandt_watchman_pdu_length(client->in, client->in_length);
+            if (expected == -1) {
+                DEBUG_LOG("client_receive(): invalid PDU header\n");
+                return false;
+            } else if (expected) {
+                client->in_expected = expected;
+                client_reserve(client);
+            }
+        }
+
+        if (client->in_expected &&
+            client->in_length >= client->in_expected) {
+            // While reading a header, we may have received the start of the
+            // next PDU too; carry it over.
+            char *pdu = client->in;
+            size_t length = client->in_expected;
+            size_t extra = client->in_length - length;
+            client->in = NULL;
+            client->in_capacity = 0;
+            if (extra) {
+                client->in = xmalloc(CLIENT_HEADER_SIZE);
+                client->in_capacity = CLIENT_HEADER_SIZE;
+                memcpy(client->in, pdu + length, extra);
+            }
+            client->in_length = extra;
+            client->in_expected = 0;
+            client_handle(client, pdu, length);
+            continue;
+        }
+
+        size_t wanted = client->in_expected
+                            ? client->in_expected - client->in_length
+                            : CLIENT_HEADER_SIZE - client->in_length;
+        if (wanted > CLIENT_CHUNK_SIZE) {
+            wanted = CLIENT_CHUNK_SIZE;
+        }
+        if (client->in_capacity < client->in_length + wanted) {
+            client->in_capacity = client->in_length + wanted;
+            client->in = xrealloc(client->in, client->in_capacity);
+        }
+        ssize_t count =
+            recv(client->fd, client->in + client->in_length, wanted, 0);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return false;
+        } else if (count == 0) {
+            return false;
+        }
+        client->in_length += count;
+    }
+}
+
+/**
+ * Makes room for the whole of the PDU being received, once its length is
+ * known; if it is the response to a "query", the spare payload (see
+ * `client_recycle()`) is used if it is big enough, and released otherwise.
+ */
+static void client_reserve(client_t *client) {
+    if (client->spare_payload && client->requests_count &&
+        client->requests[client->requests_head].kind ==
+            CLIENT_REQUEST_QUERY) {
+        if (client->spare_payload_size >= client->in_expected &&
+            client->in_capacity < client->in_expected) {
+            memcpy(client->spare_payload, client->in, client->in_length);
+            free(client->in);
+            client->in = client->spare_payload;
+            client->in_capacity = client->spare_payload_size;
+        } else {
+            free(client->spare_payload);
+        }
+        client->spare_payload = NULL;
+        client->spare_payload_size = 0;
+    }
+    if (client->in_capacity < client->in_expected) {
+        client->in = xrealloc(client->in, client->in_expected);
+        client->in_capacity = client->in_expected;
+    }
+}
+
+/**
+ * Queues the next command for the root at `index`: a "query" if we already
+ * know which watch it belongs to, and a "watch-project" otherwise.
+ */
+static void client_start(client_t *client, unsigned index) {
+    client_root_t *root = &client->roots[index];
+    size_t length;
+    char *pdu;
+    if (root->watch) {
+        pdu = commandt_watchman_encode_query(
+            root->watch, root->relative_path, root->filter, root->fields, &length
+        );
+        root->cached = true;
+        root->state = CLIENT_ROOT_QUERYING;
+        client_push(client, index, CLIENT_REQUEST_QUERY, pdu, length);
+    } else {
+        pdu = commandt_watchman_encode_watch_project(root->directory, &length);
+        root->state = CLIENT_ROOT_WATCHING;
+        client_push(client, index, CLIENT_REQUEST_WATCH_PROJECT, pdu, length);
+    }
+}
@@ -0,0 +1,125 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A non-blocking Watchman client that can have requests for several roots in
+ * flight on one connection at once.
+ *
+ * The blocking functions in `watchman.h` send one command and wait for its
+ * response before sending the next, so listing a directory costs two full
+ * round trips ("watch-project" followed by "query"), and listing several
+ * costs two per directory. A `client_t` instead writes its commands to the
+ * socket as soon as it can, and matches up the responses (which Watchman
+ * sends in order) as they arrive: the "watch-project" commands for all of
+ * the roots go out together, and the "query" for each root goes out as soon
+ * as its "watch-project" response is in, while the others are still pending.
+ * A query can't be sent any earlier than that, because it has to name the
+ * watched root that "watch-project" reports; but that root is remembered, so
+ * listing the same directory again takes only a single round trip.
+ *
+ * Nothing blocks unless asked to: `client_process()` does whatever I/O it
+ * can and returns, so the client can be driven by an external event loop
+ * that waits on `client_fd()` for the `client_events()`. If the connection
+ * is lost (eg. because Watchman restarted), the client reconnects and
+ * reissues the commands that were in flight.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define client_events commandt_client_events
+#define client_fd commandt_client_fd
+#define client_free commandt_client_free
+#define client_new commandt_client_new
+#define client_process commandt_client_process
+#define client_query commandt_client_query
+#define client_recycle commandt_client_recycle
+#define client_result commandt_client_result
+
+#include "commandt.h" /* for scanner_t */
+#include "watchman.h" /* for watchman_filter_t, watchman_query_t */
+
+typedef struct client_t client_t;
+
+/**
+ * Creates a client for the Watchman server listening on `socket_path`, and
+ * starts connecting to it.
+ *
+ * Returns NULL if the connection can't be made. The caller should dispose of
+ * the result with `client_free()`.
+ */
+client_t *client_new(const char *socket_path);
+
+/**
+ * Asks for a listing of `directory`, restricted by `filter` (which may be
+ * NULL) and with any extra `fields` (see `commandt_watchman_query()`), and
+ * returns an identifier for use with `client_result()`.
+ *
+ * Asking again for a directory whose listing is still in flight just returns
+ * the same identifier; asking again after collecting (or while holding an
+ * uncollected) result queries afresh.
+ */
+unsigned client_query(
+    client_t *client,
+    const char *directory,
+    const watchman_filter_t *filter,
+    unsigned fields
+);
+
+/**
+ * Sends and receives whatever it can, and decodes any responses that have
+ * arrived in full. Waits up to `timeout` milliseconds for the socket to be
+ * ready (0 means don't wait, and -1 means wait indefinitely), but never
+ * waits when nothing is in flight.
+ *
+ * Returns the number of results that are ready to be collected.
+ */
+unsigned client_process(client_t *client, int timeout);
+
+/**
+ * If the listing for `id` (see `client_query()`) is complete, returns it
+ * (with `error` set if it failed) and hands ownership of it to the caller,
+ * who should dispose of it with `commandt_watchman_query_free()`; otherwise,
+ * returns NULL.
+ */
+watchman_query_t *client_result(client_t *client, unsigned id);
+
+/**
+ * Takes back the storage of `scanner` (one made by
+ * `commandt_watchman_scanner()` from an earlier result), so that the next
+ * listing can be received and decoded into it instead of into fresh
+ * allocations. This way, refreshing a listing alternates between two sets of
+ * buffers (the ones in use and the spare ones) rather than allocating a new
+ * set each time and waiting for the old one to be garbage collected.
+ *
+ * `scanner` is left empty, but remains valid until `scanner_free()` is called
+ * on it as usual. Its candidates go with the storage, though, so callers must
+ * not recycle a scanner that any matcher still in use was made from. The
+ * spare storage is only held until the next listing arrives: if that doesn't
+ * fit, it is released.
+ */
+void client_recycle(client_t *client, scanner_t *scanner);
+
+/**
+ * Returns the socket to watch for readiness when driving the client from an
+ * event loop, or -1 if there is none (eg. while nothing is in flight after
+ * the connection was lost). The socket may change after any call to
+ * `client_process()` or `client_query()`, because of reconnection.
+ */
+int client_fd(const client_t *client);
+
+/**
+ * Returns the `poll()` events (`POLLIN`, `POLLOUT` or both) to wait for on
+ * `client_fd()` before calling `client_process()`; 0 if there is nothing to
+ * wait for.
+ */
+short client_events(const client_t *client);
+
+void client_free(client_t *client);
+
+#endif
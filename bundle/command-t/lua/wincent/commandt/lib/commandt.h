@@ -12,21 +12,42 @@
 
 #include "str.h" /* for str_t */
 
+/**
+ * A candidate in a packed scanner (see `scanner_pack()`), stored as an offset
+ * into the scanner's `buffer` and a length.
+ */
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} slab_handle_t;
+
 /**
  *  Represents a single "haystack" (ie. a string to be searched for the needle).
  */
 typedef struct {
+    /**
+     * NULL if the scanner is packed or compressed (see `scanner_pack()` and
+     * `scanner_compress()`), in which case the candidate is identified by
+     * `index` instead.
+     */
     str_t *candidate;
     long bitmask;
     float score;
+    unsigned index;
 } haystack_t;
 
 typedef struct {
     /**
-     * Number of candidates currently stored in the scanner.
+     * Number of slots in use in `candidates`, including tombstones.
      */
     unsigned count;
 
+    /**
+     * Number of slots in `candidates` that are tombstones (ie. candidates
+     * removed with `scanner_remove()`, whose `contents` are NULL).
+     */
+    unsigned tombstones;
+
     str_t *candidates;
 
     /**
@@ -53,9 +74,75 @@ typedef struct {
     /**
      * @internal
      *
-     * Counter that increments any time the candidates change.
+     * A `malloc()`-ed block that the candidates point into, for scanners that
+     * adopt storage they did not allocate themselves (eg. the response from
+     * which `commandt_watchman_scanner()` takes its candidates); NULL
+     * otherwise. Book-keeping detail, needed for call to `free()`.
+     */
+    char *payload;
+    size_t payload_size;
+
+    /**
+     * Precomputed bitmasks (see `haystack_t`) for the first `bitmasks_count`
+     * candidates, or NULL. Candidates added later get their bitmasks computed
+     * lazily, as usual.
+     */
+    long *bitmasks;
+    unsigned bitmasks_count;
+
+    /**
+     * Compact storage for the candidates, used instead of `candidates` and
+     * `buffer` once the scanner has been compressed with `scanner_compress()`.
+     */
+    struct paths_t *paths;
+
+    /**
+     * Packed storage for the candidates, used instead of `candidates` once the
+     * scanner has been packed with `scanner_pack()`.
+     */
+    slab_handle_t *handles;
+
+    /**
+     * @internal
+     *
+     * Book-keeping detail, needed for call to `munmap()`.
      */
-    unsigned clock; // TODO: figure out whether I need this
+    size_t handles_size;
+
+    /**
+     * For scanners that combine several sources (see `union_scanner_new()`),
+     * the source of each candidate, and the factor by which to scale the
+     * scores of candidates from each source; NULL otherwise. Watchman
+     * scanners use them to weight files by age instead (see
+     * `commandt_watchman_scanner()`).
+     */
+    unsigned char *sources;
+    float *source_weights;
+
+    /**
+     * For scanners built by walking the filesystem (see
+     * `commandt_file_scanner()`), the number of directories that were skipped
+     * because they had already been reached by another path (eg. through a
+     * symbolic link); zero otherwise.
+     */
+    unsigned duplicate_count;
+
+    /**
+     * @internal
+     *
+     * Counter that increments any time the candidates change. The matcher
+     * uses it to notice that it needs to bring its haystacks up-to-date.
+     */
+    unsigned clock;
+
+    /**
+     * @internal
+     *
+     * Counter that increments whenever existing candidates change position
+     * (eg. when `scanner_compact()` removes tombstones), which means that
+     * the matcher has to rebuild its haystacks from scratch.
+     */
+    unsigned generation;
 } scanner_t;
 
 // TODO flesh this out; basically make it a container for instance variables
@@ -65,7 +152,25 @@ typedef struct {
      * expensive to copy or recreate.
      */
     scanner_t *scanner;
+
+    /**
+     * One haystack for each live (ie. non-tombstone) candidate in the
+     * scanner, in the same order.
+     */
     haystack_t *haystacks;
+    unsigned haystacks_count;
+    unsigned haystacks_capacity;
+
+    /**
+     * State of the scanner when the haystacks were last brought up-to-date.
+     * `seen` is the number of scanner slots accounted for; slots past that
+     * are candidates appended since then.
+     */
+    unsigned clock;
+    unsigned generation;
+    unsigned seen;
+    unsigned tombstones;
+    str_t *candidates;
 
     bool always_show_dot_files;
     bool ignore_case;
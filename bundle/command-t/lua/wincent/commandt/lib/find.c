@@ -3,88 +3,455 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
-// TODO: implement max_depth
-// TODO: implement scan_dot_directories
-
 #include "find.h"
 
 #include <assert.h> /* for assert() */
+#include <dirent.h> /* for DT_DIR, DT_LNK, DT_REG, DT_UNKNOWN */
 #include <errno.h> /* for errno */
-#include <fts.h> /* for fts_close(), fts_open(), fts_read() */
-#include <stdlib.h> /* for free() */
-#include <string.h> /* for strcmp(), strerror() */
+#include <fcntl.h> /* for O_CLOEXEC, O_DIRECTORY, O_RDONLY, open() */
+#include <limits.h> /* for PATH_MAX, UINT_MAX */
+#include <pthread.h> /* for pthread_create(), pthread_mutex_lock() etc */
+#include <stdatomic.h> /* for atomic_bool, atomic_load(), atomic_uint etc */
+#include <stdint.h> /* for int64_t, uint64_t */
+#include <stdlib.h> /* for free(), qsort() */
+#include <string.h> /* for memcpy(), strcmp(), strerror(), strlen() */
+#include <sys/stat.h> /* for S_ISDIR(), S_ISREG(), fstat(), fstatat() */
+#include <unistd.h> /* for close() */
+
+#ifdef LINUX
+#include <sys/syscall.h> /* for SYS_getdents64, syscall() */
+#endif
 
 #include "debug.h"
-#include "scanner.h" /* for scanner_new() */
+#include "die.h" /* for die() */
+#include "gitignore.h" /* for gitignore_load(), gitignore_match() */
+#include "ignore.h" /* for ignore_match(), ignore_new() */
+#include "scanner.h" /* for scanner_new(), scanner_pack() */
 #include "xmalloc.h"
-#include "xmap.h" /* for xmap(), xmunmap() */
+#include "xmap.h" /* for xmap(), xmremap(), xmunmap() etc */
 #include "xstrdup.h" /* for xstrdup() */
 
-// TODO: share these with scanner.c
-static long MAX_FILES = MAX_FILES_CONF;
-static size_t buffer_size = MMAP_SLAB_SIZE_CONF;
 static const char *current_directory = ".";
 
-find_result_t *commandt_find(const char *directory, unsigned max_files) {
+// Initial sizes of the result slabs; they grow as needed, and are trimmed to
+// fit once the walk is over.
+#define INITIAL_FILES 4096
+#define INITIAL_BUFFER_SIZE 262144
+
+// Once the `files` array is this big, ask for huge pages.
+#define HUGEPAGE_THRESHOLD 8388608
+
+// Arbitrary limit to stop people from doing self-harm.
+#define MAX_THREADS 128
+
+// Workers flush their private buffers into the shared slab whenever they hold
+// this many paths...
+#define FLUSH_COUNT 256
+
+// ... or this many bytes.
+#define FLUSH_BYTES 65536
+
+// Size of the buffer each worker uses to read directory entries.
+#define DIRENT_BUFFER_SIZE 32768
+
+// Initial capacity of the set of visited directories (must be a power of 2).
+#define VISITED_INITIAL_CAPACITY 1024
+
+/**
+ * A directory waiting to be (or being) walked.
+ */
+typedef struct walk_dir_t {
+    struct walk_dir_t *next;
+
+    /**
+     * Path as it will appear in the results (ie. "" rather than "." for the
+     * current directory). NUL-terminated.
+     */
+    char *path;
+    size_t length;
+
+    /**
+     * Number of levels below the starting directory.
+     */
+    unsigned depth;
+
+    /**
+     * Ancestors are kept alive (via `refs`) for as long as any of their
+     * descendants are still waiting to be walked, so that descendants can
+     * refer to their ignore rules.
+     */
+    struct walk_dir_t *parent;
+    atomic_uint refs;
+
+    /**
+     * True if we reached this directory by following a symbolic link.
+     */
+    bool symlink;
+
+    /**
+     * Ignore rules in effect for entries in this directory; either compiled
+     * from this directory's own ignore files (in which case `owns_gitignore`
+     * is true), or inherited from the parent. Because ancestors outlive their
+     * descendants, children can share the parent's rules without copying.
+     */
+    gitignore_t *gitignore;
+    bool owns_gitignore;
+} walk_dir_t;
+
+/**
+ * Identifies a directory independently of the path used to reach it.
+ *
+ * No real directory has inode 0, so we use that to mark empty slots.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} walk_inode_t;
+
+/**
+ * State shared among all workers.
+ */
+typedef struct {
+    /**
+     * Protects `queue`, `queue_tail`, `pending`, `level`, `level_active`,
+     * `level_links`, `deferred` and `deferred_count`.
+     */
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+
+    /**
+     * Directories yet to be walked; a stack, unless `breadth_first` is set,
+     * in which case it is a FIFO queue (with new entries going on the end,
+     * at `queue_tail`).
+     */
+    walk_dir_t *queue;
+    walk_dir_t *queue_tail;
+
+    /**
+     * Count of directories that are either in the `queue` or being walked
+     * right now. When this drops to zero, the walk is over.
+     */
+    unsigned pending;
+
+    /**
+     * When `breadth_first` is set, workers walk one level at a time: nobody
+     * starts on a directory at depth `level + 1` until all `level_active`
+     * directories at depth `level` are done (and their files flushed).
+     * Likewise, nobody starts on a directory reached via a symbolic link
+     * while any of the `level_active` directories not so reached (ie. all but
+     * `level_links` of them) are still being walked.
+     */
+    bool breadth_first;
+    unsigned level;
+    unsigned level_active;
+    unsigned level_links;
+
+    /**
+     * Directories reached via symbolic links, set aside until everything
+     * else has been walked (or, when `breadth_first` is set, until everything
+     * else at the same depth has been queued, so that links still get walked
+     * at their own depth, behind everything else there; see `level_links`).
+     * That way, when a link points at a directory that is also reachable
+     * directly (and, in breadth-first mode, no deeper than the link), the
+     * directory has already been walked by the time any worker gets to the
+     * link, and it is the link that gets skipped (see `walk_visit()`).
+     */
+    walk_dir_t *deferred;
+    unsigned deferred_count;
+
+    /**
+     * Protects `visited`, `visited_capacity` and `visited_count`.
+     */
+    pthread_mutex_t visited_mutex;
+
+    /**
+     * Open-addressed hash set of every directory opened so far.
+     */
+    walk_inode_t *visited;
+    size_t visited_capacity;
+    size_t visited_count;
+
+    /**
+     * Number of directories skipped because they had already been visited;
+     * see `find_result_t`.
+     */
+    atomic_uint duplicates;
+
+    /**
+     * See `find_options_t`.
+     */
+    bool emit_aliases;
+    find_directory_callback_t on_directory;
+    void *context;
+
+    /**
+     * Set when the walk should stop early (ie. `max_files` was reached, or the
+     * slab was exhausted).
+     */
+    atomic_bool done;
+
+    /**
+     * Protects `result` and `cursor`.
+     */
+    pthread_mutex_t result_mutex;
+    find_result_t *result;
+
+    /**
+     * Next free byte in `result->buffer`.
+     */
+    char *cursor;
+
+    /**
+     * Maximum number of files to put in `result`.
+     */
+    unsigned limit;
+
+    /**
+     * Pruning rules; see `find_options_t`.
+     */
+    unsigned max_depth;
+    bool scan_dot_directories;
+    ignore_t *ignore;
+    bool respect_gitignore;
+} walker_t;
+
+/**
+ * Per-thread state.
+ */
+typedef struct {
+    walker_t *walker;
+
+    /**
+     * Paths found by this worker but not yet flushed into the shared slab,
+     * stored back-to-back and NUL-terminated.
+     */
+    char *bytes;
+    size_t length;
+
+    /**
+     * Length (not counting NUL) of each path in `bytes`.
+     */
+    size_t lengths[FLUSH_COUNT];
+    unsigned count;
+
+    /**
+     * Subdirectories found while walking the current directory; these get
+     * pushed onto the shared queue in a single batch.
+     */
+    walk_dir_t *subdirectories;
+    unsigned subdirectory_count;
+
+    /**
+     * Likewise, but for subdirectories reached via symbolic links; these go
+     * onto the walker's `deferred` list.
+     */
+    walk_dir_t *deferred;
+    unsigned deferred_count;
+
+#ifdef LINUX
+    /**
+     * Buffer for `getdents64()`. Normally `DIRENT_BUFFER_SIZE` bytes, but
+     * grows as needed when we have to read an entire directory at once (see
+     * `walk_directory()`).
+     */
+    char *dirents;
+    size_t dirents_size;
+#endif
+} walk_worker_t;
+
+#ifdef LINUX
+/**
+ * Layout of the records returned by the `getdents64()` system call.
+ */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} walk_dirent64_t;
+#endif
+
+// Forward declarations.
+static int cmp_path(const void *a, const void *b);
+static walk_dir_t *walk_dir_new(walk_dir_t *parent, const char *name, size_t name_length);
+static void walk_dir_release(walk_dir_t *dir);
+static bool walk_directory(walk_worker_t *worker, walk_dir_t *dir);
+static void walk_emit(walk_worker_t *worker, size_t length);
+static void walk_entry(
+    walk_worker_t *worker,
+    walk_dir_t *dir,
+    int fd,
+    const char *name,
+    unsigned char type
+);
+static void walk_flush(walk_worker_t *worker);
+static size_t walk_inode_hash(dev_t dev, ino_t ino);
+static void walk_load_gitignore(
+    walk_dir_t *dir, int fd, bool gitignore, bool ignore
+);
+static void walk_push(walk_worker_t *worker);
+static void walk_reserve(walker_t *walker, unsigned count, size_t size);
+static void walk_stop(walker_t *walker);
+static void walk_undefer(walker_t *walker);
+static bool walk_visit(walker_t *walker, dev_t dev, ino_t ino);
+static void *walk_worker(void *arg);
+static void walk_worker_free(walk_worker_t *worker);
+static void walk_worker_init(walk_worker_t *worker, walker_t *walker);
+
+find_result_t *commandt_find(
+    const char *directory, const find_options_t *options
+) {
+    find_options_t defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+    unsigned max_files = options->max_files;
+
     find_result_t *result = xcalloc(1, sizeof(find_result_t));
 
-    result->files_size = sizeof(str_t) * (max_files ? max_files + 1 : MAX_FILES);
+    result->files_size = sizeof(str_t) * INITIAL_FILES;
     result->files = xmap(result->files_size);
 
-    result->buffer_size = buffer_size;
+    result->buffer_size = INITIAL_BUFFER_SIZE;
     result->buffer = xmap(result->buffer_size);
 
-    char *buffer = result->buffer;
+    walker_t walker;
+    walker.queue = NULL;
+    walker.queue_tail = NULL;
+    walker.pending = 0;
+    walker.breadth_first = options->breadth_first;
+    walker.level = 0;
+    walker.level_active = 0;
+    walker.level_links = 0;
+    walker.deferred = NULL;
+    walker.deferred_count = 0;
+    walker.visited_capacity = VISITED_INITIAL_CAPACITY;
+    walker.visited_count = 0;
+    walker.visited = xcalloc(walker.visited_capacity, sizeof(walk_inode_t));
+    atomic_init(&walker.duplicates, 0);
+    walker.emit_aliases = options->emit_aliases;
+    walker.on_directory = options->on_directory;
+    walker.context = options->context;
+    atomic_init(&walker.done, false);
+    walker.result = result;
+    walker.cursor = result->buffer;
+    walker.limit = max_files ? max_files : UINT_MAX;
+    walker.max_depth = options->max_depth;
+    walker.scan_dot_directories = options->scan_dot_directories;
+    walker.ignore = ignore_new(options->ignore, options->ignore_count);
+    walker.respect_gitignore = options->respect_gitignore;
+    pthread_mutex_init(&walker.queue_mutex, NULL);
+    pthread_cond_init(&walker.queue_cond, NULL);
+    pthread_mutex_init(&walker.result_mutex, NULL);
+    pthread_mutex_init(&walker.visited_mutex, NULL);
 
-    // TODO: make sure there is no trailing slash
-    char *copy = xstrdup(directory);
+    // Trim trailing slashes, and represent the current directory as "" so
+    // that results don't get a leading "./" (which would make everything look
+    // like a dot-file).
+    walk_dir_t *root = xcalloc(1, sizeof(walk_dir_t));
+    atomic_init(&root->refs, 1);
+    root->path = xstrdup(directory);
+    root->length = strlen(root->path);
+    while (root->length > 1 && root->path[root->length - 1] == '/') {
+        root->path[--root->length] = '\0';
+    }
+    if (strcmp(root->path, current_directory) == 0) {
+        root->path[0] = '\0';
+        root->length = 0;
+    }
 
-    // Drop leading "./" if we're exploring current directory.
-    size_t drop = strcmp(directory, current_directory) == 0 ? 2 : 0;
+    // Walk the root directory on this thread; that way we can report an error
+    // if it can't be opened, and we don't spin up any threads at all for an
+    // empty directory.
+    walk_worker_t *workers = NULL;
+    walk_worker_t main_worker;
+    walk_worker_init(&main_worker, &walker);
+    walker.pending = 1;
+    if (!walk_directory(&main_worker, root)) {
+        result->error = xstrdup(strerror(errno));
+    }
+    walk_dir_release(root);
+    if (--walker.pending == 0 || walker.breadth_first) {
+        walk_undefer(&walker);
+    }
+    walk_flush(&main_worker);
 
-    char *paths[] = {copy, NULL};
-#ifdef FTS_NOSTAT_TYPE
-    int flags = FTS_LOGICAL | FTS_NOSTAT_TYPE;
-#else
-    int flags = FTS_LOGICAL | FTS_NOSTAT;
-#endif
-    FTS *handle = fts_open(paths, flags, NULL);
-    if (handle == NULL) {
-        result->error = strerror(errno);
-    } else {
-        FTSENT *node;
-        while ((node = fts_read(handle)) != NULL) {
-            if (node->fts_info == FTS_F) {
-                size_t path_len =
-                    strlen(node->fts_path) + 1 - drop; // Include NUL byte.
-                if (buffer + path_len > result->buffer + result->buffer_size) {
-                    // Would be decidedly odd to get here.
-                    DEBUG_LOG("commandt_find(): slab allocation exhausted\n");
-                    break;
-                }
-                str_t *str = &result->files[result->count++];
-                memcpy(buffer, node->fts_path + drop, path_len);
-                str_init(str, buffer, path_len - 1); // Don't count NUL byte.
-                buffer += path_len;
+    if (walker.queue) {
+        unsigned thread_count =
+            options->threads ? options->threads : commandt_processors();
+        if (thread_count > MAX_THREADS) {
+            thread_count = MAX_THREADS;
+        }
 
-                if (max_files && result->count >= max_files) {
-                    break;
-                }
+        // As in the matcher, the main thread acts as the last worker.
+        pthread_t *threads = xmalloc(thread_count * sizeof(pthread_t));
+        workers = xmalloc(thread_count * sizeof(walk_worker_t));
+        for (unsigned i = 0; i < thread_count - 1; i++) {
+            walk_worker_init(&workers[i], &walker);
+            int err =
+                pthread_create(&threads[i], NULL, walk_worker, &workers[i]);
+            if (err != 0) {
+                die("pthread_create() failed", err);
             }
         }
-        if (errno != 0) {
-            result->error = strerror(errno);
-        }
-        if (fts_close(handle) == -1 && !result->error) {
-            result->error = strerror(errno);
+        walk_worker(&main_worker);
+        for (unsigned i = 0; i < thread_count - 1; i++) {
+            int err = pthread_join(threads[i], NULL);
+            if (err != 0) {
+                die("pthread_join() failed", err);
+            }
+            walk_worker_free(&workers[i]);
         }
+        free(threads);
+        free(workers);
     }
+    walk_worker_free(&main_worker);
 
-    if (result->error) {
-        result->error = xstrdup(result->error);
+    // If we stopped early, there may be unvisited directories left over.
+    while (walker.queue) {
+        walk_dir_t *next = walker.queue->next;
+        walk_dir_release(walker.queue);
+        walker.queue = next;
+    }
+    while (walker.deferred) {
+        walk_dir_t *next = walker.deferred->next;
+        walk_dir_release(walker.deferred);
+        walker.deferred = next;
+    }
+
+    result->duplicate_count = atomic_load(&walker.duplicates);
+
+    pthread_mutex_destroy(&walker.queue_mutex);
+    pthread_cond_destroy(&walker.queue_cond);
+    pthread_mutex_destroy(&walker.result_mutex);
+    pthread_mutex_destroy(&walker.visited_mutex);
+    free(walker.visited);
+    ignore_free(walker.ignore);
+
+    // Give back what we didn't use (keeping at least a page, so that nobody
+    // has to worry about empty mappings); shrinking never moves the slabs.
+    size_t files_size = xmap_round(
+        result->count ? result->count * sizeof(str_t) : 1
+    );
+    result->files = xmremap(result->files, result->files_size, files_size);
+    result->files_size = files_size;
+    size_t buffer_size = xmap_round(
+        walker.cursor > result->buffer ? walker.cursor - result->buffer : 1
+    );
+    result->buffer = xmremap(result->buffer, result->buffer_size, buffer_size);
+    result->buffer_size = buffer_size;
+    DEBUG_LOG(
+        "commandt_find(): %u files in %llu + %llu bytes\n",
+        result->count,
+        result->files_size,
+        result->buffer_size
+    );
+
+    if (options->sort) {
+        qsort(result->files, result->count, sizeof(str_t), cmp_path);
     }
 
-    free(copy);
     return result;
 }
 
@@ -95,8 +462,10 @@ void commandt_find_result_free(find_result_t *result) {
     free(result);
 }
 
-scanner_t *commandt_file_scanner(const char *directory, unsigned max_files) {
-    find_result_t *result = commandt_find(directory, max_files);
+scanner_t *commandt_file_scanner(
+    const char *directory, const find_options_t *options
+) {
+    find_result_t *result = commandt_find(directory, options);
     // BUG: if there is an error here, we effectively swallow it...
     if (result->error) {
         DEBUG_LOG("%s\n", result->error);
@@ -104,7 +473,621 @@ scanner_t *commandt_file_scanner(const char *directory, unsigned max_files) {
     scanner_t *scanner = scanner_new(
         result->count, result->files, result->files_size, result->buffer, result->buffer_size
     );
+    scanner->duplicate_count = result->duplicate_count;
+    scanner_pack(scanner);
     free((void *)result->error);
     free(result);
     return scanner;
 }
+
+/**
+ * Comparison function for use with `qsort()`.
+ *
+ * Paths in the slab are NUL-terminated, so we can use `strcmp()` directly.
+ */
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(((str_t *)a)->contents, ((str_t *)b)->contents);
+}
+
+/**
+ * Returns a new `walk_dir_t` for the subdirectory `name` of `parent`.
+ */
+static walk_dir_t *walk_dir_new(
+    walk_dir_t *parent, const char *name, size_t name_length
+) {
+    walk_dir_t *dir = xmalloc(sizeof(walk_dir_t));
+    dir->parent = parent;
+    atomic_init(&dir->refs, 1);
+    atomic_fetch_add(&parent->refs, 1);
+    dir->symlink = false;
+    dir->depth = parent->depth + 1;
+    dir->gitignore = parent->gitignore;
+    dir->owns_gitignore = false;
+    size_t length =
+        parent->length ? parent->length + 1 + name_length : name_length;
+    dir->path = xmalloc(length + 1);
+    if (parent->length) {
+        memcpy(dir->path, parent->path, parent->length);
+        dir->path[parent->length] = '/';
+    }
+    memcpy(dir->path + length - name_length, name, name_length + 1);
+    dir->length = length;
+    return dir;
+}
+
+/**
+ * Drops a reference to `dir`, freeing it (and, potentially, its ancestors) if
+ * nothing else refers to it.
+ */
+static void walk_dir_release(walk_dir_t *dir) {
+    while (dir && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        walk_dir_t *parent = dir->parent;
+        if (dir->owns_gitignore) {
+            gitignore_free(dir->gitignore);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/**
+ * Reads all the entries in `dir`, recording files and queuing subdirectories.
+ *
+ * Returns false (with `errno` set) if `dir` couldn't be opened.
+ */
+static bool walk_directory(walk_worker_t *worker, walk_dir_t *dir) {
+    walker_t *walker = worker->walker;
+    const char *path = dir->length ? dir->path : current_directory;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG_LOG("walk_directory(): failed open() - %s\n", strerror(errno));
+        return false;
+    }
+
+    // Skipping directories we've already seen takes care of symbolic link
+    // cycles (which must lead back to an ancestor), and of links that merely
+    // duplicate part of the tree (eg. Bazel's "bazel-*" links, or a pnpm
+    // store).
+    struct stat info;
+    if (fstat(fd, &info) == 0 &&
+        !walk_visit(walker, info.st_dev, info.st_ino)) {
+        DEBUG_LOG("walk_directory(): already visited %s\n", dir->path);
+        atomic_fetch_add(&walker->duplicates, 1);
+        close(fd);
+        if (walker->emit_aliases && dir->symlink) {
+            memcpy(worker->bytes + worker->length, dir->path, dir->length + 1);
+            walk_emit(worker, dir->length);
+        }
+        return true;
+    }
+
+    if (walker->on_directory &&
+        !walker->on_directory(
+            dir->length ? dir->path : current_directory,
+            dir->depth,
+            walker->context
+        )) {
+        close(fd);
+        return true;
+    }
+
+#ifdef LINUX
+    if (walker->respect_gitignore) {
+        // Ignore rules have to be loaded before we look at any entries, so
+        // read the whole directory up front; that way we can tell whether
+        // there are any ignore files without probing for them.
+        size_t read_total = 0;
+        while (true) {
+            if (worker->dirents_size - read_total < DIRENT_BUFFER_SIZE) {
+                worker->dirents_size *= 2;
+                worker->dirents =
+                    xrealloc(worker->dirents, worker->dirents_size);
+            }
+            long read_count = syscall(
+                SYS_getdents64,
+                fd,
+                worker->dirents + read_total,
+                worker->dirents_size - read_total
+            );
+            if (read_count <= 0) {
+                if (read_count == -1) {
+                    DEBUG_LOG(
+                        "walk_directory(): failed getdents64() - %s\n",
+                        strerror(errno)
+                    );
+                }
+                break;
+            }
+            read_total += read_count;
+        }
+        bool gitignore = false;
+        bool ignore = false;
+        for (size_t offset = 0; offset < read_total;) {
+            walk_dirent64_t *entry =
+                (walk_dirent64_t *)(worker->dirents + offset);
+            offset += entry->d_reclen;
+            if (entry->d_type != DT_DIR) {
+                if (strcmp(entry->d_name, ".gitignore") == 0) {
+                    gitignore = true;
+                } else if (strcmp(entry->d_name, ".ignore") == 0) {
+                    ignore = true;
+                }
+            }
+        }
+        walk_load_gitignore(dir, fd, gitignore, ignore);
+        for (size_t offset = 0;
+             offset < read_total && !atomic_load(&walker->done);) {
+            walk_dirent64_t *entry =
+                (walk_dirent64_t *)(worker->dirents + offset);
+            offset += entry->d_reclen;
+            walk_entry(worker, dir, fd, entry->d_name, entry->d_type);
+        }
+    } else {
+        while (!atomic_load(&walker->done)) {
+            long read_count = syscall(
+                SYS_getdents64, fd, worker->dirents, DIRENT_BUFFER_SIZE
+            );
+            if (read_count <= 0) {
+                if (read_count == -1) {
+                    DEBUG_LOG(
+                        "walk_directory(): failed getdents64() - %s\n",
+                        strerror(errno)
+                    );
+                }
+                break;
+            }
+            for (long offset = 0; offset < read_count;) {
+                walk_dirent64_t *entry =
+                    (walk_dirent64_t *)(worker->dirents + offset);
+                offset += entry->d_reclen;
+                walk_entry(worker, dir, fd, entry->d_name, entry->d_type);
+            }
+        }
+    }
+    close(fd);
+#else
+    if (walker->respect_gitignore) {
+        walk_load_gitignore(dir, fd, true, true);
+    }
+    DIR *handle = fdopendir(fd);
+    if (!handle) {
+        DEBUG_LOG("walk_directory(): failed fdopendir() - %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    struct dirent *entry;
+    while (!atomic_load(&walker->done) && (entry = readdir(handle)) != NULL) {
+        walk_entry(worker, dir, fd, entry->d_name, entry->d_type);
+    }
+    closedir(handle);
+#endif
+
+    walk_push(worker);
+    return true;
+}
+
+/**
+ * Processes a single directory entry, `name`, found in `dir` (which is open as
+ * `fd`).
+ */
+static void walk_entry(
+    walk_worker_t *worker,
+    walk_dir_t *dir,
+    int fd,
+    const char *name,
+    unsigned char type
+) {
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
+
+    // Only pay for a `stat()` when `d_type` can't tell us what we need to know.
+    // Note that we follow symbolic links.
+    bool symlink = type == DT_LNK;
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+        struct stat info;
+        if (fstatat(fd, name, &info, 0) == -1) {
+            // Dangling link, or entry was deleted out from under us.
+            return;
+        } else if (S_ISDIR(info.st_mode)) {
+            type = DT_DIR;
+        } else if (S_ISREG(info.st_mode)) {
+            type = DT_REG;
+        } else {
+            return;
+        }
+    }
+
+    size_t name_length = strlen(name);
+    size_t length = dir->length ? dir->length + 1 + name_length : name_length;
+    if (length >= PATH_MAX) {
+        DEBUG_LOG("walk_entry(): path too long\n");
+        return;
+    }
+
+    walker_t *walker = worker->walker;
+    if (walker->ignore &&
+        ignore_match(walker->ignore, name, name_length, type == DT_DIR)) {
+        return;
+    }
+
+    // Assemble the full path in the unused tail of the worker's buffer; if
+    // this turns out to be a file we want, it's already where it needs to be.
+    char *path = worker->bytes + worker->length;
+    if (dir->length) {
+        memcpy(path, dir->path, dir->length);
+        path[dir->length] = '/';
+    }
+    memcpy(path + length - name_length, name, name_length + 1);
+
+    if (walker->respect_gitignore) {
+        bool directory = type == DT_DIR;
+        if (strcmp(name, ".git") == 0) {
+            return;
+        } else if (dir->gitignore &&
+                   gitignore_match(dir->gitignore, path, length, directory)) {
+            return;
+        }
+    }
+
+    if (type == DT_DIR) {
+        if (walker->max_depth && dir->depth >= walker->max_depth) {
+            return;
+        } else if (name[0] == '.' && !walker->scan_dot_directories) {
+            return;
+        }
+        walk_dir_t *subdirectory = walk_dir_new(dir, name, name_length);
+        subdirectory->symlink = symlink;
+        if (symlink) {
+            subdirectory->next = worker->deferred;
+            worker->deferred = subdirectory;
+            worker->deferred_count++;
+        } else {
+            subdirectory->next = worker->subdirectories;
+            worker->subdirectories = subdirectory;
+            worker->subdirectory_count++;
+        }
+    } else if (type == DT_REG) {
+        walk_emit(worker, length);
+    }
+}
+
+/**
+ * Adds the path of `length` bytes that has been written into the unused tail
+ * of the worker's buffer to the results.
+ */
+static void walk_emit(walk_worker_t *worker, size_t length) {
+    worker->lengths[worker->count++] = length;
+    worker->length += length + 1;
+    if (worker->count == FLUSH_COUNT || worker->length >= FLUSH_BYTES) {
+        walk_flush(worker);
+    }
+}
+
+/**
+ * Moves paths from the worker's private buffer into the shared result slab.
+ */
+static void walk_flush(walk_worker_t *worker) {
+    if (!worker->count) {
+        return;
+    }
+    walker_t *walker = worker->walker;
+    find_result_t *result = walker->result;
+    bool stop = false;
+
+    pthread_mutex_lock(&walker->result_mutex);
+    unsigned count = worker->count;
+    if (result->count + count >= walker->limit) {
+        count = walker->limit - result->count;
+        stop = true;
+    }
+    size_t size = 0;
+    for (unsigned i = 0; i < count; i++) {
+        size += worker->lengths[i] + 1; // Include NUL byte.
+    }
+    walk_reserve(walker, count, size);
+    memcpy(walker->cursor, worker->bytes, size);
+    for (unsigned i = 0; i < count; i++) {
+        str_init(&result->files[result->count++], walker->cursor, worker->lengths[i]);
+        walker->cursor += worker->lengths[i] + 1;
+    }
+    pthread_mutex_unlock(&walker->result_mutex);
+
+    worker->count = 0;
+    worker->length = 0;
+    if (stop) {
+        walk_stop(walker);
+    }
+}
+
+/**
+ * Compiles the ignore files in `dir` (which is open as `fd`), if any, into a
+ * `gitignore_t` that takes precedence over the one inherited from the parent.
+ *
+ * `gitignore` and `ignore` say whether ".gitignore" and ".ignore" files are
+ * present. In the root directory, we additionally look at ".git/info/exclude".
+ */
+static void walk_load_gitignore(
+    walk_dir_t *dir, int fd, bool gitignore, bool ignore
+) {
+    gitignore_t *compiled = gitignore_load(
+        fd,
+        !dir->depth,
+        gitignore,
+        ignore,
+        dir->length ? dir->length + 1 : 0,
+        dir->gitignore
+    );
+    if (compiled) {
+        dir->gitignore = compiled;
+        dir->owns_gitignore = true;
+    }
+}
+
+/**
+ * Pushes any subdirectories found by the worker onto the shared queue.
+ */
+static void walk_push(walk_worker_t *worker) {
+    walker_t *walker = worker->walker;
+    if (worker->deferred) {
+        walk_dir_t *last = worker->deferred;
+        while (last->next) {
+            last = last->next;
+        }
+        pthread_mutex_lock(&walker->queue_mutex);
+        last->next = walker->deferred;
+        walker->deferred = worker->deferred;
+        walker->deferred_count += worker->deferred_count;
+        pthread_mutex_unlock(&walker->queue_mutex);
+        worker->deferred = NULL;
+        worker->deferred_count = 0;
+    }
+
+    if (!worker->subdirectories) {
+        return;
+    }
+    walk_dir_t *last = worker->subdirectories;
+    while (last->next) {
+        last = last->next;
+    }
+
+    pthread_mutex_lock(&walker->queue_mutex);
+    if (!walker->breadth_first) {
+        last->next = walker->queue;
+        walker->queue = worker->subdirectories;
+    } else if (walker->queue) {
+        walker->queue_tail->next = worker->subdirectories;
+        walker->queue_tail = last;
+    } else {
+        walker->queue = worker->subdirectories;
+        walker->queue_tail = last;
+    }
+    walker->pending += worker->subdirectory_count;
+    if (worker->subdirectory_count > 1) {
+        pthread_cond_broadcast(&walker->queue_cond);
+    } else {
+        pthread_cond_signal(&walker->queue_cond);
+    }
+    pthread_mutex_unlock(&walker->queue_mutex);
+
+    worker->subdirectories = NULL;
+    worker->subdirectory_count = 0;
+}
+
+/**
+ * Makes room in the result slabs for another `count` paths totalling `size`
+ * bytes. Must be called with `result_mutex` held.
+ *
+ * If the path slab moves, `files` and `cursor` are fixed up to match.
+ */
+static void walk_reserve(walker_t *walker, unsigned count, size_t size) {
+    find_result_t *result = walker->result;
+    size_t files_size = result->files_size;
+    while ((result->count + count) * sizeof(str_t) > files_size) {
+        files_size *= 2;
+    }
+    if (files_size != result->files_size) {
+        DEBUG_LOG("walk_reserve(): files -> %llu\n", files_size);
+        result->files = xmremap(result->files, result->files_size, files_size);
+        result->files_size = files_size;
+        if (files_size >= HUGEPAGE_THRESHOLD) {
+            xmap_hugepage(result->files, files_size);
+        }
+    }
+
+    size_t used = walker->cursor - result->buffer;
+    size_t buffer_size = result->buffer_size;
+    while (used + size > buffer_size) {
+        buffer_size *= 2;
+    }
+    if (buffer_size != result->buffer_size) {
+        DEBUG_LOG("walk_reserve(): buffer -> %llu\n", buffer_size);
+        char *buffer =
+            xmremap(result->buffer, result->buffer_size, buffer_size);
+        if (buffer != result->buffer) {
+            for (unsigned i = 0; i < result->count; i++) {
+                str_t *file = &result->files[i];
+                file->contents = buffer + (file->contents - result->buffer);
+            }
+        }
+        result->buffer = buffer;
+        result->buffer_size = buffer_size;
+        walker->cursor = buffer + used;
+    }
+}
+
+/**
+ * Tells all workers to wind up.
+ */
+static void walk_stop(walker_t *walker) {
+    pthread_mutex_lock(&walker->queue_mutex);
+    atomic_store(&walker->done, true);
+    pthread_cond_broadcast(&walker->queue_cond);
+    pthread_mutex_unlock(&walker->queue_mutex);
+}
+
+/**
+ * Moves any deferred directories onto the end of the queue. Must be called
+ * (with `queue_mutex` held, if other workers are running) whenever `pending`
+ * drops to zero and, when `breadth_first` is set, whenever the last directory
+ * at the current depth is done (at which point the queue holds only the next
+ * level down, the same depth as everything on the `deferred` list).
+ */
+static void walk_undefer(walker_t *walker) {
+    if (!walker->deferred) {
+        return;
+    }
+    walk_dir_t *last = walker->deferred;
+    while (last->next) {
+        last = last->next;
+    }
+    if (walker->queue) {
+        walker->queue_tail->next = walker->deferred;
+    } else {
+        walker->queue = walker->deferred;
+    }
+    walker->queue_tail = last;
+    walker->pending += walker->deferred_count;
+    walker->deferred = NULL;
+    walker->deferred_count = 0;
+}
+
+static size_t walk_inode_hash(dev_t dev, ino_t ino) {
+    // Multiplicative (Fibonacci) hashing; inode numbers tend to be
+    // sequential, so we need to spread them out.
+    return (size_t)((uint64_t)ino * 0x9e3779b97f4a7c15u) ^ (size_t)dev;
+}
+
+/**
+ * Records that the directory identified by `dev` and `ino` has been visited.
+ *
+ * Returns false if it had already been visited.
+ */
+static bool walk_visit(walker_t *walker, dev_t dev, ino_t ino) {
+    bool inserted = true;
+    pthread_mutex_lock(&walker->visited_mutex);
+    if (walker->visited_count * 2 >= walker->visited_capacity) {
+        // Keep the load factor below 50%.
+        size_t capacity = walker->visited_capacity * 2;
+        walk_inode_t *visited = xcalloc(capacity, sizeof(walk_inode_t));
+        for (size_t i = 0; i < walker->visited_capacity; i++) {
+            walk_inode_t *inode = &walker->visited[i];
+            if (inode->ino) {
+                size_t slot = walk_inode_hash(inode->dev, inode->ino) &
+                              (capacity - 1);
+                while (visited[slot].ino) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                visited[slot] = *inode;
+            }
+        }
+        free(walker->visited);
+        walker->visited = visited;
+        walker->visited_capacity = capacity;
+    }
+    size_t mask = walker->visited_capacity - 1;
+    size_t slot = walk_inode_hash(dev, ino) & mask;
+    while (walker->visited[slot].ino) {
+        walk_inode_t *inode = &walker->visited[slot];
+        if (inode->ino == ino && inode->dev == dev) {
+            inserted = false;
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (inserted) {
+        walker->visited[slot].dev = dev;
+        walker->visited[slot].ino = ino;
+        walker->visited_count++;
+    }
+    pthread_mutex_unlock(&walker->visited_mutex);
+    return inserted;
+}
+
+/**
+ * Worker loop: takes directories off the shared queue until there are none
+ * left (and none in progress which might produce more), or until told to stop.
+ */
+static void *walk_worker(void *arg) {
+    walk_worker_t *worker = arg;
+    walker_t *walker = worker->walker;
+    while (true) {
+        pthread_mutex_lock(&walker->queue_mutex);
+        while (!atomic_load(&walker->done) && walker->pending &&
+               (!walker->queue ||
+                (walker->breadth_first && walker->level_active &&
+                 (walker->queue->depth != walker->level ||
+                  (walker->queue->symlink &&
+                   walker->level_active != walker->level_links))))) {
+            pthread_cond_wait(&walker->queue_cond, &walker->queue_mutex);
+        }
+        walk_dir_t *dir = walker->queue;
+        if (!dir || atomic_load(&walker->done)) {
+            pthread_mutex_unlock(&walker->queue_mutex);
+            break;
+        }
+        walker->queue = dir->next;
+        bool symlink = dir->symlink;
+        if (walker->breadth_first) {
+            walker->level = dir->depth;
+            walker->level_active++;
+            walker->level_links += symlink;
+        }
+        pthread_mutex_unlock(&walker->queue_mutex);
+
+        (void)walk_directory(worker, dir);
+        walk_dir_release(dir);
+        if (walker->breadth_first) {
+            // Make sure this level's files land in the results ahead of any
+            // from the next level.
+            walk_flush(worker);
+        }
+
+        pthread_mutex_lock(&walker->queue_mutex);
+        bool level_done = false;
+        bool links_ready = false;
+        if (walker->breadth_first) {
+            walker->level_links -= symlink;
+            level_done = --walker->level_active == 0;
+            links_ready = !symlink &&
+                          walker->level_active == walker->level_links &&
+                          walker->queue && walker->queue->symlink;
+        }
+        bool empty = --walker->pending == 0;
+        if (empty ||
+            (level_done && walker->queue->depth != walker->level)) {
+            walk_undefer(walker);
+        }
+        if (empty || level_done || links_ready) {
+            pthread_cond_broadcast(&walker->queue_cond);
+        }
+        pthread_mutex_unlock(&walker->queue_mutex);
+    }
+    walk_flush(worker);
+    return NULL;
+}
+
+static void walk_worker_free(walk_worker_t *worker) {
+    free(worker->bytes);
+#ifdef LINUX
+    free(worker->dirents);
+#endif
+}
+
+static void walk_worker_init(walk_worker_t *worker, walker_t *walker) {
+    worker->walker = walker;
+    // Leave room for one maximal path beyond the flush threshold.
+    worker->bytes = xmalloc(FLUSH_BYTES + PATH_MAX);
+    worker->length = 0;
+    worker->count = 0;
+    worker->subdirectories = NULL;
+    worker->subdirectory_count = 0;
+    worker->deferred = NULL;
+    worker->deferred_count = 0;
+#ifdef LINUX
+    worker->dirents = xmalloc(DIRENT_BUFFER_SIZE);
+    worker->dirents_size = DIRENT_BUFFER_SIZE;
+#endif
+}
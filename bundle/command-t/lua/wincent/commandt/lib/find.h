@@ -6,11 +6,91 @@
 #ifndef FIND_H
 #define FIND_H
 
+#include <stdbool.h> /* for bool */
 #include <stddef.h> /* for size_t */
 
 #include "commandt.h" /* for scanner_t */
 #include "str.h" /* for str_t */
 
+/**
+ * See `find_options_t.on_directory`.
+ */
+typedef bool (*find_directory_callback_t)(
+    const char *path, unsigned depth, void *context
+);
+
+typedef struct {
+    /**
+     * Stop scanning after this many files have been found. 0 means no limit.
+     */
+    unsigned max_files;
+
+    /**
+     * Don't descend more than this many levels below the starting directory.
+     * 0 means no limit.
+     */
+    unsigned max_depth;
+
+    /**
+     * When false, directories whose names start with "." are not walked.
+     */
+    bool scan_dot_directories;
+
+    /**
+     * Names and glob patterns of entries to skip (see `ignore_new()`).
+     * Matching directories are pruned without being opened.
+     */
+    const char **ignore;
+    unsigned ignore_count;
+
+    /**
+     * When true, skip entries excluded by ".gitignore" and ".ignore" files
+     * (and by ".git/info/exclude" in the starting directory), as well as
+     * ".git" itself. Ignored directories are pruned without being walked.
+     */
+    bool respect_gitignore;
+
+    /**
+     * When true, walk the tree one level at a time, so that if `max_files`
+     * cuts the scan short, the results consist of the shallowest files rather
+     * than whatever happened to be under the first few directories visited.
+     */
+    bool breadth_first;
+
+    /**
+     * Every directory is walked at most once, no matter how many symbolic
+     * links lead to it. When true, the paths of symbolic links to directories
+     * that were skipped for that reason are included in the results (as
+     * "aliases" of the directories they point to).
+     */
+    bool emit_aliases;
+
+    /**
+     * If set, called with the path and depth of every directory that is about
+     * to be walked, along with `context`; returning false causes the
+     * directory to be skipped. Note that this may be called concurrently from
+     * multiple threads.
+     */
+    find_directory_callback_t on_directory;
+    void *context;
+
+    /**
+     * Number of threads to walk the tree with. 0 means use one thread per
+     * processor (see `commandt_processors()`).
+     */
+    unsigned threads;
+
+    /**
+     * When true, sort the results so that they come out in a deterministic
+     * order, regardless of which thread happened to visit which directory
+     * first.
+     *
+     * Note that when `max_files` truncates a multi-threaded scan, _which_
+     * files make it into the results may still vary from run to run.
+     */
+    bool sort;
+} find_options_t;
+
 typedef struct {
     unsigned count;
     str_t *files;
@@ -20,6 +100,12 @@ typedef struct {
      */
     const char *error;
 
+    /**
+     * Number of directories that were not walked because they had already
+     * been visited under another path (ie. via a symbolic link).
+     */
+    unsigned duplicate_count;
+
     /**
      * @internal
      *
@@ -42,7 +128,31 @@ typedef struct {
     size_t buffer_size;
 } find_result_t;
 
-find_result_t *commandt_find(const char *directory, unsigned max_files);
+/**
+ * Recursively walks `directory`, collecting the paths of all files found
+ * therein.
+ *
+ * Directories are placed on a shared work queue and consumed by
+ * `options->threads` workers, each of which reads entries with `getdents64()`
+ * (on Linux; `readdir()` elsewhere) and uses `d_type` to avoid calling
+ * `stat()` except where the type is unknown or the entry is a symbolic link.
+ * Workers accumulate paths in private buffers which they periodically flush
+ * into the shared result slab.
+ *
+ * Symbolic links are followed, but directories reached via symbolic links are
+ * only walked after everything else (or, in breadth-first mode, after
+ * everything else at the same depth), and every directory's (device, inode)
+ * pair is recorded in a set so that no directory is walked twice. This both
+ * breaks cycles and avoids duplicating subtrees.
+ *
+ * `options` may be NULL, in which case defaults (no limits, no dot
+ * directories, nothing ignored, ignore files disregarded, one thread per
+ * processor, unsorted) are used.
+ */
+find_result_t *commandt_find(
+    const char *directory, const find_options_t *options
+);
+
 void commandt_find_result_free(find_result_t *result);
 
 /**
@@ -51,6 +161,8 @@ void commandt_find_result_free(find_result_t *result);
  * new scanner takes ownership of the resources, which means you should call
  * `scanner_free()` on it.
  */
-scanner_t *commandt_file_scanner(const char *directory, unsigned max_files);
+scanner_t *commandt_file_scanner(
+    const char *directory, const find_options_t *options
+);
 
 #endif
@@ -0,0 +1,681 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifdef LINUX
+#define _GNU_SOURCE /* for pipe2() */
+#endif
+
+#include "git.h"
+
+#include <errno.h> /* for EINTR, errno */
+#include <fcntl.h> /* for FD_CLOEXEC, F_SETFD, O_CLOEXEC, O_WRONLY, open() */
+#include <limits.h> /* for UINT_MAX */
+#include <pthread.h> /* for pthread_create(), pthread_mutex_lock() etc */
+#include <signal.h> /* for SIGKILL, kill() */
+#include <stdatomic.h> /* for atomic_bool, atomic_load(), atomic_store() */
+#include <stdbool.h> /* for bool */
+#include <stdint.h> /* for uint32_t */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memchr(), memcmp(), memcpy(), memmove() etc */
+#include <sys/wait.h> /* for waitpid() */
+#include <unistd.h> /* for _exit(), access(), close(), dup2(), fork() etc */
+
+#include "debug.h"
+#include "die.h" /* for die() */
+#include "scanner.h" /* for scanner_new(), scanner_pack() */
+#include "xmalloc.h"
+#include "xmap.h" /* for xmap(), xmremap(), xmunmap() etc */
+
+// Initial sizes of the result slabs; they grow as needed, and are trimmed to
+// fit once the scan is over.
+#define INITIAL_FILES 4096
+#define INITIAL_BUFFER_SIZE 262144
+
+// Once the `files` array is this big, ask for huge pages.
+#define HUGEPAGE_THRESHOLD 8388608
+
+// Arbitrary limit to stop people from doing self-harm.
+#define MAX_THREADS 128
+
+// How much to read from Git at a time.
+#define READ_SIZE 65536
+
+// How `git ls-files --stage` describes a submodule (a "gitlink").
+#define GITLINK_MODE "160000 "
+
+/**
+ * A repository (the top-level one, or a submodule) waiting to be listed.
+ */
+typedef struct git_repo_t {
+    /**
+     * Directory in which to run Git.
+     */
+    char *directory;
+
+    /**
+     * Prepended to every path that Git lists in `directory`; either empty, or
+     * ending with a "/".
+     */
+    char *prefix;
+    size_t prefix_length;
+
+    struct git_repo_t *next;
+} git_repo_t;
+
+/**
+ * State shared among all workers.
+ */
+typedef struct {
+    /**
+     * Protects `queue` and `pending`.
+     */
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+
+    /**
+     * Repositories yet to be listed.
+     */
+    git_repo_t *queue;
+
+    /**
+     * Count of repositories that are either in the `queue` or being listed
+     * right now. When this drops to zero, the scan is over.
+     */
+    unsigned pending;
+
+    /**
+     * Set when the scan should stop early (ie. `max_files` was reached).
+     */
+    atomic_bool done;
+
+    /**
+     * Protects `files`, `files_size`, `count`, `buffer`, `buffer_size` and
+     * `cursor`.
+     */
+    pthread_mutex_t result_mutex;
+    str_t *files;
+    size_t files_size;
+    unsigned count;
+    char *buffer;
+    size_t buffer_size;
+
+    /**
+     * Next free byte in `buffer`.
+     */
+    char *cursor;
+
+    /**
+     * Maximum number of files to put in `files`.
+     */
+    unsigned limit;
+} git_walker_t;
+
+/**
+ * Per-thread state.
+ */
+typedef struct {
+    git_walker_t *walker;
+
+    /**
+     * Output read from Git but not yet parsed (ie. the start of a record
+     * that has not been read in full).
+     */
+    char *input;
+    size_t input_size;
+
+    /**
+     * Paths (prefixed and NUL-terminated) waiting to be flushed into the
+     * shared slab, and their lengths.
+     */
+    char *bytes;
+    size_t bytes_size;
+    size_t length;
+    uint32_t *lengths;
+    unsigned lengths_capacity;
+    unsigned count;
+
+    /**
+     * The last path seen with a non-zero stage number; during a merge, a
+     * conflicted path is listed once per stage, but we only want it once.
+     */
+    char *conflict;
+    size_t conflict_length;
+} git_worker_t;
+
+// Forward declarations.
+static void git_add(
+    git_worker_t *worker,
+    const git_repo_t *repo,
+    const char *path,
+    size_t length
+);
+static void git_flush(git_worker_t *worker);
+static void git_list(git_worker_t *worker, const git_repo_t *repo);
+static char *git_parse(
+    git_worker_t *worker, const git_repo_t *repo, char *start, char *end
+);
+static void git_push(git_walker_t *walker, git_repo_t *repo);
+static git_repo_t *git_repo_new(
+    const char *directory,
+    size_t directory_length,
+    const char *prefix,
+    size_t prefix_length
+);
+static void git_repo_free(git_repo_t *repo);
+static void git_reserve(git_walker_t *walker, unsigned count, size_t size);
+static int git_spawn(const char *directory, pid_t *pid);
+static void git_stop(git_walker_t *walker);
+static void git_submodule(
+    git_walker_t *walker,
+    const git_repo_t *repo,
+    const char *path,
+    size_t length
+);
+static void *git_worker(void *arg);
+static void git_worker_free(git_worker_t *worker);
+static void git_worker_init(git_worker_t *worker, git_walker_t *walker);
+
+scanner_t *git_scanner_new(
+    const char *directory, unsigned max_files, unsigned threads
+) {
+    git_walker_t walker;
+    walker.queue = NULL;
+    walker.pending = 0;
+    atomic_init(&walker.done, false);
+    walker.files_size = INITIAL_FILES * sizeof(str_t);
+    walker.files = xmap(walker.files_size);
+    walker.count = 0;
+    walker.buffer_size = INITIAL_BUFFER_SIZE;
+    walker.buffer = xmap(walker.buffer_size);
+    walker.cursor = walker.buffer;
+    walker.limit = max_files ? max_files : UINT_MAX;
+    pthread_mutex_init(&walker.queue_mutex, NULL);
+    pthread_cond_init(&walker.queue_cond, NULL);
+    pthread_mutex_init(&walker.result_mutex, NULL);
+
+    // Trim trailing slashes, and represent the current directory as "." with
+    // no prefix, so that results don't get a leading "./".
+    size_t length = strlen(directory);
+    while (length > 1 && directory[length - 1] == '/') {
+        length--;
+    }
+    if (length == 0 || (length == 1 && directory[0] == '.')) {
+        git_push(&walker, git_repo_new(".", 1, "", 0));
+    } else {
+        git_push(&walker, git_repo_new(directory, length, directory, length));
+    }
+
+    unsigned thread_count = threads ? threads : commandt_processors();
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+
+    // As in the matcher, the main thread acts as the last worker.
+    pthread_t *workers_threads = xmalloc(thread_count * sizeof(pthread_t));
+    git_worker_t *workers = xmalloc(thread_count * sizeof(git_worker_t));
+    for (unsigned i = 0; i < thread_count - 1; i++) {
+        git_worker_init(&workers[i], &walker);
+        int err = pthread_create(
+            &workers_threads[i], NULL, git_worker, &workers[i]
+        );
+        if (err != 0) {
+            die("pthread_create() failed", err);
+        }
+    }
+    git_worker_init(&workers[thread_count - 1], &walker);
+    git_worker(&workers[thread_count - 1]);
+    for (unsigned i = 0; i < thread_count - 1; i++) {
+        int err = pthread_join(workers_threads[i], NULL);
+        if (err != 0) {
+            die("pthread_join() failed", err);
+        }
+    }
+    for (unsigned i = 0; i < thread_count; i++) {
+        git_worker_free(&workers[i]);
+    }
+    free(workers_threads);
+    free(workers);
+
+    // If we stopped early, there may be unlisted repositories left over.
+    while (walker.queue) {
+        git_repo_t *next = walker.queue->next;
+        git_repo_free(walker.queue);
+        walker.queue = next;
+    }
+
+    pthread_mutex_destroy(&walker.queue_mutex);
+    pthread_cond_destroy(&walker.queue_cond);
+    pthread_mutex_destroy(&walker.result_mutex);
+
+    // Give back what we didn't use (keeping at least a page, so that nobody
+    // has to worry about empty mappings); shrinking never moves the slabs.
+    size_t files_size =
+        xmap_round(walker.count ? walker.count * sizeof(str_t) : 1);
+    walker.files = xmremap(walker.files, walker.files_size, files_size);
+    size_t buffer_size = xmap_round(
+        walker.cursor > walker.buffer ? walker.cursor - walker.buffer : 1
+    );
+    walker.buffer = xmremap(walker.buffer, walker.buffer_size, buffer_size);
+    DEBUG_LOG(
+        "git_scanner_new(): %u files in %llu + %llu bytes\n",
+        walker.count,
+        files_size,
+        buffer_size
+    );
+
+    scanner_t *scanner = scanner_new(
+        walker.count, walker.files, files_size, walker.buffer, buffer_size
+    );
+    scanner_pack(scanner);
+    return scanner;
+}
+
+/**
+ * Appends `prefix` + `path` to the worker's private buffer.
+ */
+static void git_add(
+    git_worker_t *worker,
+    const git_repo_t *repo,
+    const char *path,
+    size_t length
+) {
+    size_t size = repo->prefix_length + length + 1; // Include NUL byte.
+    if (worker->length + size > worker->bytes_size) {
+        while (worker->length + size > worker->bytes_size) {
+            worker->bytes_size *= 2;
+        }
+        worker->bytes = xrealloc(worker->bytes, worker->bytes_size);
+    }
+    if (worker->count == worker->lengths_capacity) {
+        worker->lengths_capacity *= 2;
+        worker->lengths = xrealloc(
+            worker->lengths, worker->lengths_capacity * sizeof(uint32_t)
+        );
+    }
+    char *cursor = worker->bytes + worker->length;
+    memcpy(cursor, repo->prefix, repo->prefix_length);
+    memcpy(cursor + repo->prefix_length, path, length);
+    cursor[size - 1] = '\0';
+    worker->lengths[worker->count++] = size - 1;
+    worker->length += size;
+}
+
+/**
+ * Moves the paths in the worker's private buffer into the shared slab.
+ */
+static void git_flush(git_worker_t *worker) {
+    if (!worker->count) {
+        return;
+    }
+    git_walker_t *walker = worker->walker;
+    bool stop = false;
+
+    pthread_mutex_lock(&walker->result_mutex);
+    unsigned count = worker->count;
+    if (walker->count + count >= walker->limit) {
+        count = walker->limit - walker->count;
+        stop = true;
+    }
+    size_t size = 0;
+    for (unsigned i = 0; i < count; i++) {
+        size += worker->lengths[i] + 1; // Include NUL byte.
+    }
+    git_reserve(walker, count, size);
+    memcpy(walker->cursor, worker->bytes, size);
+    for (unsigned i = 0; i < count; i++) {
+        str_init(
+            &walker->files[walker->count++], walker->cursor, worker->lengths[i]
+        );
+        walker->cursor += worker->lengths[i] + 1;
+    }
+    pthread_mutex_unlock(&walker->result_mutex);
+
+    worker->count = 0;
+    worker->length = 0;
+    if (stop) {
+        git_stop(walker);
+    }
+}
+
+/**
+ * Runs `git ls-files` in `repo`, streaming the paths it prints into the shared
+ * slab, and queueing up any submodules it reports.
+ */
+static void git_list(git_worker_t *worker, const git_repo_t *repo) {
+    git_walker_t *walker = worker->walker;
+    pid_t pid;
+    int fd = git_spawn(repo->directory, &pid);
+    if (fd == -1) {
+        return;
+    }
+    worker->conflict_length = 0;
+    size_t used = 0;
+    while (!atomic_load(&walker->done)) {
+        if (used + READ_SIZE > worker->input_size) {
+            worker->input_size *= 2;
+            worker->input = xrealloc(worker->input, worker->input_size);
+        }
+        ssize_t read_count = read(fd, worker->input + used, READ_SIZE);
+        if (read_count == 0) {
+            break;
+        } else if (read_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG_LOG("git_list(): failed read() - %s\n", strerror(errno));
+            break;
+        }
+        used += read_count;
+        char *end = worker->input + used;
+        char *rest = git_parse(worker, repo, worker->input, end);
+        used = end - rest;
+        memmove(worker->input, rest, used);
+        git_flush(worker);
+    }
+    if (atomic_load(&walker->done)) {
+        if (kill(pid, SIGKILL)) {
+            DEBUG_LOG("git_list(): failed kill() - %s\n", strerror(errno));
+        }
+    }
+    if (close(fd) != 0) {
+        DEBUG_LOG("git_list(): failed close() - %s\n", strerror(errno));
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        DEBUG_LOG("git_list(): failed waitpid() - %s\n", strerror(errno));
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        DEBUG_LOG("git_list(): git failed in %s\n", repo->directory);
+    }
+}
+
+/**
+ * Consumes the complete records between `start` and `end`, each of which looks
+ * like "MODE OBJECT STAGE\tPATH\0", and returns a pointer to the first byte
+ * that was not consumed.
+ */
+static char *git_parse(
+    git_worker_t *worker, const git_repo_t *repo, char *start, char *end
+) {
+    size_t gitlink_length = strlen(GITLINK_MODE);
+    while (start < end) {
+        char *record_end = memchr(start, 0, end - start);
+        if (!record_end) {
+            break;
+        }
+        char *tab = memchr(start, '\t', record_end - start);
+        if (!tab || tab == start) {
+            DEBUG_LOG("git_parse(): malformed record\n");
+            start = record_end + 1;
+            continue;
+        }
+        char *path = tab + 1;
+        size_t length = record_end - path;
+        if ((size_t)(tab - start) > gitlink_length &&
+            memcmp(start, GITLINK_MODE, gitlink_length) == 0) {
+            git_submodule(worker->walker, repo, path, length);
+        } else if (tab[-1] == '0') {
+            git_add(worker, repo, path, length);
+        } else if (
+            length != worker->conflict_length ||
+            memcmp(path, worker->conflict, length) != 0
+        ) {
+            worker->conflict = xrealloc(worker->conflict, length + 1);
+            memcpy(worker->conflict, path, length);
+            worker->conflict_length = length;
+            git_add(worker, repo, path, length);
+        }
+        start = record_end + 1;
+    }
+    return start;
+}
+
+/**
+ * Adds `repo` to the queue.
+ */
+static void git_push(git_walker_t *walker, git_repo_t *repo) {
+    pthread_mutex_lock(&walker->queue_mutex);
+    repo->next = walker->queue;
+    walker->queue = repo;
+    walker->pending++;
+    pthread_cond_signal(&walker->queue_cond);
+    pthread_mutex_unlock(&walker->queue_mutex);
+}
+
+/**
+ * Returns a new `git_repo_t`; if `prefix_length` is non-zero, a "/" is
+ * appended to `prefix`.
+ */
+static git_repo_t *git_repo_new(
+    const char *directory,
+    size_t directory_length,
+    const char *prefix,
+    size_t prefix_length
+) {
+    git_repo_t *repo = xmalloc(sizeof(git_repo_t));
+    repo->directory = xmalloc(directory_length + 1);
+    memcpy(repo->directory, directory, directory_length);
+    repo->directory[directory_length] = '\0';
+    repo->prefix_length = prefix_length ? prefix_length + 1 : 0;
+    repo->prefix = xmalloc(repo->prefix_length + 1);
+    memcpy(repo->prefix, prefix, prefix_length);
+    if (prefix_length) {
+        repo->prefix[prefix_length] = '/';
+    }
+    repo->prefix[repo->prefix_length] = '\0';
+    repo->next = NULL;
+    return repo;
+}
+
+static void git_repo_free(git_repo_t *repo) {
+    free(repo->directory);
+    free(repo->prefix);
+    free(repo);
+}
+
+/**
+ * Makes room for `count` more files, taking up `size` bytes, in the shared
+ * slab. Must be called with `result_mutex` held.
+ */
+static void git_reserve(git_walker_t *walker, unsigned count, size_t size) {
+    size_t files_size = walker->files_size;
+    while ((walker->count + count) * sizeof(str_t) > files_size) {
+        files_size *= 2;
+    }
+    if (files_size != walker->files_size) {
+        DEBUG_LOG("git_reserve(): files -> %llu\n", files_size);
+        walker->files = xmremap(walker->files, walker->files_size, files_size);
+        walker->files_size = files_size;
+        if (files_size >= HUGEPAGE_THRESHOLD) {
+            xmap_hugepage(walker->files, files_size);
+        }
+    }
+
+    size_t used = walker->cursor - walker->buffer;
+    size_t buffer_size = walker->buffer_size;
+    while (used + size > buffer_size) {
+        buffer_size *= 2;
+    }
+    if (buffer_size != walker->buffer_size) {
+        DEBUG_LOG("git_reserve(): buffer -> %llu\n", buffer_size);
+        char *buffer =
+            xmremap(walker->buffer, walker->buffer_size, buffer_size);
+        if (buffer != walker->buffer) {
+            for (unsigned i = 0; i < walker->count; i++) {
+                str_t *file = &walker->files[i];
+                file->contents = buffer + (file->contents - walker->buffer);
+            }
+        }
+        walker->buffer = buffer;
+        walker->buffer_size = buffer_size;
+        walker->cursor = buffer + used;
+    }
+}
+
+/**
+ * Starts `git ls-files` in `directory`, and returns the read end of a pipe
+ * connected to its standard output (or -1 on failure).
+ *
+ * Other workers may be forking at the same time, so the pipe is marked
+ * close-on-exec; otherwise a sibling could inherit its write end and keep it
+ * open (stopping us from seeing EOF) for as long as its own Git runs.
+ */
+static int git_spawn(const char *directory, pid_t *pid) {
+    // Index 0 = read end of pipe; index 1 = write end of pipe.
+    int stdout_pipe[2];
+#ifdef LINUX
+    if (pipe2(stdout_pipe, O_CLOEXEC) != 0) {
+        DEBUG_LOG("git_spawn(): failed pipe2() - %s\n", strerror(errno));
+        return -1;
+    }
+#else
+    if (pipe(stdout_pipe) != 0) {
+        DEBUG_LOG("git_spawn(): failed pipe() - %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(stdout_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stdout_pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    *pid = fork();
+    if (*pid == -1) {
+        DEBUG_LOG("git_spawn(): failed fork() - %s\n", strerror(errno));
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        return -1;
+    } else if (*pid == 0) {
+        // In child; only async-signal-safe calls from here on.
+        int null = open("/dev/null", O_WRONLY);
+        if (dup2(stdout_pipe[1], 1) == -1 || null == -1 ||
+            dup2(null, 2) == -1) {
+            _exit(1);
+        }
+        execlp(
+            "git",
+            "git",
+            "-C",
+            directory,
+            "ls-files",
+            "--cached",
+            "--stage",
+            "-z",
+            NULL
+        );
+        _exit(1);
+    }
+
+    // In parent.
+    if (close(stdout_pipe[1]) != 0) {
+        DEBUG_LOG("git_spawn(): failed close() - %s\n", strerror(errno));
+    }
+    return stdout_pipe[0];
+}
+
+/**
+ * Tells all workers to wind up.
+ */
+static void git_stop(git_walker_t *walker) {
+    pthread_mutex_lock(&walker->queue_mutex);
+    atomic_store(&walker->done, true);
+    pthread_cond_broadcast(&walker->queue_cond);
+    pthread_mutex_unlock(&walker->queue_mutex);
+}
+
+/**
+ * Queues up the submodule at `path` (relative to `repo`), unless it hasn't
+ * been initialized (in which case there is nothing to list, and running Git
+ * there would list the parent repository instead).
+ */
+static void git_submodule(
+    git_walker_t *walker,
+    const git_repo_t *repo,
+    const char *path,
+    size_t length
+) {
+    bool root = repo->prefix_length == 0;
+    size_t directory_length =
+        root ? length : strlen(repo->directory) + 1 + length;
+    size_t prefix_length = repo->prefix_length + length;
+
+    // Room for the directory, or the prefix, plus "/.git".
+    size_t size = directory_length > prefix_length ? directory_length
+                                                   : prefix_length;
+    char *scratch = xmalloc(size + sizeof("/.git"));
+    char *cursor = scratch;
+    if (!root) {
+        size_t parent_length = directory_length - length - 1;
+        memcpy(cursor, repo->directory, parent_length);
+        cursor[parent_length] = '/';
+        cursor += parent_length + 1;
+    }
+    memcpy(cursor, path, length);
+    memcpy(scratch + directory_length, "/.git", sizeof("/.git"));
+    if (access(scratch, F_OK) != 0) {
+        DEBUG_LOG("git_submodule(): skipping uninitialized %s\n", scratch);
+        free(scratch);
+        return;
+    }
+    char *prefix = xmalloc(prefix_length);
+    memcpy(prefix, repo->prefix, repo->prefix_length);
+    memcpy(prefix + repo->prefix_length, path, length);
+    git_push(
+        walker, git_repo_new(scratch, directory_length, prefix, prefix_length)
+    );
+    free(prefix);
+    free(scratch);
+}
+
+/**
+ * Worker loop: takes repositories off the shared queue until there are none
+ * left (and none in progress which might add more), or until told to stop.
+ */
+static void *git_worker(void *arg) {
+    git_worker_t *worker = arg;
+    git_walker_t *walker = worker->walker;
+    while (true) {
+        pthread_mutex_lock(&walker->queue_mutex);
+        while (!atomic_load(&walker->done) && walker->pending &&
+               !walker->queue) {
+            pthread_cond_wait(&walker->queue_cond, &walker->queue_mutex);
+        }
+        git_repo_t *repo = walker->queue;
+        if (!repo || atomic_load(&walker->done)) {
+            pthread_mutex_unlock(&walker->queue_mutex);
+            break;
+        }
+        walker->queue = repo->next;
+        pthread_mutex_unlock(&walker->queue_mutex);
+
+        git_list(worker, repo);
+        git_repo_free(repo);
+
+        pthread_mutex_lock(&walker->queue_mutex);
+        if (--walker->pending == 0) {
+            pthread_cond_broadcast(&walker->queue_cond);
+        }
+        pthread_mutex_unlock(&walker->queue_mutex);
+    }
+    return NULL;
+}
+
+static void git_worker_free(git_worker_t *worker) {
+    free(worker->input);
+    free(worker->bytes);
+    free(worker->lengths);
+    free(worker->conflict);
+}
+
+static void git_worker_init(git_worker_t *worker, git_walker_t *walker) {
+    worker->walker = walker;
+    worker->input_size = READ_SIZE * 2;
+    worker->input = xmalloc(worker->input_size);
+    worker->bytes_size = READ_SIZE;
+    worker->bytes = xmalloc(worker->bytes_size);
+    worker->length = 0;
+    worker->lengths_capacity = 1024;
+    worker->lengths = xmalloc(worker->lengths_capacity * sizeof(uint32_t));
+    worker->count = 0;
+    worker->conflict = NULL;
+    worker->conflict_length = 0;
+}
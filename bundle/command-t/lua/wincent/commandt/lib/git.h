@@ -0,0 +1,45 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A scanner that lists the files tracked by a Git repository and by all of
+ * its (initialized) submodules, recursively.
+ *
+ * `git ls-files --recurse-submodules` visits submodules one at a time, so with
+ * many of them the total time is the sum of all the listings. Here, each
+ * repository gets its own `git ls-files` process, and a bounded pool of
+ * workers runs them concurrently: every listing reports the submodules it
+ * contains (as "gitlink" entries), which go onto a shared queue, and the
+ * paths it produces are streamed into a shared slab with the submodule's
+ * path prepended. The total time therefore tracks the slowest repository
+ * rather than the sum.
+ */
+
+#ifndef GIT_H
+#define GIT_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define git_scanner_new commandt_git_scanner_new
+
+#include "commandt.h" /* for scanner_t */
+
+/**
+ * Returns a scanner containing the files tracked in `directory` (which may be
+ * "" or "." to mean the current directory), including those in submodules.
+ * Paths are relative to the current directory, like those printed by
+ * `git ls-files -- directory`.
+ *
+ * Stops after `max_files` files (0 means no limit), and runs at most
+ * `threads` instances of Git at once (0 means one per processor).
+ *
+ * The caller should dispose of the scanner with `scanner_free()`.
+ */
+scanner_t *git_scanner_new(
+    const char *directory, unsigned max_files, unsigned threads
+);
+
+#endif
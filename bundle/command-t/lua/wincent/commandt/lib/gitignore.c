@@ -0,0 +1,512 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "gitignore.h"
+
+#include <errno.h> /* for EINTR, errno */
+#include <fcntl.h> /* for O_CLOEXEC, O_RDONLY, openat() */
+#include <stdlib.h> /* for free(), NULL */
+#include <string.h> /* for memchr(), memcmp(), memcpy(), strpbrk() */
+#include <sys/stat.h> /* for S_ISREG(), fstat() */
+#include <unistd.h> /* for close(), read() */
+
+#include "xmalloc.h"
+
+// Forward declarations.
+static bool gitignore_glob(
+    const char *pattern,
+    const char *pattern_start,
+    const char *pattern_end,
+    const char *text,
+    const char *text_end
+);
+static uint32_t gitignore_hash(const char *key, size_t length);
+static bool gitignore_read(
+    int dirfd, const char *name, char **buffer, size_t *length
+);
+static void gitignore_table_add(
+    gitignore_table_t *table,
+    gitignore_rule_t *rule,
+    const char *key,
+    size_t length,
+    int index
+);
+static void gitignore_table_init(gitignore_table_t *table, unsigned count);
+static int gitignore_table_lookup(
+    gitignore_table_t *table, const char *key, size_t length, bool directory
+);
+static const char *last_byte(const char *bytes, size_t length, char byte);
+
+gitignore_t *gitignore_new(
+    const char *source, size_t length, size_t base_length, gitignore_t *parent
+) {
+    // Every line yields at most one rule.
+    unsigned max_rules = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (source[i] == '\n') {
+            max_rules++;
+        }
+    }
+
+    gitignore_t *gitignore = xcalloc(1, sizeof(gitignore_t));
+    gitignore->parent = parent;
+    gitignore->base_length = base_length;
+    gitignore->rules = xmalloc(max_rules * sizeof(gitignore_rule_t));
+
+    // Patterns never get longer than the lines they came from, and the NUL
+    // terminator takes the place of the "\n".
+    gitignore->bytes = xmalloc(length + 1);
+    char *cursor = gitignore->bytes;
+
+    const char *end = source + length;
+    for (const char *line = source; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        const char *pattern = line;
+        size_t pattern_length = eol - line;
+        line = eol + 1;
+
+        if (pattern_length && pattern[pattern_length - 1] == '\r') {
+            pattern_length--;
+        }
+
+        // Trailing spaces are ignored unless escaped with a backslash.
+        while (pattern_length && pattern[pattern_length - 1] == ' ' &&
+               !(pattern_length > 1 && pattern[pattern_length - 2] == '\\')) {
+            pattern_length--;
+        }
+        if (!pattern_length || pattern[0] == '#') {
+            continue;
+        }
+
+        gitignore_rule_t rule = {0};
+        if (pattern[0] == '!') {
+            rule.negate = true;
+            pattern++;
+            pattern_length--;
+        }
+        if (pattern_length && pattern[pattern_length - 1] == '/') {
+            rule.directory = true;
+            pattern_length--;
+        }
+        if (memchr(pattern, '/', pattern_length)) {
+            rule.anchored = true;
+            if (pattern[0] == '/') {
+                pattern++;
+                pattern_length--;
+            }
+        }
+
+        // "**/name" means the same as "name" (ie. match at any depth), so
+        // unanchor it to make it eligible for a hash lookup.
+        if (pattern_length > 3 && memcmp(pattern, "**/", 3) == 0 &&
+            !memchr(pattern + 3, '/', pattern_length - 3)) {
+            pattern += 3;
+            pattern_length -= 3;
+            rule.anchored = false;
+        }
+        if (!pattern_length) {
+            continue;
+        }
+
+        memcpy(cursor, pattern, pattern_length);
+        cursor[pattern_length] = '\0';
+        rule.pattern = cursor;
+        rule.length = pattern_length;
+        cursor += pattern_length + 1;
+        gitignore->rules[gitignore->rules_count++] = rule;
+    }
+
+    if (!gitignore->rules_count) {
+        gitignore_free(gitignore);
+        return NULL;
+    }
+
+    // Now that we know how many rules there are, sort them into buckets.
+    gitignore_table_init(&gitignore->names, gitignore->rules_count);
+    gitignore_table_init(&gitignore->paths, gitignore->rules_count);
+    gitignore_table_init(&gitignore->extensions, gitignore->rules_count);
+    gitignore->others = xmalloc(gitignore->rules_count * sizeof(unsigned));
+    for (unsigned i = 0; i < gitignore->rules_count; i++) {
+        gitignore_rule_t *rule = &gitignore->rules[i];
+        const char *pattern = rule->pattern;
+        size_t pattern_length = rule->length;
+        if (!strpbrk(pattern, "*?[\\")) {
+            gitignore_table_add(
+                rule->anchored ? &gitignore->paths : &gitignore->names,
+                rule,
+                pattern,
+                pattern_length,
+                i
+            );
+        } else if (!rule->anchored && pattern_length > 2 &&
+                   pattern[0] == '*' && pattern[1] == '.' &&
+                   !strpbrk(pattern + 2, "*?[\\.")) {
+            gitignore_table_add(
+                &gitignore->extensions, rule, pattern + 1, pattern_length - 1, i
+            );
+        } else {
+            gitignore->others[gitignore->others_count++] = i;
+        }
+    }
+
+    return gitignore;
+}
+
+gitignore_t *gitignore_load(
+    int dirfd,
+    bool exclude,
+    bool gitignore,
+    bool ignore,
+    size_t base_length,
+    gitignore_t *parent
+) {
+    char *source = NULL;
+    size_t length = 0;
+    bool found = false;
+    if (exclude) {
+        found |= gitignore_read(dirfd, ".git/info/exclude", &source, &length);
+    }
+    if (gitignore) {
+        found |= gitignore_read(dirfd, ".gitignore", &source, &length);
+    }
+    if (ignore) {
+        found |= gitignore_read(dirfd, ".ignore", &source, &length);
+    }
+    gitignore_t *compiled =
+        found ? gitignore_new(source, length, base_length, parent) : NULL;
+    free(source);
+    return compiled;
+}
+
+bool gitignore_match(
+    gitignore_t *gitignore, const char *path, size_t length, bool directory
+) {
+    for (; gitignore; gitignore = gitignore->parent) {
+        const char *relative = path + gitignore->base_length;
+        size_t relative_length = length - gitignore->base_length;
+        const char *name = last_byte(relative, relative_length, '/');
+        name = name ? name + 1 : relative;
+        size_t name_length = relative + relative_length - name;
+
+        int best = gitignore_table_lookup(
+            &gitignore->names, name, name_length, directory
+        );
+        int index = gitignore_table_lookup(
+            &gitignore->paths, relative, relative_length, directory
+        );
+        if (index > best) {
+            best = index;
+        }
+        const char *extension = last_byte(name, name_length, '.');
+        if (extension) {
+            index = gitignore_table_lookup(
+                &gitignore->extensions,
+                extension,
+                name + name_length - extension,
+                directory
+            );
+            if (index > best) {
+                best = index;
+            }
+        }
+
+        // Try the remaining rules from last to first, stopping as soon as we
+        // reach one that couldn't beat what we already have.
+        for (unsigned i = gitignore->others_count; i > 0; i--) {
+            unsigned other = gitignore->others[i - 1];
+            if ((int)other <= best) {
+                break;
+            }
+            gitignore_rule_t *rule = &gitignore->rules[other];
+            if (rule->directory && !directory) {
+                continue;
+            }
+            const char *text = rule->anchored ? relative : name;
+            const char *text_end = name + name_length;
+            if (gitignore_glob(
+                    rule->pattern,
+                    rule->pattern,
+                    rule->pattern + rule->length,
+                    text,
+                    text_end
+                )) {
+                best = other;
+                break;
+            }
+        }
+
+        // The nearest ignore file with an opinion gets the final say.
+        if (best != -1) {
+            return !gitignore->rules[best].negate;
+        }
+    }
+    return false;
+}
+
+void gitignore_free(gitignore_t *gitignore) {
+    if (!gitignore) {
+        return;
+    }
+    free(gitignore->rules);
+    free(gitignore->names.entries);
+    free(gitignore->paths.entries);
+    free(gitignore->extensions.entries);
+    free(gitignore->others);
+    free(gitignore->bytes);
+    free(gitignore);
+}
+
+/**
+ * Matches `text` against the glob `pattern`, using the semantics described in
+ * `man gitignore`; that is, like `fnmatch()` with `FNM_PATHNAME`, plus support
+ * for "**" as a complete path component: at the start or in the middle of a
+ * pattern it matches zero or more directories, and at the end it matches
+ * everything inside the preceding directory.
+ *
+ * `pattern_start` is the beginning of the whole pattern, needed to tell
+ * whether a "**" starts a path component.
+ */
+static bool gitignore_glob(
+    const char *pattern,
+    const char *pattern_start,
+    const char *pattern_end,
+    const char *text,
+    const char *text_end
+) {
+    while (pattern < pattern_end) {
+        char c = *pattern;
+        if (c == '*') {
+            const char *stars = pattern;
+            while (pattern < pattern_end && *pattern == '*') {
+                pattern++;
+            }
+            if (pattern - stars > 1 &&
+                (stars == pattern_start || stars[-1] == '/')) {
+                if (pattern == pattern_end) {
+                    // Trailing "/**" matches everything inside.
+                    return true;
+                } else if (*pattern == '/') {
+                    // "**/" matches zero or more directories.
+                    pattern++;
+                    for (const char *t = text;;) {
+                        if (gitignore_glob(
+                                pattern, pattern_start, pattern_end, t, text_end
+                            )) {
+                            return true;
+                        }
+                        t = memchr(t, '/', text_end - t);
+                        if (!t) {
+                            return false;
+                        }
+                        t++;
+                    }
+                }
+            }
+
+            // Any other run of "*" matches within a single path component.
+            if (pattern == pattern_end) {
+                return !memchr(text, '/', text_end - text);
+            }
+            for (const char *t = text; t <= text_end; t++) {
+                if (gitignore_glob(
+                        pattern, pattern_start, pattern_end, t, text_end
+                    )) {
+                    return true;
+                } else if (t == text_end || *t == '/') {
+                    break;
+                }
+            }
+            return false;
+        }
+
+        if (text == text_end) {
+            return false;
+        }
+
+        if (c == '?') {
+            if (*text == '/') {
+                return false;
+            }
+        } else if (c == '[') {
+            const char *p = pattern + 1;
+            bool negate = false;
+            if (p < pattern_end && (*p == '!' || *p == '^')) {
+                negate = true;
+                p++;
+            }
+            bool matched = false;
+            bool first = true;
+            while (p < pattern_end && (*p != ']' || first)) {
+                first = false;
+                char low = *p;
+                if (low == '\\' && p + 1 < pattern_end) {
+                    low = *++p;
+                }
+                char high = low;
+                if (p + 2 < pattern_end && p[1] == '-' && p[2] != ']') {
+                    p += 2;
+                    high = *p;
+                    if (high == '\\' && p + 1 < pattern_end) {
+                        high = *++p;
+                    }
+                }
+                if (*text >= low && *text <= high) {
+                    matched = true;
+                }
+                p++;
+            }
+            if (p == pattern_end) {
+                // Unterminated bracket expression; treat "[" literally.
+                if (*text != '[') {
+                    return false;
+                }
+            } else {
+                if (matched == negate || *text == '/') {
+                    return false;
+                }
+                pattern = p;
+            }
+        } else {
+            if (c == '\\' && pattern + 1 < pattern_end) {
+                c = *++pattern;
+            }
+            if (c != *text) {
+                return false;
+            }
+        }
+        pattern++;
+        text++;
+    }
+    return text == text_end;
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t gitignore_hash(const char *key, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Appends the contents of the file `name` (relative to `dirfd`), followed by
+ * a newline, to `*buffer` (of `*length` bytes), growing it as needed.
+ *
+ * Returns false if the file couldn't be read.
+ */
+static bool gitignore_read(
+    int dirfd, const char *name, char **buffer, size_t *length
+) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
+    }
+    *buffer = xrealloc(*buffer, *length + info.st_size + 1);
+    size_t total = 0;
+    while (total < (size_t)info.st_size) {
+        ssize_t read_count =
+            read(fd, *buffer + *length + total, info.st_size - total);
+        if (read_count <= 0) {
+            if (read_count == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += read_count;
+    }
+    close(fd);
+    (*buffer)[*length + total] = '\n';
+    *length += total + 1;
+    return true;
+}
+
+/**
+ * Records that `rule` (at position `index`) matches `key`.
+ */
+static void gitignore_table_add(
+    gitignore_table_t *table,
+    gitignore_rule_t *rule,
+    const char *key,
+    size_t length,
+    int index
+) {
+    uint32_t hash = gitignore_hash(key, length);
+    unsigned mask = table->capacity - 1;
+    unsigned slot = hash & mask;
+    while (table->entries[slot].key) {
+        gitignore_key_t *entry = &table->entries[slot];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->key, key, length) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    gitignore_key_t *entry = &table->entries[slot];
+    if (!entry->key) {
+        entry->key = key;
+        entry->length = length;
+        entry->hash = hash;
+        entry->last = -1;
+        entry->last_directory = -1;
+    }
+
+    // Rules are added in order, so the latest one always wins.
+    entry->last_directory = index;
+    if (!rule->directory) {
+        entry->last = index;
+    }
+}
+
+static void gitignore_table_init(gitignore_table_t *table, unsigned count) {
+    // Keep the load factor at or below 50%.
+    table->capacity = 8;
+    while (table->capacity < count * 2) {
+        table->capacity *= 2;
+    }
+    table->entries = xcalloc(table->capacity, sizeof(gitignore_key_t));
+}
+
+/**
+ * Returns the index of the last rule in `table` matching `key`, or -1.
+ */
+static int gitignore_table_lookup(
+    gitignore_table_t *table, const char *key, size_t length, bool directory
+) {
+    uint32_t hash = gitignore_hash(key, length);
+    unsigned mask = table->capacity - 1;
+    for (unsigned slot = hash & mask; table->entries[slot].key;
+         slot = (slot + 1) & mask) {
+        gitignore_key_t *entry = &table->entries[slot];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->key, key, length) == 0) {
+            return directory ? entry->last_directory : entry->last;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Portable equivalent of the GNU `memrchr()` extension.
+ */
+static const char *last_byte(const char *bytes, size_t length, char byte) {
+    while (length--) {
+        if (bytes[length] == byte) {
+            return bytes + length;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,167 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * Compiled rules from ".gitignore" (and ".ignore") files.
+ *
+ * Rules follow the syntax described in `man gitignore`: blank lines and lines
+ * starting with "#" are skipped, a leading "!" negates, a trailing "/" matches
+ * only directories, patterns containing a "/" are anchored to the directory
+ * containing the ignore file, and "**" matches across directory boundaries.
+ *
+ * Each ignore file compiles to a `gitignore_t`, which links to the rules
+ * inherited from ancestor directories via its `parent` pointer.
+ */
+
+#ifndef GITIGNORE_H
+#define GITIGNORE_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define gitignore_free commandt_gitignore_free
+#define gitignore_load commandt_gitignore_load
+#define gitignore_match commandt_gitignore_match
+#define gitignore_new commandt_gitignore_new
+
+#include <stdbool.h> /* for bool */
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t */
+
+typedef struct {
+    const char *pattern;
+    size_t length;
+
+    /**
+     * Rule started with "!".
+     */
+    bool negate;
+
+    /**
+     * Rule ended with "/".
+     */
+    bool directory;
+
+    /**
+     * Rule contained a "/" (other than a trailing one), so it is matched
+     * against the path relative to the ignore file rather than just the
+     * final path component.
+     */
+    bool anchored;
+} gitignore_rule_t;
+
+/**
+ * Hash table entry mapping a literal name (or an extension, such as ".o") to
+ * the last rules that could match it.
+ *
+ * Because the last matching rule wins, we only need to remember the index of
+ * the final rule for each key: `last` is for rules that apply to any kind of
+ * entry, and `last_directory` also takes directory-only rules into account.
+ * Both are -1 when there is no such rule.
+ */
+typedef struct {
+    const char *key;
+    size_t length;
+    uint32_t hash;
+    int last;
+    int last_directory;
+} gitignore_key_t;
+
+typedef struct {
+    gitignore_key_t *entries;
+    unsigned capacity;
+} gitignore_table_t;
+
+typedef struct gitignore_t {
+    /**
+     * Rules from ancestor directories, which have lower precedence than ours.
+     */
+    struct gitignore_t *parent;
+
+    /**
+     * Length of the prefix (directory path plus trailing "/") to strip from
+     * full paths to get paths relative to this ignore file.
+     */
+    size_t base_length;
+
+    gitignore_rule_t *rules;
+    unsigned rules_count;
+
+    /**
+     * Unanchored literal rules (eg. "node_modules"), keyed by name.
+     */
+    gitignore_table_t names;
+
+    /**
+     * Anchored literal rules (eg. "/build" or "doc/tags"), keyed by path.
+     */
+    gitignore_table_t paths;
+
+    /**
+     * Unanchored rules of the form "*.ext", keyed by ".ext".
+     */
+    gitignore_table_t extensions;
+
+    /**
+     * Indices (in ascending order) of all other rules, which must be tried
+     * one by one.
+     */
+    unsigned *others;
+    unsigned others_count;
+
+    /**
+     * Storage for patterns.
+     */
+    char *bytes;
+} gitignore_t;
+
+/**
+ * Compiles the contents of an ignore file, `source` (of `length` bytes), into
+ * a new `gitignore_t`.
+ *
+ * `base_length` is the length of the prefix to strip from paths passed to
+ * `gitignore_match()` (ie. 0 for an ignore file in the root of the walk,
+ * otherwise the length of the directory's path plus 1 for the "/").
+ *
+ * Returns NULL if `source` contains no rules. The caller should dispose of the
+ * result with `gitignore_free()` (which does not free `parent`).
+ */
+gitignore_t *gitignore_new(
+    const char *source, size_t length, size_t base_length, gitignore_t *parent
+);
+
+/**
+ * Reads and compiles the ignore files in the directory open as `dirfd`.
+ *
+ * `exclude`, `gitignore` and `ignore` say whether to look for
+ * ".git/info/exclude", ".gitignore" and ".ignore" respectively; rules from
+ * later files take precedence over those from earlier ones. `base_length` and
+ * `parent` are as for `gitignore_new()`.
+ *
+ * Returns NULL if none of the files exist or contain any rules.
+ */
+gitignore_t *gitignore_load(
+    int dirfd,
+    bool exclude,
+    bool gitignore,
+    bool ignore,
+    size_t base_length,
+    gitignore_t *parent
+);
+
+/**
+ * Returns true if the entry at `path` (of `length` bytes, relative to the root
+ * of the walk) is ignored by the rules in `gitignore` or any of its ancestors.
+ *
+ * Rules in deeper ignore files take precedence over those in shallower ones,
+ * and within a file, later rules take precedence over earlier ones.
+ */
+bool gitignore_match(
+    gitignore_t *gitignore, const char *path, size_t length, bool directory
+);
+
+void gitignore_free(gitignore_t *gitignore);
+
+#endif
@@ -19,11 +19,14 @@ static void heap_heapify(heap_t *heap, unsigned idx);
 static int heap_property(heap_t *heap, unsigned parent_idx, unsigned child_idx);
 static void heap_swap(heap_t *heap, unsigned a, unsigned b);
 
-heap_t *heap_new(unsigned capacity, heap_compare_entries comparator) {
+heap_t *heap_new(
+    unsigned capacity, heap_compare_entries comparator, void *context
+) {
     heap_t *heap = xmalloc(sizeof(heap_t));
 
     heap->capacity = capacity;
     heap->comparator = comparator;
+    heap->context = context;
     heap->count = 0;
     heap->entries = xmalloc(capacity * sizeof(void *));
 
@@ -80,7 +83,7 @@ void heap_insert(heap_t *heap, void *value) {
 static int heap_compare(heap_t *heap, unsigned a_idx, unsigned b_idx) {
     const void *a = heap->entries[a_idx];
     const void *b = heap->entries[b_idx];
-    return heap->comparator(a, b);
+    return heap->comparator(a, b, heap->context);
 }
 
 /**
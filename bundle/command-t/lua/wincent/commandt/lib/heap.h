@@ -18,13 +18,16 @@
 #define heap_insert commandt_heap_insert
 #define heap_new commandt_heap_new
 
-typedef int (*heap_compare_entries)(const void *a, const void *b);
+typedef int (*heap_compare_entries)(
+    const void *a, const void *b, void *context
+);
 
 typedef struct {
     unsigned count;
     unsigned capacity;
     void **entries;
     heap_compare_entries comparator;
+    void *context;
 } heap_t;
 
 #define HEAP_PEEK(heap) (heap->entries[0])
@@ -45,8 +48,10 @@ void heap_free(heap_t *heap);
 void heap_insert(heap_t *heap, void *value);
 
 /**
- * Returns a new heap.
+ * Returns a new heap. `context` is passed along to every call to `comparator`.
  */
-heap_t *heap_new(unsigned capacity, heap_compare_entries comparator);
+heap_t *heap_new(
+    unsigned capacity, heap_compare_entries comparator, void *context
+);
 
 #endif
@@ -0,0 +1,150 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "ignore.h"
+
+#include <fnmatch.h> /* for fnmatch() */
+#include <stdlib.h> /* for free(), NULL */
+#include <string.h> /* for memcmp(), memcpy(), strlen(), strpbrk() */
+
+#include "xmalloc.h"
+
+// Forward declarations.
+static uint32_t ignore_hash(const char *name, size_t length);
+
+ignore_t *ignore_new(const char **patterns, unsigned count) {
+    if (!count) {
+        return NULL;
+    }
+
+    ignore_t *ignore = xcalloc(1, sizeof(ignore_t));
+
+    // Keep the load factor at or below 50%.
+    ignore->names_capacity = 8;
+    while (ignore->names_capacity < count * 2) {
+        ignore->names_capacity *= 2;
+    }
+    ignore->names = xcalloc(ignore->names_capacity, sizeof(ignore_name_t));
+    ignore->globs = xcalloc(count, sizeof(ignore_glob_t));
+
+    for (unsigned i = 0; i < count; i++) {
+        size_t length = strlen(patterns[i]);
+        bool directories = true;
+        bool files = true;
+        if (length && patterns[i][length - 1] == '/') {
+            files = false;
+            length--;
+        }
+        if (!length) {
+            continue;
+        }
+        char *pattern = xmalloc(length + 1);
+        memcpy(pattern, patterns[i], length);
+        pattern[length] = '\0';
+
+        if (strpbrk(pattern, "*?[\\")) {
+            ignore_glob_t *glob = &ignore->globs[ignore->globs_count++];
+            glob->pattern = pattern;
+            glob->length = length;
+            glob->suffix =
+                pattern[0] == '*' && !strpbrk(pattern + 1, "*?[\\");
+            glob->directories = directories;
+            glob->files = files;
+        } else {
+            uint32_t hash = ignore_hash(pattern, length);
+            unsigned mask = ignore->names_capacity - 1;
+            unsigned slot = hash & mask;
+            while (ignore->names[slot].name) {
+                ignore_name_t *existing = &ignore->names[slot];
+                if (existing->hash == hash && existing->length == length &&
+                    memcmp(existing->name, pattern, length) == 0) {
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            ignore_name_t *name = &ignore->names[slot];
+            if (name->name) {
+                // Duplicate; merge with existing entry.
+                free(pattern);
+            } else {
+                name->name = pattern;
+                name->length = length;
+                name->hash = hash;
+            }
+            name->directories |= directories;
+            name->files |= files;
+        }
+    }
+
+    return ignore;
+}
+
+bool ignore_match(
+    ignore_t *ignore, const char *name, size_t length, bool directory
+) {
+    uint32_t hash = ignore_hash(name, length);
+    unsigned mask = ignore->names_capacity - 1;
+    for (unsigned slot = hash & mask; ignore->names[slot].name;
+         slot = (slot + 1) & mask) {
+        ignore_name_t *entry = &ignore->names[slot];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->name, name, length) == 0) {
+            if (directory ? entry->directories : entry->files) {
+                return true;
+            }
+            break;
+        }
+    }
+
+    for (unsigned i = 0; i < ignore->globs_count; i++) {
+        ignore_glob_t *glob = &ignore->globs[i];
+        if (directory ? !glob->directories : !glob->files) {
+            continue;
+        }
+        if (glob->suffix) {
+            // Compare everything after the leading "*".
+            size_t suffix_length = glob->length - 1;
+            if (length >= suffix_length &&
+                memcmp(
+                    name + length - suffix_length,
+                    glob->pattern + 1,
+                    suffix_length
+                ) == 0) {
+                return true;
+            }
+        } else if (fnmatch(glob->pattern, name, 0) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ignore_free(ignore_t *ignore) {
+    if (!ignore) {
+        return;
+    }
+    for (unsigned i = 0; i < ignore->names_capacity; i++) {
+        free((void *)ignore->names[i].name);
+    }
+    for (unsigned i = 0; i < ignore->globs_count; i++) {
+        free((void *)ignore->globs[i].pattern);
+    }
+    free(ignore->names);
+    free(ignore->globs);
+    free(ignore);
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t ignore_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,81 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * Compiled sets of names and glob patterns used to prune directory walks.
+ */
+
+#ifndef IGNORE_H
+#define IGNORE_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define ignore_free commandt_ignore_free
+#define ignore_match commandt_ignore_match
+#define ignore_new commandt_ignore_new
+
+#include <stdbool.h> /* for bool */
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t */
+
+typedef struct {
+    const char *name;
+    size_t length;
+    uint32_t hash;
+    bool directories;
+    bool files;
+} ignore_name_t;
+
+typedef struct {
+    const char *pattern;
+    size_t length;
+
+    /**
+     * True if `pattern` is of the form "*suffix" (with no other special
+     * characters), allowing it to be matched with a simple comparison instead
+     * of `fnmatch()`.
+     */
+    bool suffix;
+
+    bool directories;
+    bool files;
+} ignore_glob_t;
+
+typedef struct {
+    /**
+     * Open-addressed hash table of literal names, sized to a power of two.
+     */
+    ignore_name_t *names;
+    unsigned names_capacity;
+
+    ignore_glob_t *globs;
+    unsigned globs_count;
+} ignore_t;
+
+/**
+ * Compiles `count` `patterns` into a new `ignore_t`.
+ *
+ * Each pattern is matched against the name of a single directory entry (not a
+ * full path), and may be either a literal name (eg. "node_modules") or a glob
+ * as understood by `fnmatch()` (eg. "*.o"). A trailing "/" restricts the
+ * pattern to directories.
+ *
+ * Returns NULL if there are no patterns. The caller should dispose of the
+ * result with `ignore_free()`.
+ */
+ignore_t *ignore_new(const char **patterns, unsigned count);
+
+/**
+ * Returns true if the directory entry `name` (which must be NUL-terminated)
+ * matches any of the patterns in `ignore`.
+ */
+bool ignore_match(
+    ignore_t *ignore, const char *name, size_t length, bool directory
+);
+
+void ignore_free(ignore_t *ignore);
+
+#endif
@@ -0,0 +1,558 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "index.h"
+
+#include <errno.h> /* for errno */
+#include <fcntl.h> /* for O_CLOEXEC, O_RDONLY, open() */
+#include <limits.h> /* for PATH_MAX */
+#include <pthread.h> /* for pthread_mutex_lock(), pthread_mutex_unlock() */
+#include <stdint.h> /* for int64_t, uint32_t, uint64_t, uintptr_t */
+#include <stdio.h> /* for FILE, fopen(), fwrite(), rename(), snprintf() */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcmp(), memcpy(), strerror(), strlen() */
+#include <sys/mman.h> /* for MAP_FAILED, mmap(), munmap() */
+#include <sys/stat.h> /* for fstat(), stat() */
+#include <unistd.h> /* for close(), pread(), sysconf(), unlink() */
+
+#include "debug.h"
+#include "scanner.h" /* for scanner_new(), scanner_pack() */
+#include "xmalloc.h"
+
+#define INDEX_MAGIC "CMDTIDX\0"
+
+// Bump this whenever the layout changes.
+#define INDEX_VERSION 1
+
+/**
+ * A directory that was walked to produce the index, along with a stamp
+ * derived from its modification time (see `index_stamp()`).
+ */
+typedef struct {
+    /**
+     * Location of the (NUL-terminated) path within the slab.
+     */
+    uint64_t offset;
+    uint64_t length;
+
+    int64_t stamp;
+} index_directory_t;
+
+/**
+ * Describes the layout of the index; stored at the very end of the file.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /**
+     * `sizeof(str_t)` in the process that wrote the index, because the
+     * candidates table is only usable by a process that agrees with it.
+     */
+    uint32_t str_size;
+
+    /**
+     * Hash of the root directory and the scanner options.
+     */
+    uint64_t options_hash;
+
+    /**
+     * Address at which the `contents` pointers in the candidates table assume
+     * that the file is mapped.
+     */
+    uint64_t base;
+
+    uint64_t count;
+    uint64_t candidates_size;
+    uint64_t bitmasks_offset;
+    uint64_t directories_count;
+    uint64_t directories_offset;
+    uint64_t slab_offset;
+    uint64_t slab_size;
+    uint64_t file_size;
+} index_trailer_t;
+
+/**
+ * State shared by the walker's threads while `index_scan()` records the
+ * directories that it visits.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    bool respect_gitignore;
+
+    index_directory_t *directories;
+    size_t directories_count;
+    size_t directories_capacity;
+
+    /**
+     * Storage for directory paths; `offset` fields in `directories` are
+     * relative to the start of this buffer until the index is written.
+     */
+    char *bytes;
+    size_t bytes_length;
+    size_t bytes_capacity;
+
+    /**
+     * Set if we couldn't stamp a directory, which makes the index unusable.
+     */
+    bool failed;
+} index_walk_t;
+
+// Forward declarations.
+static uintptr_t index_base(uint64_t options_hash);
+static long index_bitmask(const char *path, size_t length);
+static uint64_t index_hash(uint64_t hash, const void *bytes, size_t length);
+static uint64_t index_options_hash(
+    const char *directory, const find_options_t *options
+);
+static bool index_on_directory(const char *path, unsigned depth, void *context);
+static bool index_pad(FILE *file, size_t count);
+static size_t index_round(size_t size, size_t multiple);
+static bool index_stamp(
+    const char *path, bool respect_gitignore, int64_t *stamp
+);
+static bool index_write(
+    const char *index_path,
+    uint64_t options_hash,
+    find_result_t *result,
+    index_walk_t *walk
+);
+
+scanner_t *index_scan(
+    const char *directory, const find_options_t *options, const char *index_path
+) {
+    find_options_t defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+
+    index_walk_t walk = {0};
+    pthread_mutex_init(&walk.mutex, NULL);
+    walk.respect_gitignore = options->respect_gitignore;
+
+    find_options_t walk_options = *options;
+    walk_options.on_directory = index_on_directory;
+    walk_options.context = &walk;
+    find_result_t *result = commandt_find(directory, &walk_options);
+    if (result->error) {
+        DEBUG_LOG("index_scan(): %s\n", result->error);
+    } else if (walk.failed) {
+        DEBUG_LOG("index_scan(): couldn't stamp all directories\n");
+    } else if (options->max_files && result->count >= options->max_files) {
+        // A truncated scan isn't reproducible, so there's no point saving it.
+        DEBUG_LOG("index_scan(): not writing truncated scan\n");
+    } else if (!index_write(
+                   index_path,
+                   index_options_hash(directory, options),
+                   result,
+                   &walk
+               )) {
+        DEBUG_LOG("index_scan(): failed to write %s\n", index_path);
+    }
+    pthread_mutex_destroy(&walk.mutex);
+    free(walk.directories);
+    free(walk.bytes);
+
+    scanner_t *scanner = scanner_new(
+        result->count,
+        result->files,
+        result->files_size,
+        result->buffer,
+        result->buffer_size
+    );
+    scanner->duplicate_count = result->duplicate_count;
+    scanner_pack(scanner);
+    free((void *)result->error);
+    free(result);
+    return scanner;
+}
+
+scanner_t *index_load(
+    const char *directory, const find_options_t *options, const char *index_path
+) {
+    find_options_t defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG_LOG("index_load(): failed open() - %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct stat info;
+    index_trailer_t trailer;
+    if (fstat(fd, &info) == -1 ||
+        (size_t)info.st_size < sizeof(index_trailer_t) ||
+        pread(
+            fd,
+            &trailer,
+            sizeof(index_trailer_t),
+            info.st_size - sizeof(index_trailer_t)
+        ) != sizeof(index_trailer_t)) {
+        DEBUG_LOG("index_load(): unreadable index\n");
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t size = info.st_size;
+    if (memcmp(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic)) != 0 ||
+        trailer.version != INDEX_VERSION || trailer.str_size != sizeof(str_t) ||
+        trailer.file_size != size ||
+        trailer.options_hash != index_options_hash(directory, options) ||
+        trailer.candidates_size < trailer.count * sizeof(str_t) ||
+        trailer.candidates_size == 0 ||
+        trailer.candidates_size % (uint64_t)sysconf(_SC_PAGESIZE) != 0 ||
+        trailer.bitmasks_offset != trailer.candidates_size ||
+        trailer.directories_offset !=
+            trailer.bitmasks_offset + trailer.count * sizeof(long) ||
+        trailer.slab_offset !=
+            trailer.directories_offset +
+                trailer.directories_count * sizeof(index_directory_t) ||
+        trailer.slab_offset + trailer.slab_size > size) {
+        DEBUG_LOG("index_load(): incompatible index\n");
+        close(fd);
+        return NULL;
+    }
+
+    // Ask for the mapping at the address that the candidates table assumes;
+    // if we get it, the table can be used as-is.
+    void *hint = (void *)(uintptr_t)trailer.base;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+    if (hint) {
+        flags |= MAP_FIXED_NOREPLACE;
+    }
+#endif
+    char *address = mmap(hint, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (address == MAP_FAILED && flags != MAP_PRIVATE) {
+        // Something else is already there.
+        address =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED) {
+        DEBUG_LOG("index_load(): failed mmap() - %s\n", strerror(errno));
+        return NULL;
+    }
+
+    const char *slab = address + trailer.slab_offset;
+    index_directory_t *directories =
+        (index_directory_t *)(address + trailer.directories_offset);
+    for (uint64_t i = 0; i < trailer.directories_count; i++) {
+        index_directory_t *entry = &directories[i];
+        int64_t stamp;
+        if (entry->offset + entry->length >= trailer.slab_size ||
+            !index_stamp(
+                slab + entry->offset, options->respect_gitignore, &stamp
+            ) ||
+            stamp != entry->stamp) {
+            DEBUG_LOG("index_load(): stale directory %s\n", slab + entry->offset);
+            munmap(address, size);
+            return NULL;
+        }
+    }
+
+    str_t *candidates = (str_t *)address;
+    if ((uintptr_t)address != trailer.base) {
+        uintptr_t delta = (uintptr_t)address - (uintptr_t)trailer.base;
+        for (uint64_t i = 0; i < trailer.count; i++) {
+            candidates[i].contents += delta;
+        }
+    }
+
+    scanner_t *scanner = scanner_new(
+        trailer.count,
+        candidates,
+        trailer.candidates_size,
+        address + trailer.candidates_size,
+        size - trailer.candidates_size
+    );
+    scanner->bitmasks = (long *)(address + trailer.bitmasks_offset);
+    scanner->bitmasks_count = trailer.count;
+    return scanner;
+}
+
+/**
+ * Returns a preferred address at which to map an index, spreading indices for
+ * different roots and options over different parts of the address space so
+ * that they're unlikely to contend for the same spot.
+ */
+static uintptr_t index_base(uint64_t options_hash) {
+#if UINTPTR_MAX > 0xffffffffu
+    return (uintptr_t)0x100000000000ull +
+           (uintptr_t)((options_hash & 0xfff) << 32);
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Computes the same bitmask that `commandt_score()` would compute for `path`
+ * (or a superset of it, as far as letters are concerned).
+ */
+static long index_bitmask(const char *path, size_t length) {
+    long mask = 0;
+    for (size_t i = 0; i < length; i++) {
+        char c = path[i];
+        if (c >= 'a' && c <= 'z') {
+            mask |= (1 << (c - 'a'));
+        } else if (c >= 'A' && c <= 'Z') {
+            mask |= (1 << (c - 'A'));
+        }
+    }
+    return mask;
+}
+
+/**
+ * 64-bit FNV-1a, continuing from `hash`.
+ */
+static uint64_t index_hash(uint64_t hash, const void *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((const unsigned char *)bytes)[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Hashes everything that influences which candidates a scan produces.
+ */
+static uint64_t index_options_hash(
+    const char *directory, const find_options_t *options
+) {
+    uint64_t hash = 14695981039346656037ull;
+    hash = index_hash(hash, directory, strlen(directory) + 1);
+    uint32_t values[] = {
+        options->max_files,
+        options->max_depth,
+        options->scan_dot_directories,
+        options->ignore_count,
+        options->respect_gitignore,
+        options->breadth_first,
+        options->emit_aliases,
+        options->sort,
+    };
+    hash = index_hash(hash, values, sizeof(values));
+    for (unsigned i = 0; i < options->ignore_count; i++) {
+        hash =
+            index_hash(hash, options->ignore[i], strlen(options->ignore[i]) + 1);
+    }
+    return hash;
+}
+
+/**
+ * Called by the walker (on any of its threads) for each directory that it is
+ * about to read.
+ *
+ * Note that we stamp the directory before it is read, so that any change that
+ * the walk might miss shows up as a changed stamp the next time around.
+ */
+static bool index_on_directory(const char *path, unsigned depth, void *context) {
+    index_walk_t *walk = context;
+    int64_t stamp;
+    bool stamped = index_stamp(path, walk->respect_gitignore, &stamp);
+    size_t length = strlen(path);
+
+    pthread_mutex_lock(&walk->mutex);
+    if (!stamped) {
+        walk->failed = true;
+    } else {
+        if (walk->directories_count == walk->directories_capacity) {
+            walk->directories_capacity = walk->directories_capacity
+                                             ? walk->directories_capacity * 2
+                                             : 1024;
+            walk->directories = xrealloc(
+                walk->directories,
+                walk->directories_capacity * sizeof(index_directory_t)
+            );
+        }
+        if (walk->bytes_length + length + 1 > walk->bytes_capacity) {
+            size_t capacity =
+                walk->bytes_capacity ? walk->bytes_capacity : 65536;
+            while (walk->bytes_length + length + 1 > capacity) {
+                capacity *= 2;
+            }
+            walk->bytes = xrealloc(walk->bytes, capacity);
+            walk->bytes_capacity = capacity;
+        }
+        index_directory_t *directory =
+            &walk->directories[walk->directories_count++];
+        directory->offset = walk->bytes_length;
+        directory->length = length;
+        directory->stamp = stamp;
+        memcpy(walk->bytes + walk->bytes_length, path, length + 1);
+        walk->bytes_length += length + 1;
+    }
+    pthread_mutex_unlock(&walk->mutex);
+
+    return true;
+}
+
+/**
+ * Writes `count` zero bytes.
+ */
+static bool index_pad(FILE *file, size_t count) {
+    static const char zeroes[4096];
+    while (count) {
+        size_t chunk = count < sizeof(zeroes) ? count : sizeof(zeroes);
+        if (fwrite(zeroes, 1, chunk, file) != chunk) {
+            return false;
+        }
+        count -= chunk;
+    }
+    return true;
+}
+
+static size_t index_round(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+/**
+ * Derives a stamp for the directory at `path` from its modification time
+ * (which changes whenever entries are added, removed or renamed), and, if
+ * `respect_gitignore` is true, from those of its ignore files too.
+ */
+static bool index_stamp(
+    const char *path, bool respect_gitignore, int64_t *stamp
+) {
+    struct stat info;
+    if (stat(path, &info) == -1) {
+        return false;
+    }
+#ifdef MACOS
+    int64_t mtime = (int64_t)info.st_mtimespec.tv_sec * 1000000000 +
+                    info.st_mtimespec.tv_nsec;
+#else
+    int64_t mtime =
+        (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    uint64_t hash = index_hash(14695981039346656037ull, &mtime, sizeof(mtime));
+    if (respect_gitignore) {
+        static const char *names[] = {".gitignore", ".ignore"};
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            char file[PATH_MAX];
+            int64_t file_mtime = 0;
+            if (snprintf(file, sizeof(file), "%s/%s", path, names[i]) <
+                    (int)sizeof(file) &&
+                stat(file, &info) == 0) {
+#ifdef MACOS
+                file_mtime = (int64_t)info.st_mtimespec.tv_sec * 1000000000 +
+                             info.st_mtimespec.tv_nsec;
+#else
+                file_mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 +
+                             info.st_mtim.tv_nsec;
+#endif
+            }
+            hash = index_hash(hash, &file_mtime, sizeof(file_mtime));
+        }
+    }
+    *stamp = (int64_t)hash;
+    return true;
+}
+
+/**
+ * Writes the index to a temporary file, then renames it into place, so that
+ * readers never see a partially-written index.
+ */
+static bool index_write(
+    const char *index_path,
+    uint64_t options_hash,
+    find_result_t *result,
+    index_walk_t *walk
+) {
+    index_trailer_t trailer;
+    memcpy(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic));
+    trailer.version = INDEX_VERSION;
+    trailer.str_size = sizeof(str_t);
+    trailer.options_hash = options_hash;
+    trailer.base = index_base(options_hash);
+    trailer.count = result->count;
+
+    // The candidates table must occupy whole pages, so that it can be
+    // `munmap()`-ed separately from the rest.
+    size_t table_size = result->count * sizeof(str_t);
+    trailer.candidates_size =
+        index_round(table_size ? table_size : 1, sysconf(_SC_PAGESIZE));
+    trailer.bitmasks_offset = trailer.candidates_size;
+    trailer.directories_count = walk->directories_count;
+    trailer.directories_offset =
+        trailer.bitmasks_offset + result->count * sizeof(long);
+    trailer.slab_offset = trailer.directories_offset +
+                          walk->directories_count * sizeof(index_directory_t);
+    size_t paths_size = 0;
+    for (unsigned i = 0; i < result->count; i++) {
+        paths_size += result->files[i].length + 1;
+    }
+    trailer.slab_size = paths_size + walk->bytes_length;
+    size_t trailer_offset =
+        index_round(trailer.slab_offset + trailer.slab_size, 8);
+    trailer.file_size = trailer_offset + sizeof(index_trailer_t);
+
+    char temporary_path[PATH_MAX];
+    if (snprintf(
+            temporary_path,
+            sizeof(temporary_path),
+            "%s.%d",
+            index_path,
+            (int)getpid()
+        ) >= (int)sizeof(temporary_path)) {
+        return false;
+    }
+    FILE *file = fopen(temporary_path, "wb");
+    if (!file) {
+        DEBUG_LOG("index_write(): failed fopen() - %s\n", strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    uintptr_t slab = trailer.base + trailer.slab_offset;
+    size_t offset = 0;
+    for (unsigned i = 0; ok && i < result->count; i++) {
+        str_t record;
+        record.contents = (const char *)(slab + offset);
+        record.length = result->files[i].length;
+        record.capacity = -1;
+        ok = fwrite(&record, sizeof(str_t), 1, file) == 1;
+        offset += record.length + 1;
+    }
+    ok = ok && index_pad(file, trailer.candidates_size - table_size);
+    for (unsigned i = 0; ok && i < result->count; i++) {
+        str_t *candidate = &result->files[i];
+        long bitmask = index_bitmask(candidate->contents, candidate->length);
+        ok = fwrite(&bitmask, sizeof(long), 1, file) == 1;
+    }
+    for (size_t i = 0; ok && i < walk->directories_count; i++) {
+        index_directory_t directory = walk->directories[i];
+        directory.offset += paths_size;
+        ok = fwrite(&directory, sizeof(index_directory_t), 1, file) == 1;
+    }
+    for (unsigned i = 0; ok && i < result->count; i++) {
+        str_t *candidate = &result->files[i];
+        ok = fwrite(candidate->contents, 1, candidate->length, file) ==
+                 candidate->length &&
+             index_pad(file, 1);
+    }
+    ok = ok &&
+         fwrite(walk->bytes, 1, walk->bytes_length, file) ==
+             walk->bytes_length &&
+         index_pad(
+             file, trailer_offset - (trailer.slab_offset + trailer.slab_size)
+         ) &&
+         fwrite(&trailer, sizeof(index_trailer_t), 1, file) == 1;
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (ok && rename(temporary_path, index_path) != 0) {
+        DEBUG_LOG("index_write(): failed rename() - %s\n", strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(temporary_path);
+    }
+    return ok;
+}
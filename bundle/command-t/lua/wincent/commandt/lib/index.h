@@ -0,0 +1,66 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * On-disk index of the results of a file scan, so that a later session can
+ * get candidates without walking the tree again.
+ *
+ * The index is laid out so that it can be `mmap()`-ed and handed straight to
+ * `scanner_new()` without copying:
+ *
+ * - A table of `str_t` records, starting at offset 0 (this becomes the
+ *   scanner's `candidates`). The `contents` pointers assume that the file is
+ *   mapped at a particular base address; if the kernel won't map it there,
+ *   the loader relocates them in a single pass.
+ * - Everything else becomes the scanner's `buffer`: the precomputed bitmask
+ *   for each candidate, a table of directories with their modification
+ *   times, the path slab, and finally a trailer describing the layout.
+ *
+ * An index is valid for as long as none of the directories it records has
+ * been modified (ie. had entries added, removed or renamed), and it is only
+ * used with the same root and scanner options that produced it.
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define index_load commandt_index_load
+#define index_scan commandt_index_scan
+
+#include "commandt.h" /* for scanner_t */
+#include "find.h" /* for find_options_t */
+
+/**
+ * Walks `directory` (see `commandt_file_scanner()`) and writes the results to
+ * an index at `index_path`.
+ *
+ * Returns the scanner, packed as `commandt_file_scanner()` packs its own (see
+ * `scanner_pack()`); failure to write the index is not an error. The caller
+ * should dispose of the scanner with `scanner_free()`.
+ */
+scanner_t *index_scan(
+    const char *directory, const find_options_t *options, const char *index_path
+);
+
+/**
+ * Maps the index at `index_path` and returns a scanner backed by it, after
+ * checking that it was produced from `directory` with the same `options` and
+ * that none of the directories it records have changed since.
+ *
+ * The scanner is not packed: its `candidates` table is part of the mapping
+ * (and so shares pages with the file in the page cache), and comes with
+ * precomputed bitmasks, which packed scanners don't support.
+ *
+ * Returns NULL if the index is missing, stale or unusable. The caller should
+ * dispose of the scanner with `scanner_free()`.
+ */
+scanner_t *index_load(
+    const char *directory, const find_options_t *options, const char *index_path
+);
+
+#endif
@@ -0,0 +1,1113 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "live.h"
+
+#include <stddef.h> /* for NULL */
+
+#ifdef LINUX
+
+#include <errno.h> /* for EAGAIN, EINTR, errno */
+#include <fcntl.h> /* for O_CLOEXEC, O_DIRECTORY, O_RDONLY, open() */
+#include <limits.h> /* for PATH_MAX */
+#include <poll.h> /* for POLLIN, poll() */
+#include <pthread.h> /* for pthread_create(), pthread_mutex_lock() etc */
+#include <stdatomic.h> /* for atomic_bool, atomic_load(), atomic_store() */
+#include <stdint.h> /* for uint32_t */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcmp(), memcpy(), strcmp(), strerror(), strlen() */
+#include <sys/inotify.h> /* for inotify_add_watch(), inotify_init1() etc */
+#include <sys/stat.h> /* for S_ISDIR(), S_ISREG(), stat() */
+#include <unistd.h> /* for close(), pipe(), read(), write() */
+
+#include "debug.h"
+#include "die.h" /* for die() */
+#include "gitignore.h" /* for gitignore_load(), gitignore_match() */
+#include "ignore.h" /* for ignore_match(), ignore_new() */
+#include "scanner.h" /* for scanner_add(), scanner_remove() etc */
+#include "xmalloc.h"
+#include "xmap.h" /* for xmunmap() */
+#include "xstrdup.h" /* for xstrdup() */
+
+// We hear about directories being deleted or moved from their parents, so
+// don't need `IN_DELETE_SELF` or `IN_MOVE_SELF`.
+#define LIVE_EVENTS                                                            \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_EXCL_UNLINK |    \
+     IN_ONLYDIR)
+
+// Size of the buffer used to read events from the inotify file descriptor.
+#define EVENT_BUFFER_SIZE 65536
+
+// Minimum capacity of the path-to-index hash table (must be a power of 2).
+#define SLOTS_INITIAL_CAPACITY 1024
+
+// Don't bother compacting the scanner for fewer tombstones than this.
+#define TOMBSTONES_COMPACT_THRESHOLD 1024
+
+typedef enum {
+    LIVE_ADD,
+    LIVE_REMOVE,
+
+    /**
+     * Removes a directory (or a symbolic link to one), and everything in it.
+     */
+    LIVE_REMOVE_DIRECTORY,
+} live_op_t;
+
+/**
+ * An entry in the log of pending changes.
+ */
+typedef struct {
+    live_op_t op;
+
+    /**
+     * Location of the (NUL-terminated) path in `live_scanner_t.change_bytes`.
+     */
+    size_t offset;
+    size_t length;
+} live_change_t;
+
+/**
+ * A watched directory.
+ */
+typedef struct {
+    /**
+     * Path, in the same form as used for candidates (ie. "" for the root when
+     * scanning the current directory).
+     */
+    char *path;
+    size_t length;
+    unsigned depth;
+
+    /**
+     * Ignore rules for entries in this directory, compiled (on demand) from
+     * the ignore files in this directory and all of its ancestors.
+     */
+    gitignore_t *gitignore;
+    bool gitignore_loaded;
+} live_dir_t;
+
+/**
+ * Slot in the hash table of directories whose contents are being removed by
+ * `live_apply_remove()`; `path` is NULL for empty slots.
+ */
+typedef struct {
+    uint32_t hash;
+    const char *path;
+    size_t length;
+} live_prefix_t;
+
+/**
+ * Slot in the hash table that maps paths to their positions in the scanner's
+ * `candidates` array. We store `index + 1`, so that 0 can mark empty slots.
+ */
+typedef struct {
+    uint32_t hash;
+    unsigned index;
+} live_slot_t;
+
+/**
+ * Context passed to `live_on_directory()` during a walk.
+ */
+typedef struct {
+    live_scanner_t *live;
+
+    /**
+     * Depth (relative to the root of the tree) of the walk's starting point.
+     */
+    unsigned depth;
+
+    /**
+     * Rules inherited from above the walk's starting point, if any.
+     */
+    gitignore_t *gitignore;
+
+    /**
+     * Set if we failed to add a watch.
+     */
+    atomic_bool failed;
+} live_walk_t;
+
+struct live_scanner_t {
+    /**
+     * Root of the tree, normalized as it is in `commandt_find()`: trailing
+     * slashes are removed, and "." is represented as "".
+     */
+    char *root;
+    size_t root_length;
+
+    /**
+     * Copy of the options passed to `live_scanner_new()` (including the
+     * `ignore` patterns, which we own).
+     */
+    find_options_t options;
+    ignore_t *ignore;
+
+    scanner_t *scanner;
+
+    /**
+     * Open-addressed hash table mapping candidate paths to indices.
+     */
+    live_slot_t *slots;
+    size_t slots_capacity;
+    size_t slots_count;
+
+    /**
+     * Protects `changes`, `change_bytes`, `replacement` and `degraded`, which
+     * are written by the background thread and consumed by
+     * `live_scanner_scanner()`.
+     */
+    pthread_mutex_t mutex;
+    live_change_t *changes;
+    unsigned changes_count;
+    unsigned changes_capacity;
+    char *change_bytes;
+    size_t change_bytes_length;
+    size_t change_bytes_capacity;
+
+    /**
+     * Result of a full rescan, waiting to replace the scanner's candidates.
+     */
+    find_result_t *replacement;
+
+    /**
+     * Set when we couldn't watch every directory, at which point we fall
+     * back to rescanning whenever asked for the scanner.
+     */
+    bool degraded;
+
+    int inotify_fd;
+
+    /**
+     * Pipe used to tell the background thread to shut down.
+     */
+    int wake_fds[2];
+    pthread_t thread;
+
+    /**
+     * Protects `dirs`, which are added by `live_on_directory()` (on any of
+     * the walker's threads), and removed by the background thread.
+     */
+    pthread_mutex_t dirs_mutex;
+
+    /**
+     * Watched directories, indexed by watch descriptor.
+     */
+    live_dir_t **dirs;
+    size_t dirs_capacity;
+};
+
+// Forward declarations.
+static bool live_allowed(
+    live_scanner_t *live,
+    live_dir_t *dir,
+    const char *path,
+    size_t length,
+    const char *name,
+    bool directory
+);
+static void live_apply_add(
+    live_scanner_t *live, const char *path, size_t length
+);
+static void live_apply_remove(
+    live_scanner_t *live,
+    const live_change_t *changes,
+    unsigned count,
+    const char *change_bytes
+);
+static void live_apply_remove_one(
+    live_scanner_t *live, const char *path, size_t length
+);
+static void live_dir_free(live_dir_t *dir);
+static gitignore_t *live_dir_gitignore(live_scanner_t *live, live_dir_t *dir);
+static bool live_handle(live_scanner_t *live, struct inotify_event *event);
+static uint32_t live_hash(const char *path, size_t length);
+static void live_index(live_scanner_t *live);
+static bool live_on_directory(const char *path, unsigned depth, void *context);
+static void live_record(
+    live_scanner_t *live, live_op_t op, const char *path, size_t length
+);
+static void live_replace(live_scanner_t *live, find_result_t *result);
+static void live_rescan(live_scanner_t *live);
+static const char *live_root(live_scanner_t *live);
+static size_t live_slot(
+    live_scanner_t *live, const char *path, size_t length, uint32_t hash
+);
+static void live_slot_delete(live_scanner_t *live, size_t slot);
+static bool live_unwatch(
+    live_scanner_t *live, const char *path, size_t length
+);
+static find_result_t *live_walk(
+    live_scanner_t *live,
+    const char *path,
+    unsigned depth,
+    gitignore_t *gitignore,
+    bool *failed
+);
+static void *live_watch(void *arg);
+
+live_scanner_t *live_scanner_new(
+    const char *directory, const find_options_t *options
+) {
+    find_options_t defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        DEBUG_LOG(
+            "live_scanner_new(): failed inotify_init1() - %s\n", strerror(errno)
+        );
+        return NULL;
+    }
+
+    live_scanner_t *live = xcalloc(1, sizeof(live_scanner_t));
+    live->inotify_fd = inotify_fd;
+    if (pipe(live->wake_fds) == -1) {
+        DEBUG_LOG("live_scanner_new(): failed pipe() - %s\n", strerror(errno));
+        close(inotify_fd);
+        free(live);
+        return NULL;
+    }
+
+    live->root = xstrdup(directory);
+    live->root_length = strlen(live->root);
+    while (live->root_length > 1 && live->root[live->root_length - 1] == '/') {
+        live->root[--live->root_length] = '\0';
+    }
+    if (strcmp(live->root, ".") == 0) {
+        live->root[0] = '\0';
+        live->root_length = 0;
+    }
+
+    live->options = *options;
+    live->options.on_directory = NULL;
+    live->options.context = NULL;
+    const char **ignore = xmalloc(options->ignore_count * sizeof(const char *));
+    for (unsigned i = 0; i < options->ignore_count; i++) {
+        ignore[i] = xstrdup(options->ignore[i]);
+    }
+    live->options.ignore = ignore;
+    live->ignore = ignore_new(ignore, options->ignore_count);
+
+    pthread_mutex_init(&live->mutex, NULL);
+    pthread_mutex_init(&live->dirs_mutex, NULL);
+
+    bool failed;
+    find_result_t *result = live_walk(live, live_root(live), 0, NULL, &failed);
+    live->scanner = scanner_new(
+        result->count,
+        result->files,
+        result->files_size,
+        result->buffer,
+        result->buffer_size
+    );
+    live->scanner->duplicate_count = result->duplicate_count;
+    free((void *)result->error);
+    free(result);
+    live_index(live);
+
+    if (failed) {
+        live_unwatch(live, NULL, 0);
+        live->degraded = true;
+    }
+
+    int err = pthread_create(&live->thread, NULL, live_watch, live);
+    if (err != 0) {
+        die("pthread_create() failed", err);
+    }
+
+    return live;
+}
+
+scanner_t *live_scanner_scanner(live_scanner_t *live) {
+    pthread_mutex_lock(&live->mutex);
+    bool degraded = live->degraded;
+    find_result_t *replacement = live->replacement;
+    live_change_t *changes = live->changes;
+    unsigned changes_count = live->changes_count;
+    char *change_bytes = live->change_bytes;
+    live->replacement = NULL;
+    live->changes = NULL;
+    live->changes_count = 0;
+    live->changes_capacity = 0;
+    live->change_bytes = NULL;
+    live->change_bytes_length = 0;
+    live->change_bytes_capacity = 0;
+    pthread_mutex_unlock(&live->mutex);
+
+    if (degraded) {
+        if (replacement) {
+            commandt_find_result_free(replacement);
+        }
+        replacement = commandt_find(live_root(live), &live->options);
+        changes_count = 0;
+    }
+
+    if (replacement) {
+        live_replace(live, replacement);
+    }
+
+    for (unsigned i = 0; i < changes_count;) {
+        if (changes[i].op == LIVE_ADD) {
+            live_apply_add(
+                live, change_bytes + changes[i].offset, changes[i].length
+            );
+            i++;
+            continue;
+        }
+
+        // Removals can be applied in any order relative to one another, so
+        // take each run of them in one go (eg. `rm -r` of a big tree produces
+        // one per directory).
+        unsigned end = i + 1;
+        while (end < changes_count && changes[end].op != LIVE_ADD) {
+            end++;
+        }
+        live_apply_remove(live, changes + i, end - i, change_bytes);
+        i = end;
+    }
+    free(changes);
+    free(change_bytes);
+
+    // Removals leave tombstones behind; once they make up more than half of
+    // the scanner, squeeze them out (at the cost of making matchers start
+    // over).
+    scanner_t *scanner = live->scanner;
+    if (scanner->tombstones > TOMBSTONES_COMPACT_THRESHOLD &&
+        scanner->tombstones > scanner->count / 2) {
+        scanner_compact(scanner);
+        live_index(live);
+    }
+
+    return scanner;
+}
+
+void live_scanner_free(live_scanner_t *live) {
+    if (write(live->wake_fds[1], "", 1) == -1) {
+        DEBUG_LOG(
+            "live_scanner_free(): failed write() - %s\n", strerror(errno)
+        );
+    }
+    int err = pthread_join(live->thread, NULL);
+    if (err != 0) {
+        die("pthread_join() failed", err);
+    }
+
+    // Closing the inotify file descriptor removes all of the watches.
+    close(live->inotify_fd);
+    close(live->wake_fds[0]);
+    close(live->wake_fds[1]);
+    for (size_t i = 0; i < live->dirs_capacity; i++) {
+        if (live->dirs[i]) {
+            live_dir_free(live->dirs[i]);
+        }
+    }
+    free(live->dirs);
+
+    free(live->changes);
+    free(live->change_bytes);
+    if (live->replacement) {
+        commandt_find_result_free(live->replacement);
+    }
+
+    scanner_free(live->scanner);
+    free(live->slots);
+
+    ignore_free(live->ignore);
+    for (unsigned i = 0; i < live->options.ignore_count; i++) {
+        free((void *)live->options.ignore[i]);
+    }
+    free(live->options.ignore);
+
+    pthread_mutex_destroy(&live->mutex);
+    pthread_mutex_destroy(&live->dirs_mutex);
+    free(live->root);
+    free(live);
+}
+
+/**
+ * Applies the same rules as `commandt_find()` to decide whether the entry
+ * `name` in `dir` (whose full path is `path`) belongs in the scanner.
+ */
+static bool live_allowed(
+    live_scanner_t *live,
+    live_dir_t *dir,
+    const char *path,
+    size_t length,
+    const char *name,
+    bool directory
+) {
+    if (live->ignore &&
+        ignore_match(live->ignore, name, strlen(name), directory)) {
+        return false;
+    }
+    if (directory) {
+        if (live->options.max_depth && dir->depth >= live->options.max_depth) {
+            return false;
+        } else if (name[0] == '.' && !live->options.scan_dot_directories) {
+            return false;
+        }
+    }
+    if (live->options.respect_gitignore) {
+        if (strcmp(name, ".git") == 0) {
+            return false;
+        }
+        gitignore_t *gitignore = live_dir_gitignore(live, dir);
+        if (gitignore && gitignore_match(gitignore, path, length, directory)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void live_apply_add(
+    live_scanner_t *live, const char *path, size_t length
+) {
+    scanner_t *scanner = live->scanner;
+    unsigned limit = live->options.max_files;
+    if (limit && scanner->count - scanner->tombstones >= limit) {
+        return;
+    }
+
+    if (live->slots_count * 2 >= live->slots_capacity) {
+        live_index(live);
+    }
+    uint32_t hash = live_hash(path, length);
+    size_t slot = live_slot(live, path, length, hash);
+    if (live->slots[slot].index) {
+        // Already present (eg. created during the initial walk).
+        return;
+    }
+
+    live->slots[slot].hash = hash;
+    live->slots[slot].index = scanner_add(scanner, path, length) + 1;
+    live->slots_count++;
+}
+
+/**
+ * Applies `count` removals (`LIVE_REMOVE` or `LIVE_REMOVE_DIRECTORY`) from
+ * the log. Everything under the removed directories is dropped in a single
+ * pass over the candidates, looking up each candidate's ancestors in a hash
+ * table of the directories, so the cost doesn't grow with their number.
+ */
+static void live_apply_remove(
+    live_scanner_t *live,
+    const live_change_t *changes,
+    unsigned count,
+    const char *change_bytes
+) {
+    size_t capacity = 16;
+    while (capacity < (size_t)count * 2) {
+        capacity *= 2;
+    }
+    size_t mask = capacity - 1;
+    live_prefix_t *prefixes = NULL;
+    for (unsigned i = 0; i < count; i++) {
+        const char *path = change_bytes + changes[i].offset;
+        size_t length = changes[i].length;
+        live_apply_remove_one(live, path, length);
+        if (changes[i].op != LIVE_REMOVE_DIRECTORY) {
+            continue;
+        }
+        if (!prefixes) {
+            prefixes = xcalloc(capacity, sizeof(live_prefix_t));
+        }
+        uint32_t hash = live_hash(path, length);
+        size_t slot = hash & mask;
+        while (prefixes[slot].path) {
+            slot = (slot + 1) & mask;
+        }
+        prefixes[slot].hash = hash;
+        prefixes[slot].path = path;
+        prefixes[slot].length = length;
+    }
+    if (!prefixes) {
+        return;
+    }
+
+    scanner_t *scanner = live->scanner;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t *candidate = &scanner->candidates[i];
+        const char *contents = candidate->contents;
+        if (!contents) {
+            continue;
+        }
+
+        // Hash the candidate incrementally (as `live_hash()` would), and look
+        // up each leading run of path components as we go.
+        uint32_t hash = 2166136261u;
+        for (size_t j = 0; j < candidate->length; j++) {
+            if (contents[j] == '/') {
+                size_t slot = hash & mask;
+                while (prefixes[slot].path &&
+                       (prefixes[slot].hash != hash ||
+                        prefixes[slot].length != j ||
+                        memcmp(prefixes[slot].path, contents, j) != 0)) {
+                    slot = (slot + 1) & mask;
+                }
+                if (prefixes[slot].path) {
+                    live_apply_remove_one(live, contents, candidate->length);
+                    break;
+                }
+            }
+            hash ^= (unsigned char)contents[j];
+            hash *= 16777619u;
+        }
+    }
+    free(prefixes);
+}
+
+/**
+ * Removes `path` from the scanner, if present.
+ */
+static void live_apply_remove_one(
+    live_scanner_t *live, const char *path, size_t length
+) {
+    size_t slot = live_slot(live, path, length, live_hash(path, length));
+    unsigned index = live->slots[slot].index;
+    if (index) {
+        live_slot_delete(live, slot);
+        scanner_remove(live->scanner, index - 1);
+    }
+}
+
+static void live_dir_free(live_dir_t *dir) {
+    // Each directory has its own private chain of rules.
+    gitignore_t *gitignore = dir->gitignore;
+    while (gitignore) {
+        gitignore_t *parent = gitignore->parent;
+        gitignore_free(gitignore);
+        gitignore = parent;
+    }
+    free(dir->path);
+    free(dir);
+}
+
+/**
+ * Returns the ignore rules that apply to entries in `dir`, compiling them
+ * from the ignore files in `dir` and its ancestors if necessary.
+ */
+static gitignore_t *live_dir_gitignore(live_scanner_t *live, live_dir_t *dir) {
+    if (dir->gitignore_loaded) {
+        return dir->gitignore;
+    }
+    dir->gitignore_loaded = true;
+
+    // Work our way down from the root, one path component at a time.
+    char prefix[PATH_MAX];
+    gitignore_t *gitignore = NULL;
+    size_t end = live->root_length;
+    while (true) {
+        memcpy(prefix, dir->path, end);
+        prefix[end] = '\0';
+        int fd = open(end ? prefix : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            gitignore_t *compiled = gitignore_load(
+                fd,
+                end == live->root_length,
+                true,
+                true,
+                end ? end + 1 : 0,
+                gitignore
+            );
+            close(fd);
+            if (compiled) {
+                gitignore = compiled;
+            }
+        }
+        if (end >= dir->length) {
+            break;
+        }
+        end = end ? end + 1 : 0;
+        while (end < dir->length && dir->path[end] != '/') {
+            end++;
+        }
+    }
+
+    dir->gitignore = gitignore;
+    return gitignore;
+}
+
+/**
+ * Records the changes implied by a single inotify `event`.
+ *
+ * Returns false if the event means that we have to start over with a full
+ * rescan.
+ */
+static bool live_handle(live_scanner_t *live, struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        DEBUG_LOG("live_handle(): event queue overflowed\n");
+        return false;
+    }
+
+    // Note that only this thread ever removes directories, so `dir` remains
+    // valid until we return.
+    pthread_mutex_lock(&live->dirs_mutex);
+    live_dir_t *dir = (size_t)event->wd < live->dirs_capacity
+                          ? live->dirs[event->wd]
+                          : NULL;
+    if (dir && (event->mask & IN_IGNORED)) {
+        live->dirs[event->wd] = NULL;
+    }
+    pthread_mutex_unlock(&live->dirs_mutex);
+    if (!dir) {
+        return true;
+    } else if (event->mask & IN_IGNORED) {
+        // Watch was removed because the directory went away.
+        live_dir_free(dir);
+        return true;
+    } else if (!event->len) {
+        return true;
+    }
+
+    const char *name = event->name;
+    size_t name_length = strlen(name);
+    size_t length = dir->length ? dir->length + 1 + name_length : name_length;
+    if (length >= PATH_MAX) {
+        return true;
+    }
+    char path[PATH_MAX];
+    if (dir->length) {
+        memcpy(path, dir->path, dir->length);
+        path[dir->length] = '/';
+    }
+    memcpy(path + length - name_length, name, name_length + 1);
+
+    bool directory = event->mask & IN_ISDIR;
+    if (live->options.respect_gitignore && !directory &&
+        (strcmp(name, ".gitignore") == 0 || strcmp(name, ".ignore") == 0)) {
+        // Rules have changed; simplest to start over.
+        return false;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        // If we were watching it, it was a directory (or a symbolic link to
+        // one).
+        bool watched = live_unwatch(live, path, length);
+        live_record(
+            live,
+            directory || watched ? LIVE_REMOVE_DIRECTORY : LIVE_REMOVE,
+            path,
+            length
+        );
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (!directory) {
+            // Note that this follows symbolic links, as does the walker.
+            struct stat info;
+            if (stat(path, &info) == -1) {
+                return true;
+            } else if (S_ISDIR(info.st_mode)) {
+                directory = true;
+            } else if (!S_ISREG(info.st_mode)) {
+                return true;
+            }
+        }
+        if (!live_allowed(live, dir, path, length, name, directory)) {
+            return true;
+        }
+        if (!directory) {
+            live_record(live, LIVE_ADD, path, length);
+            return true;
+        }
+
+        // New directory (or one moved in from elsewhere); walk it.
+        gitignore_t *gitignore = live->options.respect_gitignore
+                                     ? live_dir_gitignore(live, dir)
+                                     : NULL;
+        bool failed;
+        find_result_t *result =
+            live_walk(live, path, dir->depth + 1, gitignore, &failed);
+        for (unsigned i = 0; i < result->count; i++) {
+            str_t *file = &result->files[i];
+            if (!gitignore || !gitignore_match(
+                                  gitignore, file->contents, file->length, false
+                              )) {
+                live_record(live, LIVE_ADD, file->contents, file->length);
+            }
+        }
+        commandt_find_result_free(result);
+        if (failed) {
+            pthread_mutex_lock(&live->mutex);
+            live->degraded = true;
+            pthread_mutex_unlock(&live->mutex);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t live_hash(const char *path, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * (Re)builds the hash table mapping paths to candidate indices, sizing it
+ * with room to grow.
+ */
+static void live_index(live_scanner_t *live) {
+    scanner_t *scanner = live->scanner;
+    free(live->slots);
+    live->slots_capacity = SLOTS_INITIAL_CAPACITY;
+    while (live->slots_capacity <
+           (size_t)(scanner->count - scanner->tombstones) * 4) {
+        live->slots_capacity *= 2;
+    }
+    live->slots = xcalloc(live->slots_capacity, sizeof(live_slot_t));
+    live->slots_count = 0;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t *candidate = &scanner->candidates[i];
+        if (!candidate->contents) {
+            continue;
+        }
+        uint32_t hash = live_hash(candidate->contents, candidate->length);
+        size_t slot =
+            live_slot(live, candidate->contents, candidate->length, hash);
+        if (!live->slots[slot].index) {
+            live->slots[slot].hash = hash;
+            live->slots[slot].index = i + 1;
+            live->slots_count++;
+        }
+    }
+}
+
+/**
+ * Called by the walker for each directory it is about to walk; adds a watch.
+ */
+static bool live_on_directory(const char *path, unsigned depth, void *context) {
+    live_walk_t *walk = context;
+    live_scanner_t *live = walk->live;
+    depth += walk->depth;
+    size_t length = strlen(path);
+    if (walk->depth) {
+        // Walking a new subdirectory; apply the rules that `commandt_find()`
+        // can't know about because they depend on things above its starting
+        // point.
+        if (live->options.max_depth && depth > live->options.max_depth) {
+            return false;
+        } else if (walk->gitignore &&
+                   gitignore_match(walk->gitignore, path, length, true)) {
+            return false;
+        }
+    }
+
+    int wd = inotify_add_watch(live->inotify_fd, path, LIVE_EVENTS);
+    if (wd == -1) {
+        DEBUG_LOG(
+            "live_on_directory(): failed inotify_add_watch() - %s\n",
+            strerror(errno)
+        );
+        atomic_store(&walk->failed, true);
+        return true;
+    }
+
+    live_dir_t *dir = xmalloc(sizeof(live_dir_t));
+    if (!depth && !live->root_length) {
+        // The walker calls the current directory "."; we call it "".
+        length = 0;
+    }
+    dir->path = xmalloc(length + 1);
+    memcpy(dir->path, path, length);
+    dir->path[length] = '\0';
+    dir->length = length;
+    dir->depth = depth;
+    dir->gitignore = NULL;
+    dir->gitignore_loaded = false;
+
+    pthread_mutex_lock(&live->dirs_mutex);
+    if ((size_t)wd >= live->dirs_capacity) {
+        size_t capacity = live->dirs_capacity ? live->dirs_capacity : 1024;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        live->dirs = xrealloc(live->dirs, capacity * sizeof(live_dir_t *));
+        memset(
+            live->dirs + live->dirs_capacity,
+            0,
+            (capacity - live->dirs_capacity) * sizeof(live_dir_t *)
+        );
+        live->dirs_capacity = capacity;
+    }
+    if (live->dirs[wd]) {
+        // Already watching this directory under another name; keep that one.
+        live_dir_free(dir);
+    } else {
+        live->dirs[wd] = dir;
+    }
+    pthread_mutex_unlock(&live->dirs_mutex);
+
+    return true;
+}
+
+/**
+ * Appends a change to the log, for consumption by `live_scanner_scanner()`.
+ */
+static void live_record(
+    live_scanner_t *live, live_op_t op, const char *path, size_t length
+) {
+    pthread_mutex_lock(&live->mutex);
+    if (live->changes_count == live->changes_capacity) {
+        live->changes_capacity =
+            live->changes_capacity ? live->changes_capacity * 2 : 64;
+        live->changes = xrealloc(
+            live->changes, live->changes_capacity * sizeof(live_change_t)
+        );
+    }
+    if (live->change_bytes_length + length + 1 > live->change_bytes_capacity) {
+        size_t capacity =
+            live->change_bytes_capacity ? live->change_bytes_capacity : 4096;
+        while (live->change_bytes_length + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        live->change_bytes = xrealloc(live->change_bytes, capacity);
+        live->change_bytes_capacity = capacity;
+    }
+    live_change_t *change = &live->changes[live->changes_count++];
+    change->op = op;
+    change->offset = live->change_bytes_length;
+    change->length = length;
+    memcpy(live->change_bytes + live->change_bytes_length, path, length);
+    live->change_bytes[live->change_bytes_length + length] = '\0';
+    live->change_bytes_length += length + 1;
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/**
+ * Swaps the scanner's candidates for those in `result` (which is consumed).
+ */
+static void live_replace(live_scanner_t *live, find_result_t *result) {
+    scanner_t *scanner = live->scanner;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t *candidate = &scanner->candidates[i];
+        if (candidate->capacity >= 0) {
+            free((void *)candidate->contents);
+        }
+    }
+    xmunmap(scanner->candidates, scanner->candidates_size);
+    xmunmap(scanner->buffer, scanner->buffer_size);
+
+    scanner->count = result->count;
+    scanner->candidates = result->files;
+    scanner->candidates_size = result->files_size;
+    scanner->buffer = result->buffer;
+    scanner->buffer_size = result->buffer_size;
+    scanner->tombstones = 0;
+    scanner->clock++;
+    scanner->generation++;
+    free((void *)result->error);
+    free(result);
+
+    live_index(live);
+}
+
+/**
+ * Drops all watches and walks the whole tree again; the result gets swapped
+ * in by the next call to `live_scanner_scanner()`.
+ */
+static void live_rescan(live_scanner_t *live) {
+    live_unwatch(live, NULL, 0);
+    bool failed;
+    find_result_t *result = live_walk(live, live_root(live), 0, NULL, &failed);
+
+    pthread_mutex_lock(&live->mutex);
+    if (live->replacement) {
+        commandt_find_result_free(live->replacement);
+    }
+    live->replacement = result;
+
+    // Anything in the log predates the rescan.
+    live->changes_count = 0;
+    live->change_bytes_length = 0;
+    if (failed) {
+        live->degraded = true;
+    }
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/**
+ * Returns the root in the form that `commandt_find()` expects.
+ */
+static const char *live_root(live_scanner_t *live) {
+    return live->root_length ? live->root : ".";
+}
+
+/**
+ * Returns the slot in which `path` is stored, or else the empty slot where it
+ * would go.
+ */
+static size_t live_slot(
+    live_scanner_t *live, const char *path, size_t length, uint32_t hash
+) {
+    str_t *candidates = live->scanner->candidates;
+    size_t mask = live->slots_capacity - 1;
+    size_t slot = hash & mask;
+    while (live->slots[slot].index) {
+        live_slot_t *entry = &live->slots[slot];
+        if (entry->hash == hash) {
+            str_t *candidate = &candidates[entry->index - 1];
+            if (candidate->length == length &&
+                memcmp(candidate->contents, path, length) == 0) {
+                break;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Empties `slot`, shifting later members of the same probe sequence back so
+ * that lookups don't need tombstones.
+ */
+static void live_slot_delete(live_scanner_t *live, size_t slot) {
+    size_t mask = live->slots_capacity - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; live->slots[next].index;
+         next = (next + 1) & mask) {
+        size_t home = live->slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            live->slots[hole] = live->slots[next];
+            hole = next;
+        }
+    }
+    live->slots[hole].index = 0;
+    live->slots_count--;
+}
+
+/**
+ * Stops watching `path` and everything under it (or everything, if `path` is
+ * NULL).
+ *
+ * Returns true if we were watching anything there.
+ */
+static bool live_unwatch(
+    live_scanner_t *live, const char *path, size_t length
+) {
+    bool found = false;
+    pthread_mutex_lock(&live->dirs_mutex);
+    for (size_t wd = 0; wd < live->dirs_capacity; wd++) {
+        live_dir_t *dir = live->dirs[wd];
+        if (!dir) {
+            continue;
+        } else if (path &&
+                   !(dir->length >= length &&
+                     memcmp(dir->path, path, length) == 0 &&
+                     (dir->length == length || dir->path[length] == '/'))) {
+            continue;
+        }
+        inotify_rm_watch(live->inotify_fd, wd);
+        live->dirs[wd] = NULL;
+        live_dir_free(dir);
+        found = true;
+    }
+    pthread_mutex_unlock(&live->dirs_mutex);
+    return found;
+}
+
+/**
+ * Walks `path` (at `depth` levels below the root), watching every directory
+ * we visit. `gitignore` holds the rules inherited from above `path`, if any.
+ *
+ * Sets `failed` if we couldn't watch every directory.
+ */
+static find_result_t *live_walk(
+    live_scanner_t *live,
+    const char *path,
+    unsigned depth,
+    gitignore_t *gitignore,
+    bool *failed
+) {
+    live_walk_t walk;
+    walk.live = live;
+    walk.depth = depth;
+    walk.gitignore = gitignore;
+    atomic_init(&walk.failed, false);
+
+    find_options_t options = live->options;
+    options.on_directory = live_on_directory;
+    options.context = &walk;
+    if (depth) {
+        // `live_on_directory()` applies `max_depth` relative to the root.
+        options.max_depth = 0;
+        options.max_files = 0;
+    }
+
+    find_result_t *result = commandt_find(path, &options);
+    if (result->error) {
+        DEBUG_LOG("live_walk(): %s\n", result->error);
+    }
+    *failed = atomic_load(&walk.failed);
+    return result;
+}
+
+/**
+ * Background thread: reads events until told to stop.
+ */
+static void *live_watch(void *arg) {
+    live_scanner_t *live = arg;
+    char *events = xmalloc(EVENT_BUFFER_SIZE);
+    struct pollfd fds[2];
+    fds[0].fd = live->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = live->wake_fds[0];
+    fds[1].events = POLLIN;
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG_LOG("live_watch(): failed poll() - %s\n", strerror(errno));
+            break;
+        } else if (fds[1].revents) {
+            break;
+        }
+
+        ssize_t read_count = read(live->inotify_fd, events, EVENT_BUFFER_SIZE);
+        if (read_count == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            DEBUG_LOG("live_watch(): failed read() - %s\n", strerror(errno));
+            break;
+        }
+        bool rescan = false;
+        for (char *cursor = events; cursor < events + read_count && !rescan;) {
+            struct inotify_event *event = (struct inotify_event *)cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+            rescan = !live_handle(live, event);
+        }
+        if (rescan) {
+            live_rescan(live);
+        }
+    }
+    free(events);
+    return NULL;
+}
+
+#else
+
+live_scanner_t *live_scanner_new(
+    const char *directory, const find_options_t *options
+) {
+    return NULL;
+}
+
+scanner_t *live_scanner_scanner(live_scanner_t *live) {
+    return NULL;
+}
+
+void live_scanner_free(live_scanner_t *live) {
+}
+
+#endif
@@ -0,0 +1,61 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A long-lived file scanner that keeps itself up-to-date.
+ *
+ * After an initial walk (via `commandt_find()`), the scanner registers an
+ * inotify watch on every directory it walked, and a background thread turns
+ * the resulting events into a log of changes (files added, files removed,
+ * directories removed). The log is applied to the scanner's candidates on
+ * the caller's thread, the next time it calls `live_scanner_scanner()`; this
+ * means that the candidates never change underneath a running matcher.
+ *
+ * If the kernel's event queue overflows, the background thread walks the
+ * whole tree again and the result replaces the candidates wholesale. If we
+ * can't watch every directory (eg. because `fs.inotify.max_user_watches` is
+ * too low), the scanner gives up on watching and instead rescans on every call
+ * to `live_scanner_scanner()`.
+ *
+ * Only available on Linux.
+ */
+
+#ifndef LIVE_H
+#define LIVE_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define live_scanner_free commandt_live_scanner_free
+#define live_scanner_new commandt_live_scanner_new
+#define live_scanner_scanner commandt_live_scanner_scanner
+
+#include "commandt.h" /* for scanner_t */
+#include "find.h" /* for find_options_t */
+
+typedef struct live_scanner_t live_scanner_t;
+
+/**
+ * Walks `directory` using `options` (see `commandt_find()`; `on_directory`
+ * and `context` are ignored) and starts watching it for changes.
+ *
+ * Returns NULL if watching is not supported on this platform. The caller
+ * should dispose of the result with `live_scanner_free()`.
+ */
+live_scanner_t *live_scanner_new(
+    const char *directory, const find_options_t *options
+);
+
+/**
+ * Applies any pending changes and returns the up-to-date scanner.
+ *
+ * The scanner is owned by `live`, and remains valid until `live` is freed.
+ * Whenever its candidates change, its `clock` is incremented.
+ */
+scanner_t *live_scanner_scanner(live_scanner_t *live);
+
+void live_scanner_free(live_scanner_t *live);
+
+#endif
@@ -0,0 +1,516 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "manifest.h"
+
+#include <errno.h> /* for EINTR, errno */
+#include <fcntl.h> /* for O_CLOEXEC, O_RDONLY, open() */
+#include <stdbool.h> /* for bool, false, true */
+#include <stdlib.h> /* for qsort() */
+#include <string.h> /* for memchr(), memcmp(), memcpy(), memmove() etc */
+#include <sys/stat.h> /* for fstat() */
+#include <sys/types.h> /* for ssize_t */
+#include <unistd.h> /* for close(), read() */
+
+#include "debug.h"
+#include "scanner.h" /* for scanner_new(), scanner_pack() */
+#include "xmalloc.h"
+#include "xmap.h" /* for xmap(), xmremap(), xmunmap() */
+
+// Initial size of the `candidates` slab; it grows as needed, and is trimmed to
+// fit at the end.
+#define INITIAL_CANDIDATES 4096
+
+/**
+ * Scanning state.
+ */
+typedef struct {
+    str_t *candidates;
+    size_t candidates_size;
+    unsigned count;
+    const char *strip;
+    size_t strip_length;
+
+    /**
+     * Where the next path assembled by `manifest_entry()` goes, in the space
+     * after the manifest's contents.
+     */
+    char *tail;
+} manifest_t;
+
+// Forward declarations.
+static void manifest_add(manifest_t *manifest, const char *path, size_t length);
+static int manifest_cmp(const void *a, const void *b);
+static void manifest_compile_commands(
+    manifest_t *manifest, char *start, char *end
+);
+static long manifest_code_unit(const char *string, const char *end);
+static void manifest_dedup(manifest_t *manifest);
+static void manifest_entry(
+    manifest_t *manifest,
+    const char *directory,
+    size_t directory_length,
+    const char *file,
+    size_t file_length
+);
+static int manifest_hex(char c);
+static void manifest_list(
+    manifest_t *manifest, const char *start, const char *end
+);
+static size_t manifest_normalize(char *path, size_t length);
+static size_t manifest_unescape(char *string, size_t length);
+
+scanner_t *manifest_scanner_new(
+    const char *path, manifest_format_t format, const char *strip
+) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG_LOG(
+            "manifest_scanner_new(): failed open() - %s\n", strerror(errno)
+        );
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        DEBUG_LOG(
+            "manifest_scanner_new(): failed fstat() - %s\n", strerror(errno)
+        );
+        close(fd);
+        return NULL;
+    }
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return xcalloc(1, sizeof(scanner_t));
+    }
+
+    // Read the manifest into a slab of our own rather than mapping the file:
+    // the tool that produces it may rewrite it at any time, and touching the
+    // pages of a mapped file that has since been truncated raises SIGBUS.
+    // Compilation databases need room after the contents for the paths that
+    // `manifest_entry()` assembles, none of which is longer than the two
+    // (quoted) strings it is made from.
+    size_t buffer_size =
+        xmap_round(format == MANIFEST_FORMAT_LIST ? size : size * 2);
+    char *buffer = xmap(buffer_size);
+    size_t length = 0;
+    while (length < size) {
+        ssize_t count = read(fd, buffer + length, size - length);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1) {
+            DEBUG_LOG(
+                "manifest_scanner_new(): failed read() - %s\n", strerror(errno)
+            );
+            close(fd);
+            xmunmap(buffer, buffer_size);
+            return NULL;
+        } else if (count == 0) {
+            // Truncated since we called `fstat()`.
+            break;
+        }
+        length += count;
+    }
+    close(fd);
+
+    manifest_t manifest;
+    manifest.candidates_size = INITIAL_CANDIDATES * sizeof(str_t);
+    manifest.candidates = xmap(manifest.candidates_size);
+    manifest.count = 0;
+    manifest.strip = strip;
+    manifest.strip_length = strip ? strlen(strip) : 0;
+    manifest.tail = buffer + length;
+    if (format == MANIFEST_FORMAT_LIST) {
+        manifest_list(&manifest, buffer, buffer + length);
+    } else {
+        manifest_compile_commands(&manifest, buffer, buffer + length);
+
+        // A file built in more than one configuration appears more than once.
+        manifest_dedup(&manifest);
+    }
+    DEBUG_LOG(
+        "manifest_scanner_new(): %u paths in %llu bytes\n",
+        manifest.count,
+        (unsigned long long)length
+    );
+
+    // Give back what we didn't use; shrinking never moves.
+    size_t used = xmap_round(manifest.tail - buffer);
+    if (used && used < buffer_size) {
+        buffer = xmremap(buffer, buffer_size, used);
+        buffer_size = used;
+    }
+
+    scanner_t *scanner = scanner_new(
+        manifest.count,
+        manifest.candidates,
+        manifest.candidates_size,
+        buffer,
+        buffer_size
+    );
+    scanner_pack(scanner);
+    return scanner;
+}
+
+/**
+ * Records a path, after stripping off any prefix. The prefix must end at a
+ * path component boundary, so that stripping "/src/build" leaves
+ * "/src/buildtools/x" alone.
+ */
+static void manifest_add(
+    manifest_t *manifest, const char *path, size_t length
+) {
+    size_t strip_length = manifest->strip_length;
+    if (strip_length && length >= strip_length &&
+        memcmp(path, manifest->strip, strip_length) == 0 &&
+        (manifest->strip[strip_length - 1] == '/' || length == strip_length ||
+         path[strip_length] == '/')) {
+        path += strip_length;
+        length -= strip_length;
+        if (length && path[0] == '/') {
+            path++;
+            length--;
+        }
+    }
+    if (!length) {
+        return;
+    }
+    if ((manifest->count + 1) * sizeof(str_t) > manifest->candidates_size) {
+        size_t candidates_size = manifest->candidates_size * 2;
+        manifest->candidates = xmremap(
+            manifest->candidates, manifest->candidates_size, candidates_size
+        );
+        manifest->candidates_size = candidates_size;
+    }
+    str_init(&manifest->candidates[manifest->count++], path, length);
+}
+
+/**
+ * Comparison function for use with `qsort()`.
+ */
+static int manifest_cmp(const void *a, const void *b) {
+    const str_t *a_str = (const str_t *)a;
+    const str_t *b_str = (const str_t *)b;
+    size_t length =
+        a_str->length < b_str->length ? a_str->length : b_str->length;
+    int order = memcmp(a_str->contents, b_str->contents, length);
+    if (order) {
+        return order;
+    }
+    return a_str->length < b_str->length ? -1 : a_str->length > b_str->length;
+}
+
+/**
+ * Extracts the "file" members from the compilation database between `start`
+ * and `end`, joining relative ones to the "directory" member of the same
+ * entry.
+ *
+ * This is not a general JSON parser, but it does follow the nesting of arrays
+ * and objects (skipping over strings, so that brackets inside them don't
+ * count), which is enough to pick out the members of each object in the flat
+ * array that build systems write. A string is a key if a colon follows it;
+ * "file" appearing anywhere else (eg. as an element of an "arguments" array)
+ * is ignored.
+ */
+static void manifest_compile_commands(
+    manifest_t *manifest, char *start, char *end
+) {
+    unsigned depth = 0;
+    const char *key = NULL;
+    size_t key_length = 0;
+    const char *directory = NULL;
+    size_t directory_length = 0;
+    const char *file = NULL;
+    size_t file_length = 0;
+    char *cursor = start;
+    while (cursor < end) {
+        char c = *cursor++;
+        if (c == '"') {
+            char *value = cursor;
+            bool escaped = false;
+            while (cursor < end && *cursor != '"') {
+                if (*cursor == '\\') {
+                    escaped = true;
+                    cursor++;
+                }
+                cursor++;
+            }
+            if (cursor >= end) {
+                DEBUG_LOG("manifest_compile_commands(): unterminated string\n");
+                break;
+            }
+            size_t length = cursor - value;
+            cursor++;
+            if (depth != 2) {
+                // Not a member of an entry.
+                continue;
+            }
+            while (cursor < end && (*cursor == ' ' || *cursor == '\t' ||
+                                    *cursor == '\n' || *cursor == '\r')) {
+                cursor++;
+            }
+            if (cursor < end && *cursor == ':') {
+                key = value;
+                key_length = length;
+                cursor++;
+                continue;
+            } else if (!key) {
+                continue;
+            }
+            if (escaped) {
+                length = manifest_unescape(value, length);
+            }
+            if (key_length == 4 && memcmp(key, "file", 4) == 0) {
+                file = value;
+                file_length = length;
+            } else if (key_length == 9 && memcmp(key, "directory", 9) == 0) {
+                directory = value;
+                directory_length = length;
+            }
+            key = NULL;
+        } else if (c == '[' || c == '{') {
+            if (++depth == 2) {
+                directory = NULL;
+                file = NULL;
+            }
+            key = NULL;
+        } else if (c == ']' || c == '}') {
+            if (depth == 2 && file) {
+                manifest_entry(
+                    manifest, directory, directory_length, file, file_length
+                );
+                file = NULL;
+            }
+            if (depth) {
+                depth--;
+            }
+        } else if (c == ',') {
+            key = NULL;
+        }
+    }
+}
+
+/**
+ * Sorts the candidates, and drops any duplicates.
+ */
+static void manifest_dedup(manifest_t *manifest) {
+    if (manifest->count < 2) {
+        return;
+    }
+    str_t *candidates = manifest->candidates;
+    qsort(candidates, manifest->count, sizeof(str_t), manifest_cmp);
+    unsigned count = 1;
+    for (unsigned i = 1; i < manifest->count; i++) {
+        if (manifest_cmp(&candidates[count - 1], &candidates[i]) != 0) {
+            candidates[count++] = candidates[i];
+        }
+    }
+    manifest->count = count;
+}
+
+/**
+ * Records the `file` of a compilation database entry; if it is relative, it is
+ * taken to be relative to `directory` (which may be NULL), and the joined path
+ * is assembled at `manifest->tail`.
+ */
+static void manifest_entry(
+    manifest_t *manifest,
+    const char *directory,
+    size_t directory_length,
+    const char *file,
+    size_t file_length
+) {
+    if (!directory || !directory_length || (file_length && file[0] == '/')) {
+        manifest_add(manifest, file, file_length);
+        return;
+    }
+    char *path = manifest->tail;
+    memcpy(path, directory, directory_length);
+    size_t length = directory_length;
+    path[length++] = '/';
+    memcpy(path + length, file, file_length);
+    length = manifest_normalize(path, length + file_length);
+    path[length] = '\0';
+    manifest->tail = path + length + 1;
+    manifest_add(manifest, path, length);
+}
+
+/**
+ * Splits the list between `start` and `end` into paths.
+ *
+ * The delimiter is whichever of NUL or newline occurs first, after which
+ * `memchr()` (which is vectorized in any libc worth its salt) does the work
+ * of finding each record.
+ */
+static void manifest_list(
+    manifest_t *manifest, const char *start, const char *end
+) {
+    char delimiter = '\n';
+    for (const char *cursor = start; cursor < end; cursor++) {
+        if (*cursor == '\0') {
+            delimiter = '\0';
+            break;
+        } else if (*cursor == '\n') {
+            break;
+        }
+    }
+    while (start < end) {
+        const char *next = memchr(start, delimiter, end - start);
+        const char *record_end = next ? next : end;
+        size_t length = record_end - start;
+        if (delimiter == '\n' && length && start[length - 1] == '\r') {
+            length--;
+        }
+        manifest_add(manifest, start, length);
+        if (!next) {
+            break;
+        }
+        start = next + 1;
+    }
+}
+
+/**
+ * Drops "." components (and empty ones) from the `length` bytes at `path`,
+ * and folds each "name/.." pair, in place, returning the new length. This is
+ * purely lexical, but then build systems don't go through symbolic links when
+ * they refer to "../src/foo.c", and it means that a file built from several
+ * build directories is still recognized as a single file.
+ */
+static size_t manifest_normalize(char *path, size_t length) {
+    size_t root = length && path[0] == '/' ? 1 : 0;
+
+    // Leading ".." components of a relative path can't be folded, so they
+    // are written out, and `floor` marks the end of them.
+    size_t floor = root;
+    size_t output = root;
+    size_t input = root;
+    while (input < length) {
+        size_t end = input;
+        while (end < length && path[end] != '/') {
+            end++;
+        }
+        size_t component_length = end - input;
+        bool dot = component_length == 1 && path[input] == '.';
+        bool dot_dot = component_length == 2 && path[input] == '.' &&
+                       path[input + 1] == '.';
+        if (dot_dot && output > floor) {
+            while (output > floor && path[output - 1] != '/') {
+                output--;
+            }
+            if (output > floor) {
+                output--;
+            }
+        } else if (dot_dot && root) {
+            // "/.." is "/".
+        } else if (component_length && !dot) {
+            if (output > root) {
+                path[output++] = '/';
+            }
+            memmove(path + output, path + input, component_length);
+            output += component_length;
+            if (dot_dot) {
+                floor = output;
+            }
+        }
+        input = end + 1;
+    }
+    return output;
+}
+
+/**
+ * Returns the value (0-15) of the hexadecimal digit `c`, or -1.
+ */
+static int manifest_hex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Reads the 4 hexadecimal digits of a "\u" escape at `string`, returning -1
+ * if they are invalid (or if there aren't 4 of them before `end`).
+ */
+static long manifest_code_unit(const char *string, const char *end) {
+    if (end - string < 4) {
+        return -1;
+    }
+    long value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = manifest_hex(string[i]);
+        if (digit == -1) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+/**
+ * Decodes the JSON string escapes in the `length` bytes at `string`, in place
+ * (the result is never longer than the input), and returns the new length.
+ */
+static size_t manifest_unescape(char *string, size_t length) {
+    const char *input = string;
+    const char *end = string + length;
+    char *output = string;
+    while (input < end) {
+        if (*input != '\\' || input + 1 == end) {
+            *output++ = *input++;
+            continue;
+        }
+        char c = input[1];
+        input += 2;
+        if (c == 'b') {
+            *output++ = '\b';
+        } else if (c == 'f') {
+            *output++ = '\f';
+        } else if (c == 'n') {
+            *output++ = '\n';
+        } else if (c == 'r') {
+            *output++ = '\r';
+        } else if (c == 't') {
+            *output++ = '\t';
+        } else if (c == 'u') {
+            long code_point = manifest_code_unit(input, end);
+            if (code_point == -1) {
+                continue;
+            }
+            input += 4;
+            if (code_point >= 0xd800 && code_point <= 0xdbff &&
+                end - input >= 6 && input[0] == '\\' && input[1] == 'u') {
+                long low = manifest_code_unit(input + 2, end);
+                if (low >= 0xdc00 && low <= 0xdfff) {
+                    code_point = 0x10000 + ((code_point - 0xd800) << 10) +
+                                 (low - 0xdc00);
+                    input += 6;
+                }
+            }
+            if (code_point < 0x80) {
+                *output++ = code_point;
+            } else if (code_point < 0x800) {
+                *output++ = 0xc0 | (code_point >> 6);
+                *output++ = 0x80 | (code_point & 0x3f);
+            } else if (code_point < 0x10000) {
+                *output++ = 0xe0 | (code_point >> 12);
+                *output++ = 0x80 | ((code_point >> 6) & 0x3f);
+                *output++ = 0x80 | (code_point & 0x3f);
+            } else {
+                *output++ = 0xf0 | (code_point >> 18);
+                *output++ = 0x80 | ((code_point >> 12) & 0x3f);
+                *output++ = 0x80 | ((code_point >> 6) & 0x3f);
+                *output++ = 0x80 | (code_point & 0x3f);
+            }
+        } else {
+            // '"', '\\' and '/' stand for themselves.
+            *output++ = c;
+        }
+    }
+    return output - string;
+}
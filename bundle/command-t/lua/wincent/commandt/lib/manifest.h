@@ -0,0 +1,57 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A scanner over a file list ("manifest") produced by some other tool, such as
+ * a build system.
+ *
+ * Rather than running `cat` and copying the bytes through a pipe, the manifest
+ * is read straight into the scanner's slab, and the candidates point into it.
+ * (It isn't `mmap()`-ed, because the tool that writes it may truncate or
+ * rewrite it while the scanner is still in use.)
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define manifest_scanner_new commandt_manifest_scanner_new
+
+#include "commandt.h" /* for scanner_t */
+
+typedef enum {
+    /**
+     * One path per line, or per NUL byte (whichever comes first in the file
+     * determines which). Carriage returns before newlines are ignored, as are
+     * blank lines.
+     */
+    MANIFEST_FORMAT_LIST,
+
+    /**
+     * A JSON compilation database ("compile_commands.json"); the candidates
+     * are the "file" members of its entries (joined to the entry's
+     * "directory", if relative), each reported once.
+     */
+    MANIFEST_FORMAT_COMPILE_COMMANDS,
+} manifest_format_t;
+
+/**
+ * Returns a scanner with the paths listed in the manifest at `path`, or NULL
+ * if it can't be read.
+ *
+ * If `strip` is non-NULL, it is removed from the start of every path that
+ * begins with it as a whole directory (along with any "/" that follows it),
+ * so that absolute paths can be shown relative to a project root, for
+ * example.
+ *
+ * The caller should dispose of the scanner with `scanner_free()`.
+ */
+scanner_t *manifest_scanner_new(
+    const char *path, manifest_format_t format, const char *strip
+);
+
+#endif
@@ -9,13 +9,14 @@
 #include <pthread.h> /* for pthread_create, pthread_join etc */
 #include <stdbool.h> /* for bool */
 #include <stddef.h> /* for size_t */
-#include <stdlib.h> /* for qsort(), NULL */
+#include <stdlib.h> /* for NULL */
 #include <string.h> /* for strncmp() */
 
 #include "commandt.h"
 #include "debug.h"
 #include "die.h"
 #include "heap.h"
+#include "paths.h" /* for paths_bitmask(), paths_get() */
 #include "scanner.h"
 #include "score.h"
 #include "str.h" /* for str_t */
@@ -38,11 +39,10 @@ typedef struct {
 
 // Forward declarations.
 static long calculate_bitmask(const char *str, unsigned long length);
-static int cmp_alpha(const void *a, const void *b);
-static int cmp_alpha_p(const void *a, const void *b);
-static int cmp_score(const void *a, const void *b);
-static int cmp_score_p(const void *a, const void *b);
+static int cmp_alpha(const void *a, const void *b, void *context);
+static int cmp_score(const void *a, const void *b, void *context);
 static void *get_matches(void *worker_args);
+static void sync_haystacks(matcher_t *matcher);
 
 matcher_t *commandt_matcher_new(
     scanner_t *scanner,
@@ -63,13 +63,14 @@ matcher_t *commandt_matcher_new(
 
     matcher_t *matcher = xmalloc(sizeof(matcher_t));
     matcher->scanner = scanner;
-    matcher->haystacks = xmalloc(scanner->count * sizeof(haystack_t));
-
-    for (unsigned i = 0; i < scanner->count; i++) {
-        matcher->haystacks[i].candidate = &scanner->candidates[i];
-        matcher->haystacks[i].bitmask = UNSET_BITMASK;
-        matcher->haystacks[i].score = UNSET_SCORE;
-    }
+    matcher->haystacks_capacity = scanner->count - scanner->tombstones;
+    matcher->haystacks =
+        xmalloc(matcher->haystacks_capacity * sizeof(haystack_t));
+    matcher->haystacks_count = 0;
+    matcher->generation = scanner->generation;
+    matcher->seen = 0;
+    matcher->tombstones = 0;
+    matcher->candidates = scanner->candidates;
 
     matcher->always_show_dot_files = always_show_dot_files;
     matcher->ignore_case = ignore_case;
@@ -85,6 +86,8 @@ matcher_t *commandt_matcher_new(
     matcher->last_needle = NULL;
     matcher->last_needle_length = 0;
 
+    sync_haystacks(matcher);
+
     return matcher;
 }
 
@@ -97,8 +100,10 @@ void commandt_matcher_free(matcher_t *matcher) {
 }
 
 result_t *commandt_matcher_run(matcher_t *matcher, const char *needle) {
-    scanner_t *scanner = matcher->scanner;
-    unsigned candidate_count = scanner->count;
+    if (matcher->scanner->clock != matcher->clock) {
+        sync_haystacks(matcher);
+    }
+    unsigned candidate_count = matcher->haystacks_count;
     unsigned limit = matcher->limit;
     unsigned matches_count = 0;
 
@@ -145,11 +150,11 @@ result_t *commandt_matcher_run(matcher_t *matcher, const char *needle) {
     matcher->needle = needle_copy;
     matcher->needle_length = needle_length;
 
-    if (matcher->last_needle) {
-        // Will compare against previously computed haystack bitmasks.
-        matcher->needle_bitmask =
-            calculate_bitmask(matcher->needle, needle_length);
+    // Will compare against previously computed (or precomputed) haystack
+    // bitmasks.
+    matcher->needle_bitmask = calculate_bitmask(matcher->needle, needle_length);
 
+    if (matcher->last_needle) {
         // Check whether current search extends previous search; if so, we can
         // skip all the non-matches from last time without looking at them.
         bool is_extension = false;
@@ -226,11 +231,23 @@ result_t *commandt_matcher_run(matcher_t *matcher, const char *needle) {
     free(threads);
     free(worker_args);
 
-    if (needle_length == 0 || (needle_length == 1 && matcher->needle[0] == '.')) {
-        // Alphabetic order if search string is only "" or "."
-        qsort(matches, matches_count, sizeof(haystack_t *), cmp_alpha_p);
-    } else {
-        qsort(matches, matches_count, sizeof(haystack_t *), cmp_score_p);
+    // Alphabetic order if search string is only "" or ".". We sort with a
+    // heap rather than `qsort()` so that the comparators can get at the
+    // scanner; the heap's root is always the last of the remaining matches,
+    // so the array gets filled in from the end.
+    scanner_t *scanner = matcher->scanner;
+    bool alpha =
+        needle_length == 0 || (needle_length == 1 && matcher->needle[0] == '.');
+    if (matches_count > 1) {
+        heap_t *sorted =
+            heap_new(matches_count, alpha ? cmp_alpha : cmp_score, scanner);
+        for (unsigned i = 0; i < matches_count; i++) {
+            heap_insert(sorted, matches[i]);
+        }
+        for (unsigned i = matches_count; i > 0; i--) {
+            matches[i - 1] = heap_extract(sorted);
+        }
+        heap_free(sorted);
     }
 
     result_t *results = xmalloc(sizeof(result_t));
@@ -239,9 +256,34 @@ result_t *commandt_matcher_run(matcher_t *matcher, const char *needle) {
     results->match_count = 0;
     results->candidate_count = candidate_count;
 
+    results->strings = NULL;
+    results->buffer = NULL;
+    paths_t *paths = scanner->paths;
+    size_t offset = 0;
+    if (paths || scanner->handles) {
+        results->strings = xmalloc(count * sizeof(str_t));
+    }
+    if (paths) {
+        results->buffer = xmalloc(count * (paths->max_length + 1));
+    }
+
     for (long i = 0; i < count && results->match_count <= limit; i++) {
         if (matches[i]->score > 0.0f) {
-            results->matches[results->match_count++] = matches[i]->candidate;
+            str_t *candidate = matches[i]->candidate;
+            if (!candidate && paths) {
+                // Reassemble the path from the compressed scanner.
+                candidate = &results->strings[results->match_count];
+                candidate->contents = results->buffer + offset;
+                candidate->length = paths_get(
+                    paths, matches[i]->index, results->buffer + offset
+                );
+                candidate->capacity = -1;
+                offset += candidate->length + 1;
+            } else if (!candidate) {
+                candidate = &results->strings[results->match_count];
+                *candidate = scanner_get(scanner, matches[i]->index);
+            }
+            results->matches[results->match_count++] = candidate;
         }
     }
 
@@ -257,6 +299,8 @@ result_t *commandt_matcher_run(matcher_t *matcher, const char *needle) {
 
 void commandt_result_free(result_t *result) {
     free(result->matches);
+    free(result->strings);
+    free(result->buffer);
     free(result);
 }
 
@@ -273,15 +317,28 @@ static long calculate_bitmask(const char *str, unsigned long length) {
 }
 
 /**
- * Comparison function for use with `heap_new()`.
+ * Comparison function for use with `heap_new()`; `context` is the scanner.
  */
-static int cmp_alpha(const void *a, const void *b) {
-    str_t *a_str = ((haystack_t *)a)->candidate;
-    str_t *b_str = ((haystack_t *)b)->candidate;
-    const char *a_ptr = a_str->contents;
-    const char *b_ptr = b_str->contents;
-    size_t a_len = a_str->length;
-    size_t b_len = b_str->length;
+static int cmp_alpha(const void *a, const void *b, void *context) {
+    const haystack_t *a_haystack = a;
+    const haystack_t *b_haystack = b;
+    const scanner_t *scanner = context;
+    if (scanner->paths) {
+        // Compressed scanners store candidates in sorted order.
+        unsigned a_index = a_haystack->index;
+        unsigned b_index = b_haystack->index;
+        return a_index < b_index ? -1 : a_index > b_index;
+    }
+    str_t a_str = a_haystack->candidate
+                      ? *a_haystack->candidate
+                      : scanner_get(scanner, a_haystack->index);
+    str_t b_str = b_haystack->candidate
+                      ? *b_haystack->candidate
+                      : scanner_get(scanner, b_haystack->index);
+    const char *a_ptr = a_str.contents;
+    const char *b_ptr = b_str.contents;
+    size_t a_len = a_str.length;
+    size_t b_len = b_str.length;
     int order = strncmp(a_ptr, b_ptr, b_len);
     if (order == 0) {
         return a_len - b_len; // Shorter string wins.
@@ -291,9 +348,9 @@ static int cmp_alpha(const void *a, const void *b) {
 }
 
 /**
- * Comparison function for use with `heap_new()`.
+ * Comparison function for use with `heap_new()`; `context` is the scanner.
  */
-static int cmp_score(const void *a, const void *b) {
+static int cmp_score(const void *a, const void *b, void *context) {
     float a_score = ((haystack_t *)a)->score;
     float b_score = ((haystack_t *)b)->score;
     if (a_score > b_score) {
@@ -301,28 +358,10 @@ static int cmp_score(const void *a, const void *b) {
     } else if (a_score < b_score) {
         return 1; // `b` should appear before `a`.
     } else {
-        return cmp_alpha(a, b);
+        return cmp_alpha(a, b, context);
     }
 }
 
-/**
- * Comparison function for use with `qsort()`.
- */
-static int cmp_alpha_p(const void *a, const void *b) {
-    haystack_t *a_haystack = *((haystack_t **)a);
-    haystack_t *b_haystack = *((haystack_t **)b);
-    return cmp_alpha(a_haystack, b_haystack);
-}
-
-/**
- * Comparison function for use with `qsort()`.
- */
-static int cmp_score_p(const void *a, const void *b) {
-    haystack_t *a_haystack = *((haystack_t **)a);
-    haystack_t *b_haystack = *((haystack_t **)b);
-    return cmp_score(a_haystack, b_haystack);
-}
-
 static void *get_matches(void *worker_args) {
     unsigned worker_count = ((worker_args_t *)worker_args)->worker_count;
     unsigned worker_index = ((worker_args_t *)worker_args)->worker_index;
@@ -332,24 +371,54 @@ static void *get_matches(void *worker_args) {
     // Reserve one extra slot so that we can do an insert-then-extract even
     // when "full" (effectively allows use of min-heap to maintain a
     // top-"limit" list of items).
-    heap_t *heap = heap_new(matcher->limit + 1, cmp_score);
+    heap_t *heap = heap_new(matcher->limit + 1, cmp_score, matcher->scanner);
+
+    // Compressed scanners store candidates in pieces, so we put each one back
+    // together in this buffer in order to score it (packed scanners just need
+    // a `str_t` to point into their slab).
+    paths_t *paths = matcher->scanner->paths;
+    char *buffer = paths ? xmalloc(paths->max_length + 1) : NULL;
+    str_t scratch;
+    scratch.contents = buffer;
+    scratch.capacity = -1;
+
+    // Union scanners weight candidates according to their source.
+    unsigned char *sources = matcher->scanner->sources;
+    float *weights = matcher->scanner->source_weights;
 
     // TODO benchmark different thread partitioning method
     // (intead of every nth item to a thread, break into blocks)
     // to see if cache characteristics improve the speed)
-    for (unsigned i = worker_index; i < matcher->scanner->count;
+    for (unsigned i = worker_index; i < matcher->haystacks_count;
          i += worker_count) {
         haystack_t *haystack = matcher->haystacks + i;
-        if (matcher->needle_bitmask == UNSET_BITMASK) {
-            haystack->bitmask = UNSET_BITMASK;
-        }
         if (matcher->last_needle != NULL && haystack->score == 0.0f) {
             // Skip over this candidate because it didn't match last
             // time and it can't match this time either.
             continue;
         }
 
-        haystack->score = commandt_score(haystack, matcher, ignore_case);
+        str_t *candidate = haystack->candidate;
+        if (!candidate) {
+            if (matcher->needle_length &&
+                (matcher->needle_bitmask & haystack->bitmask) !=
+                    matcher->needle_bitmask) {
+                haystack->score = 0.0f;
+                continue;
+            }
+            if (paths) {
+                scratch.length = paths_get(paths, haystack->index, buffer);
+            } else {
+                scratch = scanner_get(matcher->scanner, haystack->index);
+            }
+            candidate = &scratch;
+        }
+
+        haystack->score =
+            commandt_score(haystack, candidate, matcher, ignore_case);
+        if (sources && haystack->score > 0.0f) {
+            haystack->score *= weights[sources[haystack->index]];
+        }
 
         if (haystack->score == 0.0f) {
             continue;
@@ -366,5 +435,95 @@ static void *get_matches(void *worker_args) {
         }
     }
 
+    free(buffer);
     return heap;
 }
+
+/**
+ * Brings the haystacks up-to-date with changes made to the scanner since we
+ * last looked at it.
+ *
+ * Wherever possible, this is done incrementally (dropping the haystacks of
+ * removed candidates and appending haystacks for new ones), so that the
+ * bitmasks and scores cached in surviving haystacks are preserved.
+ */
+static void sync_haystacks(matcher_t *matcher) {
+    scanner_t *scanner = matcher->scanner;
+
+    if (scanner->generation != matcher->generation) {
+        // Candidates have moved around (eg. due to compaction); start over.
+        matcher->haystacks_count = 0;
+        matcher->generation = scanner->generation;
+        matcher->seen = 0;
+        matcher->tombstones = 0;
+        free((void *)matcher->last_needle);
+        matcher->last_needle = NULL;
+        matcher->last_needle_length = 0;
+    } else if (scanner->candidates != matcher->candidates) {
+        // The array was reallocated to make room for new candidates, but
+        // their positions within it are unchanged.
+        for (unsigned i = 0; i < matcher->haystacks_count; i++) {
+            haystack_t *haystack = &matcher->haystacks[i];
+            if (haystack->candidate) {
+                haystack->candidate =
+                    scanner->candidates +
+                    (haystack->candidate - matcher->candidates);
+            }
+        }
+    }
+    matcher->candidates = scanner->candidates;
+
+    if (scanner->tombstones != matcher->tombstones) {
+        // Haystacks for packed and compressed scanners have no `candidate` to
+        // check, but then, those scanners never have tombstones either.
+        unsigned count = 0;
+        for (unsigned i = 0; i < matcher->haystacks_count; i++) {
+            str_t *candidate = matcher->haystacks[i].candidate;
+            if (!candidate || candidate->contents) {
+                matcher->haystacks[count++] = matcher->haystacks[i];
+            }
+        }
+        matcher->haystacks_count = count;
+        matcher->tombstones = scanner->tombstones;
+    }
+
+    if (scanner->count > matcher->seen) {
+        unsigned needed =
+            matcher->haystacks_count + (scanner->count - matcher->seen);
+        if (needed > matcher->haystacks_capacity) {
+            unsigned capacity = matcher->haystacks_capacity * 2;
+            matcher->haystacks_capacity = capacity > needed ? capacity : needed;
+            matcher->haystacks = xrealloc(
+                matcher->haystacks,
+                matcher->haystacks_capacity * sizeof(haystack_t)
+            );
+        }
+        for (unsigned i = matcher->seen; i < scanner->count; i++) {
+            haystack_t *haystack =
+                &matcher->haystacks[matcher->haystacks_count];
+            if (scanner->paths) {
+                // Directory bitmasks are shared, so this is cheap enough to do
+                // up-front, and means that we only have to reassemble paths
+                // that could possibly match.
+                haystack->candidate = NULL;
+                haystack->bitmask = paths_bitmask(scanner->paths, i);
+            } else if (scanner->handles) {
+                haystack->candidate = NULL;
+                haystack->bitmask = UNSET_BITMASK;
+            } else if (scanner->candidates[i].contents) {
+                haystack->candidate = &scanner->candidates[i];
+                haystack->bitmask = i < scanner->bitmasks_count
+                                        ? scanner->bitmasks[i]
+                                        : UNSET_BITMASK;
+            } else {
+                continue;
+            }
+            haystack->score = UNSET_SCORE;
+            haystack->index = i;
+            matcher->haystacks_count++;
+        }
+        matcher->seen = scanner->count;
+    }
+
+    matcher->clock = scanner->clock;
+}
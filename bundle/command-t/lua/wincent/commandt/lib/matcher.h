@@ -16,6 +16,15 @@ typedef struct {
     str_t **matches;
     unsigned match_count;
     unsigned candidate_count;
+
+    /**
+     * @internal
+     *
+     * Storage for `matches` when the scanner is packed or compressed (see
+     * `scanner_pack()` and `scanner_compress()`); NULL otherwise.
+     */
+    str_t *strings;
+    char *buffer;
 } result_t;
 
 /**
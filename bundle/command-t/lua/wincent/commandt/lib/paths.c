@@ -0,0 +1,309 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "paths.h"
+
+#include <stdlib.h> /* for free(), qsort() */
+#include <string.h> /* for memcmp(), memcpy() */
+
+#include "die.h" /* for die() */
+#include "xmalloc.h"
+
+/**
+ * Slot in the hash table used to intern directories while building.
+ * `index` is stored plus one, so that 0 can mark empty slots.
+ */
+typedef struct {
+    uint32_t hash;
+    unsigned index;
+} paths_slot_t;
+
+// Forward declarations.
+static long paths_calculate_bitmask(const char *str, size_t length);
+static int paths_cmp(const void *a, const void *b);
+static uint32_t paths_hash(const char *str, size_t length);
+static unsigned paths_intern(
+    paths_t *paths,
+    paths_slot_t **slots,
+    size_t *slots_capacity,
+    size_t *directory_bytes_capacity,
+    unsigned *directories_capacity,
+    const char *directory,
+    size_t length
+);
+static const unsigned char *paths_name(
+    const paths_t *paths, unsigned index, size_t *length
+);
+
+paths_t *paths_new(const str_t *candidates, unsigned count) {
+    paths_t *paths = xcalloc(1, sizeof(paths_t));
+
+    const str_t **sorted = xmalloc(count * sizeof(str_t *));
+    for (unsigned i = 0; i < count; i++) {
+        sorted[i] = &candidates[i];
+    }
+    qsort(sorted, count, sizeof(str_t *), paths_cmp);
+
+    paths->handles = xmalloc(count * sizeof(path_handle_t));
+    paths->count = count;
+
+    size_t slots_capacity = 1024;
+    paths_slot_t *slots = xcalloc(slots_capacity, sizeof(paths_slot_t));
+    size_t directory_bytes_capacity = 4096;
+    paths->directory_bytes = xmalloc(directory_bytes_capacity);
+    unsigned directories_capacity = 256;
+    paths->directories =
+        xmalloc(directories_capacity * sizeof(path_directory_t));
+    size_t names_capacity = 65536;
+    paths->names = xmalloc(names_capacity);
+
+    // Consecutive (sorted) paths usually share a directory, so remember the
+    // last one to avoid hashing it again.
+    const char *last_directory = NULL;
+    size_t last_length = 0;
+    unsigned last_index = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        const char *path = sorted[i]->contents;
+        size_t length = sorted[i]->length;
+        if (length > paths->max_length) {
+            paths->max_length = length;
+        }
+
+        size_t slash = length;
+        while (slash > 0 && path[slash - 1] != '/') {
+            slash--;
+        }
+        // The directory keeps its trailing slash, so that "/foo" (directory
+        // "/") and "foo" (no directory) come back out unchanged.
+        size_t directory_length = slash;
+        unsigned directory;
+        if (last_directory && directory_length == last_length &&
+            memcmp(path, last_directory, directory_length) == 0) {
+            directory = last_index;
+        } else {
+            directory = paths_intern(
+                paths,
+                &slots,
+                &slots_capacity,
+                &directory_bytes_capacity,
+                &directories_capacity,
+                path,
+                directory_length
+            );
+            last_directory = path;
+            last_length = directory_length;
+            last_index = directory;
+        }
+
+        // Store the basename with a little-endian base-128 length prefix.
+        size_t name_length = length - slash;
+        if (paths->names_size + name_length + 10 > names_capacity) {
+            while (paths->names_size + name_length + 10 > names_capacity) {
+                names_capacity *= 2;
+            }
+            paths->names = xrealloc(paths->names, names_capacity);
+        }
+        if (paths->names_size > UINT32_MAX) {
+            die("paths_new(): names slab too large", 0);
+        }
+        paths->handles[i].directory = directory;
+        paths->handles[i].name = paths->names_size;
+        size_t remaining = name_length;
+        do {
+            unsigned char byte = remaining & 0x7f;
+            remaining >>= 7;
+            paths->names[paths->names_size++] = byte | (remaining ? 0x80 : 0);
+        } while (remaining);
+        memcpy(paths->names + paths->names_size, path + slash, name_length);
+        paths->names_size += name_length;
+    }
+
+    free(slots);
+    free(sorted);
+
+    // Give back whatever we over-allocated while building.
+    if (paths->names_size) {
+        paths->names = xrealloc(paths->names, paths->names_size);
+    }
+    if (paths->directory_bytes_size) {
+        paths->directory_bytes =
+            xrealloc(paths->directory_bytes, paths->directory_bytes_size);
+    }
+    if (paths->directories_count) {
+        paths->directories = xrealloc(
+            paths->directories,
+            paths->directories_count * sizeof(path_directory_t)
+        );
+    }
+
+    return paths;
+}
+
+size_t paths_get(const paths_t *paths, unsigned index, char *buffer) {
+    path_directory_t *directory =
+        &paths->directories[paths->handles[index].directory];
+    size_t length = directory->length;
+    memcpy(buffer, paths->directory_bytes + directory->offset, length);
+    size_t name_length;
+    const unsigned char *name = paths_name(paths, index, &name_length);
+    memcpy(buffer + length, name, name_length);
+    length += name_length;
+    buffer[length] = '\0';
+    return length;
+}
+
+long paths_bitmask(const paths_t *paths, unsigned index) {
+    size_t name_length;
+    const unsigned char *name = paths_name(paths, index, &name_length);
+    return paths->directories[paths->handles[index].directory].bitmask |
+           paths_calculate_bitmask((const char *)name, name_length);
+}
+
+size_t paths_size(const paths_t *paths) {
+    return sizeof(paths_t) + paths->count * sizeof(path_handle_t) +
+           paths->directories_count * sizeof(path_directory_t) +
+           paths->directory_bytes_size + paths->names_size;
+}
+
+void paths_free(paths_t *paths) {
+    free(paths->handles);
+    free(paths->directories);
+    free(paths->directory_bytes);
+    free(paths->names);
+    free(paths);
+}
+
+static long paths_calculate_bitmask(const char *str, size_t length) {
+    long mask = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (str[i] >= 'a' && str[i] <= 'z') {
+            mask |= (1 << (str[i] - 'a'));
+        } else if (str[i] >= 'A' && str[i] <= 'Z') {
+            mask |= (1 << (str[i] - 'A'));
+        }
+    }
+    return mask;
+}
+
+/**
+ * Comparison function for use with `qsort()`.
+ */
+static int paths_cmp(const void *a, const void *b) {
+    const str_t *a_str = *(const str_t **)a;
+    const str_t *b_str = *(const str_t **)b;
+    size_t length =
+        a_str->length < b_str->length ? a_str->length : b_str->length;
+    int order = memcmp(a_str->contents, b_str->contents, length);
+    if (order) {
+        return order;
+    }
+    return a_str->length < b_str->length ? -1 : a_str->length > b_str->length;
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t paths_hash(const char *str, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the index of `directory` in the directory table, adding it if
+ * necessary.
+ */
+static unsigned paths_intern(
+    paths_t *paths,
+    paths_slot_t **slots,
+    size_t *slots_capacity,
+    size_t *directory_bytes_capacity,
+    unsigned *directories_capacity,
+    const char *directory,
+    size_t length
+) {
+    uint32_t hash = paths_hash(directory, length);
+    size_t mask = *slots_capacity - 1;
+    size_t slot = hash & mask;
+    while ((*slots)[slot].index) {
+        path_directory_t *entry = &paths->directories[(*slots)[slot].index - 1];
+        if ((*slots)[slot].hash == hash && entry->length == length &&
+            memcmp(paths->directory_bytes + entry->offset, directory, length) ==
+                0) {
+            return (*slots)[slot].index - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (paths->directories_count == *directories_capacity) {
+        *directories_capacity *= 2;
+        paths->directories = xrealloc(
+            paths->directories, *directories_capacity * sizeof(path_directory_t)
+        );
+    }
+    if (paths->directory_bytes_size + length > *directory_bytes_capacity) {
+        while (paths->directory_bytes_size + length >
+               *directory_bytes_capacity) {
+            *directory_bytes_capacity *= 2;
+        }
+        paths->directory_bytes =
+            xrealloc(paths->directory_bytes, *directory_bytes_capacity);
+    }
+    if (paths->directory_bytes_size > UINT32_MAX) {
+        die("paths_new(): directory slab too large", 0);
+    }
+    unsigned index = paths->directories_count++;
+    path_directory_t *entry = &paths->directories[index];
+    entry->offset = paths->directory_bytes_size;
+    entry->length = length;
+    entry->bitmask = paths_calculate_bitmask(directory, length);
+    memcpy(paths->directory_bytes + entry->offset, directory, length);
+    paths->directory_bytes_size += length;
+    (*slots)[slot].hash = hash;
+    (*slots)[slot].index = index + 1;
+
+    // Keep the load factor below 1/2.
+    if (paths->directories_count * 2 > *slots_capacity) {
+        size_t capacity = *slots_capacity * 2;
+        paths_slot_t *grown = xcalloc(capacity, sizeof(paths_slot_t));
+        for (size_t i = 0; i < *slots_capacity; i++) {
+            if ((*slots)[i].index) {
+                size_t j = (*slots)[i].hash & (capacity - 1);
+                while (grown[j].index) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                grown[j] = (*slots)[i];
+            }
+        }
+        free(*slots);
+        *slots = grown;
+        *slots_capacity = capacity;
+    }
+
+    return index;
+}
+
+/**
+ * Returns a pointer to the basename of the path at `index`, and its length.
+ */
+static const unsigned char *paths_name(
+    const paths_t *paths, unsigned index, size_t *length
+) {
+    const unsigned char *name = paths->names + paths->handles[index].name;
+    size_t value = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+    do {
+        byte = *name++;
+        value |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *length = value;
+    return name;
+}
@@ -0,0 +1,106 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * Compact storage for large sets of paths.
+ *
+ * Instead of storing every path in full (plus a 24-byte `str_t`), each
+ * directory is stored once in a directory table, and each path is an 8-byte
+ * handle pairing a directory with a basename in a separate slab. In deep trees,
+ * where most of the bytes in a flat slab are repeated directory prefixes, this
+ * is several times smaller.
+ *
+ * Paths are kept in sorted order, so comparing the indices of two paths is
+ * equivalent to comparing the paths themselves.
+ */
+
+#ifndef PATHS_H
+#define PATHS_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define paths_bitmask commandt_paths_bitmask
+#define paths_free commandt_paths_free
+#define paths_get commandt_paths_get
+#define paths_new commandt_paths_new
+#define paths_size commandt_paths_size
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t */
+
+#include "str.h" /* for str_t */
+
+/**
+ * A path, represented as a directory (an index into the directory table) and a
+ * basename (an offset into the names slab, where it is stored with a varint
+ * length prefix).
+ */
+typedef struct {
+    uint32_t directory;
+    uint32_t name;
+} path_handle_t;
+
+typedef struct {
+    /**
+     * Location of the directory's path (including its trailing slash, so the
+     * root directory is "/") in the directory slab. Paths with no directory
+     * component belong to a directory with an empty path.
+     */
+    uint32_t offset;
+    uint32_t length;
+
+    /**
+     * Letters that appear in the directory's path (see `haystack_t`), so that
+     * they needn't be worked out again for every path in the directory.
+     */
+    long bitmask;
+} path_directory_t;
+
+typedef struct paths_t {
+    path_handle_t *handles;
+    unsigned count;
+
+    path_directory_t *directories;
+    unsigned directories_count;
+    char *directory_bytes;
+    size_t directory_bytes_size;
+
+    unsigned char *names;
+    size_t names_size;
+
+    /**
+     * Length of the longest path, so that callers of `paths_get()` can size
+     * their buffers.
+     */
+    size_t max_length;
+} paths_t;
+
+/**
+ * Builds a compact (and sorted) copy of `candidates`.
+ *
+ * The caller should dispose of the result with `paths_free()`.
+ */
+paths_t *paths_new(const str_t *candidates, unsigned count);
+
+/**
+ * Writes the path at `index` into `buffer`, which must have room for at least
+ * `max_length + 1` bytes, and returns its length. The path is NUL-terminated.
+ */
+size_t paths_get(const paths_t *paths, unsigned index, char *buffer);
+
+/**
+ * Returns the bitmask (see `haystack_t`) for the path at `index`.
+ */
+long paths_bitmask(const paths_t *paths, unsigned index);
+
+/**
+ * Returns the number of bytes used by `paths`.
+ */
+size_t paths_size(const paths_t *paths);
+
+void paths_free(paths_t *paths);
+
+#endif
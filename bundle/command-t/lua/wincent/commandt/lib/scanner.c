@@ -3,26 +3,46 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#ifdef LINUX
+#define _GNU_SOURCE /* for pipe2() */
+#endif
+
 #include "scanner.h"
 
 #include <assert.h> /* for assert() */
 #include <errno.h> /* for errno */
+#include <fcntl.h> /* for FD_CLOEXEC, F_SETFD, O_CLOEXEC */
 #include <signal.h> /* for SIGKILL, kill() */
+#include <stdbool.h> /* for bool, true */
 #include <stddef.h> /* for NULL */
 #include <stdio.h> /* for fprintf(), stderr */
 #include <stdlib.h> /* for free() */
-#include <string.h> /* for memchr(), strlen() */
+#include <string.h> /* for memchr(), memcmp(), memcpy(), strlen() */
+#include <sys/wait.h> /* for waitpid() */
 #include <unistd.h> /* _exit(), close(), fork(), pipe(), read() */
 
 #include "debug.h"
+#include "die.h" /* for die() */
+#include "paths.h" /* for paths_free(), paths_get(), paths_new() etc */
 #include "str.h"
 #include "xmalloc.h"
-#include "xmap.h" /* for xmap(), xmunmap() */
+#include "xmap.h" /* for xmap(), xmremap(), xmunmap() etc */
 
 // TODO: make this capable of producing asynchronously?
 
-static long MAX_FILES = MAX_FILES_CONF;
-static size_t buffer_size = MMAP_SLAB_SIZE_CONF;
+// Initial sizes of the slabs that `scanner_new_command()` reads into; they
+// grow as needed, and are trimmed to fit once the command has finished.
+#define INITIAL_CANDIDATES 4096
+#define INITIAL_BUFFER_SIZE 262144
+
+// Once the `candidates` array is this big, ask for huge pages.
+#define HUGEPAGE_THRESHOLD 8388608
+
+// Forward declarations.
+static void grow_buffer(
+    scanner_t *scanner, size_t size, char **start, char **end
+);
+static void grow_candidates(scanner_t *scanner, unsigned count);
 
 scanner_t *scanner_new_copy(const char **candidates, unsigned count) {
     scanner_t *scanner = xcalloc(1, sizeof(scanner_t));
@@ -39,30 +59,77 @@ scanner_t *scanner_new_copy(const char **candidates, unsigned count) {
     return scanner;
 }
 
-scanner_t *scanner_new_command(const char *command, unsigned drop, unsigned max_files) {
+scanner_t *scanner_new_packed(
+    const char *buffer, const uint32_t *lengths, unsigned count
+) {
+    scanner_t *scanner = xcalloc(1, sizeof(scanner_t));
+    if (!count) {
+        return scanner;
+    }
+    size_t size = 0;
+    for (unsigned i = 0; i < count; i++) {
+        size += lengths[i] + 1; // Include NUL byte.
+    }
+    scanner->buffer_size = xmap_round(size);
+    DEBUG_LOG("scanner_new_packed() -> xmap() buffer %llu\n", size);
+    scanner->buffer = xmap(scanner->buffer_size);
+    memcpy(scanner->buffer, buffer, size);
+    scanner->candidates_size = xmap_round(count * sizeof(str_t));
+    scanner->candidates = xmap(scanner->candidates_size);
+    const char *contents = scanner->buffer;
+    for (unsigned i = 0; i < count; i++) {
+        str_init(&scanner->candidates[i], contents, lengths[i]);
+        contents += lengths[i] + 1;
+    }
+    scanner->count = count;
+    return scanner;
+}
+
+scanner_t *scanner_new_command(
+    const char *command,
+    unsigned drop,
+    unsigned max_files,
+    scanner_delimiter_t delimiter
+) {
+    char terminator = delimiter == SCANNER_DELIMITER_NUL ? '\0' : '\n';
     scanner_t *scanner = xcalloc(1, sizeof(scanner_t));
-    scanner->candidates_size = sizeof(str_t) * MAX_FILES;
+    scanner->candidates_size = sizeof(str_t) * INITIAL_CANDIDATES;
     DEBUG_LOG(
         "scanner_new_command() -> xmap() candidates %llu\n", scanner->candidates_size
     );
     scanner->candidates = xmap(scanner->candidates_size);
-    scanner->buffer_size = buffer_size;
+    scanner->buffer_size = INITIAL_BUFFER_SIZE;
     DEBUG_LOG(
         "scanner_new_command() -> xmap() buffer %llu\n", scanner->buffer_size
     );
     scanner->buffer = xmap(scanner->buffer_size);
+    char *start = scanner->buffer;
+    char *end = scanner->buffer;
 
-    // Index 0 = read end of pipe; index 1 = write end of pipe.
+    // Index 0 = read end of pipe; index 1 = write end of pipe. Union scanners
+    // may be running other commands at the same time, so the pipe is marked
+    // close-on-exec; otherwise their shells could inherit its write end and
+    // keep it open (stopping us from seeing EOF) for as long as they run.
     int stdout_pipe[2];
-
+#ifdef LINUX
+    if (pipe2(stdout_pipe, O_CLOEXEC) != 0) {
+        DEBUG_LOG("scanner_new_command(): failed pipe2() - %s\n", strerror(errno));
+        goto out;
+    }
+#else
     if (pipe(stdout_pipe) != 0) {
         DEBUG_LOG("scanner_new_command(): failed pipe() - %s\n", strerror(errno));
         goto out;
     }
+    fcntl(stdout_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stdout_pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
 
     pid_t child_pid = fork();
     if (child_pid == -1) {
         DEBUG_LOG("scanner_new_command(): failed fork() - %s\n", strerror(errno));
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
         goto out;
     } else if (child_pid == 0) {
         // In child.
@@ -100,30 +167,56 @@ scanner_t *scanner_new_command(const char *command, unsigned drop, unsigned max_
             strerror(errno)
         );
     }
-    char *start = scanner->buffer;
-    char *end = scanner->buffer;
     ssize_t read_count;
-    while ((read_count = read(stdout_pipe[0], end, 4096)) != 0) {
+    bool eof = false;
+    while (true) {
+        if (end + 4096 > scanner->buffer + scanner->buffer_size) {
+            grow_buffer(scanner, scanner->buffer_size * 2, &start, &end);
+        }
+        read_count = read(stdout_pipe[0], end, 4096);
+        if (read_count == 0) {
+            if (start == end) {
+                break;
+            }
+
+            // Output ended without a final delimiter; supply one (there is
+            // always room) and go around one last time.
+            *end = terminator;
+            read_count = 1;
+            eof = true;
+        }
         DEBUG_LOG("scanner_new_command(): read %d bytes\n", read_count);
         if (read_count < 0) {
             // A read error, but we may as well try and proceed gracefully.
             DEBUG_LOG(
                 "scanner_new_command(): failed read() - %s\n", strerror(errno)
             );
-            break;
+            goto bail;
         }
         end += read_count;
         while (start < end) {
-            if (start[0] == 0) { // TODO: terminator may not always be NUL (-z)
+            if (start[0] == terminator) {
                 start++;
                 continue;
             }
-            char *next_end = memchr(start, 0, end - start);
+            char *next_end = memchr(start, terminator, end - start);
             if (!next_end) {
                 break;
             }
+
+            // Terminate the candidate with a NUL byte, whatever the delimiter.
+            char *record_end = next_end;
+            *record_end = '\0';
+            if (delimiter == SCANNER_DELIMITER_CRLF &&
+                record_end > start && record_end[-1] == '\r') {
+                *--record_end = '\0';
+                if (record_end == start) {
+                    start = next_end + 1;
+                    continue;
+                }
+            }
             char *path = start + drop;
-            int length = next_end - start - drop;
+            int length = record_end - start - drop;
             if (length < 0) {
                 DEBUG_LOG(
                     "commandt_scanner_new_command(): not enough output to skip %u characters\n",
@@ -132,6 +225,7 @@ scanner_t *scanner_new_command(const char *command, unsigned drop, unsigned max_
                 goto bail;
             }
             start = next_end + 1;
+            grow_candidates(scanner, scanner->count + 1);
             str_init(&scanner->candidates[scanner->count++], path, length);
             DEBUG_LOG(
                 "commandt_scanner_new_command(): scanned %s\n",
@@ -140,30 +234,57 @@ scanner_t *scanner_new_command(const char *command, unsigned drop, unsigned max_
 
             if (max_files && scanner->count >= max_files) {
                 DEBUG_LOG(
-                    "commandt_scanner_new_command(): killing process %d because count %d\n",
-                    child_pid,
+                    "commandt_scanner_new_command(): stopping because count %d\n",
                     scanner->count
                 );
-                if (kill(child_pid, SIGKILL)) {
-                    DEBUG_LOG(
-                        "commandt_scanner_new_command(): failed kill() - %s\n",
-                        strerror(errno)
-                    );
-                }
                 goto bail;
             }
         }
+        if (eof) {
+            break;
+        }
     }
+    goto reap;
 
 bail:
+    // Stopping early; the child may still be writing (and, once the pipe
+    // fills up, would block forever), so kill it before waiting for it.
+    DEBUG_LOG("commandt_scanner_new_command(): killing process %d\n", child_pid);
+    if (kill(child_pid, SIGKILL)) {
+        DEBUG_LOG(
+            "commandt_scanner_new_command(): failed kill() - %s\n",
+            strerror(errno)
+        );
+    }
+
+reap:
     DEBUG_LOG("commandt_scanner_new_command(): waiting %d\n", child_pid);
-    if (wait(&child_pid) == -1) {
+    if (waitpid(child_pid, &status, 0) == -1) {
         DEBUG_LOG(
-            "commandt_scanner_new_command(): failed wait() - %s\n", strerror(errno)
+            "commandt_scanner_new_command(): failed waitpid() - %s\n",
+            strerror(errno)
+        );
+    }
+    if (close(stdout_pipe[0]) != 0) {
+        DEBUG_LOG(
+            "commandt_scanner_new_command(): failed close() - %s\n",
+            strerror(errno)
         );
     }
 
 out:
+    // Trim the slab to fit; shrinking never moves it.
+    if (end == scanner->buffer) {
+        xmunmap(scanner->buffer, scanner->buffer_size);
+        scanner->buffer = NULL;
+        scanner->buffer_size = 0;
+    } else {
+        size_t buffer_size = xmap_round(end - scanner->buffer);
+        scanner->buffer =
+            xmremap(scanner->buffer, scanner->buffer_size, buffer_size);
+        scanner->buffer_size = buffer_size;
+    }
+    scanner_pack(scanner);
     DEBUG_LOG(
         "commandt_scanner_new_command(): returning scanner with count %d\n",
         scanner->count
@@ -197,6 +318,163 @@ scanner_t *scanner_new(
     return scanner;
 }
 
+unsigned scanner_add(scanner_t *scanner, const char *candidate, size_t length) {
+    assert(!scanner->handles && !scanner->paths && !scanner->sources);
+    grow_candidates(scanner, scanner->count + 1);
+    str_init_copy(&scanner->candidates[scanner->count], candidate, length);
+    scanner->clock++;
+    return scanner->count++;
+}
+
+void scanner_remove(scanner_t *scanner, unsigned index) {
+    assert(!scanner->handles && !scanner->paths && !scanner->sources);
+    assert(index < scanner->count);
+    str_t *str = &scanner->candidates[index];
+    if (!str->contents) {
+        return;
+    }
+    if (str->capacity >= 0) {
+        free((void *)str->contents);
+    }
+    str->contents = NULL;
+    str->length = 0;
+    str->capacity = -1;
+    scanner->tombstones++;
+    scanner->clock++;
+}
+
+void scanner_compact(scanner_t *scanner) {
+    if (!scanner->tombstones) {
+        return;
+    }
+    unsigned count = 0;
+    unsigned bitmasks_count = 0;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        if (scanner->candidates[i].contents) {
+            if (i < scanner->bitmasks_count) {
+                scanner->bitmasks[bitmasks_count++] = scanner->bitmasks[i];
+            }
+            scanner->candidates[count++] = scanner->candidates[i];
+        }
+    }
+    scanner->count = count;
+    scanner->bitmasks_count = bitmasks_count;
+    scanner->tombstones = 0;
+    scanner->clock++;
+    scanner->generation++;
+}
+
+void scanner_compress(scanner_t *scanner) {
+    if (scanner->paths) {
+        return;
+    }
+    assert(!scanner->sources);
+    scanner_compact(scanner);
+    if (scanner->handles) {
+        str_t *candidates = xmalloc(scanner->count * sizeof(str_t));
+        for (unsigned i = 0; i < scanner->count; i++) {
+            candidates[i] = scanner_get(scanner, i);
+        }
+        scanner->paths = paths_new(candidates, scanner->count);
+        free(candidates);
+        xmunmap(scanner->handles, scanner->handles_size);
+        scanner->handles = NULL;
+        scanner->handles_size = 0;
+    } else {
+        scanner->paths = paths_new(scanner->candidates, scanner->count);
+        for (unsigned i = 0; i < scanner->count; i++) {
+            str_t str = scanner->candidates[i];
+            if (str.capacity >= 0) {
+                free((void *)str.contents);
+            }
+        }
+        if (scanner->candidates) {
+            xmunmap(scanner->candidates, scanner->candidates_size);
+        }
+    }
+    if (scanner->buffer) {
+        xmunmap(scanner->buffer, scanner->buffer_size);
+    }
+    free(scanner->payload);
+    scanner->candidates = NULL;
+    scanner->candidates_size = 0;
+    scanner->buffer = NULL;
+    scanner->buffer_size = 0;
+    scanner->payload = NULL;
+    scanner->payload_size = 0;
+    scanner->bitmasks = NULL;
+    scanner->bitmasks_count = 0;
+    scanner->clock++;
+    scanner->generation++;
+}
+
+void scanner_pack(scanner_t *scanner) {
+    if (scanner->handles || scanner->paths) {
+        return;
+    }
+    assert(!scanner->bitmasks && !scanner->payload && !scanner->sources);
+    scanner_compact(scanner);
+    str_t *candidates = scanner->candidates;
+    unsigned count = scanner->count;
+
+    // Each handle is a third of the size of a `str_t`, so we can write them
+    // over the start of the same array without clobbering anything unread.
+    slab_handle_t *handles = (slab_handle_t *)candidates;
+    for (unsigned i = 0; i < count; i++) {
+        str_t str = candidates[i];
+        assert(str.capacity < 0);
+        size_t offset = str.contents - scanner->buffer;
+        if (offset > UINT32_MAX || str.length > UINT32_MAX) {
+            die("scanner_pack(): slab too large", 0);
+        }
+        handles[i].offset = offset;
+        handles[i].length = str.length;
+    }
+
+    // Give back the rest of the `candidates` allocation.
+    size_t handles_size = xmap_round(count * sizeof(slab_handle_t));
+    if (handles_size < scanner->candidates_size) {
+        xmunmap(
+            (char *)candidates + handles_size,
+            scanner->candidates_size - handles_size
+        );
+    }
+    scanner->handles = handles_size ? handles : NULL;
+    scanner->handles_size = handles_size;
+    scanner->candidates = NULL;
+    scanner->candidates_size = 0;
+    scanner->clock++;
+    scanner->generation++;
+}
+
+str_t scanner_get(const scanner_t *scanner, unsigned index) {
+    assert(!scanner->paths);
+    assert(index < scanner->count);
+    if (scanner->handles) {
+        str_t str;
+        str.contents = scanner->buffer + scanner->handles[index].offset;
+        str.length = scanner->handles[index].length;
+        str.capacity = -1;
+        return str;
+    }
+    return scanner->candidates[index];
+}
+
+size_t scanner_size(const scanner_t *scanner) {
+    size_t size = sizeof(scanner_t) + scanner->candidates_size +
+                  scanner->handles_size + scanner->buffer_size +
+                  scanner->payload_size;
+    if (scanner->paths) {
+        size += paths_size(scanner->paths);
+    }
+    for (unsigned i = 0; scanner->candidates && i < scanner->count; i++) {
+        if (scanner->candidates[i].capacity >= 0) {
+            size += scanner->candidates[i].capacity;
+        }
+    }
+    return size;
+}
+
 static const char *NUL_BYTE = "\0";
 static const char *L_BRACE = "{";
 static const char *R_BRACE = "}";
@@ -208,13 +486,26 @@ str_t *scanner_dump(scanner_t *scanner) {
     str_t *dump = str_new();
     str_append(dump, L_BRACE, 1);
     str_append(dump, NEWLINE, 1);
-    for (unsigned i = 0; i < scanner->count; i++) {
-        str_append(dump, INDENT, strlen(INDENT));
-        str_append(
-            dump, scanner->candidates[i].contents, scanner->candidates[i].length
-        );
-        str_append(dump, COMMA, 1);
-        str_append(dump, NEWLINE, 1);
+    if (scanner->paths) {
+        char *buffer = xmalloc(scanner->paths->max_length + 1);
+        for (unsigned i = 0; i < scanner->count; i++) {
+            str_append(dump, INDENT, strlen(INDENT));
+            str_append(dump, buffer, paths_get(scanner->paths, i, buffer));
+            str_append(dump, COMMA, 1);
+            str_append(dump, NEWLINE, 1);
+        }
+        free(buffer);
+    } else {
+        for (unsigned i = 0; i < scanner->count; i++) {
+            str_t candidate = scanner_get(scanner, i);
+            if (!candidate.contents) {
+                continue;
+            }
+            str_append(dump, INDENT, strlen(INDENT));
+            str_append(dump, candidate.contents, candidate.length);
+            str_append(dump, COMMA, 1);
+            str_append(dump, NEWLINE, 1);
+        }
     }
     str_append(dump, R_BRACE, 1);
     str_append(dump, NUL_BYTE, 1);
@@ -222,14 +513,23 @@ str_t *scanner_dump(scanner_t *scanner) {
 }
 
 void scanner_free(scanner_t *scanner) {
-    for (unsigned i = 0; i < scanner->count; i++) {
-        str_t str = scanner->candidates[i];
-        if (str.capacity >= 0) {
-            free((void *)str.contents);
-        }
+    if (scanner->paths) {
+        paths_free(scanner->paths);
+        free(scanner);
+        return;
     }
 
-    if (scanner->candidates) {
+    if (scanner->handles) {
+        // Packed candidates all live in the slab, so there is nothing to free
+        // individually.
+        xmunmap(scanner->handles, scanner->handles_size);
+    } else if (scanner->candidates) {
+        for (unsigned i = 0; i < scanner->count; i++) {
+            str_t str = scanner->candidates[i];
+            if (str.capacity >= 0) {
+                free((void *)str.contents);
+            }
+        }
         xmunmap(scanner->candidates, scanner->candidates_size);
     }
 
@@ -237,6 +537,9 @@ void scanner_free(scanner_t *scanner) {
         xmunmap(scanner->buffer, scanner->buffer_size);
     }
 
+    free(scanner->payload);
+    free(scanner->sources);
+    free(scanner->source_weights);
     free(scanner);
 }
 
@@ -245,3 +548,51 @@ void commandt_print_scanner(scanner_t *scanner) {
     fprintf(stderr, "\n\n\n%s\n\n\n", dump->contents);
     str_free(dump);
 }
+
+/**
+ * Grows `buffer` to `size` bytes, fixing up the candidates that point into it
+ * (and `start` and `end`) if it moves.
+ */
+static void grow_buffer(
+    scanner_t *scanner, size_t size, char **start, char **end
+) {
+    DEBUG_LOG("grow_buffer() -> xmremap() %llu\n", size);
+    char *buffer = xmremap(scanner->buffer, scanner->buffer_size, size);
+    if (buffer != scanner->buffer) {
+        for (unsigned i = 0; i < scanner->count; i++) {
+            str_t *str = &scanner->candidates[i];
+            str->contents = buffer + (str->contents - scanner->buffer);
+        }
+        *start = buffer + (*start - scanner->buffer);
+        *end = buffer + (*end - scanner->buffer);
+    }
+    scanner->buffer = buffer;
+    scanner->buffer_size = size;
+}
+
+/**
+ * Makes room for at least `count` candidates in `candidates`.
+ */
+static void grow_candidates(scanner_t *scanner, unsigned count) {
+    if (count * sizeof(str_t) <= scanner->candidates_size) {
+        return;
+    }
+    size_t candidates_size = scanner->candidates_size
+                                 ? scanner->candidates_size * 2
+                                 : INITIAL_CANDIDATES * sizeof(str_t);
+    while (candidates_size < count * sizeof(str_t)) {
+        candidates_size *= 2;
+    }
+    DEBUG_LOG("grow_candidates() -> xmremap() %llu\n", candidates_size);
+    if (scanner->candidates) {
+        scanner->candidates = xmremap(
+            scanner->candidates, scanner->candidates_size, candidates_size
+        );
+    } else {
+        scanner->candidates = xmap(candidates_size);
+    }
+    scanner->candidates_size = candidates_size;
+    if (candidates_size >= HUGEPAGE_THRESHOLD) {
+        xmap_hugepage(scanner->candidates, candidates_size);
+    }
+}
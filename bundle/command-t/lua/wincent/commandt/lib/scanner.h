@@ -6,16 +6,26 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <stdint.h> /* for uint32_t */
+
 #include "commandt.h" /* for scanner_t */
 #include "str.h"
 
 // Define short names for convenience, but all external symbols need prefixes.
+#define scanner_add commandt_scanner_add
+#define scanner_compact commandt_scanner_compact
+#define scanner_compress commandt_scanner_compress
 #define scanner_new_copy commandt_scanner_new_copy
 #define scanner_new_command commandt_scanner_new_command
+#define scanner_new_packed commandt_scanner_new_packed
 #define scanner_new_str commandt_scanner_new_str
 #define scanner_new commandt_scanner_new
 #define scanner_dump commandt_scanner_dump
 #define scanner_free commandt_scanner_free
+#define scanner_get commandt_scanner_get
+#define scanner_pack commandt_scanner_pack
+#define scanner_remove commandt_scanner_remove
+#define scanner_size commandt_scanner_size
 
 /**
  * Create a new `scanner_t` struct initialized with `candidates`.
@@ -25,16 +35,58 @@
  */
 scanner_t *scanner_new_copy(const char **candidates, unsigned count);
 
+/**
+ * Create a new `scanner_t` struct initialized with `count` candidates packed
+ * into `buffer`, each followed by a NUL byte, whose lengths (not counting the
+ * NUL) are given by `lengths`.
+ *
+ * Unlike `scanner_new_copy()`, this copies all of the candidates into a
+ * single slab in one go, so creating and freeing the scanner cost one
+ * allocation each rather than one per candidate. The caller should call
+ * `scanner_free()` when done.
+ */
+scanner_t *scanner_new_packed(
+    const char *buffer, const uint32_t *lengths, unsigned count
+);
+
+/**
+ * How the output of a command is split into candidates.
+ */
+typedef enum {
+    /**
+     * Each candidate is followed by a NUL byte (eg. `find -print0`,
+     * `git ls-files -z`).
+     */
+    SCANNER_DELIMITER_NUL,
+
+    /**
+     * Each candidate is followed by a newline (eg. `fd`, `bazel query`).
+     */
+    SCANNER_DELIMITER_LF,
+
+    /**
+     * As for `SCANNER_DELIMITER_LF`, but a carriage return before the newline
+     * is dropped too.
+     */
+    SCANNER_DELIMITER_CRLF,
+} scanner_delimiter_t;
+
 /**
  * Create a new `scanner_t` struct that will be populated by executing the
- * NUL-terminated `command` string.
+ * NUL-terminated `command` string, whose output is split into candidates
+ * according to `delimiter`. Empty candidates are skipped.
  *
  * The `drop` parameter indicates how many characters of prefix, if any, should
  * be omitted from the strings returned by the scanner; commonly, this will be
  * 0, but for commands such as `find .` which prefix all paths with "./", `drop`
  * would be 2.
  */
-scanner_t *scanner_new_command(const char *command, unsigned drop, unsigned max_files);
+scanner_t *scanner_new_command(
+    const char *command,
+    unsigned drop,
+    unsigned max_files,
+    scanner_delimiter_t delimiter
+);
 
 /**
  * Create a new `scanner_t` struct initialized with `candidates`.
@@ -59,6 +111,67 @@ scanner_t *scanner_new(
     size_t buffer_size
 );
 
+/**
+ * Appends a copy of `candidate` (of `length` bytes) to the scanner, growing
+ * the `candidates` array if necessary.
+ *
+ * Returns the index of the new candidate, which remains stable until the next
+ * call to `scanner_compact()`.
+ */
+unsigned scanner_add(scanner_t *scanner, const char *candidate, size_t length);
+
+/**
+ * Removes the candidate at `index` by turning it into a tombstone, so that the
+ * indices of other candidates (and any matcher state that refers to them)
+ * remain valid. Removing a tombstone is a no-op.
+ */
+void scanner_remove(scanner_t *scanner, unsigned index);
+
+/**
+ * Squeezes out tombstones, preserving the order of the remaining candidates.
+ *
+ * This invalidates indices, so matchers built on the scanner have to start
+ * over the next time they run.
+ */
+void scanner_compact(scanner_t *scanner);
+
+/**
+ * Replaces the scanner's candidates with a compact copy (see `paths_new()`),
+ * releasing the original storage.
+ *
+ * A compressed scanner uses a fraction of the memory, but can no longer be
+ * changed with `scanner_add()` or `scanner_remove()`, and its candidates are
+ * no longer accessible via `candidates`. Matchers built on the scanner have to
+ * start over the next time they run.
+ */
+void scanner_compress(scanner_t *scanner);
+
+/**
+ * Replaces the scanner's `candidates` with 8-byte handles into its `buffer`
+ * (keeping them in the same order), and returns the unused part of the
+ * `candidates` allocation to the system.
+ *
+ * Only applies to scanners whose candidates all live in `buffer` (ie. those
+ * produced by `scanner_new_command()` and `commandt_file_scanner()`). Like a
+ * compressed scanner, a packed one can no longer be changed with
+ * `scanner_add()` or `scanner_remove()`.
+ */
+void scanner_pack(scanner_t *scanner);
+
+/**
+ * Returns the candidate at `index` of a scanner that is not compressed. The
+ * returned string refers to the scanner's own storage and must not be freed.
+ */
+str_t scanner_get(const scanner_t *scanner, unsigned index);
+
+/**
+ * Returns the number of bytes of memory that the scanner's candidates occupy.
+ *
+ * Slabs are trimmed to fit once scanning is done, so this is what they
+ * actually commit rather than how much address space they once reserved.
+ */
+size_t scanner_size(const scanner_t *scanner);
+
 /**
  * For debugging, a human-readable string representation of the scanner.
  *
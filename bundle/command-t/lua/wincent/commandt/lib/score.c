@@ -13,6 +13,7 @@
 // Use a struct to make passing params during recursion easier.
 typedef struct {
     haystack_t *haystack;
+    const str_t *candidate;
     const char *needle_p;
     size_t needle_length;
     size_t *rightmost_match_p; // Rightmost match for each char in needle.
@@ -48,10 +49,10 @@ static float recursive_match(
                 return *memoized > seen_score ? *memoized : seen_score;
             }
             c = m->needle_p[i];
-            d = m->haystack->candidate->contents[j];
+            d = m->candidate->contents[j];
             if (d == '.') {
                 if (j == 0 ||
-                    m->haystack->candidate->contents[j - 1] ==
+                    m->candidate->contents[j - 1] ==
                         '/') { // This is a dot-file.
                     int dot_search = c == '.'; // Searching for a dot.
                     if (m->never_show_dot_files ||
@@ -70,9 +71,9 @@ static float recursive_match(
 
                 if (distance > 1) {
                     float factor = 1.0f;
-                    char last = m->haystack->candidate->contents[j - 1];
+                    char last = m->candidate->contents[j - 1];
                     char curr =
-                        m->haystack->candidate->contents[j]; // Case matters, so get again.
+                        m->candidate->contents[j]; // Case matters, so get again.
                     if (last == '/') {
                         factor = 0.9f;
                     } else if (last == '-' || last == '_' || last == ' ' || (last >= '0' && last <= '9')) {
@@ -113,15 +114,21 @@ static float recursive_match(
     return *memoized = score;
 }
 
-float commandt_score(haystack_t *haystack, matcher_t *matcher, bool ignore_case) {
+float commandt_score(
+    haystack_t *haystack,
+    const str_t *candidate,
+    matcher_t *matcher,
+    bool ignore_case
+) {
     matchinfo_t m;
     bool compute_bitmasks = haystack->bitmask == UNSET_BITMASK;
     m.haystack = haystack;
+    m.candidate = candidate;
     m.needle_p = matcher->needle;
     m.needle_length = matcher->needle_length;
     m.rightmost_match_p = NULL;
     m.max_score_per_char =
-        (1.0f / m.haystack->candidate->length + 1.0f / m.needle_length) / 2;
+        (1.0f / m.candidate->length + 1.0f / m.needle_length) / 2;
     m.always_show_dot_files = matcher->always_show_dot_files;
     m.never_show_dot_files = matcher->never_show_dot_files;
     m.ignore_case = ignore_case;
@@ -131,10 +138,10 @@ float commandt_score(haystack_t *haystack, matcher_t *matcher, bool ignore_case)
     if (m.needle_length == 0) {
         // Filter out dot files.
         if (m.never_show_dot_files || !m.always_show_dot_files) {
-            for (size_t i = 0; i < m.haystack->candidate->length; i++) {
-                char c = m.haystack->candidate->contents[i];
+            for (size_t i = 0; i < m.candidate->length; i++) {
+                char c = m.candidate->contents[i];
                 if (c == '.' &&
-                    (i == 0 || m.haystack->candidate->contents[i - 1] == '/')) {
+                    (i == 0 || m.candidate->contents[i - 1] == '/')) {
                     return -1.0f;
                 }
             }
@@ -154,13 +161,13 @@ float commandt_score(haystack_t *haystack, matcher_t *matcher, bool ignore_case)
         size_t rightmost_match_p[m.needle_length];
         m.rightmost_match_p = rightmost_match_p;
         size_t needle_idx = m.needle_length - 1;
-        size_t haystack_len = m.haystack->candidate->length;
+        size_t haystack_len = m.candidate->length;
         size_t haystack_idx = haystack_len ? haystack_len - 1 : 0;
         long mask = 0;
         bool found_needle = false;
         if (haystack_len) {
             while (haystack_idx >= needle_idx) {
-                char c = m.haystack->candidate->contents[haystack_idx];
+                char c = m.candidate->contents[haystack_idx];
                 char lower = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
                 if (m.ignore_case) {
                     c = lower;
@@ -191,7 +198,7 @@ float commandt_score(haystack_t *haystack, matcher_t *matcher, bool ignore_case)
             if (haystack_len) {
                 // In case we broke out of the loop early, compute rest of mask.
                 for (size_t i = 0; i <= haystack_idx; i++) {
-                    char c = m.haystack->candidate->contents[i];
+                    char c = m.candidate->contents[i];
                     char lower = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
                     mask |= (1 << (lower - 'a'));
                 }
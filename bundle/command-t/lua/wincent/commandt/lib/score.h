@@ -10,10 +10,20 @@
 #include <stdbool.h> /* for bool */
 
 #include "commandt.h" /* for haystack_t, matcher_t */
+#include "str.h" /* for str_t */
 
 #define UNSET_BITMASK (-1)
 #define UNSET_SCORE FLT_MAX
 
-float commandt_score(haystack_t *haystack, matcher_t *matcher, bool ignore_case);
+/**
+ * Scores `candidate` (the string that `haystack` stands for) against the
+ * matcher's current needle.
+ */
+float commandt_score(
+    haystack_t *haystack,
+    const str_t *candidate,
+    matcher_t *matcher,
+    bool ignore_case
+);
 
 #endif
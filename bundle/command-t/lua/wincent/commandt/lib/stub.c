@@ -0,0 +1,710 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "stub.h"
+
+#include <errno.h> /* for EINTR, errno */
+#include <limits.h> /* for UINT_MAX */
+#include <poll.h> /* for POLLIN, nfds_t, poll() */
+#include <signal.h> /* for SIGPIPE, SIGTERM, SIG_IGN, kill(), signal() */
+#include <stdbool.h> /* for bool, false, true */
+#include <stdint.h> /* for int64_t, int8_t etc */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcpy(), memset(), strerror(), strncpy() */
+#include <sys/socket.h> /* for accept(), bind(), listen(), socket() */
+#include <sys/un.h> /* for sockaddr_un */
+#include <sys/wait.h> /* for waitpid() */
+#include <time.h> /* for nanosleep(), timespec */
+#include <unistd.h> /* for _exit(), close(), fork(), read(), write() etc */
+
+#include "debug.h"
+#include "watchman.h" /* for commandt_watchman_pdu_length() */
+#include "xmalloc.h" /* for xmalloc(), xrealloc() */
+#include "xstrdup.h" /* for xstrdup() */
+
+// Largest request that the stub will read; Command-T's are far smaller.
+#define STUB_REQUEST_SIZE 65536
+
+// How many clients the stub will talk to at once.
+#define STUB_MAX_CONNECTIONS 16
+
+// How often (in milliseconds) the stub checks whether its parent has gone
+// away while it waits for a connection.
+#define STUB_POLL_INTERVAL 1000
+
+// How long (in milliseconds) the stub stops halfway through the initial
+// listing of a subscription, so that clients get to use the first part of it
+// before the rest arrives.
+#define STUB_PAUSE 250
+
+// PDU header with an int64 length, filled in by `stub_finish()`.
+#define STUB_HEADER "\x00\x01\x06\x00\x00\x00\x00\x00\x00\x00\x00"
+#define STUB_HEADER_SIZE (sizeof(STUB_HEADER) - 1)
+
+struct watchman_stub_t {
+    char *socket_path;
+    pid_t pid;
+};
+
+/**
+ * A PDU under construction.
+ */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} stub_pdu_t;
+
+/**
+ * The PDUs that the stub sends, all encoded up front.
+ */
+typedef struct {
+    /**
+     * Complete listing of files 0 to `count - 1`, as sent in response to a
+     * "query" and as the initial listing of a subscription.
+     */
+    stub_pdu_t listing;
+
+    /**
+     * Offset within `listing` of the name of file 1 (or of the end, if there
+     * is no such file).
+     */
+    size_t second;
+
+    /**
+     * The fresh listing that a subscription receives next (as if Watchman had
+     * recrawled the tree, finding that file 0 had gone and file `count` had
+     * appeared), minus the bulk of the names, which are shared with
+     * `listing`: `recrawl` has everything before them, and `tail` everything
+     * after them.
+     */
+    stub_pdu_t recrawl;
+    stub_pdu_t tail;
+
+    /**
+     * Number of files in each listing.
+     */
+    unsigned count;
+} stub_pdus_t;
+
+// Forward declarations.
+static void stub_append(stub_pdu_t *pdu, const void *data, size_t length);
+static void stub_append_byte(stub_pdu_t *pdu, char byte);
+static void stub_append_int(stub_pdu_t *pdu, int64_t value);
+static void stub_append_string(
+    stub_pdu_t *pdu, const char *string, size_t length
+);
+static void stub_begin_listing(
+    stub_pdu_t *pdu, const char *clock, unsigned count
+);
+static void stub_finish(stub_pdu_t *pdu);
+static char *stub_format_decimal(
+    char *buffer, const char *prefix, unsigned value
+);
+static bool stub_read(int fd, char *buffer, size_t length);
+static bool stub_read_int(const char **ptr, const char *end, int64_t *value);
+static bool stub_read_string(
+    const char **ptr, const char *end, const char **string, size_t *length
+);
+static bool stub_respond(int fd, const stub_pdus_t *pdus);
+static void stub_serve(int listener, pid_t parent, const stub_pdus_t *pdus);
+static unsigned stub_since(
+    const char *ptr, const char *end, int64_t count, unsigned files
+);
+static bool stub_skip(const char **ptr, const char *end);
+static bool stub_write(int fd, const char *data, size_t length);
+static bool stub_write_changes(int fd, unsigned since, unsigned count);
+
+watchman_stub_t *watchman_stub_new(const char *socket_path, unsigned count) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        DEBUG_LOG("watchman_stub_new(): socket path too long\n");
+        return NULL;
+    }
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int listener = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (listener == -1) {
+        DEBUG_LOG(
+            "watchman_stub_new(): failed socket() - %s\n", strerror(errno)
+        );
+        return NULL;
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 16) == -1) {
+        DEBUG_LOG("watchman_stub_new(): failed bind() - %s\n", strerror(errno));
+        close(listener);
+        return NULL;
+    }
+
+    // Encode the PDUs once, here, so that the child never has to allocate
+    // (which isn't safe after `fork()` in a multi-threaded process).
+    stub_pdus_t pdus;
+    pdus.count = count;
+    pdus.listing = (stub_pdu_t){
+        .data = xmalloc(4096 + (size_t)count * 32),
+        .length = 0,
+        .capacity = 4096 + (size_t)count * 32,
+    };
+    stub_begin_listing(&pdus.listing, "c:0:1", count);
+    pdus.second = pdus.listing.length;
+    char name[64];
+    for (unsigned i = 0; i < count; i++) {
+        stub_append_string(&pdus.listing, name, watchman_stub_name(i, name));
+        if (i == 0) {
+            pdus.second = pdus.listing.length;
+        }
+    }
+    stub_finish(&pdus.listing);
+
+    pdus.recrawl = (stub_pdu_t){
+        .data = xmalloc(4096), .length = 0, .capacity = 4096
+    };
+    stub_begin_listing(&pdus.recrawl, "c:0:2", count);
+    pdus.tail = (stub_pdu_t){.data = xmalloc(64), .length = 0, .capacity = 64};
+    if (count) {
+        stub_append_string(&pdus.tail, name, watchman_stub_name(count, name));
+    }
+    int64_t length = pdus.recrawl.length - STUB_HEADER_SIZE +
+                     pdus.listing.length - pdus.second + pdus.tail.length;
+    memcpy(
+        pdus.recrawl.data + STUB_HEADER_SIZE - sizeof(length),
+        &length,
+        sizeof(length)
+    );
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        DEBUG_LOG("watchman_stub_new(): failed fork() - %s\n", strerror(errno));
+        free(pdus.listing.data);
+        free(pdus.recrawl.data);
+        free(pdus.tail.data);
+        close(listener);
+        unlink(socket_path);
+        return NULL;
+    } else if (pid == 0) {
+        // In child; only async-signal-safe calls from here on.
+        signal(SIGPIPE, SIG_IGN);
+        stub_serve(listener, parent, &pdus);
+        _exit(0);
+    }
+
+    // In parent.
+    free(pdus.listing.data);
+    free(pdus.recrawl.data);
+    free(pdus.tail.data);
+    close(listener);
+    watchman_stub_t *stub = xmalloc(sizeof(watchman_stub_t));
+    stub->socket_path = xstrdup(socket_path);
+    stub->pid = pid;
+    return stub;
+}
+
+size_t watchman_stub_name(unsigned index, char *buffer) {
+    static const char *extensions[] = {
+        "c", "h", "js", "lua", "md", "rb", "txt"
+    };
+
+    // Equivalent to formatting "lib%u/src%u/file%u.%s" with `snprintf()`,
+    // which the stub can't call after `fork()`.
+    char *end = stub_format_decimal(buffer, "lib", index % 97);
+    end = stub_format_decimal(end, "/src", index / 97 % 89);
+    end = stub_format_decimal(end, "/file", index);
+    *end++ = '.';
+    for (const char *c = extensions[index % 7]; *c; c++) {
+        *end++ = *c;
+    }
+    *end = '\0';
+    return end - buffer;
+}
+
+void watchman_stub_free(watchman_stub_t *stub) {
+    kill(stub->pid, SIGTERM);
+    while (waitpid(stub->pid, NULL, 0) == -1 && errno == EINTR) {
+        // Try again.
+    }
+    unlink(stub->socket_path);
+    free(stub->socket_path);
+    free(stub);
+}
+
+/**
+ * Appends `length` bytes from `data` to `pdu`, growing it if necessary.
+ */
+static void stub_append(stub_pdu_t *pdu, const void *data, size_t length) {
+    if (pdu->length + length > pdu->capacity) {
+        while (pdu->length + length > pdu->capacity) {
+            pdu->capacity *= 2;
+        }
+        pdu->data = xrealloc(pdu->data, pdu->capacity);
+    }
+    memcpy(pdu->data + pdu->length, data, length);
+    pdu->length += length;
+}
+
+static void stub_append_byte(stub_pdu_t *pdu, char byte) {
+    stub_append(pdu, &byte, 1);
+}
+
+/**
+ * Appends `value` using the smallest encoding that fits, as Watchman does.
+ */
+static void stub_append_int(stub_pdu_t *pdu, int64_t value) {
+    if (value == (int8_t)value) {
+        int8_t v = value;
+        stub_append_byte(pdu, 0x03);
+        stub_append(pdu, &v, sizeof(v));
+    } else if (value == (int16_t)value) {
+        int16_t v = value;
+        stub_append_byte(pdu, 0x04);
+        stub_append(pdu, &v, sizeof(v));
+    } else if (value == (int32_t)value) {
+        int32_t v = value;
+        stub_append_byte(pdu, 0x05);
+        stub_append(pdu, &v, sizeof(v));
+    } else {
+        stub_append_byte(pdu, 0x06);
+        stub_append(pdu, &value, sizeof(value));
+    }
+}
+
+static void stub_append_string(
+    stub_pdu_t *pdu, const char *string, size_t length
+) {
+    stub_append_byte(pdu, 0x02);
+    stub_append_int(pdu, length);
+    stub_append(pdu, string, length);
+}
+
+/**
+ * Appends the start of a fresh listing of `count` files (as of `clock`) to
+ * `pdu`, up to where the names of the files go.
+ */
+static void stub_begin_listing(
+    stub_pdu_t *pdu, const char *clock, unsigned count
+) {
+    stub_append(pdu, STUB_HEADER, STUB_HEADER_SIZE);
+    stub_append_byte(pdu, 0x01); // Object.
+    stub_append_int(pdu, 4);
+    stub_append_string(pdu, "version", sizeof("version") - 1);
+    stub_append_string(pdu, "stub", sizeof("stub") - 1);
+    stub_append_string(pdu, "clock", sizeof("clock") - 1);
+    stub_append_string(pdu, clock, strlen(clock));
+    stub_append_string(
+        pdu, "is_fresh_instance", sizeof("is_fresh_instance") - 1
+    );
+    stub_append_byte(pdu, 0x08); // True.
+    stub_append_string(pdu, "files", sizeof("files") - 1);
+    stub_append_byte(pdu, 0x00); // Array.
+    stub_append_int(pdu, count);
+}
+
+/**
+ * Fills in the length field of the header at the start of `pdu`.
+ */
+static void stub_finish(stub_pdu_t *pdu) {
+    int64_t length = pdu->length - STUB_HEADER_SIZE;
+    memcpy(
+        pdu->data + STUB_HEADER_SIZE - sizeof(length), &length, sizeof(length)
+    );
+}
+
+/**
+ * Writes `prefix` followed by `value` in decimal to `buffer`, and returns a
+ * pointer to the end of what was written (where a NUL terminator is also
+ * written).
+ */
+static char *stub_format_decimal(
+    char *buffer, const char *prefix, unsigned value
+) {
+    while (*prefix) {
+        *buffer++ = *prefix++;
+    }
+    char digits[16];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count) {
+        *buffer++ = digits[--count];
+    }
+    *buffer = '\0';
+    return buffer;
+}
+
+/**
+ * Reads exactly `length` bytes into `buffer`. Returns false if the
+ * connection is closed first.
+ */
+static bool stub_read(int fd, char *buffer, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t count = read(fd, buffer + received, length - received);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        received += count;
+    }
+    return true;
+}
+
+static bool stub_read_int(const char **ptr, const char *end, int64_t *value) {
+    const char *p = *ptr;
+    if (p >= end) {
+        return false;
+    }
+    char marker = *p++;
+    size_t size = marker == 0x03   ? sizeof(int8_t)
+                  : marker == 0x04 ? sizeof(int16_t)
+                  : marker == 0x05 ? sizeof(int32_t)
+                  : marker == 0x06 ? sizeof(int64_t)
+                                   : 0;
+    if (!size || p + size > end) {
+        return false;
+    }
+    if (size == sizeof(int8_t)) {
+        *value = (int8_t)*p;
+    } else if (size == sizeof(int16_t)) {
+        int16_t v;
+        memcpy(&v, p, size);
+        *value = v;
+    } else if (size == sizeof(int32_t)) {
+        int32_t v;
+        memcpy(&v, p, size);
+        *value = v;
+    } else {
+        memcpy(value, p, size);
+    }
+    *ptr = p + size;
+    return true;
+}
+
+/**
+ * Reads a string, pointing `string` at its (non-NUL-terminated) contents.
+ */
+static bool stub_read_string(
+    const char **ptr, const char *end, const char **string, size_t *length
+) {
+    const char *p = *ptr;
+    int64_t value;
+    if (p >= end || *p++ != 0x02 || !stub_read_int(&p, end, &value) ||
+        value < 0 || value > end - p) {
+        return false;
+    }
+    *string = p;
+    *length = value;
+    *ptr = p + value;
+    return true;
+}
+
+/**
+ * Reads one request from `fd` and answers it, blocking until the whole of the
+ * request has arrived and the whole of the response has been written. Returns
+ * false once the connection has been closed (or has sent something we can't
+ * make sense of).
+ */
+static bool stub_respond(int fd, const stub_pdus_t *pdus) {
+    char request[STUB_REQUEST_SIZE];
+    size_t header_length = 3;
+    if (!stub_read(fd, request, header_length)) {
+        return false;
+    }
+    int64_t length;
+    while ((length = commandt_watchman_pdu_length(request, header_length)) ==
+           0) {
+        if (header_length == STUB_HEADER_SIZE ||
+            !stub_read(fd, request + header_length, 1)) {
+            return false;
+        }
+        header_length++;
+    }
+    if (length == -1 || length > STUB_REQUEST_SIZE ||
+        !stub_read(fd, request + header_length, length - header_length)) {
+        return false;
+    }
+
+    // Requests are arrays whose first element is the command name.
+    const char *ptr = request + header_length;
+    const char *end = request + length;
+    int64_t count;
+    const char *command;
+    size_t command_length;
+    if (ptr >= end || *ptr++ != 0x00 || !stub_read_int(&ptr, end, &count) ||
+        count < 1 || !stub_read_string(&ptr, end, &command, &command_length)) {
+        return false;
+    }
+    if (command_length == sizeof("query") - 1 &&
+        memcmp(command, "query", command_length) == 0) {
+        unsigned since = stub_since(ptr, end, count, pdus->count);
+        return since ? stub_write_changes(fd, since, pdus->count)
+                     : stub_write(fd, pdus->listing.data, pdus->listing.length);
+    }
+
+    // Other responses are small enough to build on the stack, without
+    // allocating.
+    char storage[STUB_REQUEST_SIZE + 256];
+    stub_pdu_t response = {
+        .data = storage, .length = 0, .capacity = sizeof(storage)
+    };
+    const char *root;
+    size_t root_length;
+    const char *name;
+    size_t name_length;
+    bool subscribed = false;
+    stub_append(&response, STUB_HEADER, STUB_HEADER_SIZE);
+    stub_append_byte(&response, 0x01); // Object.
+    stub_append_int(&response, 2);
+    stub_append_string(&response, "version", sizeof("version") - 1);
+    stub_append_string(&response, "stub", sizeof("stub") - 1);
+    if (command_length == sizeof("watch-project") - 1 &&
+        memcmp(command, "watch-project", command_length) == 0 && count > 1 &&
+        stub_read_string(&ptr, end, &root, &root_length)) {
+        stub_append_string(&response, "watch", sizeof("watch") - 1);
+        stub_append_string(&response, root, root_length);
+    } else if (command_length == sizeof("subscribe") - 1 &&
+               memcmp(command, "subscribe", command_length) == 0 &&
+               count > 2 && stub_read_string(&ptr, end, &root, &root_length) &&
+               stub_read_string(&ptr, end, &name, &name_length)) {
+        stub_append_string(&response, "subscribe", sizeof("subscribe") - 1);
+        stub_append_string(&response, name, name_length);
+        subscribed = true;
+    } else {
+        const char *error = "unsupported command";
+        stub_append_string(&response, "error", sizeof("error") - 1);
+        stub_append_string(&response, error, strlen(error));
+    }
+    stub_finish(&response);
+    if (!stub_write(fd, response.data, response.length)) {
+        return false;
+    } else if (subscribed) {
+        // Follow up with the initial listing (in two halves), and then with a
+        // fresh one.
+        size_t half = pdus->listing.length / 2;
+        struct timespec pause = {
+            .tv_sec = STUB_PAUSE / 1000,
+            .tv_nsec = STUB_PAUSE % 1000 * 1000000L,
+        };
+        if (!stub_write(fd, pdus->listing.data, half)) {
+            return false;
+        }
+        nanosleep(&pause, NULL);
+        return stub_write(
+                   fd, pdus->listing.data + half, pdus->listing.length - half
+               ) &&
+               stub_write(fd, pdus->recrawl.data, pdus->recrawl.length) &&
+               stub_write(
+                   fd,
+                   pdus->listing.data + pdus->second,
+                   pdus->listing.length - pdus->second
+               ) &&
+               stub_write(fd, pdus->tail.data, pdus->tail.length);
+    }
+    return true;
+}
+
+/**
+ * Answers requests on up to `STUB_MAX_CONNECTIONS` connections at once, until
+ * our parent goes away (or kills us first).
+ */
+static void stub_serve(int listener, pid_t parent, const stub_pdus_t *pdus) {
+    struct pollfd fds[STUB_MAX_CONNECTIONS + 1];
+    nfds_t count = 1;
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    while (getppid() == parent) {
+        if (poll(fds, count, STUB_POLL_INTERVAL) <= 0) {
+            continue;
+        }
+        for (nfds_t i = count - 1; i > 0; i--) {
+            if (fds[i].revents && !stub_respond(fds[i].fd, pdus)) {
+                close(fds[i].fd);
+                fds[i] = fds[--count];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd == -1) {
+                continue;
+            } else if (count == STUB_MAX_CONNECTIONS + 1) {
+                close(fd);
+                continue;
+            }
+            fds[count].fd = fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            count++;
+        }
+    }
+}
+
+/**
+ * Looks for a "since" clock in the query object of a "query" request (of
+ * `count` elements, of which `ptr` points at the second), and returns its
+ * tick: the stub's clocks are of the form "c:0:N", where listing `N` has the
+ * `files` files starting at file `N - 1`.
+ *
+ * Returns 0 if there is no "since" (or it isn't a clock that the stub handed
+ * out), in which case the complete listing should be sent, as Watchman does
+ * when it doesn't recognize a clock.
+ */
+static unsigned stub_since(
+    const char *ptr, const char *end, int64_t count, unsigned files
+) {
+    const char *root;
+    size_t root_length;
+    int64_t keys;
+    if (count < 3 || !stub_read_string(&ptr, end, &root, &root_length) ||
+        ptr >= end || *ptr++ != 0x01 || !stub_read_int(&ptr, end, &keys)) {
+        return 0;
+    }
+    for (int64_t i = 0; i < keys; i++) {
+        const char *key;
+        size_t key_length;
+        if (!stub_read_string(&ptr, end, &key, &key_length)) {
+            return 0;
+        } else if (key_length != sizeof("since") - 1 ||
+                   memcmp(key, "since", key_length) != 0) {
+            if (!stub_skip(&ptr, end)) {
+                return 0;
+            }
+            continue;
+        }
+        const char *clock;
+        size_t clock_length;
+        if (!stub_read_string(&ptr, end, &clock, &clock_length) ||
+            clock_length <= sizeof("c:0:") - 1 ||
+            memcmp(clock, "c:0:", sizeof("c:0:") - 1) != 0) {
+            return 0;
+        }
+        uint64_t tick = 0;
+        for (size_t j = sizeof("c:0:") - 1; j < clock_length; j++) {
+            if (clock[j] < '0' || clock[j] > '9') {
+                return 0;
+            }
+            tick = tick * 10 + (clock[j] - '0');
+            if (tick > UINT_MAX - files - 1) {
+                return 0;
+            }
+        }
+        return tick;
+    }
+    return 0;
+}
+
+/**
+ * Skips over one value of a request.
+ */
+static bool stub_skip(const char **ptr, const char *end) {
+    const char *p = *ptr;
+    if (p >= end) {
+        return false;
+    }
+    char marker = *p;
+    int64_t count;
+    const char *string;
+    size_t length;
+    if (marker == 0x00 || marker == 0x01) { // Array or object.
+        p++;
+        if (!stub_read_int(&p, end, &count)) {
+            return false;
+        }
+        for (int64_t i = 0; i < count; i++) {
+            if (marker == 0x01 &&
+                !stub_read_string(&p, end, &string, &length)) {
+                return false;
+            } else if (!stub_skip(&p, end)) {
+                return false;
+            }
+        }
+    } else if (marker == 0x02) {
+        if (!stub_read_string(&p, end, &string, &length)) {
+            return false;
+        }
+    } else if (marker >= 0x03 && marker <= 0x06) {
+        if (!stub_read_int(&p, end, &count)) {
+            return false;
+        }
+    } else if (marker == 0x07 && end - p > 8) { // Double.
+        p += 9;
+    } else if (marker >= 0x08 && marker <= 0x0a) { // True, false or null.
+        p++;
+    } else {
+        return false;
+    }
+    *ptr = p;
+    return true;
+}
+
+/**
+ * Writes all `length` bytes of `data`. Returns false if the connection is
+ * closed first.
+ */
+static bool stub_write(int fd, const char *data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t count = write(fd, data + sent, length - sent);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+/**
+ * Answers a query for the changes since listing `since` (see `stub_since()`)
+ * of `count` files: by the time of the next listing, the first file has been
+ * deleted, and a new one created at the end.
+ */
+static bool stub_write_changes(int fd, unsigned since, unsigned count) {
+    char storage[512];
+    stub_pdu_t response = {
+        .data = storage, .length = 0, .capacity = sizeof(storage)
+    };
+    char clock[32];
+    size_t clock_length = stub_format_decimal(clock, "c:0:", since + 1) - clock;
+    char name[64];
+    stub_append(&response, STUB_HEADER, STUB_HEADER_SIZE);
+    stub_append_byte(&response, 0x01); // Object.
+    stub_append_int(&response, 4);
+    stub_append_string(&response, "version", sizeof("version") - 1);
+    stub_append_string(&response, "stub", sizeof("stub") - 1);
+    stub_append_string(&response, "clock", sizeof("clock") - 1);
+    stub_append_string(&response, clock, clock_length);
+    stub_append_string(
+        &response, "is_fresh_instance", sizeof("is_fresh_instance") - 1
+    );
+    stub_append_byte(&response, 0x09); // False.
+    stub_append_string(&response, "files", sizeof("files") - 1);
+    stub_append_byte(&response, 0x0b); // Template.
+    stub_append_byte(&response, 0x00); // Array.
+    stub_append_int(&response, 3);
+    stub_append_string(&response, "name", sizeof("name") - 1);
+    stub_append_string(&response, "exists", sizeof("exists") - 1);
+    stub_append_string(&response, "new", sizeof("new") - 1);
+    stub_append_int(&response, count ? 2 : 0);
+    if (count) {
+        stub_append_string(
+            &response, name, watchman_stub_name(since - 1, name)
+        );
+        stub_append_byte(&response, 0x09); // Doesn't exist.
+        stub_append_byte(&response, 0x09); // Isn't new.
+        stub_append_string(
+            &response, name, watchman_stub_name(since - 1 + count, name)
+        );
+        stub_append_byte(&response, 0x08); // Exists.
+        stub_append_byte(&response, 0x08); // Is new.
+    }
+    stub_finish(&response);
+    return stub_write(fd, response.data, response.length);
+}
@@ -0,0 +1,73 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A stand-in for the Watchman server, for benchmarking (and testing) the
+ * client side of `commandt_watchman_query()` and friends without a real
+ * Watchman daemon (whose timings depend on what it happens to be watching, and
+ * which isn't available in CI).
+ *
+ * The stub listens on a Unix socket and answers, in BSER, the subset of
+ * commands that Command-T sends:
+ *
+ * - "watch-project" reports that the directory is a watched root of its own.
+ * - "query" lists a synthetic set of files, the same every time, no matter
+ *   which root, expression or fields were asked for. Given a "since" clock
+ *   from an earlier response, it instead reports what has changed since then:
+ *   the first file of that listing has been deleted, and a new one created at
+ *   the end (so successive queries see the files come and go one at a time).
+ * - "subscribe" is acknowledged, and followed by the same listing (sent in
+ *   two halves, with a pause in between, so that the client has a chance to
+ *   use the first part of it before the rest arrives); then, as if Watchman
+ *   had recrawled the tree, by a fresh listing in which the first file has
+ *   been replaced by a new one at the end.
+ *
+ * Anything else gets an "error" response. The listings are encoded up front,
+ * so answering a query costs the stub no more than writing it to the socket.
+ *
+ * The stub runs in a child process, so that the time it spends doesn't count
+ * against the CPU time of the process being benchmarked.
+ */
+
+#ifndef STUB_H
+#define STUB_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define watchman_stub_free commandt_watchman_stub_free
+#define watchman_stub_name commandt_watchman_stub_name
+#define watchman_stub_new commandt_watchman_stub_new
+
+#include <stddef.h> /* for size_t */
+
+typedef struct watchman_stub_t watchman_stub_t;
+
+/**
+ * Starts a stub that listens on `socket_path` (replacing any existing file
+ * there) and answers each query with `count` files, named as by
+ * `watchman_stub_name()`.
+ *
+ * Returns NULL on failure. The caller should dispose of the result with
+ * `watchman_stub_free()`.
+ */
+watchman_stub_t *watchman_stub_new(const char *socket_path, unsigned count);
+
+/**
+ * Writes the name of the file at `index` in the stub's listing to `buffer`,
+ * which must have room for at least 64 bytes, and returns its length (not
+ * counting the NUL terminator).
+ *
+ * Names are spread over a few levels of directories (eg.
+ * "lib12/src34/file5678.c"), with a mixture of extensions.
+ */
+size_t watchman_stub_name(unsigned index, char *buffer);
+
+/**
+ * Stops the stub and removes its socket.
+ */
+void watchman_stub_free(watchman_stub_t *stub);
+
+#endif
@@ -0,0 +1,647 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "subscription.h"
+
+#include <pthread.h> /* for pthread_create(), pthread_mutex_lock() etc */
+#include <stdatomic.h> /* for atomic_bool, atomic_load(), atomic_store() */
+#include <stdbool.h> /* for bool, false, true */
+#include <stdint.h> /* for uint32_t */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcmp(), memcpy() */
+#include <sys/socket.h> /* for SHUT_RDWR, shutdown() */
+
+#include "debug.h"
+#include "die.h" /* for die() */
+#include "scanner.h" /* for scanner_add(), scanner_remove() etc */
+#include "watchman.h" /* for commandt_watchman_subscribe() etc */
+#include "xmalloc.h"
+#include "xmap.h" /* for xmap(), xmap_round(), xmunmap() */
+#include "xstrdup.h" /* for xstrdup() */
+
+// Name under which we subscribe; subscriptions are scoped to a connection, so
+// it only needs to be unique within one.
+#define SUBSCRIPTION_NAME "command-t"
+
+// Minimum capacity of the path-to-index hash table (must be a power of 2).
+#define SLOTS_INITIAL_CAPACITY 1024
+
+// Don't bother compacting the scanner for fewer tombstones than this.
+#define TOMBSTONES_COMPACT_THRESHOLD 1024
+
+/**
+ * Slot in the hash table that maps paths to their positions in the scanner's
+ * `candidates` array. We store `index + 1`, so that 0 can mark empty slots.
+ */
+typedef struct {
+    uint32_t hash;
+    unsigned index;
+} subscription_slot_t;
+
+struct subscription_t {
+    int socket;
+
+    /**
+     * Set if we query for changes instead of subscribing to them, in which
+     * case we need the root and relative path to query, a copy of the filter
+     * to query with, and the `clock` of the last result; none of the fields
+     * used by the background thread (`mutex`, `pending`, `lost`, `stopping`
+     * and `thread`) are used.
+     */
+    bool poll;
+    char *root;
+    char *relative_root;
+    watchman_filter_t *filter;
+    char *clock;
+
+    scanner_t *scanner;
+
+    /**
+     * Open-addressed hash table mapping candidate paths to indices.
+     */
+    subscription_slot_t *slots;
+    size_t slots_capacity;
+    size_t slots_count;
+
+    /**
+     * Protects `pending`, `partial`, `ready` and `lost`, which are written by
+     * the background thread and consumed by `subscription_scanner()`.
+     */
+    pthread_mutex_t mutex;
+
+    /**
+     * PDUs received since the last call to `subscription_scanner()`, in
+     * order; each one owns the buffer that its `files` point into.
+     */
+    watchman_query_t **pending;
+    unsigned pending_count;
+    unsigned pending_capacity;
+
+    /**
+     * While the initial listing is arriving, the PDU that is being decoded,
+     * of which the first `partial_count` files are ready to use, and the
+     * first `partial_applied` have been added to the scanner.
+     */
+    const watchman_query_t *partial;
+    unsigned partial_count;
+    unsigned partial_applied;
+
+    /**
+     * Set once some (or all) of the initial listing has arrived; signalled
+     * via `ready_cond`.
+     */
+    bool ready;
+    pthread_cond_t ready_cond;
+
+    /**
+     * Set when the connection drops (or Watchman sends something we can't
+     * make sense of), at which point we can no longer keep up.
+     */
+    bool lost;
+
+    /**
+     * Set by `subscription_free()` so that the background thread doesn't
+     * mistake the shutdown of the socket for a lost connection.
+     */
+    atomic_bool stopping;
+
+    pthread_t thread;
+};
+
+// Forward declarations.
+static void subscription_apply(
+    subscription_t *subscription, const watchman_query_t *changes
+);
+static void subscription_compact(subscription_t *subscription);
+static uint32_t subscription_hash(const char *path, size_t length);
+static void subscription_index(subscription_t *subscription);
+static scanner_t *subscription_poll(subscription_t *subscription);
+static void subscription_progress(
+    const watchman_query_t *partial, void *context
+);
+static void subscription_replace(
+    subscription_t *subscription, const watchman_query_t *listing
+);
+static size_t subscription_slot(
+    subscription_t *subscription,
+    const char *path,
+    size_t length,
+    uint32_t hash
+);
+static void subscription_slot_delete(
+    subscription_t *subscription, size_t slot
+);
+static void *subscription_watch(void *arg);
+
+subscription_t *subscription_new(
+    const char *socket_path,
+    const char *directory,
+    const watchman_filter_t *filter,
+    bool poll
+) {
+    int socket = commandt_watchman_connect(socket_path);
+    if (socket == -1) {
+        DEBUG_LOG("subscription_new(): failed to connect to Watchman\n");
+        return NULL;
+    }
+
+    watchman_watch_project_t *project =
+        commandt_watchman_watch_project(directory, socket);
+    if (project->error) {
+        DEBUG_LOG("subscription_new(): %s\n", project->error);
+        commandt_watchman_watch_project_free(project);
+        commandt_watchman_disconnect(socket);
+        return NULL;
+    }
+    watchman_query_t *listing =
+        poll ? commandt_watchman_query(
+                   project->watch,
+                   project->relative_path,
+                   NULL,
+                   filter,
+                   0,
+                   socket
+               )
+             : commandt_watchman_subscribe(
+                   project->watch,
+                   project->relative_path,
+                   SUBSCRIPTION_NAME,
+                   filter,
+                   socket
+               );
+    if (listing->error || (poll && !listing->clock)) {
+        DEBUG_LOG(
+            "subscription_new(): %s\n",
+            listing->error ? listing->error : "no clock"
+        );
+        commandt_watchman_query_free(listing);
+        commandt_watchman_watch_project_free(project);
+        commandt_watchman_disconnect(socket);
+        return NULL;
+    }
+
+    // When subscribing, `listing` is just the acknowledgement, and the
+    // scanner starts out empty.
+    subscription_t *subscription = xcalloc(1, sizeof(subscription_t));
+    subscription->socket = socket;
+    subscription->scanner = xcalloc(1, sizeof(scanner_t));
+    subscription_replace(subscription, listing);
+    if (poll) {
+        DEBUG_LOG(
+            "subscription_new(): %u files\n", subscription->scanner->count
+        );
+        subscription->poll = true;
+        subscription->root = xstrdup(project->watch);
+        subscription->relative_root = project->relative_path
+                                          ? xstrdup(project->relative_path)
+                                          : NULL;
+        subscription->filter = commandt_watchman_filter_copy(filter);
+        subscription->clock = xstrdup(listing->clock);
+    }
+    commandt_watchman_query_free(listing);
+    commandt_watchman_watch_project_free(project);
+    if (poll) {
+        return subscription;
+    }
+
+    pthread_mutex_init(&subscription->mutex, NULL);
+    pthread_cond_init(&subscription->ready_cond, NULL);
+    int err = pthread_create(
+        &subscription->thread, NULL, subscription_watch, subscription
+    );
+    if (err != 0) {
+        die("pthread_create() failed", err);
+    }
+
+    // The background thread receives the initial listing; wait until there's
+    // something to show, but not (if it's large) for all of it.
+    pthread_mutex_lock(&subscription->mutex);
+    while (!subscription->ready && !subscription->lost) {
+        pthread_cond_wait(&subscription->ready_cond, &subscription->mutex);
+    }
+    bool lost = subscription->lost;
+    pthread_mutex_unlock(&subscription->mutex);
+    if (lost) {
+        subscription_free(subscription);
+        return NULL;
+    }
+
+    return subscription;
+}
+
+scanner_t *subscription_scanner(subscription_t *subscription) {
+    if (subscription->poll) {
+        return subscription_poll(subscription);
+    }
+
+    pthread_mutex_lock(&subscription->mutex);
+    bool lost = subscription->lost;
+    watchman_query_t **pending = subscription->pending;
+    unsigned pending_count = subscription->pending_count;
+    subscription->pending = NULL;
+    subscription->pending_count = 0;
+    subscription->pending_capacity = 0;
+
+    // Nothing is pending while the initial listing is still arriving, so we
+    // can add the part that has been decoded since last time. It must be done
+    // while holding the lock, because the PDU is still being written to.
+    // Once the listing is complete, it replaces these candidates wholesale.
+    const watchman_query_t *partial = subscription->partial;
+    if (partial && !lost) {
+        for (unsigned i = subscription->partial_applied;
+             i < subscription->partial_count;
+             i++) {
+            const str_t *file = &partial->files[i];
+            if (file->contents && (!partial->exists || partial->exists[i])) {
+                scanner_add(
+                    subscription->scanner, file->contents, file->length
+                );
+            }
+        }
+        subscription->partial_applied = subscription->partial_count;
+    }
+    pthread_mutex_unlock(&subscription->mutex);
+
+    for (unsigned i = 0; i < pending_count; i++) {
+        if (!lost) {
+            if (pending[i]->is_fresh_instance) {
+                subscription_replace(subscription, pending[i]);
+            } else {
+                subscription_apply(subscription, pending[i]);
+            }
+        }
+        commandt_watchman_query_free(pending[i]);
+    }
+    free(pending);
+    if (lost) {
+        return NULL;
+    }
+
+    subscription_compact(subscription);
+    return subscription->scanner;
+}
+
+void subscription_free(subscription_t *subscription) {
+    if (subscription->poll) {
+        commandt_watchman_disconnect(subscription->socket);
+        free(subscription->root);
+        free(subscription->relative_root);
+        commandt_watchman_filter_free(subscription->filter);
+        free(subscription->clock);
+    } else {
+        // Wake the background thread out of its `recv()`; closing the
+        // connection also ends the subscription.
+        atomic_store(&subscription->stopping, true);
+        shutdown(subscription->socket, SHUT_RDWR);
+        int err = pthread_join(subscription->thread, NULL);
+        if (err != 0) {
+            die("pthread_join() failed", err);
+        }
+        commandt_watchman_disconnect(subscription->socket);
+
+        for (unsigned i = 0; i < subscription->pending_count; i++) {
+            commandt_watchman_query_free(subscription->pending[i]);
+        }
+        free(subscription->pending);
+        pthread_cond_destroy(&subscription->ready_cond);
+        pthread_mutex_destroy(&subscription->mutex);
+    }
+    scanner_free(subscription->scanner);
+    free(subscription->slots);
+    free(subscription);
+}
+
+/**
+ * Adds the files in `changes` that exist, and removes those that don't.
+ */
+static void subscription_apply(
+    subscription_t *subscription, const watchman_query_t *changes
+) {
+    for (unsigned i = 0; i < changes->count; i++) {
+        const str_t *file = &changes->files[i];
+        if (!file->contents) {
+            continue;
+        }
+        bool exists = !changes->exists || changes->exists[i];
+        if (exists && changes->is_new && !changes->is_new[i]) {
+            // Merely modified, so we must have it already; skip the lookup.
+            continue;
+        }
+        if (subscription->slots_count * 2 >= subscription->slots_capacity) {
+            subscription_index(subscription);
+        }
+        uint32_t hash = subscription_hash(file->contents, file->length);
+        size_t slot =
+            subscription_slot(subscription, file->contents, file->length, hash);
+        unsigned index = subscription->slots[slot].index;
+        if (exists) {
+            // A file may be deleted and re-created in between updates, so
+            // this may be a no-op.
+            if (!index) {
+                subscription->slots[slot].hash = hash;
+                unsigned added = scanner_add(
+                    subscription->scanner, file->contents, file->length
+                );
+                subscription->slots[slot].index = added + 1;
+                subscription->slots_count++;
+            }
+        } else if (index) {
+            subscription_slot_delete(subscription, slot);
+            scanner_remove(subscription->scanner, index - 1);
+        }
+    }
+}
+
+/**
+ * Removals leave tombstones behind; once they make up more than half of the
+ * scanner, squeeze them out (at the cost of making matchers start over).
+ */
+static void subscription_compact(subscription_t *subscription) {
+    scanner_t *scanner = subscription->scanner;
+    if (scanner->tombstones > TOMBSTONES_COMPACT_THRESHOLD &&
+        scanner->tombstones > scanner->count / 2) {
+        scanner_compact(scanner);
+        subscription_index(subscription);
+    }
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t subscription_hash(const char *path, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * (Re)builds the hash table mapping paths to candidate indices, sizing it
+ * with room to grow.
+ */
+static void subscription_index(subscription_t *subscription) {
+    scanner_t *scanner = subscription->scanner;
+    free(subscription->slots);
+    subscription->slots_capacity = SLOTS_INITIAL_CAPACITY;
+    while (subscription->slots_capacity <
+           (size_t)(scanner->count - scanner->tombstones) * 4) {
+        subscription->slots_capacity *= 2;
+    }
+    subscription->slots =
+        xcalloc(subscription->slots_capacity, sizeof(subscription_slot_t));
+    subscription->slots_count = 0;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t *candidate = &scanner->candidates[i];
+        if (!candidate->contents) {
+            continue;
+        }
+        uint32_t hash =
+            subscription_hash(candidate->contents, candidate->length);
+        size_t slot = subscription_slot(
+            subscription, candidate->contents, candidate->length, hash
+        );
+        if (!subscription->slots[slot].index) {
+            subscription->slots[slot].hash = hash;
+            subscription->slots[slot].index = i + 1;
+            subscription->slots_count++;
+        }
+    }
+}
+
+/**
+ * Queries for the files that have changed since the last query, and applies
+ * the changes. Returns NULL if the query fails.
+ */
+static scanner_t *subscription_poll(subscription_t *subscription) {
+    watchman_query_t *changes = commandt_watchman_query(
+        subscription->root,
+        subscription->relative_root,
+        subscription->clock,
+        subscription->filter,
+        0,
+        subscription->socket
+    );
+    if (changes->error || !changes->clock) {
+        DEBUG_LOG(
+            "subscription_poll(): %s\n",
+            changes->error ? changes->error : "no clock"
+        );
+        commandt_watchman_query_free(changes);
+        return NULL;
+    }
+    DEBUG_LOG(
+        "subscription_poll(): %u changes since %s%s\n",
+        changes->count,
+        subscription->clock,
+        changes->is_fresh_instance ? " (fresh instance)" : ""
+    );
+    if (changes->is_fresh_instance) {
+        subscription_replace(subscription, changes);
+    } else {
+        subscription_apply(subscription, changes);
+    }
+    free(subscription->clock);
+    subscription->clock = xstrdup(changes->clock);
+    commandt_watchman_query_free(changes);
+
+    subscription_compact(subscription);
+    return subscription->scanner;
+}
+
+/**
+ * Makes the part of the initial listing that has been decoded so far
+ * available to `subscription_scanner()`. Called on the background thread.
+ */
+static void subscription_progress(
+    const watchman_query_t *partial, void *context
+) {
+    subscription_t *subscription = context;
+    pthread_mutex_lock(&subscription->mutex);
+    subscription->partial = partial;
+    subscription->partial_count = partial->count;
+    if (!subscription->ready) {
+        subscription->ready = true;
+        pthread_cond_signal(&subscription->ready_cond);
+    }
+    pthread_mutex_unlock(&subscription->mutex);
+}
+
+/**
+ * Swaps the scanner's candidates for copies of the files in `listing` (a
+ * complete listing, as opposed to a set of changes).
+ *
+ * The copies go into a single slab, so that we don't have to hold on to the
+ * (much larger) PDU that they came from.
+ */
+static void subscription_replace(
+    subscription_t *subscription, const watchman_query_t *listing
+) {
+    unsigned count = 0;
+    size_t size = 0;
+    for (unsigned i = 0; i < listing->count; i++) {
+        if (listing->files[i].contents &&
+            (!listing->exists || listing->exists[i])) {
+            count++;
+            size += listing->files[i].length + 1; // Include NUL byte.
+        }
+    }
+
+    scanner_t *scanner = subscription->scanner;
+    for (unsigned i = 0; i < scanner->count; i++) {
+        str_t *candidate = &scanner->candidates[i];
+        if (candidate->capacity >= 0) {
+            free((void *)candidate->contents);
+        }
+    }
+    if (scanner->candidates) {
+        xmunmap(scanner->candidates, scanner->candidates_size);
+    }
+    if (scanner->buffer) {
+        xmunmap(scanner->buffer, scanner->buffer_size);
+    }
+    scanner->candidates = NULL;
+    scanner->candidates_size = 0;
+    scanner->buffer = NULL;
+    scanner->buffer_size = 0;
+    scanner->count = 0;
+    scanner->tombstones = 0;
+    scanner->clock++;
+    scanner->generation++;
+
+    if (count) {
+        scanner->candidates_size = xmap_round(count * sizeof(str_t));
+        scanner->candidates = xmap(scanner->candidates_size);
+        scanner->buffer_size = xmap_round(size);
+        scanner->buffer = xmap(scanner->buffer_size);
+        char *cursor = scanner->buffer;
+        for (unsigned i = 0; i < listing->count; i++) {
+            const str_t *file = &listing->files[i];
+            if (file->contents && (!listing->exists || listing->exists[i])) {
+                memcpy(cursor, file->contents, file->length);
+                cursor[file->length] = '\0';
+                str_init(
+                    &scanner->candidates[scanner->count++], cursor, file->length
+                );
+                cursor += file->length + 1;
+            }
+        }
+    }
+
+    subscription_index(subscription);
+}
+
+/**
+ * Returns the slot that holds `path`, or else the empty slot where it would
+ * go.
+ */
+static size_t subscription_slot(
+    subscription_t *subscription,
+    const char *path,
+    size_t length,
+    uint32_t hash
+) {
+    str_t *candidates = subscription->scanner->candidates;
+    size_t mask = subscription->slots_capacity - 1;
+    size_t slot = hash & mask;
+    while (subscription->slots[slot].index) {
+        subscription_slot_t *entry = &subscription->slots[slot];
+        if (entry->hash == hash) {
+            str_t *candidate = &candidates[entry->index - 1];
+            if (candidate->length == length &&
+                memcmp(candidate->contents, path, length) == 0) {
+                break;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Empties `slot`, shifting later members of the same probe sequence back so
+ * that lookups don't need tombstones.
+ */
+static void subscription_slot_delete(
+    subscription_t *subscription, size_t slot
+) {
+    size_t mask = subscription->slots_capacity - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; subscription->slots[next].index;
+         next = (next + 1) & mask) {
+        size_t home = subscription->slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            subscription->slots[hole] = subscription->slots[next];
+            hole = next;
+        }
+    }
+    subscription->slots[hole].index = 0;
+    subscription->slots_count--;
+}
+
+/**
+ * Receives PDUs from Watchman and queues them for `subscription_scanner()`.
+ * Runs on a background thread until the connection is shut down.
+ *
+ * Parts of the initial listing are published as they arrive (see
+ * `subscription_progress()`).
+ */
+static void *subscription_watch(void *arg) {
+    subscription_t *subscription = arg;
+    bool listed = false;
+    watchman_query_t *changes;
+    while ((changes = commandt_watchman_receive(
+                subscription->socket,
+                listed ? NULL : subscription_progress,
+                subscription
+            ))) {
+        pthread_mutex_lock(&subscription->mutex);
+        subscription->partial = NULL;
+        if (changes->error) {
+            pthread_mutex_unlock(&subscription->mutex);
+            DEBUG_LOG("subscription_watch(): %s\n", changes->error);
+            commandt_watchman_query_free(changes);
+            break;
+        } else if (!changes->count && !changes->is_fresh_instance) {
+            pthread_mutex_unlock(&subscription->mutex);
+            commandt_watchman_query_free(changes);
+            continue;
+        }
+
+        if (changes->is_fresh_instance) {
+            listed = true;
+            if (!subscription->ready) {
+                subscription->ready = true;
+                pthread_cond_signal(&subscription->ready_cond);
+            }
+
+            // Anything still pending is superseded.
+            for (unsigned i = 0; i < subscription->pending_count; i++) {
+                commandt_watchman_query_free(subscription->pending[i]);
+            }
+            subscription->pending_count = 0;
+        }
+        if (subscription->pending_count == subscription->pending_capacity) {
+            unsigned capacity = subscription->pending_capacity;
+            subscription->pending_capacity = capacity ? capacity * 2 : 16;
+            subscription->pending = xrealloc(
+                subscription->pending,
+                subscription->pending_capacity * sizeof(watchman_query_t *)
+            );
+        }
+        subscription->pending[subscription->pending_count++] = changes;
+        pthread_mutex_unlock(&subscription->mutex);
+    }
+
+    if (!atomic_load(&subscription->stopping)) {
+        DEBUG_LOG("subscription_watch(): lost connection to Watchman\n");
+        pthread_mutex_lock(&subscription->mutex);
+        subscription->lost = true;
+        pthread_cond_signal(&subscription->ready_cond);
+        pthread_mutex_unlock(&subscription->mutex);
+    }
+    return NULL;
+}
@@ -0,0 +1,85 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A long-lived Watchman scanner that keeps itself up-to-date.
+ *
+ * Instead of running a "query" (and receiving, parsing and mapping the entire
+ * file list) every time, we open a dedicated connection to Watchman and
+ * "subscribe" to the root. The initial listing populates the scanner, and
+ * from then on Watchman pushes a PDU whenever files are added or removed,
+ * which a background thread appends to a queue of pending changes. As with
+ * `live_scanner_t`, the queue is applied to the scanner's candidates on the
+ * caller's thread, the next time it calls `subscription_scanner()`, so the
+ * candidates never change underneath a running matcher.
+ *
+ * If Watchman sends a fresh listing (eg. after recrawling the tree), it
+ * replaces the candidates wholesale.
+ *
+ * The initial listing is received on the background thread too, and is
+ * decoded as it arrives, so in a large tree the first files can be shown
+ * before the rest of them have even been sent; until the listing is
+ * complete, each call to `subscription_scanner()` adds whatever more of it
+ * has been decoded.
+ *
+ * A lighter-weight alternative is to poll: no subscription is made (and no
+ * thread is started), but the clock reported with each listing is recorded,
+ * and every call to `subscription_scanner()` runs a query for only the files
+ * that have changed since then. This costs a round trip per call, but one
+ * whose size is proportional to the number of changes rather than to the
+ * size of the tree.
+ */
+
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define subscription_free commandt_subscription_free
+#define subscription_new commandt_subscription_new
+#define subscription_scanner commandt_subscription_scanner
+
+#include "commandt.h" /* for scanner_t */
+#include "watchman.h" /* for watchman_filter_t */
+
+typedef struct subscription_t subscription_t;
+
+/**
+ * Connects to the Watchman server listening on `socket_path`, watches
+ * `directory` (an absolute path) and subscribes to changes in it (or, if
+ * `poll` is true, just lists its files). When subscribing, returns as soon as
+ * the first part of the initial listing has arrived.
+ *
+ * Only files that pass `filter` (which may be NULL) are listed, and only
+ * changes to them reported; see `watchman_filter_t`.
+ *
+ * Returns NULL if any of that fails. The caller should dispose of the result
+ * with `subscription_free()`.
+ */
+subscription_t *subscription_new(
+    const char *socket_path,
+    const char *directory,
+    const watchman_filter_t *filter,
+    bool poll
+);
+
+/**
+ * Applies any pending changes (when polling, after querying for them) and
+ * returns the up-to-date scanner.
+ *
+ * The scanner is owned by `subscription`, and remains valid until
+ * `subscription` is freed. Whenever its candidates change, its `clock` is
+ * incremented.
+ *
+ * Returns NULL if the connection to Watchman has been lost (eg. because the
+ * server exited), in which case changes can no longer be tracked, and the
+ * caller should free the subscription and start over.
+ */
+scanner_t *subscription_scanner(subscription_t *subscription);
+
+void subscription_free(subscription_t *subscription);
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "union.h"
+
+#include <assert.h> /* for assert() */
+#include <pthread.h> /* for pthread_create(), pthread_join() */
+#include <stdbool.h> /* for bool */
+#include <stdint.h> /* for uint32_t */
+#include <stdlib.h> /* for free() */
+#include <string.h> /* for memcmp(), memcpy(), strlen() */
+
+#include "debug.h"
+#include "die.h" /* for die() */
+#include "paths.h" /* for paths_get() */
+#include "scanner.h" /* for scanner_get(), scanner_new_command() etc */
+#include "watchman.h" /* for commandt_watchman_connect() etc */
+#include "xmalloc.h"
+#include "xmap.h" /* for xmap(), xmap_round(), xmremap() */
+
+// Minimum capacity of the hash table used to spot duplicates (must be a power
+// of 2).
+#define SLOTS_INITIAL_CAPACITY 1024
+
+/**
+ * Scanning state for one source.
+ */
+typedef struct {
+    const union_source_t *source;
+
+    /**
+     * Result of scanning a `UNION_SOURCE_COMMAND` or `UNION_SOURCE_FILE`.
+     */
+    scanner_t *scanner;
+
+    /**
+     * Result of querying a `UNION_SOURCE_WATCHMAN`.
+     */
+    watchman_query_t *query;
+
+    /**
+     * Room to reassemble candidates in, if the source is a compressed
+     * `UNION_SOURCE_SCANNER`; NULL otherwise.
+     */
+    char *path;
+
+    pthread_t thread;
+    bool threaded;
+} union_job_t;
+
+/**
+ * Slot in the hash table used to spot duplicates. `index` is stored plus one,
+ * so that 0 can mark empty slots.
+ */
+typedef struct {
+    uint32_t hash;
+    unsigned index;
+} union_slot_t;
+
+// Forward declarations.
+static uint32_t union_hash(const char *str, size_t length);
+static unsigned union_job_count(const union_job_t *job);
+static str_t union_job_get(const union_job_t *job, unsigned index);
+static void *union_scan(void *arg);
+
+scanner_t *union_scanner_new(const union_source_t *sources, unsigned count) {
+    // Callers (ie. `lib.union_scanner()`) check this for us.
+    assert(count <= UNION_MAX_SOURCES);
+
+    // As in the matcher, the main thread acts as the last worker. With only
+    // one processor, running sources side by side just has them contend for
+    // it (file walks are multi-threaded already), so we take them in turn.
+    bool concurrent = commandt_processors() > 1;
+    union_job_t *jobs = xcalloc(count, sizeof(union_job_t));
+    for (unsigned i = 0; i < count; i++) {
+        jobs[i].source = &sources[i];
+        if (sources[i].kind == UNION_SOURCE_SCANNER) {
+            scanner_t *source_scanner = sources[i].scanner;
+            if (source_scanner && source_scanner->paths) {
+                jobs[i].path = xmalloc(source_scanner->paths->max_length + 1);
+            }
+            continue;
+        } else if (i == count - 1 || !concurrent) {
+            continue;
+        }
+        int err = pthread_create(&jobs[i].thread, NULL, union_scan, &jobs[i]);
+        if (err != 0) {
+            die("pthread_create() failed", err);
+        }
+        jobs[i].threaded = true;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (!jobs[i].threaded && sources[i].kind != UNION_SOURCE_SCANNER) {
+            union_scan(&jobs[i]);
+        }
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (jobs[i].threaded) {
+            int err = pthread_join(jobs[i].thread, NULL);
+            if (err != 0) {
+                die("pthread_join() failed", err);
+            }
+        }
+    }
+
+    // Size the slabs for the worst case (no duplicates), and trim them later.
+    size_t total = 0;
+    size_t size = 0;
+    for (unsigned i = 0; i < count; i++) {
+        size_t prefix_length =
+            sources[i].prefix ? strlen(sources[i].prefix) : 0;
+        unsigned job_count = union_job_count(&jobs[i]);
+        for (unsigned j = 0; j < job_count; j++) {
+            str_t str = union_job_get(&jobs[i], j);
+            if (str.contents) {
+                total++;
+                size += prefix_length + str.length + 1; // Include NUL byte.
+            }
+        }
+    }
+
+    scanner_t *scanner = xcalloc(1, sizeof(scanner_t));
+    scanner->source_weights = xmalloc((count ? count : 1) * sizeof(float));
+    for (unsigned i = 0; i < count; i++) {
+        scanner->source_weights[i] = sources[i].weight;
+    }
+    if (total) {
+        scanner->candidates_size = xmap_round(total * sizeof(str_t));
+        scanner->candidates = xmap(scanner->candidates_size);
+        scanner->buffer_size = xmap_round(size);
+        scanner->buffer = xmap(scanner->buffer_size);
+        scanner->sources = xmalloc(total);
+
+        size_t slots_capacity = SLOTS_INITIAL_CAPACITY;
+        while (slots_capacity < total * 2) {
+            slots_capacity *= 2;
+        }
+        size_t mask = slots_capacity - 1;
+        union_slot_t *slots = xcalloc(slots_capacity, sizeof(union_slot_t));
+
+        char *cursor = scanner->buffer;
+        for (unsigned i = 0; i < count; i++) {
+            const char *prefix = sources[i].prefix;
+            size_t prefix_length = prefix ? strlen(prefix) : 0;
+            unsigned job_count = union_job_count(&jobs[i]);
+            for (unsigned j = 0; j < job_count; j++) {
+                str_t str = union_job_get(&jobs[i], j);
+                if (!str.contents) {
+                    continue;
+                }
+
+                // Assemble the candidate in place, and only keep it (ie.
+                // advance `cursor`) if we haven't seen it before.
+                size_t length = prefix_length + str.length;
+                if (prefix_length) {
+                    memcpy(cursor, prefix, prefix_length);
+                }
+                memcpy(cursor + prefix_length, str.contents, str.length);
+                cursor[length] = '\0';
+                uint32_t hash = union_hash(cursor, length);
+                size_t slot = hash & mask;
+                bool duplicate = false;
+                while (slots[slot].index) {
+                    str_t *other = &scanner->candidates[slots[slot].index - 1];
+                    if (slots[slot].hash == hash && other->length == length &&
+                        memcmp(other->contents, cursor, length) == 0) {
+                        duplicate = true;
+                        break;
+                    }
+                    slot = (slot + 1) & mask;
+                }
+                if (duplicate) {
+                    continue;
+                }
+                slots[slot].hash = hash;
+                slots[slot].index = scanner->count + 1;
+                str_init(&scanner->candidates[scanner->count], cursor, length);
+                scanner->sources[scanner->count++] = i;
+                cursor += length + 1;
+            }
+        }
+        free(slots);
+
+        // Give back what duplicates left unused; shrinking never moves.
+        size_t candidates_size = xmap_round(scanner->count * sizeof(str_t));
+        scanner->candidates = xmremap(
+            scanner->candidates, scanner->candidates_size, candidates_size
+        );
+        scanner->candidates_size = candidates_size;
+        size_t buffer_size = xmap_round(cursor - scanner->buffer);
+        scanner->buffer =
+            xmremap(scanner->buffer, scanner->buffer_size, buffer_size);
+        scanner->buffer_size = buffer_size;
+        scanner->sources = xrealloc(scanner->sources, scanner->count);
+    }
+    DEBUG_LOG(
+        "union_scanner_new(): %u candidates (%u duplicates) from %u sources\n",
+        scanner->count,
+        (unsigned)total - scanner->count,
+        count
+    );
+
+    for (unsigned i = 0; i < count; i++) {
+        if (jobs[i].scanner) {
+            scanner_free(jobs[i].scanner);
+        }
+        if (jobs[i].query) {
+            commandt_watchman_query_free(jobs[i].query);
+        }
+        free(jobs[i].path);
+    }
+    free(jobs);
+    return scanner;
+}
+
+/**
+ * 32-bit FNV-1a.
+ */
+static uint32_t union_hash(const char *str, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the number of candidates produced by `job` (including any
+ * tombstones, in the case of a `UNION_SOURCE_SCANNER`).
+ */
+static unsigned union_job_count(const union_job_t *job) {
+    if (job->source->kind == UNION_SOURCE_SCANNER) {
+        return job->source->scanner ? job->source->scanner->count : 0;
+    } else if (job->scanner) {
+        return job->scanner->count;
+    } else if (job->query) {
+        return job->query->count;
+    }
+    return 0;
+}
+
+/**
+ * Returns the candidate at `index` in `job`; its `contents` are NULL if it is
+ * a tombstone. Candidates of compressed scanners are reassembled into
+ * `job->path`, so they only remain valid until the next call.
+ */
+static str_t union_job_get(const union_job_t *job, unsigned index) {
+    if (job->source->kind == UNION_SOURCE_SCANNER) {
+        const scanner_t *scanner = job->source->scanner;
+        if (scanner->paths) {
+            str_t str;
+            str.contents = job->path;
+            str.length = paths_get(scanner->paths, index, job->path);
+            str.capacity = -1;
+            return str;
+        }
+        return scanner_get(scanner, index);
+    } else if (job->scanner) {
+        return scanner_get(job->scanner, index);
+    }
+    return job->query->files[index];
+}
+
+/**
+ * Scans a single source. Runs on its own thread.
+ */
+static void *union_scan(void *arg) {
+    union_job_t *job = (union_job_t *)arg;
+    const union_source_t *source = job->source;
+    if (source->kind == UNION_SOURCE_COMMAND) {
+        job->scanner = scanner_new_command(
+            source->command,
+            source->drop,
+            source->max_files,
+            source->delimiter
+        );
+    } else if (source->kind == UNION_SOURCE_FILE) {
+        job->scanner =
+            commandt_file_scanner(source->directory, source->options);
+    } else if (source->kind == UNION_SOURCE_WATCHMAN) {
+        int socket = commandt_watchman_connect(source->socket_path);
+        if (socket == -1) {
+            DEBUG_LOG("union_scan(): failed to connect to Watchman\n");
+            return NULL;
+        }
+        watchman_watch_project_t *project =
+            commandt_watchman_watch_project(source->directory, socket);
+        if (project->error) {
+            DEBUG_LOG("union_scan(): %s\n", project->error);
+        } else {
+            job->query = commandt_watchman_query(
+                project->watch, project->relative_path, NULL, NULL, 0, socket
+            );
+            if (job->query->error) {
+                DEBUG_LOG("union_scan(): %s\n", job->query->error);
+                commandt_watchman_query_free(job->query);
+                job->query = NULL;
+            }
+        }
+        commandt_watchman_watch_project_free(project);
+        commandt_watchman_disconnect(socket);
+    }
+    return NULL;
+}
@@ -0,0 +1,114 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * @file
+ *
+ * A scanner that combines the candidates of several others (eg. the files in
+ * a number of repositories, plus open buffers) so that a single matcher can
+ * serve them all.
+ *
+ * Sources that involve scanning (commands, file walks and Watchman queries)
+ * run concurrently, one thread each, when there is more than one processor
+ * (and one after the other otherwise). Their results are then copied into a
+ * single slab, in the order in which the sources were given, skipping any
+ * path that an earlier source already produced. Every candidate remembers
+ * which source it came from, and the matcher scales its score by that
+ * source's weight.
+ */
+
+#ifndef UNION_H
+#define UNION_H
+
+// Define short names for convenience, but all external symbols need prefixes.
+#define union_scanner_new commandt_union_scanner_new
+
+#include "commandt.h" /* for scanner_t */
+#include "find.h" /* for find_options_t */
+#include "scanner.h" /* for scanner_delimiter_t */
+
+// Arbitrary limit, but we store source indices in a byte.
+#define UNION_MAX_SOURCES 256
+
+typedef enum {
+    /**
+     * Candidates produced by running `command` (see `scanner_new_command()`).
+     */
+    UNION_SOURCE_COMMAND,
+
+    /**
+     * Files found by walking `directory` with `options` (see
+     * `commandt_file_scanner()`).
+     */
+    UNION_SOURCE_FILE,
+
+    /**
+     * Candidates from an existing `scanner` (which may be packed or
+     * compressed). The union takes a copy, so the caller still owns (and must
+     * free) it.
+     */
+    UNION_SOURCE_SCANNER,
+
+    /**
+     * Files reported by querying the Watchman instance listening on
+     * `socket_path` about `directory`.
+     */
+    UNION_SOURCE_WATCHMAN,
+} union_source_kind_t;
+
+typedef struct {
+    union_source_kind_t kind;
+
+    /**
+     * For `UNION_SOURCE_COMMAND`.
+     */
+    const char *command;
+    unsigned drop;
+    unsigned max_files;
+    scanner_delimiter_t delimiter;
+
+    /**
+     * For `UNION_SOURCE_FILE` and `UNION_SOURCE_WATCHMAN`.
+     */
+    const char *directory;
+
+    /**
+     * For `UNION_SOURCE_FILE`. May be NULL.
+     */
+    const find_options_t *options;
+
+    /**
+     * For `UNION_SOURCE_SCANNER`.
+     */
+    scanner_t *scanner;
+
+    /**
+     * For `UNION_SOURCE_WATCHMAN`.
+     */
+    const char *socket_path;
+
+    /**
+     * Prepended to every candidate from this source (eg. "lib/" for the files
+     * of a repository in the "lib" subdirectory), or NULL.
+     */
+    const char *prefix;
+
+    /**
+     * Factor by which to scale the scores of candidates from this source.
+     * Must be greater than 0.
+     */
+    float weight;
+} union_source_t;
+
+/**
+ * Scans all of the `sources` (at most `UNION_MAX_SOURCES`) and returns a
+ * scanner with their combined, deduplicated candidates. Sources that fail
+ * (eg. a command that can't be run) contribute no candidates.
+ *
+ * The caller should dispose of the scanner with `scanner_free()`.
+ */
+scanner_t *union_scanner_new(const union_source_t *sources, unsigned count);
+
+#endif
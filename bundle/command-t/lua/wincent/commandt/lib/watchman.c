@@ -8,12 +8,14 @@
 #include <assert.h> /* for assert() */
 #include <fcntl.h> /* for F_GETFL, F_SETFL, O_NONBLOCK, fcntl() */
 #include <limits.h> /* for SSIZE_MAX */
+#include <stdbool.h> /* for bool, false, true */
 #include <stdint.h> /* for uint8_t */
 #include <stdlib.h> /* for free() */
-#include <string.h> /* for memset(), strlen(), strcpy(), strncpy() */
+#include <string.h> /* for memcpy(), memset(), strlen(), strncpy() */
 #include <sys/errno.h> /* for errno */
-#include <sys/socket.h> /* for AF_LOCAL, MSG_PEEK, MSG_WAITALL, recv() */
+#include <sys/socket.h> /* for AF_LOCAL, MSG_PEEK, recv(), send() etc */
 #include <sys/un.h> /* for sockaddr_un */
+#include <time.h> /* for CLOCK_REALTIME, clock_gettime() */
 #include <unistd.h> /* for close() */
 
 #include "debug.h"
@@ -28,32 +30,148 @@ typedef struct {
     size_t length;
 } watchman_request_t;
 
+/**
+ * Where each value of a file in a "files" array goes (see
+ * `watchman_read_files()`).
+ */
+typedef enum {
+    WATCHMAN_COLUMN_SKIP,
+    WATCHMAN_COLUMN_NAME,
+    WATCHMAN_COLUMN_EXISTS,
+    WATCHMAN_COLUMN_NEW,
+    WATCHMAN_COLUMN_MTIME,
+} watchman_column_t;
+
 // Forward declarations of static functions.
 
 static void watchman_append(watchman_request_t *w, const char *data, size_t length);
 static void watchman_append_char(watchman_request_t *w, char c);
+static void watchman_column_alloc(
+    watchman_query_t *result, watchman_column_t column, uint64_t count
+);
+static watchman_column_t watchman_column_for_key(const str_t *key);
+static void watchman_drain(watchman_response_t *r);
+static bool watchman_fill(watchman_response_t *r, size_t length);
+static const char *watchman_filter_pattern(
+    const char *pattern, size_t *length, bool *directories
+);
+static const char *watchman_filter_suffix(const char *suffix, size_t *length);
+static watchman_request_t *watchman_query_request(
+    const char *root,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields
+);
+static watchman_query_t *watchman_query_response(
+    watchman_response_t *r, str_t *files, size_t files_size
+);
 static uint64_t watchman_read_array(watchman_response_t *r, const char **error);
+static bool watchman_read_bool(watchman_response_t *r, const char **error);
+static void watchman_read_column(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    watchman_column_t column,
+    uint64_t index,
+    const char **error
+);
 static double watchman_read_double(watchman_response_t *r, const char **error);
 static int64_t watchman_read_int(watchman_response_t *r, const char **error);
+static void watchman_read_file(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    uint64_t index,
+    uint64_t count,
+    const char **error
+);
+static void watchman_read_files(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    watchman_progress_t progress,
+    void *context,
+    const char **error
+);
 static uint64_t watchman_read_object(watchman_response_t *r, const char **error);
+static watchman_response_t *watchman_read_pdu(int socket);
+static watchman_query_t *watchman_read_query(
+    watchman_response_t *r,
+    str_t *files,
+    size_t files_size,
+    bool *has_files,
+    watchman_progress_t progress,
+    void *context
+);
 static str_t *watchman_read_string(watchman_response_t *r, const char **error);
 static void watchman_read_string_no_copy(
     watchman_response_t *r, str_t *str, const char **error
 );
+static char *watchman_request_finish(watchman_request_t *w, size_t *length);
 static void watchman_request_free(watchman_request_t *w);
 static watchman_request_t *watchman_request_init();
+static void watchman_request_size(watchman_request_t *w);
 static void watchman_response_free(watchman_response_t *r);
+static watchman_response_t *watchman_response_wrap(char *pdu, size_t length);
+static bool watchman_recv(int socket, char *buffer, size_t length, int flags);
 static watchman_response_t *watchman_send(watchman_request_t *w, int socket);
 static void watchman_skip_value(watchman_response_t *r, const char **error);
+static const char **watchman_strings_copy(
+    const char **strings, unsigned count
+);
+static void watchman_strings_free(const char **strings, unsigned count);
+static watchman_request_t *watchman_watch_project_request(const char *root);
+static watchman_watch_project_t *watchman_watch_project_response(
+    watchman_response_t *r
+);
 static void watchman_write_array(watchman_request_t *w, unsigned length);
+static void watchman_write_expression(
+    watchman_request_t *w, const watchman_filter_t *filter
+);
+static void watchman_write_query_object(
+    watchman_request_t *w,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    bool changes
+);
 static void watchman_write_int(watchman_request_t *w, int64_t num);
+static void watchman_write_match(
+    watchman_request_t *w, const char *pattern, size_t length, const char *scope
+);
 static void watchman_write_object(watchman_request_t *w, unsigned size);
 static void watchman_write_string(
     watchman_request_t *w, const char *string, size_t length
 );
 
+// Don't let a closed connection kill the whole process with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
 #define WATCHMAN_DEFAULT_STORAGE 4096
 
+/**
+ * Files modified less than `age` milliseconds before they were listed have
+ * their scores scaled by `weight` (see `commandt_watchman_scanner()`); the
+ * first band that a file falls into applies, and older files are left alone.
+ */
+static const struct {
+    int64_t age;
+    float weight;
+} watchman_recency[] = {
+    {60 * 60 * 1000LL, 1.5f}, // An hour.
+    {24 * 60 * 60 * 1000LL, 1.25f}, // A day.
+    {7 * 24 * 60 * 60 * 1000LL, 1.1f}, // A week.
+};
+
+#define WATCHMAN_RECENCY_COUNT \
+    (sizeof(watchman_recency) / sizeof(watchman_recency[0]))
+
+// How much of a PDU to receive at a time while decoding it.
+#define WATCHMAN_CHUNK_SIZE (1024 * 1024)
+
 #define WATCHMAN_BINARY_MARKER "\x00\x01"
 #define WATCHMAN_ARRAY_MARKER 0x00
 #define WATCHMAN_OBJECT_MARKER 0x01
@@ -120,107 +238,103 @@ int commandt_watchman_disconnect(int socket) {
 }
 
 watchman_query_t *commandt_watchman_query(
-    const char *root, const char *relative_root, int socket
+    const char *root,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    int socket
+) {
+    watchman_request_t *w =
+        watchman_query_request(root, relative_root, since, filter, fields);
+    watchman_response_t *r = watchman_send(w, socket);
+    watchman_request_free(w);
+    return watchman_query_response(r, NULL, 0);
+}
+
+scanner_t *commandt_watchman_scanner(watchman_query_t *result) {
+    assert(!result->error);
+    scanner_t *scanner = xcalloc(1, sizeof(scanner_t));
+    scanner->count = result->count;
+    scanner->candidates = result->files;
+    scanner->candidates_size = result->files_size;
+    if (result->response) {
+        scanner->payload = result->response->payload;
+        scanner->payload_size = result->response->capacity;
+        result->response->payload = NULL;
+    }
+    if (result->mtimes && result->count) {
+        // Sort the files into bands by age, which the matcher weights just
+        // like the sources of a union scanner.
+        struct timespec now;
+        int64_t now_ms = 0;
+        if (clock_gettime(CLOCK_REALTIME, &now) == 0) {
+            now_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        }
+        scanner->source_weights =
+            xmalloc((WATCHMAN_RECENCY_COUNT + 1) * sizeof(float));
+        for (size_t i = 0; i < WATCHMAN_RECENCY_COUNT; i++) {
+            scanner->source_weights[i] = watchman_recency[i].weight;
+        }
+        scanner->source_weights[WATCHMAN_RECENCY_COUNT] = 1.0f;
+        scanner->sources = xmalloc(result->count);
+        for (unsigned i = 0; i < result->count; i++) {
+            int64_t age = now_ms - result->mtimes[i];
+            unsigned char band = 0;
+            while (band < WATCHMAN_RECENCY_COUNT &&
+                   age >= watchman_recency[band].age) {
+                band++;
+            }
+            scanner->sources[i] = band;
+        }
+    }
+    result->files = NULL;
+    commandt_watchman_query_free(result);
+    return scanner;
+}
+
+watchman_query_t *commandt_watchman_subscribe(
+    const char *root,
+    const char *relative_root,
+    const char *name,
+    const watchman_filter_t *filter,
+    int socket
 ) {
     // Prepare the message.
     //
     //     [
-    //       "query",
-    //       "/path/to/root", {
+    //       "subscribe",
+    //       "/path/to/root",
+    //       "name", {
     //         "expression": ["type", "f"],
-    //         "fields": ["name"],
+    //         "fields": ["name", "exists", "new"],
     //         "relative_root": "relative/path"
     //       }
     //     ]
     //
     watchman_request_t *w = watchman_request_init();
-    watchman_write_array(w, 3);
-    watchman_write_string(w, "query", sizeof("query") - 1);
+    watchman_write_array(w, 4);
+    watchman_write_string(w, "subscribe", sizeof("subscribe") - 1);
     watchman_write_string(w, root, strlen(root));
-    watchman_write_object(w, relative_root ? 3 : 2);
-    watchman_write_string(w, "expression", sizeof("expression") - 1);
-    watchman_write_array(w, 2);
-    watchman_write_string(w, "type", sizeof("type") - 1);
-    watchman_write_string(w, "f", sizeof("f") - 1);
-    watchman_write_string(w, "fields", sizeof("fields") - 1);
-    watchman_write_array(w, 1);
-    watchman_write_string(w, "name", sizeof("name") - 1);
-    if (relative_root) {
-        watchman_write_string(w, "relative_root", sizeof("relative_root") - 1);
-        watchman_write_string(w, relative_root, strlen(relative_root));
-    }
+    watchman_write_string(w, name, strlen(name));
+    watchman_write_query_object(w, relative_root, NULL, filter, 0, true);
     watchman_response_t *r = watchman_send(w, socket);
     watchman_request_free(w);
 
-    // Process the response:
-    //
-    watchman_query_t *result = xcalloc(1, sizeof(watchman_query_t));
-    result->response = r;
-    str_t *key = NULL;
-    uint64_t count = watchman_read_object(r, &result->error);
-    if (result->error) {
-        goto done;
-    }
-
-    for (uint64_t i = 0; i < count; i++) {
-        key = watchman_read_string(r, &result->error);
-        if (result->error) {
-            goto done;
-        } else if (key->length == sizeof("files") - 1 && strncmp(key->contents, "files", key->length) == 0) {
-            assert(!result->files);
-            uint64_t file_count = watchman_read_array(r, &result->error);
-            if (result->error) {
-                goto done;
-            }
-            result->files_size = sizeof(str_t) * file_count;
-            DEBUG_LOG(
-                "commandt_watchman_query() -> xmap() %llu\n", result->files_size
-            );
-            result->files = xmap(result->files_size);
-            for (uint64_t j = 0; j < file_count; j++) {
-                watchman_read_string_no_copy(r, &result->files[j], &result->error);
-                if (result->error) {
-                    goto done;
-                }
-            }
-            result->count = file_count;
-        } else if (key->length == sizeof("error") - 1 && strncmp(key->contents, "error", key->length) == 0) {
-            str_t *error = watchman_read_string(r, &result->error);
-            if (result->error) {
-                goto done;
-            } else {
-                // Some song and dance here because string is not guaranteed to
-                // be NUL-terminated.
-                result->error = str_c_string(error);
-                str_free(error);
-                goto done_no_copy;
-            }
-        } else {
-            // Skip over values we don't care about.
-            watchman_skip_value(r, &result->error);
-            if (result->error) {
-                goto done;
-            }
-        }
-        str_free(key);
-        key = NULL;
-    }
-    if (!result->files) {
-        result->error =
-            "commandt_watchman_query(): no \"files\" value in \"query\" response";
-        goto done;
-    }
-    assert(r->ptr == r->end);
+    // The response just acknowledges the subscription (or reports an error).
+    bool has_files;
+    return watchman_read_query(r, NULL, 0, &has_files, NULL, NULL);
+}
 
-done:
-    if (result->error) {
-        result->error = xstrdup(result->error);
-    }
-done_no_copy:
-    if (key) {
-        str_free(key);
+watchman_query_t *commandt_watchman_receive(
+    int socket, watchman_progress_t progress, void *context
+) {
+    watchman_response_t *r = watchman_read_pdu(socket);
+    if (!r) {
+        return NULL;
     }
-    return result;
+    bool has_files;
+    return watchman_read_query(r, NULL, 0, &has_files, progress, context);
 }
 
 watchman_watch_project_t *commandt_watchman_watch_project(
@@ -229,114 +343,120 @@ watchman_watch_project_t *commandt_watchman_watch_project(
 #ifdef DEBUG
     DEBUG_LOG("watch-project %s\n", root);
 #endif
-    // Prepare and send the message:
-    //
-    //     ["watch-project", "/path/to/root"]
-    //
-    watchman_request_t *w = watchman_request_init();
-    watchman_write_array(w, 2);
-    watchman_write_string(w, "watch-project", sizeof("watch-project") - 1);
-    watchman_write_string(w, root, strlen(root));
+    watchman_request_t *w = watchman_watch_project_request(root);
     watchman_response_t *r = watchman_send(w, socket);
     watchman_request_free(w);
+    return watchman_watch_project_response(r);
+}
 
-    // Process the response:
-    //
-    //     {
-    //       "watch": "/path/to/root",
-    //       "relative_path": "optional/relative/path",
-    //       "error": "If present, someting went wrong",
-    //       ...
-    //     }
-    //
-    watchman_watch_project_t *result =
-        xcalloc(1, sizeof(watchman_watch_project_t));
-    str_t *key = NULL;
-    uint64_t count = watchman_read_object(r, &result->error);
-    if (result->error) {
-        goto done;
-    }
+void commandt_watchman_watch_project_free(watchman_watch_project_t *result) {
+    free((void *)result->watch);
+    free((void *)result->relative_path);
+    free((void *)result->error);
+    free(result);
+}
 
-    for (uint64_t i = 0; i < count; i++) {
-        key = watchman_read_string(r, &result->error);
-        if (result->error) {
-            goto done;
-        } else if (key->length == sizeof("watch") - 1 && strncmp(key->contents, "watch", key->length) == 0) {
-            str_t *watch = watchman_read_string(r, &result->error);
-            if (result->error) {
-                goto done;
-            }
-            result->watch = watch->contents;
-            free(watch);
-        } else if (key->length == sizeof("relative_path") - 1 && strncmp(key->contents, "relative_path", key->length) == 0) {
-            str_t *relative_path = watchman_read_string(r, &result->error);
-            if (result->error) {
-                goto done;
-            }
-            result->relative_path = relative_path->contents;
-            free(relative_path);
-        } else if (key->length == sizeof("error") - 1 && strncmp(key->contents, "error", key->length) == 0) {
-            // Error may be something like:
-            //
-            //     std::system_error: open: : No such file or directory
-            //
-            // or:
-            //
-            //     watchman::RootResolveError: failed to resolve root:
-            //     unable to resolve root $DIRECTORY: failed to parse json
-            //     from $DIRECTORY/.watchmanconfig: '[' or '{' expected near
-            //     end of file
-            //
-            str_t *error = watchman_read_string(r, &result->error);
-            if (result->error) {
-                goto done;
-            } else {
-                // Some song and dance here because string is not guaranteed to
-                // be NUL-terminated.
-                result->error = str_c_string(error);
-                str_free(error);
-                goto done_no_copy;
-            }
-        } else {
-            // Skip over values we don't care about.
-            watchman_skip_value(r, &result->error);
-            if (result->error) {
-                goto done;
-            }
-        }
-        str_free(key);
-        key = NULL;
+char *commandt_watchman_encode_query(
+    const char *root,
+    const char *relative_root,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    size_t *length
+) {
+    watchman_request_t *w =
+        watchman_query_request(root, relative_root, NULL, filter, fields);
+    return watchman_request_finish(w, length);
+}
+
+char *commandt_watchman_encode_watch_project(
+    const char *root, size_t *length
+) {
+    return watchman_request_finish(
+        watchman_watch_project_request(root), length
+    );
+}
+
+int64_t commandt_watchman_pdu_length(const char *buffer, size_t length) {
+    size_t marker_length = sizeof(WATCHMAN_BINARY_MARKER) - 1;
+    if (length < marker_length + 1) {
+        return 0;
+    } else if (memcmp(buffer, WATCHMAN_BINARY_MARKER, marker_length) != 0) {
+        return -1;
     }
-    if (!result->watch) {
-        result->error =
-            "commandt_watchman_watch_project(): no \"watch\" value in \"watch-project\" response";
-        goto done;
+    int8_t sizes[] = {0, 0, 0, 1, 2, 4, 8};
+    int8_t sizes_idx = buffer[marker_length];
+    if (sizes_idx < WATCHMAN_INT8_MARKER || sizes_idx > WATCHMAN_INT64_MARKER) {
+        return -1;
     }
-    assert(r->ptr == r->end);
-
-done:
-    if (result->error) {
-        result->error = xstrdup(result->error);
+    size_t header_length = marker_length + 1 + sizes[sizes_idx];
+    if (length < header_length) {
+        return 0;
     }
-done_no_copy:
-    watchman_response_free(r);
-    if (key) {
-        str_free(key);
+    watchman_response_t r;
+    r.ptr = (char *)buffer + marker_length;
+    r.end = (char *)buffer + header_length;
+    r.limit = r.end;
+    const char *error = NULL;
+    int64_t payload_length = watchman_read_int(&r, &error);
+    if (error || payload_length <= 0 ||
+        payload_length > INT64_MAX - (int64_t)header_length) {
+        return -1;
     }
+    return header_length + payload_length;
+}
 
-    return result;
+watchman_query_t *commandt_watchman_decode_query(
+    char *pdu, size_t length, str_t *files, size_t files_size
+) {
+    return watchman_query_response(
+        watchman_response_wrap(pdu, length), files, files_size
+    );
 }
 
-void commandt_watchman_watch_project_free(watchman_watch_project_t *result) {
-    free((void *)result->watch);
-    free((void *)result->relative_path);
-    free((void *)result->error);
-    free(result);
+watchman_watch_project_t *commandt_watchman_decode_watch_project(
+    char *pdu, size_t length
+) {
+    return watchman_watch_project_response(watchman_response_wrap(pdu, length));
+}
+
+watchman_filter_t *commandt_watchman_filter_copy(
+    const watchman_filter_t *filter
+) {
+    if (!filter) {
+        return NULL;
+    }
+    watchman_filter_t *copy = xmalloc(sizeof(watchman_filter_t));
+    copy->suffixes =
+        watchman_strings_copy(filter->suffixes, filter->suffixes_count);
+    copy->suffixes_count = filter->suffixes_count;
+    copy->exclude = watchman_strings_copy(filter->exclude, filter->exclude_count);
+    copy->exclude_count = filter->exclude_count;
+    copy->ignore = watchman_strings_copy(filter->ignore, filter->ignore_count);
+    copy->ignore_count = filter->ignore_count;
+    return copy;
+}
+
+void commandt_watchman_filter_free(watchman_filter_t *filter) {
+    if (!filter) {
+        return;
+    }
+    watchman_strings_free(filter->suffixes, filter->suffixes_count);
+    watchman_strings_free(filter->exclude, filter->exclude_count);
+    watchman_strings_free(filter->ignore, filter->ignore_count);
+    free(filter);
 }
 
 void commandt_watchman_query_free(watchman_query_t *result) {
-    xmunmap(result->files, result->files_size);
-    free(result->response);
+    if (result->files) {
+        xmunmap(result->files, result->files_size);
+    }
+    free(result->exists);
+    free(result->is_new);
+    free(result->mtimes);
+    free((void *)result->clock);
+    if (result->response) {
+        watchman_response_free(result->response);
+    }
     free((void *)result->error);
     free(result);
 }
@@ -348,8 +468,10 @@ void commandt_watchman_query_free(watchman_query_t *result) {
  */
 static void watchman_append(watchman_request_t *w, const char *data, size_t length) {
     if (w->length + length > w->capacity) {
-        w->capacity += w->length + WATCHMAN_DEFAULT_STORAGE;
-        xrealloc(w->payload, w->capacity);
+        while (w->length + length > w->capacity) {
+            w->capacity *= 2;
+        }
+        w->payload = xrealloc(w->payload, w->capacity);
     }
     memcpy(w->payload + w->length, data, length);
     w->length += length;
@@ -362,19 +484,195 @@ static void watchman_append(watchman_request_t *w, const char *data, size_t leng
  */
 static void watchman_append_char(watchman_request_t *w, char c) {
     if (w->length + 1 > w->capacity) {
-        w->capacity += w->length + WATCHMAN_DEFAULT_STORAGE;
-        xrealloc(w->payload, w->capacity);
+        w->capacity *= 2;
+        w->payload = xrealloc(w->payload, w->capacity);
     }
     w->payload[w->length++] = c;
 }
 
+/**
+ * Allocates the array that holds `column` for each of `count` files, unless
+ * that has been done already. Files are assumed to exist, and to be new,
+ * unless Watchman says otherwise.
+ */
+static void watchman_column_alloc(
+    watchman_query_t *result, watchman_column_t column, uint64_t count
+) {
+    switch (column) {
+        case WATCHMAN_COLUMN_EXISTS:
+            if (!result->exists) {
+                result->exists = xmalloc(count * sizeof(bool));
+                memset(result->exists, true, count * sizeof(bool));
+            }
+            break;
+        case WATCHMAN_COLUMN_NEW:
+            if (!result->is_new) {
+                result->is_new = xmalloc(count * sizeof(bool));
+                memset(result->is_new, true, count * sizeof(bool));
+            }
+            break;
+        case WATCHMAN_COLUMN_MTIME:
+            if (!result->mtimes) {
+                result->mtimes = xcalloc(count, sizeof(int64_t));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Returns the column that the values of the file field named `key` go in.
+ */
+static watchman_column_t watchman_column_for_key(const str_t *key) {
+    static const char *names[] = {
+        [WATCHMAN_COLUMN_NAME] = "name",
+        [WATCHMAN_COLUMN_EXISTS] = "exists",
+        [WATCHMAN_COLUMN_NEW] = "new",
+        [WATCHMAN_COLUMN_MTIME] = "mtime_ms",
+    };
+    for (size_t i = WATCHMAN_COLUMN_NAME; i < sizeof(names) / sizeof(names[0]);
+         i++) {
+        if (key->length == strlen(names[i]) &&
+            strncmp(key->contents, names[i], key->length) == 0) {
+            return i;
+        }
+    }
+    return WATCHMAN_COLUMN_SKIP;
+}
+
+/**
+ * Receives whatever is left of the PDU that `r` is reading (eg. because we
+ * stopped decoding it early), so that the next read from the socket starts
+ * at the beginning of the next PDU.
+ */
+static void watchman_drain(watchman_response_t *r) {
+    (void)watchman_fill(r, r->limit - r->ptr);
+}
+
+/**
+ * Makes sure that at least `length` bytes of the PDU are available at
+ * `r->ptr`, receiving more from the socket if necessary. Returns false if the
+ * PDU ends first (or the connection is lost).
+ *
+ * Because the whole payload is allocated up front, nothing ever moves, so
+ * values (including `str_t` structs that point into the payload) can be
+ * decoded while the rest of the PDU is still in flight.
+ */
+static bool watchman_fill(watchman_response_t *r, size_t length) {
+    if ((size_t)(r->end - r->ptr) >= length) {
+        return true;
+    } else if ((size_t)(r->limit - r->ptr) < length) {
+        return false;
+    }
+    while ((size_t)(r->end - r->ptr) < length) {
+        // Wait for a sizeable chunk (but not for all of it); waking up for
+        // every packet costs more than it saves.
+        size_t wanted = r->limit - r->end;
+        if (wanted > WATCHMAN_CHUNK_SIZE) {
+            wanted = WATCHMAN_CHUNK_SIZE;
+        }
+        ssize_t count = recv(r->socket, r->end, wanted, MSG_WAITALL);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        r->end += count;
+    }
+    return true;
+}
+
+/**
+ * Returns the name or glob `pattern` from a `watchman_filter_t`, setting
+ * `length` to its length without any trailing "/", and `directories` to
+ * whether it had one (meaning that it applies only to directories). Returns
+ * NULL if nothing is left.
+ */
+static const char *watchman_filter_pattern(
+    const char *pattern, size_t *length, bool *directories
+) {
+    *length = strlen(pattern);
+    *directories = *length && pattern[*length - 1] == '/';
+    if (*directories) {
+        (*length)--;
+    }
+    return *length ? pattern : NULL;
+}
+
+/**
+ * Returns `suffix` without any leading "*." or ".", setting `length` to its
+ * length. Returns NULL if nothing is left.
+ */
+static const char *watchman_filter_suffix(const char *suffix, size_t *length) {
+    if (suffix[0] == '*' && suffix[1] == '.') {
+        suffix += 2;
+    } else if (suffix[0] == '.') {
+        suffix++;
+    }
+    *length = strlen(suffix);
+    return *length ? suffix : NULL;
+}
+
+/**
+ * Prepares a "query" command:
+ *
+ *     [
+ *       "query",
+ *       "/path/to/root", {
+ *         "expression": ["type", "f"],
+ *         "fields": ["name"],
+ *         "relative_root": "relative/path",
+ *         "since": "c:123:456"
+ *       }
+ *     ]
+ *
+ * (With "since", the fields also include "exists" and "new", and "mtime_ms"
+ * may be requested via `fields`; a `filter` makes the expression more
+ * elaborate.)
+ */
+static watchman_request_t *watchman_query_request(
+    const char *root,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields
+) {
+    watchman_request_t *w = watchman_request_init();
+    watchman_write_array(w, 3);
+    watchman_write_string(w, "query", sizeof("query") - 1);
+    watchman_write_string(w, root, strlen(root));
+    watchman_write_query_object(
+        w, relative_root, since, filter, fields, since != NULL
+    );
+    return w;
+}
+
+/**
+ * Processes the response to a "query" command, taking ownership of `r`
+ * (which may be NULL if the command could not be sent).
+ */
+static watchman_query_t *watchman_query_response(
+    watchman_response_t *r, str_t *files, size_t files_size
+) {
+    bool has_files;
+    watchman_query_t *result =
+        watchman_read_query(r, files, files_size, &has_files, NULL, NULL);
+    if (!result->error && !has_files) {
+        result->error = xstrdup(
+            "commandt_watchman_query(): no \"files\" value in \"query\" response"
+        );
+    }
+    return result;
+}
+
 /**
  * Returns count of values in the array.
  */
 static uint64_t watchman_read_array(watchman_response_t *r, const char **error) {
     assert(error != NULL);
     int64_t count = 0;
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_array(): unexpected end of input";
         goto done;
     }
@@ -382,7 +680,7 @@ static uint64_t watchman_read_array(watchman_response_t *r, const char **error)
     // Verify and consume marker.
     if (r->ptr[0] == WATCHMAN_ARRAY_MARKER) {
         r->ptr++;
-        if (r->ptr + 2 > r->end) {
+        if (!watchman_fill(r, 2)) {
             *error = "watchman_read_array(): incomplete array header";
             goto done;
         }
@@ -402,6 +700,55 @@ done:
     return count;
 }
 
+/**
+ * Reads and returns a boolean.
+ */
+static bool watchman_read_bool(watchman_response_t *r, const char **error) {
+    assert(error != NULL);
+    if (!watchman_fill(r, 1)) {
+        *error = "watchman_read_bool(): unexpected end of input";
+        return false;
+    }
+    if (r->ptr[0] == WATCHMAN_TRUE) {
+        r->ptr++;
+        return true;
+    } else if (r->ptr[0] == WATCHMAN_FALSE) {
+        r->ptr++;
+        return false;
+    }
+    *error = "watchman_read_bool(): not a boolean";
+    return false;
+}
+
+/**
+ * Reads a value of the file at `index` into the array for `column` (which
+ * must have been allocated with `watchman_column_alloc()`).
+ */
+static void watchman_read_column(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    watchman_column_t column,
+    uint64_t index,
+    const char **error
+) {
+    switch (column) {
+        case WATCHMAN_COLUMN_NAME:
+            watchman_read_string_no_copy(r, &result->files[index], error);
+            break;
+        case WATCHMAN_COLUMN_EXISTS:
+            result->exists[index] = watchman_read_bool(r, error);
+            break;
+        case WATCHMAN_COLUMN_NEW:
+            result->is_new[index] = watchman_read_bool(r, error);
+            break;
+        case WATCHMAN_COLUMN_MTIME:
+            result->mtimes[index] = watchman_read_int(r, error);
+            break;
+        default:
+            watchman_skip_value(r, error);
+    }
+}
+
 /**
  * Reads and returns a double encoded in the Watchman binary protocol format,
  * starting at `ptr` and finishing at or before `end`
@@ -410,8 +757,9 @@ static double watchman_read_double(watchman_response_t *r, const char **error) {
     assert(error != NULL);
     double val = 0.0;
 
-    if (r->ptr + sizeof(typeof(WATCHMAN_DOUBLE_MARKER)) + sizeof(double) >
-        r->end) {
+    if (!watchman_fill(
+            r, sizeof(typeof(WATCHMAN_DOUBLE_MARKER)) + sizeof(double)
+        )) {
         *error = "watchman_read_double(): insufficient double storage";
         goto done;
     }
@@ -429,19 +777,178 @@ done:
     return val;
 }
 
+/**
+ * Reads the element at `index` of a "files" array (of `count` elements) in
+ * its non-template form: either a bare name (when "name" is the only field
+ * requested) or an object with a key for each field.
+ */
+static void watchman_read_file(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    uint64_t index,
+    uint64_t count,
+    const char **error
+) {
+    if (watchman_fill(r, 1) && r->ptr[0] == WATCHMAN_STRING_MARKER) {
+        watchman_read_string_no_copy(r, &result->files[index], error);
+        return;
+    }
+    uint64_t key_count = watchman_read_object(r, error);
+    if (*error) {
+        return;
+    }
+    for (uint64_t i = 0; i < key_count; i++) {
+        str_t key;
+        watchman_read_string_no_copy(r, &key, error);
+        if (*error) {
+            return;
+        }
+        watchman_column_t column = watchman_column_for_key(&key);
+        watchman_column_alloc(result, column, count);
+        watchman_read_column(r, result, column, index, error);
+        if (*error) {
+            return;
+        }
+    }
+}
+
+/**
+ * Reads a "files" array into `result`.
+ *
+ * When more than one field is requested, Watchman sends the files as a
+ * "template" (an array of key names, followed by a count of objects and then
+ * the values of each object in key order). We map each key to a column once,
+ * up front, and then decode every value straight into the array for its
+ * column (`files`, `exists`, `mtimes` etc) without materializing any objects
+ * or looking at any more keys. Plain arrays of objects (or of names) are
+ * handled too.
+ *
+ * The files are decoded as the PDU arrives; if `progress` is non-NULL, it is
+ * called with the files decoded so far each time more of the PDU comes in.
+ */
+static void watchman_read_files(
+    watchman_response_t *r,
+    watchman_query_t *result,
+    watchman_progress_t progress,
+    void *context,
+    const char **error
+) {
+    assert(!result->count);
+    if (!watchman_fill(r, 1)) {
+        *error = "watchman_read_files(): unexpected end of input";
+        return;
+    }
+
+    bool templated = r->ptr[0] == WATCHMAN_TEMPLATE_MARKER;
+    watchman_column_t *columns = NULL;
+    uint64_t key_count = 0;
+    int64_t count;
+    if (templated) {
+        r->ptr++;
+        key_count = watchman_read_array(r, error);
+        if (*error) {
+            return;
+        } else if (key_count > (uint64_t)(r->limit - r->ptr)) {
+            *error = "watchman_read_files(): too many keys in template";
+            return;
+        }
+        columns = xmalloc((key_count ? key_count : 1) * sizeof(*columns));
+        bool named = false;
+        for (uint64_t i = 0; i < key_count; i++) {
+            str_t key;
+            watchman_read_string_no_copy(r, &key, error);
+            if (*error) {
+                goto done;
+            }
+            columns[i] = watchman_column_for_key(&key);
+            named = named || columns[i] == WATCHMAN_COLUMN_NAME;
+        }
+        count = watchman_read_int(r, error);
+        if (*error) {
+            goto done;
+        } else if (count < 0) {
+            *error = "watchman_read_files(): negative count";
+            goto done;
+        } else if (!named) {
+            *error = "watchman_read_files(): no \"name\" in template";
+            goto done;
+        }
+    } else {
+        count = watchman_read_array(r, error);
+        if (*error) {
+            return;
+        }
+    }
+
+    if (count) {
+        size_t files_size = sizeof(str_t) * count;
+        if (result->files && result->files_size < files_size) {
+            xmunmap(result->files, result->files_size);
+            result->files = NULL;
+        }
+        if (result->files) {
+            DEBUG_LOG(
+                "watchman_read_files() reusing %llu\n", result->files_size
+            );
+        } else {
+            result->files_size = files_size;
+            DEBUG_LOG(
+                "watchman_read_files() -> xmap() %llu\n", result->files_size
+            );
+            result->files = xmap(result->files_size);
+        }
+        for (uint64_t j = 0; j < key_count; j++) {
+            watchman_column_alloc(result, columns[j], count);
+        }
+        if (progress && !templated) {
+            // Objects only reveal their keys as we go, but the columns that
+            // `progress` hands out must not appear (or be initialized) while
+            // another thread may be reading them, so allocate them now.
+            watchman_column_alloc(result, WATCHMAN_COLUMN_EXISTS, count);
+            watchman_column_alloc(result, WATCHMAN_COLUMN_NEW, count);
+        }
+    }
+    char *seen = r->end;
+    for (int64_t i = 0; i < count; i++) {
+        if (progress && r->end != seen) {
+            seen = r->end;
+            result->count = i;
+            progress(result, context);
+        }
+        if (!templated) {
+            watchman_read_file(r, result, i, count, error);
+        } else {
+            for (uint64_t j = 0; j < key_count && !*error; j++) {
+                if (watchman_fill(r, 1) && r->ptr[0] == WATCHMAN_SKIP_MARKER) {
+                    r->ptr++;
+                } else {
+                    watchman_read_column(r, result, columns[j], i, error);
+                }
+            }
+        }
+        if (*error) {
+            goto done;
+        }
+    }
+    result->count = count;
+
+done:
+    free(columns);
+}
+
 static int64_t watchman_read_int(watchman_response_t *r, const char **error) {
     assert(error != NULL);
     char *val_ptr = r->ptr + sizeof(int8_t);
     int64_t val = 0;
 
-    if (val_ptr >= r->end) {
+    if (!watchman_fill(r, 2 * sizeof(int8_t))) {
         *error = "watchman_read_int(): insufficient int storage";
         goto done;
     }
 
     switch (r->ptr[0]) {
         case WATCHMAN_INT8_MARKER:
-            if (val_ptr + sizeof(int8_t) > r->end) {
+            if (!watchman_fill(r, sizeof(int8_t) + sizeof(int8_t))) {
                 *error = "watchman_read_int(): overrun extracting int8_t";
                 goto done;
             }
@@ -449,7 +956,7 @@ static int64_t watchman_read_int(watchman_response_t *r, const char **error) {
             r->ptr = val_ptr + sizeof(int8_t);
             break;
         case WATCHMAN_INT16_MARKER:
-            if (val_ptr + sizeof(int16_t) > r->end) {
+            if (!watchman_fill(r, sizeof(int8_t) + sizeof(int16_t))) {
                 *error = "watchman_read_int(): overrun extracting int16_t";
                 goto done;
             }
@@ -457,7 +964,7 @@ static int64_t watchman_read_int(watchman_response_t *r, const char **error) {
             r->ptr = val_ptr + sizeof(int16_t);
             break;
         case WATCHMAN_INT32_MARKER:
-            if (val_ptr + sizeof(int32_t) > r->end) {
+            if (!watchman_fill(r, sizeof(int8_t) + sizeof(int32_t))) {
                 *error = "watchman_read_int(): overrun extracting int32_t";
                 goto done;
             }
@@ -465,7 +972,7 @@ static int64_t watchman_read_int(watchman_response_t *r, const char **error) {
             r->ptr = val_ptr + sizeof(int32_t);
             break;
         case WATCHMAN_INT64_MARKER:
-            if (val_ptr + sizeof(int64_t) > r->end) {
+            if (!watchman_fill(r, sizeof(int8_t) + sizeof(int64_t))) {
                 *error = "watchman_read_int(): overrun extracting int64_t";
                 goto done;
             }
@@ -487,7 +994,7 @@ done:
 static uint64_t watchman_read_object(watchman_response_t *r, const char **error) {
     assert(error != NULL);
     int64_t count = 0;
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_object(): unexpected end of input";
         goto done;
     }
@@ -495,7 +1002,7 @@ static uint64_t watchman_read_object(watchman_response_t *r, const char **error)
     // Verify and consume marker.
     if (r->ptr[0] == WATCHMAN_OBJECT_MARKER) {
         r->ptr++;
-        if (r->ptr + 2 > r->end) {
+        if (!watchman_fill(r, 2)) {
             *error = "watchman_read_object(): incomplete hash header";
             goto done;
         }
@@ -503,15 +1010,168 @@ static uint64_t watchman_read_object(watchman_response_t *r, const char **error)
         if (*error) {
             goto done;
         }
-    } else {
-        *error = "watchman_read_object(): not an object";
-        goto done;
-    }
-    if (count < 0) {
-        *error = "watchman_read_object(): negative count";
+    } else {
+        *error = "watchman_read_object(): not an object";
+        goto done;
+    }
+    if (count < 0) {
+        *error = "watchman_read_object(): negative count";
+    }
+done:
+    return count;
+}
+
+/**
+ * Starts reading a PDU from `socket`, blocking until its header arrives.
+ * Returns NULL if the connection is closed (or on error).
+ *
+ * The caller must decode (or `watchman_drain()`) the whole PDU before reading
+ * the next one.
+ */
+static watchman_response_t *watchman_read_pdu(int socket) {
+    watchman_response_t *r = xmalloc(sizeof(watchman_response_t));
+    r->capacity = WATCHMAN_DEFAULT_STORAGE;
+    r->payload = xmalloc(WATCHMAN_DEFAULT_STORAGE);
+    r->ptr = r->payload;
+    r->end = r->payload;
+    r->limit = r->payload;
+    r->socket = -1;
+
+    // Sniff to see how large the header is.
+    if (!watchman_recv(
+            socket, r->payload, WATCHMAN_SNIFF_BUFFER_SIZE, MSG_PEEK
+        )) {
+        goto fail;
+    }
+
+    // Peek at size of PDU.
+    int8_t sizes_idx = r->ptr[sizeof(WATCHMAN_BINARY_MARKER) - 1];
+    if (sizes_idx < WATCHMAN_INT8_MARKER || sizes_idx > WATCHMAN_INT64_MARKER) {
+        goto fail;
+    }
+    int8_t sizes[] = {0, 0, 0, 1, 2, 4, 8};
+    ssize_t peek_size =
+        sizeof(WATCHMAN_BINARY_MARKER) - 1 + sizeof(int8_t) + sizes[sizes_idx];
+
+    if (!watchman_recv(socket, r->payload, peek_size, MSG_PEEK)) {
+        goto fail;
+    }
+    r->ptr = r->ptr + sizeof(WATCHMAN_BINARY_MARKER) - sizeof(int8_t);
+    r->end = r->ptr + peek_size;
+    r->limit = r->end;
+    const char *error = NULL;
+    int64_t payload_size = peek_size + watchman_read_int(r, &error);
+    if (error) {
+        goto fail;
+    }
+
+    // Make room for the whole PDU, but only receive the header; the rest is
+    // received as it is decoded (see `watchman_fill()`).
+    assert(payload_size > 0);
+    if ((size_t)payload_size > r->capacity) {
+        r->payload = xrealloc(r->payload, payload_size);
+    }
+
+    if (!watchman_recv(socket, r->payload, peek_size, 0)) {
+        goto fail;
+    }
+
+    r->ptr = r->payload + peek_size;
+    r->end = r->ptr;
+    r->limit = r->payload + payload_size;
+    r->capacity = payload_size;
+    r->socket = socket;
+
+    return r;
+
+fail:
+    watchman_response_free(r);
+    return NULL;
+}
+
+/**
+ * Reads a response (to a "query" or "subscribe" command) or a unilateral
+ * subscription PDU, taking ownership of `r`, and of `files` (a slab to reuse
+ * for the result's `files`, if it is big enough; see
+ * `commandt_watchman_decode_query()`). `has_files` is set to indicate
+ * whether there was a "files" value.
+ */
+static watchman_query_t *watchman_read_query(
+    watchman_response_t *r,
+    str_t *files,
+    size_t files_size,
+    bool *has_files,
+    watchman_progress_t progress,
+    void *context
+) {
+    watchman_query_t *result = xcalloc(1, sizeof(watchman_query_t));
+    result->files = files;
+    result->files_size = files ? files_size : 0;
+    *has_files = false;
+    if (!r) {
+        result->error = "watchman_read_query(): failed to talk to Watchman";
+        goto done;
+    }
+    result->response = r;
+    uint64_t count = watchman_read_object(r, &result->error);
+    if (result->error) {
+        goto done;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        str_t key;
+        watchman_read_string_no_copy(r, &key, &result->error);
+        if (result->error) {
+            goto done;
+        } else if (key.length == sizeof("files") - 1 && strncmp(key.contents, "files", key.length) == 0) {
+            watchman_read_files(r, result, progress, context, &result->error);
+            if (result->error) {
+                goto done;
+            }
+            *has_files = true;
+        } else if (key.length == sizeof("clock") - 1 && strncmp(key.contents, "clock", key.length) == 0 && watchman_fill(r, 1) && r->ptr[0] == WATCHMAN_STRING_MARKER) {
+            str_t clock;
+            watchman_read_string_no_copy(r, &clock, &result->error);
+            if (result->error) {
+                goto done;
+            }
+            free((void *)result->clock);
+            result->clock = str_c_string(&clock);
+        } else if (key.length == sizeof("is_fresh_instance") - 1 && strncmp(key.contents, "is_fresh_instance", key.length) == 0) {
+            result->is_fresh_instance = watchman_read_bool(r, &result->error);
+            if (result->error) {
+                goto done;
+            }
+        } else if (key.length == sizeof("error") - 1 && strncmp(key.contents, "error", key.length) == 0) {
+            str_t *error = watchman_read_string(r, &result->error);
+            if (result->error) {
+                goto done;
+            } else {
+                // Some song and dance here because string is not guaranteed to
+                // be NUL-terminated.
+                result->error = str_c_string(error);
+                str_free(error);
+                goto done_no_copy;
+            }
+        } else {
+            // Skip over values we don't care about.
+            watchman_skip_value(r, &result->error);
+            if (result->error) {
+                goto done;
+            }
+        }
     }
+    assert(r->ptr == r->limit);
+
 done:
-    return count;
+    if (result->error) {
+        result->error = xstrdup(result->error);
+    }
+done_no_copy:
+    if (r) {
+        watchman_drain(r);
+    }
+    return result;
 }
 
 /**
@@ -520,7 +1180,7 @@ done:
  */
 static str_t *watchman_read_string(watchman_response_t *r, const char **error) {
     assert(error != NULL);
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_string(): unexpected end of input";
         return NULL;
     }
@@ -531,7 +1191,7 @@ static str_t *watchman_read_string(watchman_response_t *r, const char **error) {
     }
 
     r->ptr += sizeof(int8_t);
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_string(): invalid string header";
         return NULL;
     }
@@ -542,7 +1202,7 @@ static str_t *watchman_read_string(watchman_response_t *r, const char **error) {
     }
     if (length == 0) { // Special case for zero-length strings.
         return str_new_copy("", 0);
-    } else if (r->ptr + length > r->end) {
+    } else if (length < 0 || !watchman_fill(r, length)) {
         *error = "watchman_read_string(): insufficient string storage";
         return NULL;
     }
@@ -571,7 +1231,7 @@ static void watchman_read_string_no_copy(
     watchman_response_t *r, str_t *str, const char **error
 ) {
     assert(error != NULL);
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_string_no_copy(): unexpected end of input";
         return;
     }
@@ -582,7 +1242,7 @@ static void watchman_read_string_no_copy(
     }
 
     r->ptr += sizeof(int8_t);
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_read_string_no_copy(): invalid string header";
         return;
     }
@@ -591,7 +1251,7 @@ static void watchman_read_string_no_copy(
     if (*error) {
         return;
     }
-    if (r->ptr + length > r->end) {
+    if (length < 0 || !watchman_fill(r, length)) {
         *error = "watchman_read_string_no_copy(): insufficient string storage";
         return;
     }
@@ -600,6 +1260,43 @@ static void watchman_read_string_no_copy(
     r->ptr += length;
 }
 
+/**
+ * Receives exactly `length` bytes from `socket` into `buffer` (or, with
+ * `MSG_PEEK`, waits until that many are available and copies them without
+ * consuming them). Returns false if the connection is closed first, or on
+ * error.
+ */
+static bool watchman_recv(int socket, char *buffer, size_t length, int flags) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t count = recv(
+            socket,
+            flags & MSG_PEEK ? buffer : buffer + received,
+            flags & MSG_PEEK ? length : length - received,
+            flags | MSG_WAITALL
+        );
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        received = count + (flags & MSG_PEEK ? 0 : received);
+    }
+    return true;
+}
+
+/**
+ * Frees `w`, after filling in its size, handing over its payload, the length
+ * of which is stored in `length`.
+ */
+static char *watchman_request_finish(watchman_request_t *w, size_t *length) {
+    watchman_request_size(w);
+    char *payload = (char *)w->payload;
+    *length = w->length;
+    free(w);
+    return payload;
+}
+
 /**
  * Free a watchman_request_t struct `w` that was previously allocated with
  * `watchman_request_init`
@@ -624,76 +1321,72 @@ static watchman_request_t *watchman_request_init() {
     return w;
 }
 
+/**
+ * Fills in the size of the PDU in `w` (which doesn't count the header itself).
+ */
+static void watchman_request_size(watchman_request_t *w) {
+    int64_t size = w->length - (sizeof(WATCHMAN_HEADER) - 1);
+    memcpy(
+        w->payload + sizeof(WATCHMAN_HEADER) - 1 - sizeof(int64_t),
+        &size,
+        sizeof(int64_t)
+    );
+}
+
 static void watchman_response_free(watchman_response_t *r) {
     free(r->payload);
     free(r);
 }
 
-static watchman_response_t *watchman_send(watchman_request_t *w, int socket) {
-    watchman_response_t *r = xmalloc(sizeof(watchman_response_t));
-    r->capacity = WATCHMAN_DEFAULT_STORAGE;
-    r->payload = xmalloc(WATCHMAN_DEFAULT_STORAGE);
-    r->ptr = r->payload;
-    r->end = r->payload;
-
-    // Send the message.
-    assert(w->length < SSIZE_MAX);
-    ssize_t length = w->length;
-    ssize_t sent = send(socket, w->payload, w->length, 0);
-    if (sent == -1 || sent != length) {
-        return NULL; // TODO: don't leak response for these early returns
-    }
-
-    // Sniff to see how large the header is.
-    ssize_t received = recv(
-        socket, r->payload, WATCHMAN_SNIFF_BUFFER_SIZE, MSG_PEEK | MSG_WAITALL
-    );
-    if (received == -1 || received != WATCHMAN_SNIFF_BUFFER_SIZE) {
-        return NULL;
-    }
-
-    // Peek at size of PDU.
-    int8_t sizes_idx = r->ptr[sizeof(WATCHMAN_BINARY_MARKER) - 1];
-    if (sizes_idx < WATCHMAN_INT8_MARKER || sizes_idx > WATCHMAN_INT64_MARKER) {
-        return NULL;
-    }
-    int8_t sizes[] = {0, 0, 0, 1, 2, 4, 8};
-    ssize_t peek_size =
-        sizeof(WATCHMAN_BINARY_MARKER) - 1 + sizeof(int8_t) + sizes[sizes_idx];
-
-    received = recv(socket, r->payload, peek_size, MSG_PEEK);
-    if (received == -1 || received != peek_size) {
+/**
+ * Wraps the complete PDU of `length` bytes at `pdu` (as counted by
+ * `commandt_watchman_pdu_length()`) for decoding, taking ownership of it.
+ * Returns NULL (after freeing `pdu`) if the length doesn't add up.
+ */
+static watchman_response_t *watchman_response_wrap(char *pdu, size_t length) {
+    int64_t expected = commandt_watchman_pdu_length(pdu, length);
+    if (expected <= 0 || (size_t)expected != length) {
+        free(pdu);
         return NULL;
     }
-    r->ptr = r->ptr + sizeof(WATCHMAN_BINARY_MARKER) - sizeof(int8_t);
-    r->end = r->ptr + peek_size;
+    watchman_response_t *r = xmalloc(sizeof(watchman_response_t));
+    r->capacity = length;
+    r->payload = pdu;
+    r->end = pdu + length;
+    r->limit = r->end;
+    r->socket = -1;
+
+    // Skip the header.
+    r->ptr = pdu + sizeof(WATCHMAN_BINARY_MARKER) - 1;
     const char *error = NULL;
-    int64_t payload_size = peek_size + watchman_read_int(r, &error);
-    if (error) {
-        return NULL;
-    }
+    (void)watchman_read_int(r, &error);
+    return r;
+}
 
-    // Actually read the PDU.
-    assert(payload_size > 0);
-    if ((size_t)payload_size > r->capacity) {
-        r->payload = xrealloc(r->payload, payload_size);
-    }
+static watchman_response_t *watchman_send(watchman_request_t *w, int socket) {
+    watchman_request_size(w);
 
-    received = recv(socket, r->payload, payload_size, MSG_WAITALL);
-    if (received == -1 || received != payload_size) {
-        return NULL;
+    // Send the message.
+    assert(w->length < SSIZE_MAX);
+    size_t sent = 0;
+    while (sent < w->length) {
+        ssize_t count =
+            send(socket, w->payload + sent, w->length - sent, SEND_FLAGS);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        sent += count;
     }
 
-    r->ptr = r->payload + peek_size;
-    r->end = r->payload + payload_size;
-    r->capacity = payload_size;
-
-    return r;
+    return watchman_read_pdu(socket);
 }
 
 static void watchman_skip_value(watchman_response_t *r, const char **error) {
     assert(error != NULL);
-    if (r->ptr >= r->end) {
+    if (!watchman_fill(r, 1)) {
         *error = "watchman_skip_value(): unexpected end of input";
         return;
     }
@@ -723,9 +1416,12 @@ static void watchman_skip_value(watchman_response_t *r, const char **error) {
             }
             break;
         case WATCHMAN_STRING_MARKER:
-            (void)watchman_read_string(r, error);
-            if (*error) {
-                return;
+            {
+                str_t string;
+                watchman_read_string_no_copy(r, &string, error);
+                if (*error) {
+                    return;
+                }
             }
             break;
         case WATCHMAN_INT8_MARKER:
@@ -764,11 +1460,11 @@ static void watchman_skip_value(watchman_response_t *r, const char **error) {
                         return;
                     }
                 }
-                uint64_t object_count = watchman_read_array(r, error);
+                int64_t object_count = watchman_read_int(r, error);
                 if (*error) {
                     return;
                 }
-                for (uint64_t i = 0; i < object_count; i++) {
+                for (int64_t i = 0; i < object_count; i++) {
                     for (uint64_t j = 0; j < key_count; j++) {
                         watchman_skip_value(r, error);
                         if (*error) {
@@ -783,11 +1479,266 @@ static void watchman_skip_value(watchman_response_t *r, const char **error) {
     }
 }
 
+/**
+ * Returns a copy of the `count` `strings`, or NULL if there are none.
+ */
+static const char **watchman_strings_copy(
+    const char **strings, unsigned count
+) {
+    if (!count) {
+        return NULL;
+    }
+    const char **copy = xmalloc(count * sizeof(char *));
+    for (unsigned i = 0; i < count; i++) {
+        copy[i] = xstrdup(strings[i]);
+    }
+    return copy;
+}
+
+/**
+ * Frees a copy made by `watchman_strings_copy()`.
+ */
+static void watchman_strings_free(const char **strings, unsigned count) {
+    for (unsigned i = 0; i < count; i++) {
+        free((void *)strings[i]);
+    }
+    free(strings);
+}
+
+/**
+ * Prepares a "watch-project" command:
+ *
+ *     ["watch-project", "/path/to/root"]
+ */
+static watchman_request_t *watchman_watch_project_request(const char *root) {
+    watchman_request_t *w = watchman_request_init();
+    watchman_write_array(w, 2);
+    watchman_write_string(w, "watch-project", sizeof("watch-project") - 1);
+    watchman_write_string(w, root, strlen(root));
+    return w;
+}
+
+/**
+ * Processes the response to a "watch-project" command, taking ownership of
+ * `r` (which may be NULL if the command could not be sent):
+ *
+ *     {
+ *       "watch": "/path/to/root",
+ *       "relative_path": "optional/relative/path",
+ *       "error": "If present, someting went wrong",
+ *       ...
+ *     }
+ */
+static watchman_watch_project_t *watchman_watch_project_response(
+    watchman_response_t *r
+) {
+    watchman_watch_project_t *result =
+        xcalloc(1, sizeof(watchman_watch_project_t));
+    str_t *key = NULL;
+    if (!r) {
+        result->error = xstrdup(
+            "commandt_watchman_watch_project(): failed to talk to Watchman"
+        );
+        return result;
+    }
+    uint64_t count = watchman_read_object(r, &result->error);
+    if (result->error) {
+        goto done;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        key = watchman_read_string(r, &result->error);
+        if (result->error) {
+            goto done;
+        } else if (key->length == sizeof("watch") - 1 && strncmp(key->contents, "watch", key->length) == 0) {
+            str_t *watch = watchman_read_string(r, &result->error);
+            if (result->error) {
+                goto done;
+            }
+            result->watch = watch->contents;
+            free(watch);
+        } else if (key->length == sizeof("relative_path") - 1 && strncmp(key->contents, "relative_path", key->length) == 0) {
+            str_t *relative_path = watchman_read_string(r, &result->error);
+            if (result->error) {
+                goto done;
+            }
+            result->relative_path = relative_path->contents;
+            free(relative_path);
+        } else if (key->length == sizeof("error") - 1 && strncmp(key->contents, "error", key->length) == 0) {
+            // Error may be something like:
+            //
+            //     std::system_error: open: : No such file or directory
+            //
+            // or:
+            //
+            //     watchman::RootResolveError: failed to resolve root:
+            //     unable to resolve root $DIRECTORY: failed to parse json
+            //     from $DIRECTORY/.watchmanconfig: '[' or '{' expected near
+            //     end of file
+            //
+            str_t *error = watchman_read_string(r, &result->error);
+            if (result->error) {
+                goto done;
+            } else {
+                // Some song and dance here because string is not guaranteed to
+                // be NUL-terminated.
+                result->error = str_c_string(error);
+                str_free(error);
+                goto done_no_copy;
+            }
+        } else {
+            // Skip over values we don't care about.
+            watchman_skip_value(r, &result->error);
+            if (result->error) {
+                goto done;
+            }
+        }
+        str_free(key);
+        key = NULL;
+    }
+    if (!result->watch) {
+        result->error =
+            "commandt_watchman_watch_project(): no \"watch\" value in \"watch-project\" response";
+        goto done;
+    }
+    assert(r->ptr == r->limit);
+
+done:
+    if (result->error) {
+        result->error = xstrdup(result->error);
+    }
+done_no_copy:
+    watchman_drain(r);
+    watchman_response_free(r);
+    if (key) {
+        str_free(key);
+    }
+
+    return result;
+}
+
 static void watchman_write_array(watchman_request_t *w, unsigned length) {
     watchman_append_char(w, WATCHMAN_ARRAY_MARKER);
     watchman_write_int(w, length);
 }
 
+/**
+ * Encodes the "expression" that selects the files to list. Without a
+ * `filter` (or with an empty one), that is just:
+ *
+ *     ["type", "f"]
+ *
+ * Otherwise, the suffixes are required, and the exclusions ruled out:
+ *
+ *     ["allof",
+ *       ["type", "f"],
+ *       ["anyof", ["suffix", "c"], ["suffix", "h"]],
+ *       ["not", ["anyof",
+ *         ["dirname", "third_party"],
+ *         ["match", "*.o", "basename", {"includedotfiles": true}],
+ *         ["match", ..., "wholename", {"includedotfiles": true}]
+ *       ]]
+ *     ]
+ *
+ * Each "ignore" pattern needs two terms: one to match the file's own name,
+ * and one, with the pattern wrapped in "**" path components, to match the
+ * name of any directory above it (the first is left out for patterns that
+ * only apply to directories).
+ */
+static void watchman_write_expression(
+    watchman_request_t *w, const watchman_filter_t *filter
+) {
+    unsigned suffixes = 0;
+    unsigned exclusions = 0;
+    if (filter) {
+        for (unsigned i = 0; i < filter->suffixes_count; i++) {
+            size_t length;
+            if (watchman_filter_suffix(filter->suffixes[i], &length)) {
+                suffixes++;
+            }
+        }
+        for (unsigned i = 0; i < filter->exclude_count; i++) {
+            if (filter->exclude[i][0]) {
+                exclusions++;
+            }
+        }
+        for (unsigned i = 0; i < filter->ignore_count; i++) {
+            size_t length;
+            bool directories;
+            if (watchman_filter_pattern(
+                    filter->ignore[i], &length, &directories
+                )) {
+                exclusions += directories ? 1 : 2;
+            }
+        }
+    }
+
+    if (!suffixes && !exclusions) {
+        watchman_write_array(w, 2);
+        watchman_write_string(w, "type", sizeof("type") - 1);
+        watchman_write_string(w, "f", sizeof("f") - 1);
+        return;
+    }
+
+    watchman_write_array(w, 2 + (suffixes != 0) + (exclusions != 0));
+    watchman_write_string(w, "allof", sizeof("allof") - 1);
+    watchman_write_array(w, 2);
+    watchman_write_string(w, "type", sizeof("type") - 1);
+    watchman_write_string(w, "f", sizeof("f") - 1);
+
+    if (suffixes) {
+        watchman_write_array(w, 1 + suffixes);
+        watchman_write_string(w, "anyof", sizeof("anyof") - 1);
+        for (unsigned i = 0; i < filter->suffixes_count; i++) {
+            size_t length;
+            const char *suffix =
+                watchman_filter_suffix(filter->suffixes[i], &length);
+            if (suffix) {
+                watchman_write_array(w, 2);
+                watchman_write_string(w, "suffix", sizeof("suffix") - 1);
+                watchman_write_string(w, suffix, length);
+            }
+        }
+    }
+
+    if (exclusions) {
+        watchman_write_array(w, 2);
+        watchman_write_string(w, "not", sizeof("not") - 1);
+        watchman_write_array(w, 1 + exclusions);
+        watchman_write_string(w, "anyof", sizeof("anyof") - 1);
+        for (unsigned i = 0; i < filter->exclude_count; i++) {
+            const char *directory = filter->exclude[i];
+            if (directory[0]) {
+                watchman_write_array(w, 2);
+                watchman_write_string(w, "dirname", sizeof("dirname") - 1);
+                watchman_write_string(w, directory, strlen(directory));
+            }
+        }
+        for (unsigned i = 0; i < filter->ignore_count; i++) {
+            size_t length;
+            bool directories;
+            const char *pattern =
+                watchman_filter_pattern(filter->ignore[i], &length, &directories);
+            if (!pattern) {
+                continue;
+            }
+            if (!directories) {
+                watchman_write_match(w, pattern, length, "basename");
+            }
+
+            // "**/pattern/**" matches any path with `pattern` as one of its
+            // directory components.
+            size_t wholename_length = length + 6;
+            char *wholename = xmalloc(wholename_length);
+            memcpy(wholename, "**/", 3);
+            memcpy(wholename + 3, pattern, length);
+            memcpy(wholename + 3 + length, "/**", 3);
+            watchman_write_match(w, wholename, wholename_length, "wholename");
+            free(wholename);
+        }
+    }
+}
+
 /**
  * Encodes and appends the integer `num` to `w`
  */
@@ -812,6 +1763,26 @@ static void watchman_write_int(watchman_request_t *w, int64_t num) {
     }
 }
 
+/**
+ * Encodes a "match" term for the glob `pattern`, which may match dotfiles
+ * (as `fnmatch()` does when called without `FNM_PERIOD`):
+ *
+ *     ["match", "pattern", "basename", {"includedotfiles": true}]
+ *
+ * `scope` is either "basename" or "wholename".
+ */
+static void watchman_write_match(
+    watchman_request_t *w, const char *pattern, size_t length, const char *scope
+) {
+    watchman_write_array(w, 4);
+    watchman_write_string(w, "match", sizeof("match") - 1);
+    watchman_write_string(w, pattern, length);
+    watchman_write_string(w, scope, strlen(scope));
+    watchman_write_object(w, 1);
+    watchman_write_string(w, "includedotfiles", sizeof("includedotfiles") - 1);
+    watchman_append_char(w, WATCHMAN_TRUE);
+}
+
 /**
  * Prepares to encode an object of `size` key/value pairs.
  *
@@ -824,6 +1795,55 @@ static void watchman_write_object(watchman_request_t *w, unsigned size) {
     watchman_write_int(w, size);
 }
 
+/**
+ * Encodes the object that describes the files to list, which is common to
+ * "query" and "subscribe":
+ *
+ *     {
+ *       "expression": ["type", "f"],
+ *       "fields": ["name", "exists", "new", "mtime_ms"],
+ *       "relative_root": "relative/path",
+ *       "since": "c:123:456"
+ *     }
+ *
+ * "exists" and "new" are only requested if `changes` is true, and "mtime_ms"
+ * only if it is among `fields` (see `watchman_field_t`); "relative_root" and
+ * "since" are omitted if NULL. The
+ * "expression" depends on `filter` (see `watchman_write_expression()`).
+ */
+static void watchman_write_query_object(
+    watchman_request_t *w,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    bool changes
+) {
+    watchman_write_object(w, 2 + (relative_root != NULL) + (since != NULL));
+    watchman_write_string(w, "expression", sizeof("expression") - 1);
+    watchman_write_expression(w, filter);
+    watchman_write_string(w, "fields", sizeof("fields") - 1);
+    watchman_write_array(
+        w, 1 + (changes ? 2 : 0) + ((fields & WATCHMAN_FIELD_MTIME) != 0)
+    );
+    watchman_write_string(w, "name", sizeof("name") - 1);
+    if (changes) {
+        watchman_write_string(w, "exists", sizeof("exists") - 1);
+        watchman_write_string(w, "new", sizeof("new") - 1);
+    }
+    if (fields & WATCHMAN_FIELD_MTIME) {
+        watchman_write_string(w, "mtime_ms", sizeof("mtime_ms") - 1);
+    }
+    if (relative_root) {
+        watchman_write_string(w, "relative_root", sizeof("relative_root") - 1);
+        watchman_write_string(w, relative_root, strlen(relative_root));
+    }
+    if (since) {
+        watchman_write_string(w, "since", sizeof("since") - 1);
+        watchman_write_string(w, since, strlen(since));
+    }
+}
+
 /**
  * Encodes and appends the string `string` to `w`
  */
@@ -14,8 +14,11 @@
 #ifndef WATCHMAN_H
 #define WATCHMAN_H
 
+#include <stdbool.h> /* for bool */
 #include <stddef.h> /* for size_t */
+#include <stdint.h> /* for int64_t */
 
+#include "commandt.h" /* for scanner_t */
 #include "str.h" /* for str_t */
 
 // TODO: Either use uint8_t for both requests and responses, or char for both.
@@ -26,9 +29,63 @@ typedef struct {
     size_t capacity;
     char *payload;
     char *ptr;
+
+    /**
+     * End of the bytes received so far.
+     */
     char *end;
+
+    /**
+     * End of the PDU; the bytes between `end` and `limit` have yet to be
+     * received from `socket`.
+     */
+    char *limit;
+    int socket;
 } watchman_response_t;
 
+/**
+ * Fields that can be requested, in addition to the name, for each file
+ * listed by `commandt_watchman_query()`; combine them with `|`.
+ */
+typedef enum {
+    WATCHMAN_FIELD_MTIME = 1 << 0, // "mtime_ms"
+} watchman_field_t;
+
+/**
+ * Restricts the files listed by `commandt_watchman_query()` and
+ * `commandt_watchman_subscribe()`. The filter is compiled into the query's
+ * "expression", so Watchman drops the files that don't pass it before it
+ * serializes the listing, rather than us throwing them away after receiving
+ * and decoding them.
+ */
+typedef struct {
+    /**
+     * If any are given, only files with one of these suffixes are listed. As
+     * with Watchman's "suffix" term, a suffix is the part of the name after
+     * the last ".", and is compared case-insensitively; a leading "." or "*."
+     * (eg. "*.c") is ignored.
+     */
+    const char **suffixes;
+    unsigned suffixes_count;
+
+    /**
+     * Directories (relative to the directory being listed) whose contents
+     * should not be listed, using Watchman's "dirname" term.
+     */
+    const char **exclude;
+    unsigned exclude_count;
+
+    /**
+     * Names and glob patterns of entries to skip at any depth, in the form
+     * accepted by `ignore_new()` (and produced from 'wildignore' by
+     * `wincent.commandt.private.wildignore`): a file is skipped if its own
+     * name matches, or if the name of any directory above it does. A trailing
+     * "/" restricts a pattern to directories.
+     */
+    const char **ignore;
+    unsigned ignore_count;
+} watchman_filter_t;
+
 typedef struct {
     unsigned count;
     str_t *files;
@@ -38,6 +95,42 @@ typedef struct {
      */
     const char *error;
 
+    /**
+     * When the "exists" field was requested (as it is for subscriptions),
+     * whether each of the `files` exists; a file that doesn't has been
+     * deleted. NULL if every file exists.
+     */
+    bool *exists;
+
+    /**
+     * When the "new" field was requested, whether each of the `files` was
+     * created since the clock given as "since" (or since the previous PDU of a
+     * subscription); an existing file that isn't new has merely been
+     * modified. Files that Watchman says nothing about are assumed to be new.
+     * NULL if no fields other than "name" were requested.
+     */
+    bool *is_new;
+
+    /**
+     * When requested (see `watchman_field_t`), the modification time (in
+     * milliseconds since the epoch) of each of the `files`; NULL otherwise.
+     * Values that Watchman omits are 0.
+     */
+    int64_t *mtimes;
+
+    /**
+     * True if `files` is a complete listing rather than a set of changes
+     * relative to the previous one.
+     */
+    bool is_fresh_instance;
+
+    /**
+     * Watchman's clock at the time of the response, which can be passed as
+     * the `since` argument of a later `commandt_watchman_query()` to ask for
+     * only the files that have changed in the meantime. May be NULL.
+     */
+    const char *clock;
+
     /**
      * @internal
      *
@@ -53,6 +146,22 @@ typedef struct {
     watchman_response_t *response;
 } watchman_query_t;
 
+/**
+ * Called while the "files" of a PDU are being decoded, each time more of the
+ * PDU arrives, with the first `partial->count` of `partial->files` (and, if
+ * present, of `partial->exists` and `partial->is_new`); the other fields are
+ * not filled in yet. The same `partial` is eventually returned to the caller
+ * of `commandt_watchman_receive()`.
+ *
+ * `partial->files`, `partial->exists` and `partial->is_new` are allocated
+ * before the first call, and don't move after it, so the files passed to one
+ * call can be read (under a lock that the callback also takes) while later
+ * ones are being decoded.
+ */
+typedef void (*watchman_progress_t)(
+    const watchman_query_t *partial, void *context
+);
+
 typedef struct {
     /**
      * May be NULL if an error occurred.
@@ -91,6 +200,20 @@ int commandt_watchman_disconnect(int socket);
  *          ]
  *      JSON
  *
+ * If `filter` is non-NULL, it is added to the "expression" (see
+ * `watchman_filter_t`).
+ *
+ * Any `fields` (see `watchman_field_t`) are requested as well as "name". When
+ * more than one field is requested, Watchman sends the list in "template"
+ * form (the keys once, followed by the values for each file), which is
+ * decoded straight into one array per field.
+ *
+ * If `since` is non-NULL (a `clock` from an earlier result), it is added to
+ * the query object as "since", and the fields include "exists" and "new";
+ * the result lists only the files that have been added, removed or modified
+ * since then, unless Watchman can't tell (eg. because it has restarted), in
+ * which case `is_fresh_instance` is set and all of the files are listed.
+ *
  * As a performance optimization, the slab of memory allocated to hold
  * the response from the Watchman server is preserved and the returned
  * `watchman_query_t` struct contains `str_t` structs that
@@ -99,11 +222,80 @@ int commandt_watchman_disconnect(int socket);
  * `commandt_watchman_query_free()`, you must make a copy.
  */
 watchman_query_t *commandt_watchman_query(
-    const char *root, const char *relative_root, int socket
+    const char *root,
+    const char *relative_root,
+    const char *since,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    int socket
 );
 
 void commandt_watchman_query_free(watchman_query_t *result);
 
+/**
+ * Returns a scanner for the `files` of `result`, which takes over the `files`
+ * slab and the response that they point into, instead of copying them; the
+ * rest of `result` is freed. Once the scanner is disposed of with
+ * `scanner_free()` (or handed to `commandt_client_recycle()`), nothing of
+ * the listing remains.
+ *
+ * If `result` has `mtimes`, the scanner favors recently modified files: their
+ * scores are scaled up (by up to 1.5 for files modified within the last hour)
+ * via the scanner's `sources` and `source_weights`.
+ *
+ * `result` must not have an `error`.
+ */
+scanner_t *commandt_watchman_scanner(watchman_query_t *result);
+
+/**
+ * Equivalent to:
+ *
+ *      watchman -j <<JSON
+ *          [
+ *              "subscribe",
+ *              "/path/to/root",
+ *              "name", {
+ *                  "expression": ["type", "f"],
+ *                  "fields": ["name", "exists", "new"],
+ *                  "relative_root": "relative/path"
+ *              }
+ *          ]
+ *      JSON
+ *
+ * As with `commandt_watchman_query()`, `filter` may be NULL.
+ *
+ * Returns the response to the command itself, which has no `files` (but may
+ * have an `error`). Watchman follows up with the initial (complete) listing,
+ * with `is_fresh_instance` set, and from then on pushes changes to the socket
+ * whenever files are added or removed; read them with
+ * `commandt_watchman_receive()`. The subscription lasts until the socket is
+ * closed, so the socket should not be used for anything else.
+ */
+watchman_query_t *commandt_watchman_subscribe(
+    const char *root,
+    const char *relative_root,
+    const char *name,
+    const watchman_filter_t *filter,
+    int socket
+);
+
+/**
+ * Blocks until Watchman pushes the next unilateral PDU for a subscription
+ * (see `commandt_watchman_subscribe()`) and returns its `files`. PDUs that
+ * don't carry files (eg. "state-enter") produce an empty result.
+ *
+ * The files are decoded as they arrive. If `progress` is non-NULL, it is
+ * called (on the calling thread, with `context`) whenever more of them have
+ * been decoded, so that a large listing can be put to use before all of it
+ * has arrived.
+ *
+ * Returns NULL once the connection has been closed or shut down (see
+ * `shutdown()`).
+ */
+watchman_query_t *commandt_watchman_receive(
+    int socket, watchman_progress_t progress, void *context
+);
+
 /**
  * Equivalent to `watchman watch-project /path/to/root`.
  */
@@ -113,4 +305,71 @@ watchman_watch_project_t *commandt_watchman_watch_project(
 
 void commandt_watchman_watch_project_free(watchman_watch_project_t *result);
 
+/**
+ * Returns a copy of `filter` (which may be NULL), including all of its
+ * strings. The caller should dispose of it with
+ * `commandt_watchman_filter_free()`.
+ */
+watchman_filter_t *commandt_watchman_filter_copy(
+    const watchman_filter_t *filter
+);
+
+void commandt_watchman_filter_free(watchman_filter_t *filter);
+
+/**
+ * @internal
+ *
+ * The functions that follow are building blocks for clients that do their
+ * own I/O (see `client_t`). They encode requests as complete PDUs (the
+ * caller should `free()` the result, whose length is stored in `length`) and
+ * decode complete responses.
+ */
+char *commandt_watchman_encode_query(
+    const char *root,
+    const char *relative_root,
+    const watchman_filter_t *filter,
+    unsigned fields,
+    size_t *length
+);
+
+/**
+ * @internal
+ */
+char *commandt_watchman_encode_watch_project(const char *root, size_t *length);
+
+/**
+ * @internal
+ *
+ * Given the first `length` bytes of a PDU at `buffer`, returns the length of
+ * the whole PDU (including its header), 0 if more bytes are needed to tell,
+ * or -1 if `buffer` doesn't hold a valid header.
+ */
+int64_t commandt_watchman_pdu_length(const char *buffer, size_t length);
+
+/**
+ * @internal
+ *
+ * Decodes the response to a "query" command from the complete PDU of
+ * `length` bytes at `pdu`, which must have been allocated with `malloc()`;
+ * takes ownership of `pdu` (the `files` of the result point into it).
+ *
+ * If `files` is non-NULL, it is a slab of `files_size` bytes obtained from
+ * `xmap()` (eg. the `files` of an earlier result), which is used for the
+ * `files` of this one if it is big enough, and unmapped otherwise; either
+ * way, ownership of it passes to the result.
+ */
+watchman_query_t *commandt_watchman_decode_query(
+    char *pdu, size_t length, str_t *files, size_t files_size
+);
+
+/**
+ * @internal
+ *
+ * Like `commandt_watchman_decode_query()`, but for a "watch-project" command;
+ * `pdu` is freed before returning.
+ */
+watchman_watch_project_t *commandt_watchman_decode_watch_project(
+    char *pdu, size_t length
+);
+
 #endif
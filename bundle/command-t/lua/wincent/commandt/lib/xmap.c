@@ -3,12 +3,18 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#ifdef LINUX
+#define _GNU_SOURCE /* for mremap() */
+#endif
+
 #include "xmap.h"
 
 #include <assert.h> /* for assert() */
 #include <stddef.h> /* for NULL */
 #include <stdlib.h> /* for abort() */
-#include <sys/mman.h> /* for mmap(), munmap() */
+#include <string.h> /* for memcpy() */
+#include <sys/mman.h> /* for madvise(), mmap(), mremap(), munmap() */
+#include <unistd.h> /* for sysconf() */
 
 void *xmap(size_t size) {
     void *result = mmap(
@@ -25,6 +31,40 @@ void *xmap(size_t size) {
     return result;
 }
 
+size_t xmap_round(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+void *xmremap(void *address, size_t old_size, size_t new_size) {
+    old_size = xmap_round(old_size);
+    new_size = xmap_round(new_size);
+    if (new_size == old_size) {
+        return address;
+    } else if (new_size < old_size) {
+        xmunmap((char *)address + new_size, old_size - new_size);
+        return address;
+    }
+#ifdef LINUX
+    void *result = mremap(address, old_size, new_size, MREMAP_MAYMOVE);
+    if (result == MAP_FAILED) {
+        abort();
+    }
+#else
+    void *result = xmap(new_size);
+    memcpy(result, address, old_size);
+    xmunmap(address, old_size);
+#endif
+    return result;
+}
+
+void xmap_hugepage(void *address, size_t size) {
+#ifdef MADV_HUGEPAGE
+    // Purely advisory, so failure doesn't matter.
+    madvise(address, size, MADV_HUGEPAGE);
+#endif
+}
+
 int xmunmap(void *address, size_t length) {
     int munmapped = munmap(address, length);
     assert(munmapped == 0);
@@ -8,6 +8,9 @@
 
 // Define short names for convenience, but all external symbols need prefixes.
 #define xmap commandt_xmap
+#define xmap_hugepage commandt_xmap_hugepage
+#define xmap_round commandt_xmap_round
+#define xmremap commandt_xmremap
 #define xmunmap commandt_xmunmap
 
 #include <stddef.h> /* for size_t */
@@ -17,6 +20,27 @@
  */
 void *xmap(size_t size);
 
+/**
+ * Rounds `size` up to a whole number of pages.
+ */
+size_t xmap_round(size_t size);
+
+/**
+ * Resizes a mapping previously obtained from `xmap()`, preserving its
+ * contents, and calls `abort()` on failure.
+ *
+ * Growing may move the mapping, so callers must be prepared to fix up any
+ * pointers into it; shrinking never does.
+ */
+void *xmremap(void *address, size_t old_size, size_t new_size);
+
+/**
+ * Asks for a mapping to be backed by huge pages where the system supports
+ * it (ie. `MADV_HUGEPAGE` on Linux), which cuts down on TLB misses when
+ * sweeping over large arrays. A no-op elsewhere.
+ */
+void xmap_hugepage(void *address, size_t size);
+
 /**
  * `munmap()` wrapper that uses `assert()` to confirm success.
  *
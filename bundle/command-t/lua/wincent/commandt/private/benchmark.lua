@@ -272,7 +272,7 @@ local benchmark = function(options)
       local cumulative_cpu_delta = 0
       local cumulative_wall_delta = 0
       for _, variant in ipairs(config.variants) do
-        if variant.skip and variant.skip(variant) then
+        if (options.skip and options.skip(variant)) or (variant.skip and variant.skip(variant)) then
           print('Skipping: ' .. variant.name)
         else
           local setup = options.setup and options.setup(variant)
@@ -332,7 +332,9 @@ local benchmark = function(options)
     local cpu_avg = metrics['cpu (avg)']
     local wall_avg = metrics['wall (avg)']
 
-    if previous then
+    -- Variants can come and go (eg. when skipped), so there may be nothing to
+    -- compare with.
+    if previous and previous.timings[label] then
       local previous_cpu_avg = previous.timings[label]['cpu (avg)']
       local previous_cpu = previous.timings[label].cpu
       local previous_wall_avg = previous.timings[label]['wall (avg)']
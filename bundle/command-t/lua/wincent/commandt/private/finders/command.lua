@@ -8,6 +8,7 @@ return function(directory, command, options, name)
   local drop = 0
   local max_files = 0
   local get_max_files = options.finders[name].max_files
+  local get_scanner = options.finders[name].scanner
   if type(command) == 'function' then
     command, drop = command(directory, options)
   end
@@ -17,7 +18,18 @@ return function(directory, command, options, name)
     max_files = get_max_files(options) or 0
   end
   local finder = {}
-  finder.scanner = require('wincent.commandt.private.scanners.command').scanner(command, drop, max_files)
+  if get_scanner then
+    -- Finders may supply a native scanner to use instead of running `command`.
+    finder.scanner = get_scanner(directory, options, max_files)
+  end
+  if finder.scanner == nil then
+    finder.scanner = require('wincent.commandt.private.scanners.command').scanner(
+      command,
+      drop,
+      max_files,
+      options.finders[name].delimiter
+    )
+  end
   finder.matcher = lib.matcher_new(finder.scanner, options)
   finder.run = function(query)
     local results = lib.matcher_run(finder.matcher, query)
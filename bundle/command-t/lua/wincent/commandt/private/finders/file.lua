@@ -3,14 +3,42 @@
 
 local ffi = require('ffi')
 
--- TODO: remember cached directories
+-- When watching, the matcher for the most recent live scanner; it notices
+-- changes to the scanner's candidates by itself, so we can keep reusing it
+-- (along with the bitmasks and scores that it has cached), for as long as the
+-- matcher options stay the same.
+local cached = nil
+
 return function(directory, options)
   directory = directory or os.getenv('PWD')
   local lib = require('wincent.commandt.private.lib')
   local finder = {}
   local max_files = options.scanners.file.max_files or 0
-  finder.scanner = require('wincent.commandt.private.scanners.file').scanner(directory, max_files)
-  finder.matcher = lib.matcher_new(finder.scanner, options)
+  finder.scanner, finder.live = require('wincent.commandt.private.scanners.file').scanner(directory, {
+    -- When the scan is capped, make sure the files that make the cut are the
+    -- shallowest ones (ie. top-level sources rather than some deeply-nested
+    -- vendored directory).
+    breadth_first = max_files > 0,
+    compact = options.scanners.file.compact,
+    emit_aliases = options.scanners.file.emit_aliases,
+    ignore = require('wincent.commandt.private.wildignore')(vim.o.wildignore),
+    index = options.scanners.file.index,
+    max_depth = options.scanners.file.max_depth or 0,
+    max_files = max_files,
+    respect_gitignore = options.scanners.file.respect_gitignore,
+    scan_dot_directories = options.scanners.file.scan_dot_directories,
+    threads = options.threads,
+    watch = options.scanners.file.watch,
+  })
+  if finder.live ~= nil then
+    local key = vim.inspect(lib.matcher_options(options))
+    if cached == nil or cached.live ~= finder.live or cached.key ~= key then
+      cached = { key = key, live = finder.live, matcher = lib.matcher_new(finder.scanner, options) }
+    end
+    finder.matcher = cached.matcher
+  else
+    finder.matcher = lib.matcher_new(finder.scanner, options)
+  end
   finder.run = function(query)
     local results = lib.matcher_run(finder.matcher, query)
     local strings = {}
@@ -0,0 +1,30 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+return function(directory, manifest, options)
+  local lib = require('wincent.commandt.private.lib')
+  local strip = nil
+  if type(manifest) == 'function' then
+    manifest, strip = manifest(directory, options)
+  end
+  local format = manifest:match('%.json$') and 'compile_commands' or 'list'
+  local finder = {}
+  finder.scanner = lib.manifest_scanner(manifest, { format = format, strip = strip })
+  if finder.scanner == nil then
+    error('wincent.commandt.private.finders.manifest(): could not read ' .. manifest)
+  end
+  finder.matcher = lib.matcher_new(finder.scanner, options)
+  finder.run = function(query)
+    local results = lib.matcher_run(finder.matcher, query)
+    local strings = {}
+    for i = 0, results.match_count - 1 do
+      local str = results.matches[i]
+      table.insert(strings, ffi.string(str.contents, str.length))
+    end
+    return strings, results.candidate_count
+  end
+  finder.open = options.open
+  return finder
+end
@@ -0,0 +1,25 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+return function(directory, sources, options)
+  local lib = require('wincent.commandt.private.lib')
+  local finder = {}
+  if type(sources) == 'function' then
+    sources = sources(directory, options)
+  end
+  finder.scanner = lib.union_scanner(sources)
+  finder.matcher = lib.matcher_new(finder.scanner, options)
+  finder.run = function(query)
+    local results = lib.matcher_run(finder.matcher, query)
+    local strings = {}
+    for i = 0, results.match_count - 1 do
+      local str = results.matches[i]
+      table.insert(strings, ffi.string(str.contents, str.length))
+    end
+    return strings, results.candidate_count
+  end
+  finder.open = options.open
+  return finder
+end
@@ -3,15 +3,42 @@
 
 local ffi = require('ffi')
 
+-- When subscribed (or polling with "since" queries), the matcher for the most
+-- recent subscription and matcher options; it notices changes to the scanner's
+-- candidates by itself, so we can keep reusing it (along with the bitmasks and
+-- scores that it has cached) until either of those changes.
+local cached = nil
+
 return function(directory, options)
   if directory == nil or directory == '' then
     directory = os.getenv('PWD')
   end
   local lib = require('wincent.commandt.private.lib')
   local finder = {}
-  finder.scanner = require('wincent.commandt.private.scanners.watchman').scanner(directory)
-  finder.matcher = lib.matcher_new(finder.scanner, options)
+  finder.scanner, finder.subscription = require('wincent.commandt.private.scanners.watchman').scanner(directory, {
+    exclude = options.scanners.watchman.exclude,
+    ignore = options.scanners.watchman.wildignore and require('wincent.commandt.private.wildignore')(vim.o.wildignore)
+      or nil,
+    recency = options.scanners.watchman.recency,
+    since = options.scanners.watchman.since,
+    subscribe = options.scanners.watchman.subscribe,
+    suffixes = options.scanners.watchman.suffixes,
+  })
+  if finder.subscription ~= nil then
+    local key = vim.inspect(lib.matcher_options(options))
+    if cached == nil or cached.subscription ~= finder.subscription or cached.key ~= key then
+      cached = { key = key, subscription = finder.subscription, matcher = lib.matcher_new(finder.scanner, options) }
+    end
+    finder.matcher = cached.matcher
+  else
+    finder.matcher = lib.matcher_new(finder.scanner, options)
+  end
   finder.run = function(query)
+    if finder.subscription ~= nil and options.scanners.watchman.subscribe then
+      -- Pick up any changes (or more of the initial listing, if it is still
+      -- arriving) that have come in since we last looked; this is cheap.
+      lib.watchman_subscription_scanner(finder.subscription)
+    end
     local results = lib.matcher_run(finder.matcher, query)
     local strings = {}
     for i = 0, results.match_count - 1 do
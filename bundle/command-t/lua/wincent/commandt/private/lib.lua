@@ -21,24 +21,49 @@ setmetatable(c, {
           size_t capacity;
       } str_t;
 
+      typedef struct {
+          uint32_t offset;
+          uint32_t length;
+      } slab_handle_t;
+
       typedef struct {
           str_t *candidate;
           long bitmask;
           float score;
+          unsigned index;
       } haystack_t;
 
       typedef struct {
           unsigned count;
+          unsigned tombstones;
           str_t *candidates;
           size_t candidates_size;
           char *buffer;
           size_t buffer_size;
+          char *payload;
+          size_t payload_size;
+          long *bitmasks;
+          unsigned bitmasks_count;
+          void *paths;
+          slab_handle_t *handles;
+          size_t handles_size;
+          unsigned char *sources;
+          float *source_weights;
+          unsigned duplicate_count;
           unsigned clock;
+          unsigned generation;
       } scanner_t;
 
       typedef struct {
           scanner_t *scanner;
           haystack_t *haystacks;
+          unsigned haystacks_count;
+          unsigned haystacks_capacity;
+          unsigned clock;
+          unsigned generation;
+          unsigned seen;
+          unsigned tombstones;
+          str_t *candidates;
           bool always_show_dot_files;
           bool ignore_case;
           bool ignore_spaces;
@@ -58,19 +83,88 @@ setmetatable(c, {
           str_t **matches;
           unsigned match_count;
           unsigned candidate_count;
+          str_t *strings;
+          char *buffer;
       } result_t;
 
+      typedef struct {
+          unsigned max_files;
+          unsigned max_depth;
+          bool scan_dot_directories;
+          const char **ignore;
+          unsigned ignore_count;
+          bool respect_gitignore;
+          bool breadth_first;
+          bool emit_aliases;
+          void *on_directory;
+          void *context;
+          unsigned threads;
+          bool sort;
+      } find_options_t;
+
+      typedef enum {
+          SCANNER_DELIMITER_NUL,
+          SCANNER_DELIMITER_LF,
+          SCANNER_DELIMITER_CRLF,
+      } scanner_delimiter_t;
+
+      typedef enum {
+          MANIFEST_FORMAT_LIST,
+          MANIFEST_FORMAT_COMPILE_COMMANDS,
+      } manifest_format_t;
+
+      typedef enum {
+          UNION_SOURCE_COMMAND,
+          UNION_SOURCE_FILE,
+          UNION_SOURCE_SCANNER,
+          UNION_SOURCE_WATCHMAN,
+      } union_source_kind_t;
+
+      typedef enum {
+          WATCHMAN_FIELD_MTIME = 1,
+      } watchman_field_t;
+
+      typedef struct {
+          union_source_kind_t kind;
+          const char *command;
+          unsigned drop;
+          unsigned max_files;
+          scanner_delimiter_t delimiter;
+          const char *directory;
+          const find_options_t *options;
+          scanner_t *scanner;
+          const char *socket_path;
+          const char *prefix;
+          float weight;
+      } union_source_t;
+
       typedef struct {
           size_t capacity;
           char *payload;
           char *ptr;
           char *end;
+          char *limit;
+          int socket;
       } watchman_response_t;
 
+      typedef struct {
+          const char **suffixes;
+          unsigned suffixes_count;
+          const char **exclude;
+          unsigned exclude_count;
+          const char **ignore;
+          unsigned ignore_count;
+      } watchman_filter_t;
+
       typedef struct {
           unsigned count;
           str_t *files;
           const char *error;
+          bool *exists;
+          bool *is_new;
+          int64_t *mtimes;
+          bool is_fresh_instance;
+          const char *clock;
           size_t files_size;
           watchman_response_t *response;
       } watchman_query_t;
@@ -86,6 +180,14 @@ setmetatable(c, {
         uint32_t microseconds;
       } benchmark_t;
 
+      typedef struct live_scanner_t live_scanner_t;
+
+      typedef struct subscription_t subscription_t;
+
+      typedef struct client_t client_t;
+
+      typedef struct watchman_stub_t watchman_stub_t;
+
       // Matcher functions.
 
       matcher_t *commandt_matcher_new(
@@ -105,23 +207,72 @@ setmetatable(c, {
 
       // Scanner functions.
 
-      scanner_t *commandt_file_scanner(const char *directory, unsigned max_files);
-      scanner_t *commandt_scanner_new_command(const char *command, unsigned drop, unsigned max_files);
+      scanner_t *commandt_file_scanner(const char *directory, const find_options_t *options);
+      scanner_t *commandt_git_scanner_new(const char *directory, unsigned max_files, unsigned threads);
+      scanner_t *commandt_scanner_new_command(
+          const char *command,
+          unsigned drop,
+          unsigned max_files,
+          scanner_delimiter_t delimiter
+      );
       scanner_t *commandt_scanner_new_copy(const char **candidates, unsigned count);
+      scanner_t *commandt_scanner_new_packed(const char *buffer, const uint32_t *lengths, unsigned count);
       scanner_t *commandt_scanner_new_str(str_t *candidates, unsigned count);
+      scanner_t *commandt_union_scanner_new(const union_source_t *sources, unsigned count);
+      void commandt_scanner_compress(scanner_t *scanner);
       void commandt_scanner_free(scanner_t *scanner);
+      str_t commandt_scanner_get(const scanner_t *scanner, unsigned index);
+      size_t commandt_scanner_size(const scanner_t *scanner);
+      scanner_t *commandt_manifest_scanner_new(const char *path, manifest_format_t format, const char *strip);
+      scanner_t *commandt_index_load(const char *directory, const find_options_t *options, const char *index_path);
+      scanner_t *commandt_index_scan(const char *directory, const find_options_t *options, const char *index_path);
+      live_scanner_t *commandt_live_scanner_new(const char *directory, const find_options_t *options);
+      scanner_t *commandt_live_scanner_scanner(live_scanner_t *live);
+      void commandt_live_scanner_free(live_scanner_t *live);
+      subscription_t *commandt_subscription_new(
+          const char *socket_path,
+          const char *directory,
+          const watchman_filter_t *filter,
+          bool poll
+      );
+      scanner_t *commandt_subscription_scanner(subscription_t *subscription);
+      void commandt_subscription_free(subscription_t *subscription);
       void commandt_print_scanner(scanner_t *scanner);
 
       // Watchman functions.
 
+      client_t *commandt_client_new(const char *socket_path);
+      unsigned commandt_client_query(
+          client_t *client,
+          const char *directory,
+          const watchman_filter_t *filter,
+          unsigned fields
+      );
+      unsigned commandt_client_process(client_t *client, int timeout);
+      watchman_query_t *commandt_client_result(client_t *client, unsigned id);
+      void commandt_client_recycle(client_t *client, scanner_t *scanner);
+      int commandt_client_fd(const client_t *client);
+      short commandt_client_events(const client_t *client);
+      void commandt_client_free(client_t *client);
       int commandt_watchman_connect(const char *socket_path);
       int commandt_watchman_disconnect(int socket);
       watchman_query_t *commandt_watchman_query(
           const char *root,
           const char *relative_root,
+          const char *since,
+          const watchman_filter_t *filter,
+          unsigned fields,
           int socket
       );
       void commandt_watchman_query_free(watchman_query_t *result);
+      char *commandt_watchman_encode_query(
+          const char *root,
+          const char *relative_root,
+          const watchman_filter_t *filter,
+          unsigned fields,
+          size_t *length
+      );
+      scanner_t *commandt_watchman_scanner(watchman_query_t *result);
       watchman_watch_project_t *commandt_watchman_watch_project(
           const char *root,
           int socket
@@ -133,6 +284,12 @@ setmetatable(c, {
       // Benchmarking.
 
       benchmark_t commandt_epoch();
+      watchman_stub_t *commandt_watchman_stub_new(
+          const char *socket_path,
+          unsigned count
+      );
+      size_t commandt_watchman_stub_name(unsigned index, char *buffer);
+      void commandt_watchman_stub_free(watchman_stub_t *stub);
 
       // Utilities.
 
@@ -161,8 +318,143 @@ lib.epoch = function()
   return result['seconds'], result['microseconds']
 end
 
-lib.file_scanner = function(directory, max_files)
-  local scanner = c.commandt_file_scanner(directory, max_files or 0)
+-- For benchmarks (and tests): starts a stand-in for the Watchman server (see
+-- "stub.h") listening on `socket_path`, which answers every query with the same
+-- `count` synthetic files. It is stopped when the returned handle is passed to
+-- `lib.watchman_stub_free()` or garbage collected.
+lib.watchman_stub = function(socket_path, count)
+  local stub = c.commandt_watchman_stub_new(socket_path, count)
+  if stub == nil then
+    error('commandt_watchman_stub_new(): failed')
+  end
+  ffi.gc(stub, c.commandt_watchman_stub_free)
+  return stub
+end
+
+lib.watchman_stub_free = function(stub)
+  ffi.gc(stub, nil)
+  c.commandt_watchman_stub_free(stub)
+end
+
+-- Returns the name of the file at (0-based) `index` in the stub's listing.
+lib.watchman_stub_name = function(index)
+  local buffer = ffi.new('char[64]')
+  local length = c.commandt_watchman_stub_name(index, buffer)
+  return ffi.string(buffer, length)
+end
+
+-- Supported `options`:
+--
+-- - `breadth_first` (default: false); when true, shallower files are found
+--   before deeper ones, which matters when `max_files` truncates the scan.
+-- - `emit_aliases` (default: false); when true, symbolic links to directories
+--   that were already walked via another path are included in the results.
+-- - `ignore` (default: {}): list of names and glob patterns (see
+--   `wincent.commandt.private.wildignore`) of entries to skip.
+-- - `max_depth` (default: 0, meaning no limit).
+-- - `max_files` (default: 0, meaning no limit).
+-- - `respect_gitignore` (default: false); when true, skip entries excluded by
+--   ".gitignore" and ".ignore" files.
+-- - `scan_dot_directories` (default: false).
+-- - `sort` (default: false); when true, results come back in a deterministic
+--   order.
+-- - `threads` (default: 0, meaning one thread per processor).
+--
+local new_find_options = function(options)
+  options = options or {}
+  local ignore = options.ignore or {}
+
+  -- Return a reference to this so the caller can keep it from being
+  -- garbage-collected before the scan has finished.
+  local ignore_array = ffi.new('const char *[' .. #ignore .. ']', ignore)
+  return ffi.new('find_options_t', {
+    breadth_first = options.breadth_first or false,
+    emit_aliases = options.emit_aliases or false,
+    ignore = ignore_array,
+    ignore_count = #ignore,
+    max_depth = options.max_depth or 0,
+    max_files = options.max_files or 0,
+    respect_gitignore = options.respect_gitignore or false,
+    scan_dot_directories = options.scan_dot_directories or false,
+    sort = options.sort or false,
+    threads = options.threads or 0,
+  }), ignore_array
+end
+
+-- Walks `directory` (see `new_find_options()` for the supported `options`).
+-- The `duplicate_count` field of the returned scanner says how many
+-- directories were skipped because they had already been reached by another
+-- path (eg. through a symbolic link).
+lib.file_scanner = function(directory, options)
+  local find_options, ignore_array = new_find_options(options)
+  local scanner = c.commandt_file_scanner(directory, find_options)
+  ffi.gc(scanner, c.commandt_scanner_free)
+  return scanner
+end
+
+-- Lists the files tracked by Git in `directory`, and in its submodules, running
+-- up to `threads` instances of Git at once (see `git_scanner_new()`).
+lib.git_scanner = function(directory, max_files, threads)
+  local scanner = c.commandt_git_scanner_new(directory or '', max_files or 0, threads or 0)
+  ffi.gc(scanner, c.commandt_scanner_free)
+  return scanner
+end
+
+-- Rebuilds `scanner` in a compact form that uses much less memory (see
+-- `scanner_compress()`); after this, it can no longer be changed in place.
+lib.scanner_compress = function(scanner)
+  c.commandt_scanner_compress(scanner)
+  return scanner
+end
+
+-- Like `lib.file_scanner()`, but loads the results from the index at
+-- `index_path` if it is still valid; otherwise, scans and (re)writes the index.
+-- The second return value is true if the index was used.
+lib.index_scanner = function(directory, options, index_path)
+  local find_options, ignore_array = new_find_options(options)
+  local scanner = c.commandt_index_load(directory, find_options, index_path)
+  local loaded = scanner ~= nil
+  if not loaded then
+    scanner = c.commandt_index_scan(directory, find_options, index_path)
+  end
+  ffi.gc(scanner, c.commandt_scanner_free)
+  return scanner, loaded
+end
+
+-- Like `lib.file_scanner()`, but returns a handle that keeps watching
+-- `directory` for changes; use `lib.live_scanner_scanner()` to get an
+-- up-to-date scanner from it. Returns `nil` where watching isn't supported.
+lib.live_scanner = function(directory, options)
+  local find_options, ignore_array = new_find_options(options)
+  local live = c.commandt_live_scanner_new(directory, find_options)
+  if live == nil then
+    return nil
+  end
+  ffi.gc(live, c.commandt_live_scanner_free)
+  return live
+end
+
+-- Note that the returned scanner is owned by `live`, so callers must keep a
+-- reference to `live` for as long as they use the scanner.
+lib.live_scanner_scanner = function(live)
+  return c.commandt_live_scanner_scanner(live)
+end
+
+-- Returns a scanner over the paths listed in the manifest file at `path` (see
+-- `manifest_scanner_new()`). Options:
+--
+-- - `format` (default: 'list'): either 'list' (paths separated by newlines or
+--   NUL bytes) or 'compile_commands' (a JSON compilation database).
+-- - `strip` (default: nil): a prefix to remove from the start of each path.
+--
+-- Returns nil if the manifest can't be read.
+lib.manifest_scanner = function(path, options)
+  options = options or {}
+  local format = options.format == 'compile_commands' and 'MANIFEST_FORMAT_COMPILE_COMMANDS' or 'MANIFEST_FORMAT_LIST'
+  local scanner = c.commandt_manifest_scanner_new(path, format, options.strip)
+  if scanner == nil then
+    return nil
+  end
   ffi.gc(scanner, c.commandt_scanner_free)
   return scanner
 end
@@ -178,7 +470,10 @@ local default_thread_count = function()
   end
 end
 
-lib.matcher_new = function(scanner, options)
+-- Returns just the settings, out of `options`, that `lib.matcher_new()` pays
+-- attention to (with defaults filled in); finders that hang on to a matcher
+-- compare these to tell whether it can still be reused.
+lib.matcher_options = function(options)
   options = merge({
     always_show_dot_files = false,
     ignore_case = true,
@@ -189,6 +484,25 @@ lib.matcher_new = function(scanner, options)
     smart_case = true,
     threads = default_thread_count(),
   }, { limit = options.height }, options)
+  return {
+    always_show_dot_files = options.always_show_dot_files,
+    ignore_case = options.ignore_case,
+    ignore_spaces = options.ignore_spaces,
+    limit = options.limit,
+    never_show_dot_files = options.never_show_dot_files,
+    recurse = options.recurse,
+    smart_case = options.smart_case,
+    threads = options.threads,
+  }
+end
+
+-- Scanner that each matcher was made from, so that `lib.scanner_in_use()` can
+-- tell which scanners are still being matched against. Keyed weakly, so that
+-- matchers can still be garbage collected; a matcher keeps its scanner alive.
+local matcher_scanners = setmetatable({}, { __mode = 'k' })
+
+lib.matcher_new = function(scanner, options)
+  options = lib.matcher_options(options)
   if options.limit < 1 then
     error('limit must be > 0')
   end
@@ -205,6 +519,7 @@ lib.matcher_new = function(scanner, options)
     options.threads
   )
   ffi.gc(matcher, c.commandt_matcher_free)
+  matcher_scanners[matcher] = scanner
   return matcher
 end
 
@@ -221,25 +536,133 @@ lib.print_scanner = function(scanner)
   c.commandt_print_scanner(scanner)
 end
 
-lib.scanner_new_command = function(command, drop, max_files)
-  local scanner = c.commandt_scanner_new_command(command, drop or 0, max_files or 0)
+local delimiters = {
+  crlf = 'SCANNER_DELIMITER_CRLF',
+  lf = 'SCANNER_DELIMITER_LF',
+  nul = 'SCANNER_DELIMITER_NUL',
+}
+
+-- Runs `command`, and returns a scanner with its output, split according to
+-- `delimiter` (default: 'nul'), which may be 'nul', 'lf' or 'crlf'.
+lib.scanner_new_command = function(command, drop, max_files, delimiter)
+  local scanner = c.commandt_scanner_new_command(command, drop or 0, max_files or 0, delimiters[delimiter or 'nul'])
   ffi.gc(scanner, c.commandt_scanner_free)
   return scanner
 end
 
 lib.scanner_new_copy = function(candidates)
   local count = #candidates
-  local scanner = c.commandt_scanner_new_copy(ffi.new('const char *[' .. count .. ']', candidates), count)
+  local lengths = ffi.new('uint32_t[?]', count)
+  for i = 1, count do
+    lengths[i - 1] = #candidates[i]
+  end
+
+  -- Pack the candidates into a single string, separated by NUL bytes; Lua
+  -- strings always carry a trailing NUL, so the last one is terminated too.
+  local buffer = table.concat(candidates, '\0')
+  local scanner = c.commandt_scanner_new_packed(buffer, lengths, count)
   ffi.gc(scanner, c.commandt_scanner_free)
   return scanner
 end
 
+-- Returns the candidate at (0-based) `index` in `scanner` as a Lua string;
+-- works for packed scanners, whose candidates aren't `str_t` records.
+lib.scanner_get = function(scanner, index)
+  local str = c.commandt_scanner_get(scanner, index)
+  return ffi.string(str.contents, str.length)
+end
+
+-- Returns the number of bytes of memory used by `scanner`'s candidates.
+lib.scanner_size = function(scanner)
+  return tonumber(c.commandt_scanner_size(scanner))
+end
+
+-- Returns true if a matcher made from `scanner` might still be in use (ie. it
+-- hasn't been garbage collected yet).
+lib.scanner_in_use = function(scanner)
+  for _, used in pairs(matcher_scanners) do
+    if used == scanner then
+      return true
+    end
+  end
+  return false
+end
+
 lib.scanner_new_str = function(candidates, count)
   local scanner = c.commandt_scanner_new_str(candidates, count)
   ffi.gc(scanner, c.commandt_scanner_free)
   return scanner
 end
 
+-- Matches `UNION_MAX_SOURCES` in "union.h" (source indices are stored in a
+-- byte).
+local UNION_MAX_SOURCES = 256
+
+-- Returns a scanner that combines the candidates of several `sources`,
+-- scanning them (concurrently, given more than one processor) and dropping
+-- duplicates (the first source to produce a path wins). Each source is a table
+-- with one of:
+--
+-- - `command` (plus optional `drop`, `max_files` and `delimiter`): as for
+--   `scanner_new_command()`.
+-- - `directory` (plus optional find `options`): as for `file_scanner()`.
+-- - `candidates`: a list of strings.
+-- - `scanner`: an existing scanner.
+-- - `watchman` (a socket path) and `directory`: files from a Watchman query.
+--
+-- and, optionally:
+--
+-- - `prefix`: a string to prepend to each of the source's candidates.
+-- - `weight` (default: 1): a factor by which to scale the source's scores.
+--
+-- There may be at most `UNION_MAX_SOURCES` sources.
+--
+lib.union_scanner = function(sources)
+  local count = #sources
+  if count > UNION_MAX_SOURCES then
+    error('lib.union_scanner(): too many sources (' .. count .. '; the limit is ' .. UNION_MAX_SOURCES .. ')')
+  end
+  local array = ffi.new('union_source_t[?]', count)
+
+  -- Keep references to everything we hand to C until the scan has finished.
+  local keep = {}
+  for i, source in ipairs(sources) do
+    local entry = array[i - 1]
+    if source.command then
+      entry.kind = 'UNION_SOURCE_COMMAND'
+      entry.command = source.command
+      entry.drop = source.drop or 0
+      entry.max_files = source.max_files or 0
+      entry.delimiter = delimiters[source.delimiter or 'nul']
+    elseif source.candidates then
+      entry.kind = 'UNION_SOURCE_SCANNER'
+      entry.scanner = lib.scanner_new_copy(source.candidates)
+      table.insert(keep, entry.scanner)
+    elseif source.scanner then
+      entry.kind = 'UNION_SOURCE_SCANNER'
+      entry.scanner = source.scanner
+    elseif source.watchman then
+      entry.kind = 'UNION_SOURCE_WATCHMAN'
+      entry.socket_path = source.watchman
+      entry.directory = source.directory
+    elseif source.directory then
+      local find_options, ignore_array = new_find_options(source.options)
+      table.insert(keep, find_options)
+      table.insert(keep, ignore_array)
+      entry.kind = 'UNION_SOURCE_FILE'
+      entry.directory = source.directory
+      entry.options = find_options
+    else
+      error('lib.union_scanner(): source ' .. i .. ' has no `command`, `candidates`, `scanner` or `directory`')
+    end
+    entry.prefix = source.prefix
+    entry.weight = source.weight or 1
+  end
+  local scanner = c.commandt_union_scanner_new(array, count)
+  ffi.gc(scanner, c.commandt_scanner_free)
+  return scanner
+end
+
 lib.watchman_connect = function(name)
   -- TODO: validate name is a string/path
   local socket = c.commandt_watchman_connect(name)
@@ -257,8 +680,83 @@ lib.watchman_disconnect = function(socket)
   end
 end
 
-lib.watchman_query = function(root, relative_root, socket)
-  local raw = c.commandt_watchman_query(root, relative_root, socket)
+-- `filter` is an optional table with any of `suffixes` (eg. `{ 'c', 'h' }`),
+-- `exclude` (directories, relative to the root, eg. `{ 'third_party' }`) and
+-- `ignore` (patterns as produced by `wincent.commandt.private.wildignore`);
+-- Watchman drops the files that don't pass it before sending the list.
+--
+-- Returns `nil` (and nothing else) if there is no filter; otherwise, also
+-- returns the arrays that it references, so that the caller can keep them
+-- from being garbage-collected while the filter is in use.
+local new_watchman_filter = function(filter)
+  if filter == nil then
+    return nil
+  end
+  local suffixes = filter.suffixes or {}
+  local exclude = filter.exclude or {}
+  local ignore = filter.ignore or {}
+  local arrays = {
+    suffixes = ffi.new('const char *[' .. #suffixes .. ']', suffixes),
+    exclude = ffi.new('const char *[' .. #exclude .. ']', exclude),
+    ignore = ffi.new('const char *[' .. #ignore .. ']', ignore),
+  }
+  return ffi.new('watchman_filter_t', {
+    suffixes = arrays.suffixes,
+    suffixes_count = #suffixes,
+    exclude = arrays.exclude,
+    exclude_count = #exclude,
+    ignore = arrays.ignore,
+    ignore_count = #ignore,
+  }), arrays
+end
+
+-- Returns a handle that keeps a Watchman subscription to `directory` (an
+-- absolute path) open, so that the list of files can be kept up-to-date
+-- without querying again; use `lib.watchman_subscription_scanner()` to get an
+-- up-to-date scanner from it. Returns `nil` if the subscription can't be set
+-- up.
+--
+-- If `poll` is true, no subscription is made; instead, each call to
+-- `lib.watchman_subscription_scanner()` queries for the files that have
+-- changed since the previous one.
+--
+-- `filter` is optional (see `new_watchman_filter()`).
+lib.watchman_subscription = function(socket_path, directory, poll, filter)
+  local watchman_filter, arrays = new_watchman_filter(filter)
+  local subscription = c.commandt_subscription_new(socket_path, directory, watchman_filter, poll or false)
+  if subscription == nil then
+    return nil
+  end
+  ffi.gc(subscription, c.commandt_subscription_free)
+  return subscription
+end
+
+-- Note that the returned scanner is owned by `subscription`, so callers must
+-- keep a reference to `subscription` for as long as they use the scanner.
+-- Returns `nil` if the connection to Watchman has been lost.
+lib.watchman_subscription_scanner = function(subscription)
+  local scanner = c.commandt_subscription_scanner(subscription)
+  if scanner == nil then
+    return nil
+  end
+  return scanner
+end
+
+local watchman_fields = {
+  mtime_ms = 'WATCHMAN_FIELD_MTIME',
+}
+
+-- Turns an optional list of field names into a `watchman_field_t` mask.
+local watchman_field_mask = function(fields)
+  local mask = 0
+  for _, field in ipairs(fields or {}) do
+    mask = bit.bor(mask, tonumber(ffi.cast('watchman_field_t', watchman_fields[field])))
+  end
+  return mask
+end
+
+-- Wraps a `watchman_query_t` (taking ownership of it) for use from Lua.
+local watchman_result = function(raw)
   local result = {
     error = raw['error'] ~= nil and ffi.string(raw['error']) or nil,
     raw = raw, -- So caller can access and pass through cdata to matcher.
@@ -267,6 +765,97 @@ lib.watchman_query = function(root, relative_root, socket)
   return result
 end
 
+-- `fields` is an optional list of fields to request for each file in addition
+-- to its name; currently, only 'mtime_ms' is supported. It ends up in the
+-- `mtimes` array of `result.raw`, in the same order as its `files`, and a
+-- scanner made from the result (see `lib.watchman_scanner()`) uses it to favor
+-- recently modified files.
+--
+-- `filter` is optional (see `new_watchman_filter()`).
+lib.watchman_query = function(root, relative_root, socket, fields, filter)
+  local watchman_filter, arrays = new_watchman_filter(filter)
+  local raw = c.commandt_watchman_query(root, relative_root, nil, watchman_filter, watchman_field_mask(fields), socket)
+  return watchman_result(raw)
+end
+
+-- For tests: returns the BSER-encoded "query" command that
+-- `lib.watchman_query()` sends for the same arguments.
+lib.watchman_encode_query = function(root, relative_root, fields, filter)
+  local watchman_filter, arrays = new_watchman_filter(filter)
+  local length = ffi.new('size_t[1]')
+  local pdu = c.commandt_watchman_encode_query(root, relative_root, watchman_filter, watchman_field_mask(fields), length)
+  local encoded = ffi.string(pdu, length[0])
+  c.free(pdu)
+  return encoded
+end
+
+-- Returns a non-blocking client (see "client.h") connected to the Watchman
+-- server listening on `socket_path`, which can have listings of several
+-- directories in flight at once.
+lib.watchman_client = function(socket_path)
+  local client = c.commandt_client_new(socket_path)
+  if client == nil then
+    error('commandt_client_new(): failed')
+  end
+  ffi.gc(client, c.commandt_client_free)
+  return client
+end
+
+-- Asks `client` for a listing of `directory`, and returns an identifier to
+-- pass to `lib.watchman_client_result()`. `filter` and `fields` are optional,
+-- as for `lib.watchman_query()`.
+lib.watchman_client_query = function(client, directory, filter, fields)
+  local watchman_filter, arrays = new_watchman_filter(filter)
+  return c.commandt_client_query(client, directory, watchman_filter, watchman_field_mask(fields))
+end
+
+-- Does whatever I/O `client` can, waiting up to `timeout` milliseconds (-1
+-- meaning indefinitely) for it to be possible, and returns the number of
+-- results that are ready.
+lib.watchman_client_process = function(client, timeout)
+  return c.commandt_client_process(client, timeout or 0)
+end
+
+-- Returns the result for `id` (in the same form as `lib.watchman_query()`), or
+-- `nil` if it is still in flight.
+lib.watchman_client_result = function(client, id)
+  local raw = c.commandt_client_result(client, id)
+  if raw == nil then
+    return nil
+  end
+  return watchman_result(raw)
+end
+
+-- Hands the storage of `scanner` (from an earlier `lib.watchman_scanner()`)
+-- back to `client`, which reuses it for the next listing; `scanner` is left
+-- empty. Only call this once nothing is using `scanner` any more (see
+-- `lib.scanner_in_use()`).
+lib.watchman_client_recycle = function(client, scanner)
+  c.commandt_client_recycle(client, scanner)
+end
+
+-- For driving `client` from an event loop (eg. with `vim.loop.new_poll()`):
+-- returns the file descriptor to wait on (which can change after any call to
+-- `lib.watchman_client_process()`), and whether to wait for it to become
+-- readable and writable, respectively.
+lib.watchman_client_poll = function(client)
+  -- `POLLIN` and `POLLOUT` are 1 and 4 on both Linux and macOS.
+  local events = c.commandt_client_events(client)
+  return c.commandt_client_fd(client), bit.band(events, 1) ~= 0, bit.band(events, 4) ~= 0
+end
+
+-- Returns a scanner for the files of `result` (from `lib.watchman_query()` or
+-- `lib.watchman_client_result()`), which takes over the memory that they occupy
+-- instead of copying it; `result.raw` can't be used afterwards.
+lib.watchman_scanner = function(result)
+  local raw = result.raw
+  result.raw = nil
+  ffi.gc(raw, nil)
+  local scanner = c.commandt_watchman_scanner(raw)
+  ffi.gc(scanner, c.commandt_scanner_free)
+  return scanner
+end
+
 lib.watchman_watch_project = function(root, socket)
   local result = c.commandt_watchman_watch_project(root, socket)
   local project = {
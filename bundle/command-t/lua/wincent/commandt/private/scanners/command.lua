@@ -3,9 +3,9 @@
 
 local command = {}
 
-command.scanner = function(user_command, drop, max_files)
+command.scanner = function(user_command, drop, max_files, delimiter)
   local lib = require('wincent.commandt.private.lib')
-  local scanner = lib.scanner_new_command(user_command, drop, max_files)
+  local scanner = lib.scanner_new_command(user_command, drop, max_files, delimiter)
   return scanner
 end
 
@@ -3,10 +3,43 @@
 
 local file = {}
 
-file.scanner = function(directory, max_files)
+-- Most recently used live scanner, kept around so that it can go on watching
+-- for changes between invocations.
+local live = nil
+
+-- See `lib.file_scanner()` for the supported `options`. Additionally, if
+-- `options.watch` is true, returns a scanner that is kept up-to-date with
+-- changes on disk (where supported); in that case, the second return value is
+-- a handle that callers must keep a reference to while they use the scanner.
+-- Otherwise, if `options.index` is true, results are saved to (and, while
+-- still valid, loaded from) an index file in Neovim's cache directory, and if
+-- `options.compact` is true, the results of a fresh scan are stored compactly.
+file.scanner = function(directory, options)
   local lib = require('wincent.commandt.private.lib')
-  -- TODO: support dot directory filter etc
-  local scanner = lib.file_scanner(directory, max_files)
+  if options.watch then
+    local key = vim.inspect({ directory, options })
+    if live == nil or live.key ~= key then
+      live = nil
+      local handle = lib.live_scanner(directory, options)
+      if handle ~= nil then
+        live = { handle = handle, key = key }
+      end
+    end
+    if live ~= nil then
+      return lib.live_scanner_scanner(live.handle), live.handle
+    end
+  end
+  if options.index then
+    local index_directory = vim.fn.stdpath('cache') .. '/command-t/index'
+    vim.fn.mkdir(index_directory, 'p')
+    local index_path = index_directory .. '/' .. vim.fn.sha256(directory) .. '.idx'
+    local scanner = lib.index_scanner(directory, options, index_path)
+    return scanner
+  end
+  local scanner = lib.file_scanner(directory, options)
+  if options.compact then
+    lib.scanner_compress(scanner)
+  end
   return scanner
 end
 
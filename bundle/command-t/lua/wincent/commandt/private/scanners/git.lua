@@ -0,0 +1,12 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local git = {}
+
+git.scanner = function(directory, max_files, threads)
+  local lib = require('wincent.commandt.private.lib')
+  local scanner = lib.git_scanner(directory, max_files, threads)
+  return scanner
+end
+
+return git
@@ -5,8 +5,13 @@ local watchman = {}
 
 local sockname = nil
 
--- TODO: figure out when to clean this up
-local socket = nil
+-- Non-blocking client (see "client.h"), which remembers the watched root of
+-- each directory, so that listing one again takes a single round trip.
+local client = nil
+
+-- Most recently used subscription, kept around so that it can go on receiving
+-- changes between invocations.
+local subscription = nil
 
 -- Run `watchman get-sockname` to get current socket name; `watchman` will spawn
 -- in response to this command if it is not already running.
@@ -32,16 +37,16 @@ local get_sockname = function()
   return sockname
 end
 
-local get_socket = function()
-  if socket == nil then
+local get_client = function()
+  if client == nil then
     local name = get_sockname()
     if name == nil then
-      error('wincent.commandt.scanners.watchman.get_socket(): no sockname')
+      error('wincent.commandt.scanners.watchman.get_client(): no sockname')
     end
     local lib = require('wincent.commandt.private.lib')
-    socket = lib.watchman_connect(name)
+    client = lib.watchman_client(name)
   end
-  return socket
+  return client
 end
 
 -- Internal: Used by the benchmark suite so that we can identify this scanner
@@ -49,12 +54,17 @@ end
 watchman.name = 'watchman'
 
 -- Internal: Used by the benchmark suite so that we can avoid calling `vim` functions
--- inside `get_sockname()` from our pure-C benchmark harness.
+-- inside `get_sockname()` from our pure-C benchmark harness, and so that it can
+-- switch between servers (eg. stubs of different sizes).
 watchman.set_sockname = function(name)
+  if name ~= sockname then
+    client = nil
+    subscription = nil
+  end
   sockname = name
 end
 
--- Equivalent to:
+-- Equivalent to `watchman watch-project $directory`, followed by:
 --
 --    watchman -j <<-JSON
 --      ["query", "/path/to/root", {
@@ -64,45 +74,104 @@ end
 --      }]
 --    JSON
 --
--- If `relative_root` is `nil`, it will be omitted from the query.
+-- If `filter` is non-`nil`, it is folded into the "expression" (see
+-- `make_filter()`), and any `fields` (see `lib.watchman_query()`) are added to
+-- "fields". Blocks until the result is in.
 --
-local query = function(root, relative_root)
+local query = function(directory, filter, fields)
   local lib = require('wincent.commandt.private.lib')
-
-  return lib.watchman_query(root, relative_root, get_socket())
+  local watchman = get_client()
+  local id = lib.watchman_client_query(watchman, directory, filter, fields)
+  local result = lib.watchman_client_result(watchman, id)
+  while result == nil do
+    lib.watchman_client_process(watchman, -1)
+    result = lib.watchman_client_result(watchman, id)
+  end
+  return result
 end
 
--- Equivalent to `watchman watch-project $root`.
---
--- Returns a table with `watch` and `relative_path` properties. `relative_path`
--- my be `nil`.
-local watch_project = function(root)
-  local lib = require('wincent.commandt.private.lib')
-  return lib.watchman_watch_project(root, get_socket())
+-- Returns the filter described by `options` (`suffixes`, `exclude` and
+-- `ignore` lists), or `nil` if it would let every file through, along with a
+-- string that identifies it (so that we can tell whether an existing
+-- subscription was made with the same filter).
+local make_filter = function(options)
+  local suffixes = options and options.suffixes or {}
+  local exclude = options and options.exclude or {}
+  local ignore = options and options.ignore or {}
+  if #suffixes == 0 and #exclude == 0 and #ignore == 0 then
+    return nil, ''
+  end
+  local filter = { exclude = exclude, ignore = ignore, suffixes = suffixes }
+  local key = table.concat(suffixes, '\0') .. '\1' .. table.concat(exclude, '\0') .. '\1' .. table.concat(ignore, '\0')
+  return filter, key
 end
 
--- BUG: We leak this forever, but I want its lifetime to be bonded to that of
--- the scanner object
-local result = nil
+-- Scanner from the most recent listing, so that the next one can reuse its
+-- storage (see `lib.watchman_client_recycle()`) once nothing is matching
+-- against it any more.
+local previous = nil
 
-watchman.scanner = function(directory)
+-- If `options.subscribe` is true, returns a scanner that Watchman keeps
+-- up-to-date with changes on disk; in that case, the second return value is a
+-- handle that callers must keep a reference to while they use the scanner.
+-- Likewise if `options.since` is true, except that instead of subscribing, we
+-- ask Watchman for the files that have changed since the previous call.
+--
+-- `options.suffixes`, `options.exclude` and `options.ignore` restrict the
+-- files that are listed; Watchman applies them on its side, so that excluded
+-- files are never sent to us.
+--
+-- If `options.recency` is true, a complete listing (as opposed to one that is
+-- kept up-to-date by subscribing or polling) also asks for the modification
+-- time of each file, so that recently modified files can be ranked higher.
+watchman.scanner = function(directory, options)
   local lib = require('wincent.commandt.private.lib')
-  local project = watch_project(vim.fn.fnamemodify(directory, ':p'))
-  if project.error then
-    error(project.error)
-    -- TODO: in the future (once Watchman is more solid), degrade gracefully
-    -- instead; for now, explode loudly.
+  directory = vim.fn.fnamemodify(directory, ':p')
+  local filter, key = make_filter(options)
+  if options and (options.subscribe or options.since) then
+    local poll = not options.subscribe
+    if
+      subscription ~= nil
+      and subscription.directory == directory
+      and subscription.poll == poll
+      and subscription.key == key
+    then
+      local scanner = lib.watchman_subscription_scanner(subscription.handle)
+      if scanner ~= nil then
+        return scanner, subscription.handle
+      end
+    end
+
+    -- No subscription yet, or the connection was lost; start over.
+    subscription = nil
+    local handle = lib.watchman_subscription(get_sockname(), directory, poll, filter)
+    local scanner = handle and lib.watchman_subscription_scanner(handle)
+    if scanner ~= nil then
+      subscription = { directory = directory, handle = handle, key = key, poll = poll }
+      return scanner, handle
+    end
   end
 
-  -- Result needs to persist until scanner is garbage collected.
-  -- TODO: figure out the right way to do that...
-  result = query(project.watch, project.relative_path)
+  -- The new listing replaces the previous one, so let it reuse its storage
+  -- rather than allocating more while the old one awaits garbage collection.
+  -- Older finders may still hold matchers made from it, though, in which case
+  -- it is left alone.
+  if previous ~= nil then
+    if not lib.scanner_in_use(previous) then
+      lib.watchman_client_recycle(get_client(), previous)
+    end
+    previous = nil
+  end
+  local result = query(directory, filter, options and options.recency and { 'mtime_ms' } or nil)
   if result.error ~= nil then
     -- TODO: in the future (once Watchman is more solid), degrade gracefully
     -- instead; for now, explode loudly.
     error(result.error)
   end
-  local scanner = lib.scanner_new_str(result.raw.files, result.raw.count)
+
+  -- The scanner takes over the memory of the result, which goes when it does.
+  local scanner = lib.watchman_scanner(result)
+  previous = scanner
   return scanner
 end
 
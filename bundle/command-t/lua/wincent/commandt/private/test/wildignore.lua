@@ -0,0 +1,31 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local wildignore = require('wincent.commandt.private.wildignore')
+
+describe('wildignore()', function()
+  it('returns an empty list for an empty setting', function()
+    expect(wildignore('')).to_equal({})
+    expect(wildignore(nil)).to_equal({})
+  end)
+
+  it('passes through plain names', function()
+    expect(wildignore('node_modules,.DS_Store')).to_equal({ 'node_modules', '.DS_Store' })
+  end)
+
+  it('passes through extension and suffix globs', function()
+    expect(wildignore('*.o,*.pyc,*~')).to_equal({ '*.o', '*.pyc', '*~' })
+  end)
+
+  it('turns "*/something/*" into a directory-only pattern', function()
+    expect(wildignore('*/.git/*,*/build/*')).to_equal({ '.git/', 'build/' })
+  end)
+
+  it('turns "*/something" into a plain name', function()
+    expect(wildignore('*/tmp')).to_equal({ 'tmp' })
+  end)
+
+  it('drops patterns that it does not understand', function()
+    expect(wildignore('foo/bar,*/a/b/*,**/x,*.o')).to_equal({ '*.o' })
+  end)
+end)
@@ -56,15 +56,18 @@ local close = function()
     current_window = nil
     vim.api.nvim_set_current_win(win)
   end
+  -- Let the finder (and anything it holds, like its scanner) be collected.
+  current_finder = nil
 end
 
 ui.open = function(kind)
+  local finder = current_finder
   close()
   if results and #results > 0 then
     -- Defer, to give autocommands a chance to run.
     local result = results[selected]
     vim.defer_fn(function()
-      current_finder.open(result, kind)
+      finder.open(result, kind)
     end, 0)
   end
 end
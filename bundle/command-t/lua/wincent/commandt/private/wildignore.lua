@@ -0,0 +1,35 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+-- Conservatively converts the `'wildignore'` patterns that we understand into
+-- the name-based patterns accepted by the built-in file scanner, which uses
+-- them to prune its walk (a trailing "/" means "directories only"). Patterns
+-- that we don't understand are dropped.
+local wildignore = function(str)
+  local patterns = {}
+  for pattern in string.gmatch(str or '', '[^,]+') do
+    local name = nil
+    if pattern:match('^[^*/]+$') then
+      -- something (match file or directory at any level)
+      name = pattern
+    elseif pattern:match('^%*%.[^*/]+$') then
+      -- *.something (match file with extension at any level)
+      name = pattern
+    elseif pattern:match('^%*[^*/.]+$') then
+      -- *something (match suffix at any level)
+      name = pattern
+    elseif pattern:match('^%*/[^/]+/%*$') then
+      -- */something/* (match directories at any level)
+      name = pattern:match('^%*/([^/]+)/%*$') .. '/'
+    elseif pattern:match('^%*/[^/]+$') then
+      -- */something (match files or directories at any level)
+      name = pattern:match('^%*/([^/]+)$')
+    end
+    if name then
+      table.insert(patterns, name)
+    end
+  end
+  return patterns
+end
+
+return wildignore
@@ -0,0 +1,100 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('client.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  -- Returns the names of files `first` to `last` in the stub's listing.
+  local names = function(first, last)
+    local strings = {}
+    for i = first, last do
+      table.insert(strings, lib.watchman_stub_name(i))
+    end
+    return strings
+  end
+
+  local socket_path = nil
+  local stub = nil
+
+  -- Starts a stub (replacing any running one) that lists `count` files.
+  local start = function(count)
+    if stub ~= nil then
+      lib.watchman_stub_free(stub)
+    end
+    stub = lib.watchman_stub(socket_path, count)
+  end
+
+  -- Lists `directory` via `client`, and returns the result's error (if any)
+  -- and files.
+  local list = function(client, directory)
+    local id = lib.watchman_client_query(client, directory)
+    local result = nil
+    for _ = 1, 500 do
+      result = lib.watchman_client_result(client, id)
+      if result ~= nil then
+        break
+      end
+      lib.watchman_client_process(client, 10)
+    end
+    local files = {}
+    for i = 0, result.raw.count - 1 do
+      local str = result.raw.files[i]
+      table.insert(files, ffi.string(str.contents, str.length))
+    end
+    return result.error, files
+  end
+
+  before(function()
+    socket_path = os.tmpname()
+  end)
+
+  after(function()
+    if stub ~= nil then
+      lib.watchman_stub_free(stub)
+      stub = nil
+    end
+    os.remove(socket_path)
+  end)
+
+  it('lists a directory', function()
+    start(10)
+    local client = lib.watchman_client(socket_path)
+    local err, files = list(client, '/project')
+    expect(err).to_be(nil)
+    expect(files).to_equal(names(0, 9))
+  end)
+
+  it('lists the same directory again with the watch it remembered', function()
+    start(10)
+    local client = lib.watchman_client(socket_path)
+    list(client, '/project')
+    local err, files = list(client, '/project')
+    expect(err).to_be(nil)
+    expect(files).to_equal(names(0, 9))
+  end)
+
+  it('reconnects after the server restarts', function()
+    start(10)
+    local client = lib.watchman_client(socket_path)
+    list(client, '/project')
+
+    start(20)
+    local err, files = list(client, '/project')
+    expect(err).to_be(nil)
+    expect(files).to_equal(names(0, 19))
+  end)
+
+  it('reports an error once the server has gone away', function()
+    start(10)
+    local client = lib.watchman_client(socket_path)
+    list(client, '/project')
+
+    lib.watchman_stub_free(stub)
+    stub = nil
+    local err, files = list(client, '/project')
+    expect(err ~= nil).to_be(true)
+    expect(files).to_equal({})
+  end)
+end)
@@ -0,0 +1,93 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+describe('git.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  local root = nil
+
+  -- Runs shell `command` in `directory` (relative to `root`).
+  local run = function(directory, command)
+    os.execute("cd '" .. root .. '/' .. directory .. "' && " .. command .. ' > /dev/null 2>&1')
+  end
+
+  -- Makes a repository in `directory` (relative to `root`) and commits the
+  -- (empty) `files` (and any repositories already nested in it) to it.
+  local repository = function(directory, files)
+    os.execute("mkdir -p '" .. root .. '/' .. directory .. "'")
+    local git = 'git -c user.name=test -c user.email=test@example.com'
+    run(directory, git .. ' init -q .')
+    for _, file in ipairs(files) do
+      run(directory, "mkdir -p \"$(dirname '" .. file .. "')\" && touch '" .. file .. "'")
+      run(directory, git .. " add '" .. file .. "'")
+    end
+    run(directory, git .. ' commit -q --allow-empty -m initial')
+  end
+
+  -- Returns the (sorted) paths, relative to `root`, that a Git scanner over
+  -- `root` reports.
+  local scan = function(max_files)
+    local scanner = lib.git_scanner(root, max_files)
+    local paths = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(paths, lib.scanner_get(scanner, i):sub(#root + 2))
+    end
+    table.sort(paths)
+    return paths
+  end
+
+  before(function()
+    root = os.tmpname()
+    os.remove(root)
+
+    -- Submodules are added as plain "gitlink" entries (as `git submodule add`
+    -- would leave them, minus ".gitmodules"), innermost first.
+    repository('lib/mod/deep', { 'z.c' })
+    repository('lib/mod', { 'x.c', 'src/y.c', 'deep' })
+    repository('', { 'a.txt', 'b/c.txt', 'lib/mod' })
+
+    -- A submodule that hasn't been initialized has nothing in its directory.
+    os.execute("mkdir -p '" .. root .. "/vendor/empty'")
+    run('', 'git update-index --add --cacheinfo 160000,' .. string.rep('1', 40) .. ',vendor/empty')
+  end)
+
+  after(function()
+    os.execute("rm -rf '" .. root .. "'")
+  end)
+
+  it('lists files in submodules with the submodule path prepended', function()
+    expect(scan()).to_equal({
+      'a.txt',
+      'b/c.txt',
+      'lib/mod/deep/z.c',
+      'lib/mod/src/y.c',
+      'lib/mod/x.c',
+    })
+  end)
+
+  it('stops after `max_files` files', function()
+    local all = {}
+    for _, path in ipairs(scan()) do
+      all[path] = true
+    end
+
+    -- Repositories are listed concurrently, so which files make the cut
+    -- varies from run to run.
+    for _, max_files in ipairs({ 1, 3 }) do
+      local paths = scan(max_files)
+      expect(#paths).to_be(max_files)
+      for _, path in ipairs(paths) do
+        expect(all[path]).to_be(true)
+      end
+    end
+  end)
+
+  it('returns an empty scanner outside of a repository', function()
+    local directory = os.tmpname()
+    os.remove(directory)
+    os.execute("mkdir -p '" .. directory .. "'")
+    local scanner = lib.git_scanner(directory)
+    os.execute("rm -rf '" .. directory .. "'")
+    expect(scanner.count).to_be(0)
+  end)
+end)
@@ -0,0 +1,131 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+describe('gitignore.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  local root = nil
+
+  -- Creates the files in `tree` (a table mapping relative paths to their
+  -- contents) in a fresh temporary directory.
+  local create = function(tree)
+    root = os.tmpname()
+    os.remove(root)
+    for path, contents in pairs(tree) do
+      local directory = (root .. '/' .. path):match('^(.*)/')
+      os.execute("mkdir -p '" .. directory .. "'")
+      local file = io.open(root .. '/' .. path, 'wb')
+      file:write(contents)
+      file:close()
+    end
+  end
+
+  -- Returns the (sorted) paths, relative to `root`, that a walk that respects
+  -- ignore files reports.
+  local scan = function()
+    local scanner = lib.file_scanner(root, { respect_gitignore = true })
+    local paths = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(paths, lib.scanner_get(scanner, i):sub(#root + 2))
+    end
+    table.sort(paths)
+    return paths
+  end
+
+  after(function()
+    if root ~= nil then
+      os.execute("rm -rf '" .. root .. "'")
+      root = nil
+    end
+  end)
+
+  -- The expected paths here are what `git ls-files --others --exclude-standard`
+  -- lists for the same tree (ie. everything that `git check-ignore` doesn't
+  -- report as ignored).
+  it('applies rules the same way as Git', function()
+    create({
+      ['.gitignore'] = [[
+# Comment, followed by a blank line.
+
+*.log
+!keep.log
+/build
+docs/*.html
+tmp/
+**/generated/**
+excluded/
+!excluded/inside.txt
+a/**/z.txt
+\#hash
+*.sw[op]
+]],
+      ['sub/.gitignore'] = '!other.log\n*.tmp\n',
+      ['#hash'] = '',
+      ['.a.swp'] = '',
+      ['a/b/c/z.txt'] = '',
+      ['a/y.txt'] = '',
+      ['a/z.txt'] = '',
+      ['app.log'] = '',
+      ['b.swq'] = '',
+      ['build/out.o'] = '',
+      ['docs/index.html'] = '',
+      ['docs/readme.md'] = '',
+      ['docs/sub/page.html'] = '',
+      ['excluded/inside.txt'] = '',
+      ['excluded/other.txt'] = '',
+      ['generated/top.c'] = '',
+      ['keep.log'] = '',
+      ['main.c'] = '',
+      ['other/tmp'] = '',
+      ['src/generated/g.c'] = '',
+      ['sub/build/out.o'] = '',
+      ['sub/keep.log'] = '',
+      ['sub/other.log'] = '',
+      ['sub/tmp/y'] = '',
+      ['sub/x.tmp'] = '',
+      ['tmp/x'] = '',
+      ['x.tmp'] = '',
+    })
+    expect(scan()).to_equal({
+      '.gitignore',
+      'a/y.txt',
+      'b.swq',
+      'docs/readme.md',
+      'docs/sub/page.html',
+      'keep.log',
+      'main.c',
+      'other/tmp',
+      'sub/.gitignore',
+      'sub/build/out.o',
+      'sub/keep.log',
+      'sub/other.log',
+      'x.tmp',
+    })
+  end)
+
+  it('does not re-include files from an excluded directory', function()
+    -- As with Git, a negation in a deeper ignore file can't bring back a file
+    -- once its parent directory has been excluded.
+    create({
+      ['.gitignore'] = 'vendor/\n!vendor/keep.c\n',
+      ['main.c'] = '',
+      ['vendor/.gitignore'] = '!keep.c\n',
+      ['vendor/keep.c'] = '',
+      ['vendor/lib.c'] = '',
+    })
+    expect(scan()).to_equal({ '.gitignore', 'main.c' })
+  end)
+
+  it('gives rules in ".ignore" precedence over those in ".gitignore"', function()
+    -- Git doesn't read ".ignore" files; this follows ripgrep and friends.
+    create({
+      ['.gitignore'] = '*.dat\n',
+      ['.ignore'] = '!keep.dat\nsecret.txt\n',
+      ['a.dat'] = '',
+      ['keep.dat'] = '',
+      ['plain.txt'] = '',
+      ['secret.txt'] = '',
+    })
+    expect(scan()).to_equal({ '.gitignore', '.ignore', 'keep.dat', 'plain.txt' })
+  end)
+end)
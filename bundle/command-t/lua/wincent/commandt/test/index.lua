@@ -0,0 +1,95 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+describe('index.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  local index_path = nil
+  local root = nil
+
+  -- Runs shell `command` in `root`.
+  local run = function(command)
+    os.execute("cd '" .. root .. "' && " .. command)
+  end
+
+  -- Returns the (sorted) candidates of an index scanner over `root`, relative
+  -- to `root`, and whether they came from the index.
+  local scan = function(options)
+    local scanner, loaded = lib.index_scanner(root, options, index_path)
+    local paths = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(paths, lib.scanner_get(scanner, i):sub(#root + 2))
+    end
+    table.sort(paths)
+    return paths, loaded
+  end
+
+  before(function()
+    root = os.tmpname()
+    os.remove(root)
+    os.execute("mkdir -p '" .. root .. "/sub'")
+    run('touch a.txt sub/b.txt')
+    index_path = os.tmpname()
+    os.remove(index_path)
+  end)
+
+  after(function()
+    os.execute("rm -rf '" .. root .. "'")
+    os.remove(index_path)
+  end)
+
+  it('scans and writes the index when there is none', function()
+    local paths, loaded = scan()
+    expect(paths).to_equal({ 'a.txt', 'sub/b.txt' })
+    expect(loaded).to_be(false)
+  end)
+
+  it('reuses the index while it is fresh', function()
+    scan()
+    local paths, loaded = scan()
+    expect(paths).to_equal({ 'a.txt', 'sub/b.txt' })
+    expect(loaded).to_be(true)
+  end)
+
+  context('when the index is stale', function()
+    -- Directory modification times may be no finer than a clock tick, so give
+    -- them a chance to move on before changing anything.
+    before(function()
+      scan()
+      os.execute('sleep 0.05')
+    end)
+
+    it('rescans after a file is added', function()
+      run('touch sub/c.txt')
+      local paths, loaded = scan()
+      expect(paths).to_equal({ 'a.txt', 'sub/b.txt', 'sub/c.txt' })
+      expect(loaded).to_be(false)
+
+      -- The rewritten index is good again.
+      paths, loaded = scan()
+      expect(paths).to_equal({ 'a.txt', 'sub/b.txt', 'sub/c.txt' })
+      expect(loaded).to_be(true)
+    end)
+
+    it('rescans after a file is removed', function()
+      run('rm a.txt')
+      local paths, loaded = scan()
+      expect(paths).to_equal({ 'sub/b.txt' })
+      expect(loaded).to_be(false)
+    end)
+
+    it('rescans after a directory is added', function()
+      run('mkdir new && touch new/d.txt')
+      local paths, loaded = scan()
+      expect(paths).to_equal({ 'a.txt', 'new/d.txt', 'sub/b.txt' })
+      expect(loaded).to_be(false)
+    end)
+  end)
+
+  it('rejects an index made with different options', function()
+    scan()
+    local paths, loaded = scan({ max_files = 1 })
+    expect(#paths).to_be(1)
+    expect(loaded).to_be(false)
+  end)
+end)
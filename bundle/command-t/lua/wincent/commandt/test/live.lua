@@ -0,0 +1,105 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('live.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  local live = nil
+  local root = nil
+
+  -- Runs shell `command` in `root`.
+  local run = function(command)
+    os.execute("cd '" .. root .. "' && " .. command)
+  end
+
+  -- Returns the (sorted) candidates of `scanner` relative to `root`, skipping
+  -- any that have been removed.
+  local candidates = function(scanner)
+    local paths = {}
+    for i = 0, scanner.count - 1 do
+      local str = scanner.candidates[i]
+      if str.contents ~= nil then
+        table.insert(paths, ffi.string(str.contents, str.length):sub(#root + 2))
+      end
+    end
+    table.sort(paths)
+    return paths
+  end
+
+  -- Calls `lib.live_scanner_scanner()` until the scanner's candidates are
+  -- `expected` (or we give up waiting for the events to arrive), and returns
+  -- them.
+  local settle = function(expected)
+    local paths = nil
+    for _ = 1, 500 do
+      paths = candidates(lib.live_scanner_scanner(live))
+      if table.concat(paths, '\0') == table.concat(expected, '\0') then
+        break
+      end
+      os.execute('sleep 0.01')
+    end
+    return paths
+  end
+
+  before(function()
+    root = os.tmpname()
+    os.remove(root)
+    os.execute("mkdir -p '" .. root .. "/sub'")
+    run('touch a.txt b.txt sub/c.txt')
+    live = lib.live_scanner(root)
+  end)
+
+  after(function()
+    live = nil
+    collectgarbage()
+    os.execute("rm -rf '" .. root .. "'")
+  end)
+
+  -- The live scanner is Linux-only; elsewhere, `lib.live_scanner()` returns
+  -- `nil`, and there is nothing to test.
+  local it_live = function(description, callback)
+    it(description, function()
+      if live ~= nil then
+        callback()
+      end
+    end)
+  end
+
+  it_live('starts with the files found by walking the directory', function()
+    expect(candidates(lib.live_scanner_scanner(live))).to_equal({ 'a.txt', 'b.txt', 'sub/c.txt' })
+  end)
+
+  it_live('adds files as they are created', function()
+    local clock = lib.live_scanner_scanner(live).clock
+    run('touch d.txt sub/e.txt')
+    local expected = { 'a.txt', 'b.txt', 'd.txt', 'sub/c.txt', 'sub/e.txt' }
+    expect(settle(expected)).to_equal(expected)
+    expect(lib.live_scanner_scanner(live).clock > clock).to_be(true)
+  end)
+
+  it_live('adds files in directories created after the walk', function()
+    run('mkdir -p new/deeper && touch new/f.txt new/deeper/g.txt')
+    local expected = { 'a.txt', 'b.txt', 'new/deeper/g.txt', 'new/f.txt', 'sub/c.txt' }
+    expect(settle(expected)).to_equal(expected)
+  end)
+
+  it_live('removes files as they are deleted', function()
+    run('rm a.txt')
+    local expected = { 'b.txt', 'sub/c.txt' }
+    expect(settle(expected)).to_equal(expected)
+  end)
+
+  it_live('removes everything under a deleted directory', function()
+    run('rm -r sub')
+    local expected = { 'a.txt', 'b.txt' }
+    expect(settle(expected)).to_equal(expected)
+  end)
+
+  it_live('follows renames', function()
+    run('mv b.txt sub/b.txt && mv sub moved')
+    local expected = { 'a.txt', 'moved/b.txt', 'moved/c.txt' }
+    expect(settle(expected)).to_equal(expected)
+  end)
+end)
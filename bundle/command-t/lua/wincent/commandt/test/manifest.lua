@@ -0,0 +1,125 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+describe('manifest.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  -- Writes `contents` to a manifest file and returns the candidates of a
+  -- scanner over it (which reads the whole file up front, so the file can go
+  -- straight away).
+  local scan = function(contents, options)
+    local path = os.tmpname()
+    local file = io.open(path, 'wb')
+    file:write(contents)
+    file:close()
+    local scanner = lib.manifest_scanner(path, options)
+    os.remove(path)
+    local strings = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(strings, lib.scanner_get(scanner, i))
+    end
+    return strings
+  end
+
+  it('returns nil for a manifest that does not exist', function()
+    expect(lib.manifest_scanner('/non-existent/manifest')).to_equal(nil)
+  end)
+
+  context('with a list', function()
+    it('splits the list on newlines', function()
+      expect(scan('a\nb/c\n\nd')).to_equal({ 'a', 'b/c', 'd' })
+    end)
+
+    it('splits the list on carriage return + newline pairs', function()
+      expect(scan('a\r\nb\r\n')).to_equal({ 'a', 'b' })
+    end)
+
+    it('splits the list on NUL bytes if one comes before any newline', function()
+      expect(scan('a\0b c\0d\ne\0')).to_equal({ 'a', 'b c', 'd\ne' })
+    end)
+
+    it('strips a prefix that ends at a directory boundary', function()
+      local list = '/src/build/a\n/src/buildtools/x\n/src/build\n'
+      expect(scan(list, { strip = '/src/build' })).to_equal({ 'a', '/src/buildtools/x' })
+      expect(scan(list, { strip = '/src/build/' })).to_equal({ 'a', '/src/buildtools/x', '/src/build' })
+      expect(scan(list, { strip = '/src' })).to_equal({ 'build/a', 'buildtools/x', 'build' })
+    end)
+  end)
+
+  context('with a compilation database', function()
+    local compile_commands = function(contents, options)
+      options = options or {}
+      options.format = 'compile_commands'
+      return scan(contents, options)
+    end
+
+    it('lists absolute files as they are', function()
+      expect(compile_commands([[
+        [
+          { "directory": "/proj/build", "command": "cc -c /proj/a.c", "file": "/proj/a.c" }
+        ]
+      ]])).to_equal({ '/proj/a.c' })
+    end)
+
+    it('joins relative files to the directory', function()
+      expect(compile_commands([[
+        [{ "directory": "/proj", "arguments": ["cc", "-c", "src/a.c"], "file": "src/a.c" }]
+      ]])).to_equal({ '/proj/src/a.c' })
+    end)
+
+    it('handles a "file" key that comes before the "directory" key', function()
+      expect(compile_commands([[
+        [{ "file": "src/a.c", "command": "cc -c src/a.c", "directory": "/proj" }]
+      ]])).to_equal({ '/proj/src/a.c' })
+    end)
+
+    it('ignores "file" when it is not a key', function()
+      expect(compile_commands([[
+        [{ "directory": "/proj", "arguments": ["file", "x.c"], "file": "y.c" }]
+      ]])).to_equal({ '/proj/y.c' })
+    end)
+
+    it('normalizes ".", ".." and repeated slashes', function()
+      expect(compile_commands([[
+        [
+          { "directory": "/proj/build/", "file": "../src/./a.c" },
+          { "directory": "/proj", "file": "x/../y//b.c" },
+          { "directory": "/", "file": "../../c.c" },
+          { "directory": "build", "file": "../../d.c" }
+        ]
+      ]])).to_equal({ '../d.c', '/c.c', '/proj/src/a.c', '/proj/y/b.c' })
+    end)
+
+    it('lists a file built more than once only once', function()
+      expect(compile_commands([[
+        [
+          { "directory": "/proj/debug", "file": "../src/a.c" },
+          { "directory": "/proj/release", "file": "../src/a.c" },
+          { "directory": "/proj", "file": "src/a.c" }
+        ]
+      ]])).to_equal({ '/proj/src/a.c' })
+    end)
+
+    it('decodes escaped characters', function()
+      expect(compile_commands([[
+        [
+          { "directory": "/p", "file": "q\"uote\\back\/slash.c" },
+          { "directory": "/p", "file": "caf\u00e9.c" },
+          { "directory": "/p", "file": "\ud83d\ude00.c" }
+        ]
+      ]])).to_equal({ '/p/caf\195\169.c', '/p/q"uote\\back/slash.c', '/p/\240\159\152\128.c' })
+    end)
+
+    it('strips a prefix that ends at a directory boundary', function()
+      expect(compile_commands(
+        [[
+          [
+            { "directory": "/src/build", "file": "a.c" },
+            { "directory": "/src/buildtools", "file": "x.c" }
+          ]
+        ]],
+        { strip = '/src/build' }
+      )).to_equal({ '/src/buildtools/x.c', 'a.c' })
+    end)
+  end)
+end)
@@ -360,4 +360,23 @@ describe('matcher.c', function()
       end)
     end)
   end)
+
+  context('scanner_in_use()', function()
+    it('reports whether any matcher made from a scanner is still around', function()
+      local scanner = lib.scanner_new_copy({ 'foo' })
+      local other = lib.scanner_new_copy({ 'bar' })
+      expect(lib.scanner_in_use(scanner)).to_equal(false)
+
+      local matcher = lib.matcher_new(scanner, {})
+      expect(lib.scanner_in_use(scanner)).to_equal(true)
+      expect(lib.scanner_in_use(other)).to_equal(false)
+
+      -- The first collection runs the finalizer of the matcher; the second
+      -- drops it from the (weak) table of matchers.
+      matcher = nil
+      collectgarbage()
+      collectgarbage()
+      expect(lib.scanner_in_use(scanner)).to_equal(false)
+    end)
+  end)
 end)
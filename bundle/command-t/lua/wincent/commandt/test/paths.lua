@@ -0,0 +1,49 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('paths.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  -- Compresses a scanner holding `paths` and reads every path back out of it
+  -- (via the matcher, which reassembles them with `paths_get()`).
+  local round_trip = function(paths)
+    local scanner = lib.scanner_compress(lib.scanner_new_copy(paths))
+    local matcher = lib.matcher_new(scanner, { limit = #paths + 1 })
+    local results = lib.matcher_run(matcher, '')
+    local strings = {}
+    for k = 0, results.match_count - 1 do
+      local str = results.matches[k]
+      table.insert(strings, ffi.string(str.contents, str.length))
+    end
+    table.sort(strings)
+    return strings
+  end
+
+  local sorted = function(paths)
+    local copy = { unpack(paths) }
+    table.sort(copy)
+    return copy
+  end
+
+  it('round-trips paths with and without directories', function()
+    local paths = { 'foo', 'a/b', 'a/b/c', 'a/b/d', 'x/y/z/deep.txt' }
+    expect(round_trip(paths)).to_equal(sorted(paths))
+  end)
+
+  it('round-trips absolute paths', function()
+    local paths = { '/usr/lib/libc.so', '/usr/bin/env', '/etc/hosts' }
+    expect(round_trip(paths)).to_equal(sorted(paths))
+  end)
+
+  it('keeps the leading slash of paths in the root directory', function()
+    local paths = { '/foo', '/bar', 'foo' }
+    expect(round_trip(paths)).to_equal(sorted(paths))
+  end)
+
+  it('round-trips repeated and trailing slashes', function()
+    local paths = { 'a//b', 'a/b', 'dir/' }
+    expect(round_trip(paths)).to_equal(sorted(paths))
+  end)
+end)
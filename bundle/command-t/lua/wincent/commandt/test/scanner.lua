@@ -0,0 +1,54 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+describe('scanner.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  local candidates = function(scanner)
+    local strings = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(strings, lib.scanner_get(scanner, i))
+    end
+    return strings
+  end
+
+  context('scanner_new_command()', function()
+    local scan = function(command, delimiter, drop, max_files)
+      return candidates(lib.scanner_new_command(command, drop, max_files, delimiter))
+    end
+
+    it('splits output on newlines', function()
+      expect(scan("printf 'a\\nb\\nc\\n'", 'lf')).to_equal({ 'a', 'b', 'c' })
+    end)
+
+    it('splits output on carriage return + newline pairs', function()
+      expect(scan("printf 'a\\r\\nb\\r\\nc\\r\\n'", 'crlf')).to_equal({ 'a', 'b', 'c' })
+    end)
+
+    it('splits output on NUL bytes', function()
+      expect(scan("printf 'a\\0b c\\0d\\ne\\0'", 'nul')).to_equal({ 'a', 'b c', 'd\ne' })
+    end)
+
+    it('keeps an unterminated final record', function()
+      expect(scan("printf 'a\\nb'", 'lf')).to_equal({ 'a', 'b' })
+      expect(scan("printf 'a\\r\\nb'", 'crlf')).to_equal({ 'a', 'b' })
+      expect(scan("printf 'a\\0b'", 'nul')).to_equal({ 'a', 'b' })
+    end)
+
+    it('skips empty records', function()
+      expect(scan("printf 'a\\n\\nb\\n'", 'lf')).to_equal({ 'a', 'b' })
+    end)
+
+    it('drops the requested number of leading bytes from each record', function()
+      expect(scan("printf './a\\n./b\\n'", 'lf', 2)).to_equal({ 'a', 'b' })
+    end)
+
+    it('stops after `max_files` records', function()
+      expect(scan("printf 'a\\nb\\nc\\n'", 'lf', 0, 2)).to_equal({ 'a', 'b' })
+    end)
+
+    it('returns an empty scanner for a command with no output', function()
+      expect(scan('true', 'lf')).to_equal({})
+    end)
+  end)
+end)
@@ -0,0 +1,108 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('subscription.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  -- Returns the candidates of `scanner`, skipping any that have been removed.
+  local candidates = function(scanner)
+    local strings = {}
+    for i = 0, scanner.count - 1 do
+      local str = scanner.candidates[i]
+      if str.contents ~= nil then
+        table.insert(strings, ffi.string(str.contents, str.length))
+      end
+    end
+    return strings
+  end
+
+  -- Returns the names of files `first` to `last` in the stub's listing.
+  local names = function(first, last)
+    local strings = {}
+    for i = first, last do
+      table.insert(strings, lib.watchman_stub_name(i))
+    end
+    return strings
+  end
+
+  local socket_path = nil
+  local stub = nil
+
+  -- Starts a stub that lists `count` files.
+  local start = function(count)
+    socket_path = os.tmpname()
+    stub = lib.watchman_stub(socket_path, count)
+  end
+
+  -- Calls `lib.watchman_subscription_scanner()` until `subscription` has
+  -- received the stub's fresh listing of files 1 to `count`.
+  local recrawled = function(subscription)
+    local expected = lib.watchman_stub_name(1)
+    local scanner = nil
+    for _ = 1, 500 do
+      scanner = lib.watchman_subscription_scanner(subscription)
+      local first = scanner.candidates[0]
+      if scanner.count > 0 and first.contents ~= nil and ffi.string(first.contents, first.length) == expected then
+        break
+      end
+      os.execute('sleep 0.01')
+    end
+    return scanner
+  end
+
+  after(function()
+    if stub ~= nil then
+      lib.watchman_stub_free(stub)
+      stub = nil
+      os.remove(socket_path)
+    end
+  end)
+
+  context('when subscribed', function()
+    it('replaces the candidates when Watchman sends a fresh instance', function()
+      start(10)
+      local subscription = lib.watchman_subscription(socket_path, '/stub', false)
+      expect(subscription ~= nil).to_equal(true)
+
+      -- The stub follows the initial listing (files 0 to 9) with a fresh one
+      -- (files 1 to 10), which arrives in the background.
+      expect(candidates(recrawled(subscription))).to_equal(names(1, 10))
+    end)
+
+    it('adds the initial listing as it arrives', function()
+      -- Big enough that the client receives (and decodes) part of the
+      -- listing while the stub pauses halfway through sending it.
+      local count = 200000
+      start(count)
+      local subscription = lib.watchman_subscription(socket_path, '/stub', false)
+      expect(subscription ~= nil).to_equal(true)
+
+      local partial = candidates(lib.watchman_subscription_scanner(subscription))
+      expect(#partial > 0).to_equal(true)
+      expect(#partial < count).to_equal(true)
+      expect(partial).to_equal(names(0, #partial - 1))
+
+      expect(candidates(recrawled(subscription))).to_equal(names(1, count))
+    end)
+  end)
+
+  context('when polling', function()
+    it('applies the changes since the previous query', function()
+      start(10)
+      local subscription = lib.watchman_subscription(socket_path, '/stub', true)
+      expect(subscription ~= nil).to_equal(true)
+
+      -- Each query after the initial listing (files 0 to 9) reports one file
+      -- deleted and one created.
+      local scanner = lib.watchman_subscription_scanner(subscription)
+      expect(candidates(scanner)).to_equal(names(1, 10))
+      expect(scanner.tombstones).to_equal(1)
+
+      scanner = lib.watchman_subscription_scanner(subscription)
+      expect(candidates(scanner)).to_equal(names(2, 11))
+      expect(scanner.tombstones).to_equal(2)
+    end)
+  end)
+end)
@@ -0,0 +1,82 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('union.c', function()
+  local lib = require('wincent.commandt.private.lib')
+
+  -- Returns the candidates of `scanner`, along with the (0-based) index of
+  -- the source each one came from.
+  local contents = function(scanner)
+    local candidates = {}
+    local sources = {}
+    for i = 0, scanner.count - 1 do
+      table.insert(candidates, lib.scanner_get(scanner, i))
+      table.insert(sources, scanner.sources[i])
+    end
+    return candidates, sources
+  end
+
+  local match = function(scanner, query)
+    local matcher = lib.matcher_new(scanner, { limit = 10 })
+    local results = lib.matcher_run(matcher, query)
+    local strings = {}
+    for k = 0, results.match_count - 1 do
+      local str = results.matches[k]
+      table.insert(strings, ffi.string(str.contents, str.length))
+    end
+    return strings
+  end
+
+  it('keeps only the first copy of a path produced by several sources', function()
+    local scanner = lib.union_scanner({
+      { candidates = { 'a', 'b' } },
+      { candidates = { 'b', 'c' } },
+      { command = "printf 'c\\nd\\n'", delimiter = 'lf' },
+    })
+    local candidates, sources = contents(scanner)
+    expect(candidates).to_equal({ 'a', 'b', 'c', 'd' })
+    expect(sources).to_equal({ 0, 0, 1, 2 })
+  end)
+
+  it('applies prefixes before looking for duplicates', function()
+    local scanner = lib.union_scanner({
+      { candidates = { 'foo' }, prefix = 'a/' },
+      { candidates = { 'foo' }, prefix = 'b/' },
+    })
+    local candidates = contents(scanner)
+    expect(candidates).to_equal({ 'a/foo', 'b/foo' })
+  end)
+
+  it('scales scores by the weight of each source', function()
+    local unweighted = lib.union_scanner({
+      { candidates = { 'foo' }, prefix = 'a/' },
+      { candidates = { 'foo' }, prefix = 'b/' },
+    })
+    expect(match(unweighted, 'foo')).to_equal({ 'a/foo', 'b/foo' })
+
+    local weighted = lib.union_scanner({
+      { candidates = { 'foo' }, prefix = 'a/' },
+      { candidates = { 'foo' }, prefix = 'b/', weight = 2 },
+    })
+    expect(match(weighted, 'foo')).to_equal({ 'b/foo', 'a/foo' })
+  end)
+
+  it('accepts compressed scanners as sources', function()
+    local compressed = lib.scanner_compress(lib.scanner_new_copy({ '/x', 'y/z' }))
+    local scanner = lib.union_scanner({ { scanner = compressed } })
+    local candidates = contents(scanner)
+    expect(candidates).to_equal({ '/x', 'y/z' })
+  end)
+
+  it('raises an error given too many sources', function()
+    local sources = {}
+    for i = 1, 257 do
+      table.insert(sources, { candidates = { 'file' .. i } })
+    end
+    local ok, err = pcall(lib.union_scanner, sources)
+    expect(ok).to_be(false)
+    expect(err:find('too many sources', 1, true) ~= nil).to_be(true)
+  end)
+end)
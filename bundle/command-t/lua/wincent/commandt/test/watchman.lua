@@ -0,0 +1,131 @@
+-- SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+-- SPDX-License-Identifier: BSD-2-Clause
+
+local ffi = require('ffi')
+
+describe('watchman.c', function()
+  local lib = require('wincent.commandt.private.lib')
+  local wildignore = require('wincent.commandt.private.wildignore')
+
+  -- Decodes the BSER `pdu` into Lua values (enough of BSER for the commands
+  -- that we send: arrays, objects, strings, integers and booleans).
+  local decode = function(pdu)
+    local bytes = ffi.cast('const uint8_t *', pdu)
+    local position = 2 -- Skip the "\0\1" marker.
+    local integers = { [3] = 'int8_t', [4] = 'int16_t', [5] = 'int32_t', [6] = 'int64_t' }
+
+    local integer = function()
+      local ctype = integers[bytes[position]]
+      local value = tonumber(ffi.cast('const ' .. ctype .. ' *', bytes + position + 1)[0])
+      position = position + 1 + ffi.sizeof(ctype)
+      return value
+    end
+
+    local value = nil
+    value = function()
+      local marker = bytes[position]
+      if integers[marker] then
+        return integer()
+      end
+      position = position + 1
+      if marker == 0 then
+        local array = {}
+        for i = 1, integer() do
+          array[i] = value()
+        end
+        return array
+      elseif marker == 1 then
+        local object = {}
+        for _ = 1, integer() do
+          local key = value()
+          object[key] = value()
+        end
+        return object
+      elseif marker == 2 then
+        local length = integer()
+        local str = ffi.string(bytes + position, length)
+        position = position + length
+        return str
+      elseif marker == 8 then
+        return true
+      elseif marker == 9 then
+        return false
+      end
+      error('unexpected BSER marker ' .. marker)
+    end
+
+    integer() -- Length of the rest of the PDU.
+    return value()
+  end
+
+  -- Returns the "expression" of the query that would be sent with `filter`.
+  local expression = function(filter)
+    local query = decode(lib.watchman_encode_query('/root', nil, nil, filter))
+    expect(query[1]).to_equal('query')
+    return query[3].expression
+  end
+
+  local match = function(pattern, scope)
+    return { 'match', pattern, scope, { includedotfiles = true } }
+  end
+
+  it('lists all files without a filter', function()
+    expect(expression(nil)).to_equal({ 'type', 'f' })
+    expect(expression({})).to_equal({ 'type', 'f' })
+  end)
+
+  it('encodes suffixes as "suffix" terms', function()
+    expect(expression({ suffixes = { 'c', '.h', '*.lua', '' } })).to_equal({
+      'allof',
+      { 'type', 'f' },
+      { 'anyof', { 'suffix', 'c' }, { 'suffix', 'h' }, { 'suffix', 'lua' } },
+    })
+  end)
+
+  it('encodes excluded directories as "dirname" terms', function()
+    expect(expression({ exclude = { 'third_party', '', 'build/out' } })).to_equal({
+      'allof',
+      { 'type', 'f' },
+      { 'not', { 'anyof', { 'dirname', 'third_party' }, { 'dirname', 'build/out' } } },
+    })
+  end)
+
+  it("encodes 'wildignore' patterns as basename and wholename matches", function()
+    local ignore = wildignore('*.o,node_modules,*/.cache/*,src/*.c')
+    expect(ignore).to_equal({ '*.o', 'node_modules', '.cache/' })
+    expect(expression({ ignore = ignore })).to_equal({
+      'allof',
+      { 'type', 'f' },
+      {
+        'not',
+        {
+          'anyof',
+          match('*.o', 'basename'),
+          match('**/*.o/**', 'wholename'),
+          match('node_modules', 'basename'),
+          match('**/node_modules/**', 'wholename'),
+          match('**/.cache/**', 'wholename'),
+        },
+      },
+    })
+  end)
+
+  it('combines suffixes with exclusions', function()
+    expect(expression({ suffixes = { 'c' }, exclude = { 'vendor' }, ignore = { '*.o' } })).to_equal({
+      'allof',
+      { 'type', 'f' },
+      { 'anyof', { 'suffix', 'c' } },
+      {
+        'not',
+        { 'anyof', { 'dirname', 'vendor' }, match('*.o', 'basename'), match('**/*.o/**', 'wholename') },
+      },
+    })
+  end)
+
+  it('requests extra fields', function()
+    local query = decode(lib.watchman_encode_query('/root', 'sub', { 'mtime_ms' }))
+    expect(query[2]).to_equal('/root')
+    expect(query[3].relative_root).to_equal('sub')
+    expect(query[3].fields).to_equal({ 'name', 'mtime_ms' })
+  end)
+end)
@@ -4,10 +4,12 @@
  */
 
 #include "matcher.h"
+#include "paths.h"
 #include "watchman.h"
 
 VALUE mCommandT = 0; // module CommandT
 VALUE cCommandTMatcher = 0; // class CommandT::Matcher
+VALUE cCommandTPaths = 0; // class CommandT::Paths
 VALUE mCommandTWatchman = 0; // module CommandT::Watchman
 VALUE mCommandTWatchmanUtils = 0; // module CommandT::Watchman::Utils
 
@@ -40,6 +42,15 @@ void Init_ext() {
         -1
     );
 
+    // class CommandT::Paths
+    cCommandTPaths = rb_define_class_under(mCommandT, "Paths", rb_cObject);
+    rb_undef_alloc_func(cCommandTPaths);
+    rb_include_module(cCommandTPaths, rb_mEnumerable);
+    rb_define_method(cCommandTPaths, "[]", CommandTPaths_aref, 1);
+    rb_define_method(cCommandTPaths, "each", CommandTPaths_each, 0);
+    rb_define_method(cCommandTPaths, "length", CommandTPaths_length, 0);
+    rb_define_method(cCommandTPaths, "size", CommandTPaths_length, 0);
+
     // module CommandT::Watchman::Utils
     mCommandTWatchman = rb_define_module_under(mCommandT, "Watchman");
     mCommandTWatchmanUtils = rb_define_module_under(mCommandTWatchman, "Utils");
@@ -52,4 +63,10 @@ void Init_ext() {
     rb_define_singleton_method(
         mCommandTWatchmanUtils, "query", CommandTWatchmanUtils_query, 2
     );
+    rb_define_singleton_method(
+        mCommandTWatchmanUtils,
+        "query_files",
+        CommandTWatchmanUtils_query_files,
+        -1
+    );
 }
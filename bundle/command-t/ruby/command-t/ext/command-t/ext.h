@@ -7,6 +7,7 @@
 
 extern VALUE mCommandT; // module CommandT
 extern VALUE cCommandTMatcher; // class CommandT::Matcher
+extern VALUE cCommandTPaths; // class CommandT::Paths
 extern VALUE mCommandTWatchman; // module CommandT::Watchman
 extern VALUE mCommandTWatchmanUtils; // module CommandT::Watchman::Utils
 
@@ -14,7 +14,7 @@
 
 // Use a struct to make passing params during recursion easier.
 typedef struct {
-    char *haystack_p; // Pointer to the path string to be searched.
+    const char *haystack_p; // Pointer to the path string to be searched.
     long haystack_len; // Length of same.
     char *needle_p; // Pointer to search string (needle).
     long needle_len; // Length of same.
@@ -114,7 +114,8 @@ float recursive_match(
 }
 
 float calculate_match(
-    VALUE haystack,
+    const char *haystack_p,
+    long haystack_len,
     VALUE needle,
     VALUE case_sensitive,
     VALUE always_show_dot_files,
@@ -127,8 +128,8 @@ float calculate_match(
     long i;
     float score = 1.0;
     int compute_bitmasks = *haystack_bitmask == UNSET_BITMASK;
-    m.haystack_p = RSTRING_PTR(haystack);
-    m.haystack_len = RSTRING_LEN(haystack);
+    m.haystack_p = haystack_p;
+    m.haystack_len = haystack_len;
     m.needle_p = RSTRING_PTR(needle);
     m.needle_len = RSTRING_LEN(needle);
     m.rightmost_match_p = NULL;
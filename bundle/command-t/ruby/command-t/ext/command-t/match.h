@@ -9,13 +9,16 @@
 
 // Struct for representing an individual match.
 typedef struct {
-    VALUE path;
+    const char *path; // Pointer to the path string.
+    long path_len; // Length of same.
+    long index; // Position of the path in the scanner's `paths`.
     long bitmask;
     float score;
 } match_t;
 
 extern float calculate_match(
-    VALUE str,
+    const char *haystack_p,
+    long haystack_len,
     VALUE needle,
     VALUE case_sensitive,
     VALUE always_show_dot_files,
@@ -11,6 +11,7 @@
 #include "ext.h"
 #include "heap.h"
 #include "match.h"
+#include "paths.h"
 #include "ruby_compat.h"
 
 // order matters; we want this to be evaluated only after ruby.h
@@ -22,12 +23,10 @@
 int cmp_alpha(const void *a, const void *b) {
     match_t a_match = *(match_t *)a;
     match_t b_match = *(match_t *)b;
-    VALUE a_str = a_match.path;
-    VALUE b_str = b_match.path;
-    char *a_p = RSTRING_PTR(a_str);
-    long a_len = RSTRING_LEN(a_str);
-    char *b_p = RSTRING_PTR(b_str);
-    long b_len = RSTRING_LEN(b_str);
+    const char *a_p = a_match.path;
+    long a_len = a_match.path_len;
+    const char *b_p = b_match.path;
+    long b_len = b_match.path_len;
     int order = 0;
 
     if (a_len > b_len) {
@@ -95,6 +94,7 @@ typedef struct {
     match_t *matches;
     long path_count;
     VALUE haystacks;
+    paths_t *packed; // Set if `haystacks` is a CommandT::Paths instance.
     VALUE needle;
     VALUE last_needle;
     VALUE always_show_dot_files;
@@ -117,7 +117,15 @@ void *match_thread(void *thread_args) {
     }
 
     for (i = args->thread_index; i < args->path_count; i += args->thread_count) {
-        args->matches[i].path = RARRAY_PTR(args->haystacks)[i];
+        args->matches[i].index = i;
+        if (args->packed) {
+            args->matches[i].path = PATHS_PTR(args->packed, i);
+            args->matches[i].path_len = PATHS_LEN(args->packed, i);
+        } else {
+            VALUE path = RARRAY_PTR(args->haystacks)[i];
+            args->matches[i].path = RSTRING_PTR(path);
+            args->matches[i].path_len = RSTRING_LEN(path);
+        }
         if (args->needle_bitmask == UNSET_BITMASK) {
             args->matches[i].bitmask = UNSET_BITMASK;
         }
@@ -128,6 +136,7 @@ void *match_thread(void *thread_args) {
         }
         args->matches[i].score = calculate_match(
             args->matches[i].path,
+            args->matches[i].path_len,
             args->needle,
             args->case_sensitive,
             args->always_show_dot_files,
@@ -182,7 +191,9 @@ VALUE CommandTMatcher_sorted_matches_for(int argc, VALUE *argv, VALUE self) {
     int sort;
     match_t *matches;
     match_t *heap_matches = NULL;
+    match_t *match;
     heap_t *heap;
+    paths_t *packed = NULL;
     thread_args_t *thread_args;
     VALUE always_show_dot_files;
     VALUE case_sensitive;
@@ -237,7 +248,12 @@ VALUE CommandTMatcher_sorted_matches_for(int argc, VALUE *argv, VALUE self) {
     // Get unsorted matches.
     scanner = rb_iv_get(self, "@scanner");
     paths = rb_funcall(scanner, rb_intern("paths"), 0);
-    path_count = RARRAY_LEN(paths);
+    if (rb_obj_is_kind_of(paths, cCommandTPaths) == Qtrue) {
+        packed = paths_get(paths);
+        path_count = packed->count;
+    } else {
+        path_count = RARRAY_LEN(paths);
+    }
 
     // Cached C data, not visible to Ruby layer.
     paths_object_id = rb_ivar_get(self, rb_intern("paths_object_id"));
@@ -300,6 +316,7 @@ VALUE CommandTMatcher_sorted_matches_for(int argc, VALUE *argv, VALUE self) {
         thread_args[i].limit = use_heap ? limit : 0;
         thread_args[i].path_count = path_count;
         thread_args[i].haystacks = paths;
+        thread_args[i].packed = packed;
         thread_args[i].needle = needle;
         thread_args[i].last_needle = last_needle;
         thread_args[i].always_show_dot_files = always_show_dot_files;
@@ -379,12 +396,14 @@ VALUE CommandTMatcher_sorted_matches_for(int argc, VALUE *argv, VALUE self) {
     }
     for (i = 0; i < (use_heap ? heap_matches_count : path_count) && limit > 0;
          i++) {
-        if ((use_heap ? heap_matches : matches)[i].score > 0.0) {
+        match = &(use_heap ? heap_matches : matches)[i];
+        if (match->score > 0.0) {
             rb_funcall(
                 results,
                 rb_intern("push"),
                 1,
-                (use_heap ? heap_matches : matches)[i].path
+                packed ? rb_str_new(match->path, match->path_len)
+                       : RARRAY_PTR(paths)[match->index]
             );
             limit--;
         }
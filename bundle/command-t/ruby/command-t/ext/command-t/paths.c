@@ -0,0 +1,95 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "paths.h"
+
+#include <string.h> /* for memcpy() */
+
+#include "ext.h"
+
+static void paths_free(void *ptr) {
+    paths_t *paths = (paths_t *)ptr;
+    xfree(paths->offsets);
+    xfree(paths->data);
+    xfree(paths);
+}
+
+VALUE paths_new(long count, long size) {
+    paths_t *paths = ALLOC(paths_t);
+    paths->count = 0;
+    paths->capacity = count > 0 ? count : 1;
+    paths->offsets = ALLOC_N(long, paths->capacity + 1);
+    paths->offsets[0] = 0;
+    paths->size = 0;
+    paths->data_capacity = size > 0 ? size : 1;
+    paths->data = ALLOC_N(char, paths->data_capacity);
+    return Data_Wrap_Struct(cCommandTPaths, 0, paths_free, paths);
+}
+
+paths_t *paths_get(VALUE object) {
+    paths_t *paths;
+    if (rb_obj_is_kind_of(object, cCommandTPaths) != Qtrue) {
+        rb_raise(rb_eTypeError, "not a CommandT::Paths instance");
+    }
+    Data_Get_Struct(object, paths_t, paths);
+    return paths;
+}
+
+void paths_push(paths_t *paths, const char *path, long len) {
+    if (paths->count == paths->capacity) {
+        paths->capacity *= 2;
+        REALLOC_N(paths->offsets, long, paths->capacity + 1);
+    }
+    if (paths->size + len + 1 > paths->data_capacity) {
+        while (paths->size + len + 1 > paths->data_capacity) {
+            paths->data_capacity *= 2;
+        }
+        REALLOC_N(paths->data, char, paths->data_capacity);
+    }
+    memcpy(paths->data + paths->size, path, len);
+    paths->size += len;
+    paths->data[paths->size++] = '\0';
+    paths->offsets[++paths->count] = paths->size;
+}
+
+/**
+ * CommandT::Paths#[](index)
+ *
+ * Returns the path at `index` as a new String, or nil if `index` is out of
+ * range. Negative indices count back from the end, as with Array.
+ */
+VALUE CommandTPaths_aref(VALUE self, VALUE index) {
+    paths_t *paths = paths_get(self);
+    long i = NUM2LONG(index);
+    if (i < 0) {
+        i += paths->count;
+    }
+    if (i < 0 || i >= paths->count) {
+        return Qnil;
+    }
+    return rb_str_new(PATHS_PTR(paths, i), PATHS_LEN(paths, i));
+}
+
+/**
+ * CommandT::Paths#each { |path| ... }
+ *
+ * Yields each path in turn, as a new String.
+ */
+VALUE CommandTPaths_each(VALUE self) {
+    long i;
+    paths_t *paths = paths_get(self);
+    RETURN_ENUMERATOR(self, 0, 0);
+    for (i = 0; i < paths->count; i++) {
+        rb_yield(rb_str_new(PATHS_PTR(paths, i), PATHS_LEN(paths, i)));
+    }
+    return self;
+}
+
+/**
+ * CommandT::Paths#length
+ */
+VALUE CommandTPaths_length(VALUE self) {
+    return LONG2NUM(paths_get(self)->count);
+}
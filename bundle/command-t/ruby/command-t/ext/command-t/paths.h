@@ -0,0 +1,52 @@
+/**
+ * SPDX-FileCopyrightText: Copyright 2024-present Greg Hurrell and contributors.
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <ruby.h>
+
+/**
+ * @class CommandT::Paths
+ *
+ * A read-only list of paths packed end to end into a single buffer.
+ *
+ * Large listings (eg. from Watchman) can be built as a `CommandT::Paths`
+ * instead of an `Array` of `String`s, which saves allocating (and later
+ * garbage collecting) a Ruby object per path. The matcher reads the paths
+ * directly out of the buffer, so Ruby strings only get created for the
+ * handful of paths that end up among the matches.
+ */
+
+typedef struct {
+    long count; // Number of paths.
+    long capacity; // Number of paths there is room for in `offsets`.
+    long *offsets; // Start of each path in `data`, plus one past the end.
+    char *data; // NUL-terminated paths, end to end.
+    long size; // Bytes used in `data`.
+    long data_capacity; // Bytes allocated for `data`.
+} paths_t;
+
+// Pointer to, and length of, the path at `index`.
+#define PATHS_PTR(paths, index) ((paths)->data + (paths)->offsets[index])
+#define PATHS_LEN(paths, index) \
+    ((paths)->offsets[(index) + 1] - (paths)->offsets[index] - 1)
+
+/**
+ * Returns a new, empty `CommandT::Paths` instance with room for `count` paths
+ * taking up `size` bytes in all (it grows as needed beyond that).
+ */
+VALUE paths_new(long count, long size);
+
+/**
+ * Returns the list underlying `object`, a `CommandT::Paths` instance.
+ */
+paths_t *paths_get(VALUE object);
+
+/**
+ * Appends the `len` bytes at `path` to `paths`.
+ */
+void paths_push(paths_t *paths, const char *path, long len);
+
+extern VALUE CommandTPaths_aref(VALUE self, VALUE index);
+extern VALUE CommandTPaths_each(VALUE self);
+extern VALUE CommandTPaths_length(VALUE self);
@@ -29,3 +29,8 @@
 #ifndef RFLOAT_VALUE
 #define RFLOAT_VALUE(f) (RFLOAT(f)->value)
 #endif
+
+// for compatibility with older versions of Ruby which don't declare RB_GC_GUARD
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
@@ -20,6 +20,9 @@
 #include <sys/errno.h> /* for errno */
 #include <sys/socket.h> /* for recv(), MSG_PEEK */
 
+#include "paths.h"
+#include "ruby_compat.h"
+
 typedef struct {
     uint8_t *data; // payload
     size_t cap; // total capacity
@@ -560,24 +563,25 @@ void watchman_raise_system_call_error(int number) {
         sizeof(int64_t)
 
 /**
- * CommandT::Watchman::Utils.query(query, socket)
+ * Helper method which transmits `query` (see `CommandTWatchmanUtils_query()`)
+ * over `socket` and returns the response PDU as a binary string, without
+ * decoding it
  *
- * Converts `query`, a Watchman query comprising Ruby objects, into the Watchman
- * binary protocol format, transmits it over socket, and unserializes and
- * returns the result.
+ * The payload starts `*header_size` bytes into the string, after the binary
+ * marker and the payload size.
  */
-VALUE CommandTWatchmanUtils_query(VALUE self, VALUE query, VALUE socket) {
-    char *payload;
+VALUE watchman_send_query(
+    VALUE self, VALUE query, VALUE socket, long *header_size
+) {
     int fileno, flags;
     int8_t peek[WATCHMAN_PEEK_BUFFER_SIZE];
     int8_t sizes[] = {0, 0, 0, 1, 2, 4, 8};
     int8_t sizes_idx;
     int8_t *pdu_size_ptr;
-    int64_t payload_size;
+    int64_t pdu_size;
     long query_len;
     ssize_t peek_size, sent, received;
-    void *buffer;
-    VALUE loaded, serialized;
+    VALUE pdu, serialized;
     fileno = NUM2INT(rb_funcall(socket, rb_intern("fileno"), 0));
 
     // do blocking I/O to simplify the following logic
@@ -622,25 +626,159 @@ VALUE CommandTWatchmanUtils_query(VALUE self, VALUE query, VALUE socket) {
         rb_raise(rb_eRuntimeError, "failed to peek at PDU header");
     }
     pdu_size_ptr = peek + sizeof(WATCHMAN_BINARY_MARKER) - sizeof(int8_t);
-    payload_size = peek_size +
+    pdu_size = peek_size +
         watchman_load_int((char **)&pdu_size_ptr, (char *)peek + peek_size);
 
-    // actually read the PDU
-    buffer = xmalloc(payload_size);
-    if (!buffer) {
-        rb_raise(
-            rb_eNoMemError, "failed to allocate %lld bytes", (long long int)payload_size
-        );
-    }
-    received = recv(fileno, buffer, payload_size, MSG_WAITALL);
+    // actually read the PDU (into a string, so that it doesn't leak if we
+    // raise while decoding it)
+    pdu = rb_str_buf_new(pdu_size);
+    received = recv(fileno, RSTRING_PTR(pdu), pdu_size, MSG_WAITALL);
     if (received == -1) {
         watchman_raise_system_call_error(errno);
-    } else if (received != payload_size) {
+    } else if (received != pdu_size) {
         rb_raise(rb_eRuntimeError, "failed to load PDU");
     }
-    payload = (char *)buffer + peek_size;
-    loaded = watchman_load(&payload, payload + payload_size);
-    free(buffer);
+    rb_str_set_len(pdu, received);
+    *header_size = peek_size;
+    return pdu;
+}
+
+/**
+ * Reads an array of strings encoded in the Watchman binary protocol format,
+ * starting at `ptr` and finishing at or before `end`, and returns it as a
+ * CommandT::Paths instance
+ *
+ * Strings matching `wildignore` (a Regexp, or nil) are left out.
+ */
+VALUE watchman_load_paths(char **ptr, char *end, VALUE wildignore) {
+    int64_t count, i, len;
+    paths_t *paths;
+    VALUE loaded, scratch = Qnil;
+
+    count = watchman_load_array_header(ptr, end);
+    if (count < 0 || count > end - *ptr) {
+        rb_raise(rb_eArgError, "insufficient array storage");
+    }
+
+    // Every string takes up at least as many bytes in the PDU as it will in
+    // the packed buffer (where it has a NUL terminator instead of a marker
+    // and length), so this is all the room we will need.
+    loaded = paths_new(count, end - *ptr);
+    paths = paths_get(loaded);
+
+    if (!NIL_P(wildignore)) {
+        // Reused for every match attempt, to avoid allocating a String each.
+        scratch = rb_str_buf_new(0);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (*ptr >= end) {
+            rb_raise(rb_eArgError, "unexpected end of input");
+        }
+
+        if (*ptr[0] != WATCHMAN_STRING_MARKER) {
+            rb_raise(rb_eArgError, "not a string");
+        }
+
+        *ptr += sizeof(int8_t);
+        if (*ptr >= end) {
+            rb_raise(rb_eArgError, "invalid string header");
+        }
+
+        len = watchman_load_int(ptr, end);
+        if (len < 0 || *ptr + len > end) {
+            rb_raise(rb_eArgError, "insufficient string storage");
+        }
+
+        if (!NIL_P(wildignore)) {
+            rb_str_set_len(scratch, 0);
+            rb_str_cat(scratch, *ptr, len);
+            if (!NIL_P(rb_reg_match(wildignore, scratch))) {
+                *ptr += len;
+                continue;
+            }
+        }
+
+        paths_push(paths, *ptr, len);
+        *ptr += len;
+    }
+
+    return loaded;
+}
+
+/**
+ * CommandT::Watchman::Utils.query(query, socket)
+ *
+ * Converts `query`, a Watchman query comprising Ruby objects, into the Watchman
+ * binary protocol format, transmits it over socket, and unserializes and
+ * returns the result.
+ */
+VALUE CommandTWatchmanUtils_query(VALUE self, VALUE query, VALUE socket) {
+    char *payload, *end;
+    long header_size;
+    VALUE loaded, pdu;
+
+    pdu = watchman_send_query(self, query, socket, &header_size);
+    payload = RSTRING_PTR(pdu) + header_size;
+    end = RSTRING_PTR(pdu) + RSTRING_LEN(pdu);
+    loaded = watchman_load(&payload, end);
+    RB_GC_GUARD(pdu);
+    return loaded;
+}
+
+/**
+ * CommandT::Watchman::Utils.query_files(query, socket, wildignore = nil)
+ *
+ * Like `CommandTWatchmanUtils_query()`, but decodes the "files" in the
+ * response into a CommandT::Paths instance rather than an Array, leaving out
+ * any that match `wildignore`.
+ */
+VALUE CommandTWatchmanUtils_query_files(int argc, VALUE *argv, VALUE self) {
+    char *payload, *end;
+    int64_t count, i;
+    long header_size;
+    VALUE key, loaded, pdu, query, socket, value, wildignore;
+
+    // Process arguments: 2 mandatory, 1 optional.
+    if (rb_scan_args(argc, argv, "21", &query, &socket, &wildignore) == 2) {
+        wildignore = Qnil;
+    }
+    if (!NIL_P(wildignore)) {
+        Check_Type(wildignore, T_REGEXP);
+    }
+
+    pdu = watchman_send_query(self, query, socket, &header_size);
+    payload = RSTRING_PTR(pdu) + header_size;
+    end = RSTRING_PTR(pdu) + RSTRING_LEN(pdu);
+
+    if (payload >= end || payload[0] != WATCHMAN_HASH_MARKER) {
+        // Not a listing; decode it normally.
+        loaded = watchman_load(&payload, end);
+        RB_GC_GUARD(pdu);
+        return loaded;
+    }
+
+    // As in `watchman_load_hash()`, except for the treatment of "files".
+    payload += sizeof(int8_t);
+    if (payload + sizeof(int8_t) * 2 > end) {
+        rb_raise(rb_eArgError, "incomplete hash header");
+    }
+    count = watchman_load_int(&payload, end);
+
+    loaded = rb_hash_new();
+
+    for (i = 0; i < count; i++) {
+        key = watchman_load_string(&payload, end);
+        if (RSTRING_LEN(key) == sizeof("files") - 1 &&
+            !memcmp(RSTRING_PTR(key), "files", sizeof("files") - 1)) {
+            value = watchman_load_paths(&payload, end, wildignore);
+        } else {
+            value = watchman_load(&payload, end);
+        }
+        rb_hash_aset(loaded, key, value);
+    }
+
+    RB_GC_GUARD(pdu);
     return loaded;
 }
 
@@ -658,4 +796,8 @@ VALUE CommandTWatchmanUtils_query(VALUE self, VALUE query, VALUE socket) {
     rb_raise(rb_eRuntimeError, "unsupported operation");
 }
 
+VALUE CommandTWatchmanUtils_query_files(int argc, VALUE *argv, VALUE self) {
+    rb_raise(rb_eRuntimeError, "unsupported operation");
+}
+
 #endif
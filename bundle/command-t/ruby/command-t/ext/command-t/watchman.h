@@ -32,3 +32,12 @@ extern VALUE CommandTWatchmanUtils_dump(VALUE self, VALUE serializable);
  * result is converted to native Ruby objects before returning to the caller.
  */
 extern VALUE CommandTWatchmanUtils_query(VALUE self, VALUE query, VALUE socket);
+
+/**
+ * Like `CommandTWatchmanUtils_query()`, but for "query" commands whose
+ * "fields" are just the "name": the "files" in the result come back as a
+ * single `CommandT::Paths` instance instead of an `Array` of `String`s, so
+ * that a listing of a million files costs a couple of allocations rather than
+ * a million. Files matching the optional `wildignore` `Regexp` are omitted.
+ */
+extern VALUE CommandTWatchmanUtils_query_files(int argc, VALUE *argv, VALUE self);
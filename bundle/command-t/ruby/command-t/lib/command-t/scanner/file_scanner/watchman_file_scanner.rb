@@ -48,15 +48,13 @@ module CommandT
             }
             query_params['relative_root'] = relative_root if relative_root
             query = ['query', root, query_params]
-            paths = Watchman::Utils.query(query, socket)
+
+            # Comes back as a CommandT::Paths rather than an Array, to avoid
+            # allocating a String for every file in the listing.
+            paths = Watchman::Utils.query_files(query, socket, @wildignore)
 
             # could return error if watch is removed
-            extracted = extract_value(paths, 'files')
-            if @wildignore
-              extracted.select { |path| path !~ @wildignore }
-            else
-              extracted
-            end
+            extract_value(paths, 'files')
           end
         rescue Errno::ENOENT, WatchmanError
           # watchman executable not present, or unable to fulfil request
@@ -3,6 +3,7 @@
 
 require 'spec_helper'
 require 'ostruct'
+require 'socket'
 
 describe CommandT::Matcher do
   def matcher(*paths)
@@ -298,5 +299,24 @@ describe CommandT::Matcher do
         app/assets/components/PrivacyPage/index.jsx
       ])
     end
+
+    context 'when the scanner returns a CommandT::Paths instance' do
+      def packed_matcher(*paths)
+        client, server = UNIXSocket.pair
+        server.write(CommandT::Watchman::Utils.dump('files' => paths))
+        packed = CommandT::Watchman::Utils.query_files(['query'], client)['files']
+        CommandT::Matcher.new(OpenStruct.new(:paths => packed))
+      ensure
+        client.close
+        server.close
+      end
+
+      it 'returns matching paths as strings' do
+        matcher = packed_matcher(*%w[foo/bar foo/baz bing])
+        expect(matcher.sorted_matches_for('z')).to eq(%w[foo/baz])
+        expect(matcher.sorted_matches_for('b', :limit => 0)).
+          to eq(%w[bing foo/bar foo/baz])
+      end
+    end
   end
 end
@@ -2,6 +2,7 @@
 # SPDX-License-Identifier: BSD-2-Clause
 
 require 'spec_helper'
+require 'socket'
 
 describe CommandT::Watchman::Utils do
   def binary(str)
@@ -412,4 +413,42 @@ describe CommandT::Watchman::Utils do
       expect(expected).to include(described_class.dump(query))
     end
   end
+
+  describe '.query_files' do
+    def query_files(response, wildignore = nil)
+      client, server = UNIXSocket.pair
+      server.write(described_class.dump(response))
+      described_class.query_files(['query', '/some/path', {}], client, wildignore)
+    ensure
+      client.close
+      server.close
+    end
+
+    let(:files) { ['foo/bar.c', 'foo/baz.o', '', 'bing'] }
+
+    it 'returns the files as a CommandT::Paths instance' do
+      result = query_files('version' => '4.9.0', 'files' => files)
+      expect(result['version']).to eq('4.9.0')
+      expect(result['files']).to be_a(CommandT::Paths)
+      expect(result['files'].length).to eq(4)
+      expect(result['files'].to_a).to eq(files)
+      expect(result['files'][-1]).to eq('bing')
+      expect(result['files'][4]).to be_nil
+    end
+
+    it 'leaves out files matching the wildignore pattern' do
+      result = query_files({ 'files' => files }, /\.o\z/)
+      expect(result['files'].to_a).to eq(['foo/bar.c', '', 'bing'])
+    end
+
+    it 'passes errors through' do
+      expect(query_files('error' => 'unable to resolve root')).
+        to eq('error' => 'unable to resolve root')
+    end
+
+    it 'raises an ArgumentError if the files are not all strings' do
+      expect { query_files('files' => ['foo', 1]) }.
+        to raise_error(ArgumentError)
+    end
+  end
 end